@@ -1,4 +1,5 @@
 // S1 server communicates with the client
+#define _GNU_SOURCE                              // vmsplice/splice, O_DIRECT/fallocate
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,34 +8,293 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>                           // FICLONE reflinks for copyf
+#include <linux/fs.h>
+#include "s25ring.h"
+#include "s25store.h"
+#include "s25delta.h"
+#include "s25cas.h"                              // SHA-256 digests reported by statf
+#include "s25journal.h"                          // Change events for watchdir
+#include "s25parse.h"                            // Request lines and command dispatch
+#include "s25dirfd.h"                            // Open storage directories, resolved with openat()
+#include "s25fanout.h"                           // Hashed bucket layout of large directories
+#include "s25file.h"                             // Size headers and preallocated, cache-friendly payload writes
+#include "s25prefetch.h"                         // Read-ahead of the next files of tar archives and downlm
+#include <sys/inotify.h>
+#include <poll.h>
 
 #define SERVER_PORT 4641
 #define BUFFER_SIZE 1024
 #define PORT_S2 4642
 #define PORT_S3 4643
 #define PORT_S4 4644
+#define MAX_NODES 32                             // Upper bound on backend nodes in the routing table
+#define VNODES_PER_NODE 64                       // Virtual nodes each backend owns on the hash ring
+#define ROUTING_FILE "s1_routing.conf"           // Routing table file kept under $HOME
+#define STATS_SLOTS (MAX_NODES * 2)              // Open-addressed slots in the shared node statistics table
+#define NODE_DOWN_SECS 30                        // A node that failed a request is skipped for reads this long
+#define LATENCY_EWMA_WEIGHT 0.2                  // Weight of the newest sample in the latency average
+#define CACHE_DIR ".s1cache"                     // Hot-file cache of backend files, kept under $HOME
+#define CACHE_MAX_BYTES (256L * 1024 * 1024)     // Default cache size bound, "cache_bytes" in ROUTING_FILE
+#define META_DIR ".s1meta"                       // SHA-256 digests of stored files for statf, kept under $HOME
+#define CACHE_MARKER_SECS 600                    // How long invalidation markers guard against stale fills
+#define STORE_DIR ".s1store"                     // Segment store for small .c files, kept under $HOME
+#define STORE_COMPACT_SECS 60                    // Interval of the background segment compaction
+#define TRASH_DIR ".s1trash"                     // Removed files wait here, under $HOME, for the reclaimer
+#define FETCH_DIR ".s1fetch"                     // Copies fetched from other hosts' nodes, kept under $HOME while used
+#define RECLAIM_BYTES_PER_SEC (256L * 1024 * 1024)  // Bytes of removed files the reclaimer frees per second
+#define MAP_CACHE_ENTRIES 32                     // Hot files kept mmap()ed per S1 process
+#define MAP_CACHE_BYTES (64L * 1024 * 1024)      // Bound on the bytes those mappings cover
+#define MAP_FILE_MAX (8L * 1024 * 1024)          // Larger files are streamed instead of mapped
+#define LOCAL_SOCK_DIR ".s25"                    // Backends on this host listen on $HOME/.s25/backend-<port>.sock
+#define TRANSPORT_TCP 0                          // S1 <-> backend over TCP
+#define TRANSPORT_UNIX 1                         // Unix domain socket, for backends on this host
+#define TRANSPORT_SHM 2                          // Unix socket for control, shared-memory ring for file data
+#define BATCH_MAX_BYTES (8L * 1024 * 1024)       // Largest entry list of uploadm/downlm/removem
+#define LIST_MAX_BYTES 8192                      // Largest dispfnames reply, read by the client in one recv()
+#define REMOVEDIR_WORKERS 8                      // Processes deleting subtrees in parallel for removedir
+#define REMOVEDIR_PROGRESS_MS 500                // Interval of removedir's progress lines
+#define JOURNAL_FILE ".s1journal"                // Change journal for watchdir, kept under $HOME
+#define WATCH_POLL_MS 50                         // How often a watchdir session looks for new events
+#define WATCH_STALL_MS 1000                      // An event claimed but unpublished this long is skipped
+#define WATCH_SETTLE_MS 1000                     // inotify events wait this long before being compared with the journal
 
-// Structure for target server info
-// Contains information about the target server for file operations
+// Structure for one backend storage node in the routing table
 typedef struct {
-    const char *server_id;                   // Identifier: "S2", "S3", or "S4"
-    const char *ip;                          // IP address (e.g., "127.0.0.1")
+    char id[16];                                 // Node identifier, also its storage root under $HOME (e.g. "S2")
+    char ip[64];
     int port;
-}TargetServer;
+    char unix_path[108];                         // Local socket for connection handoff, empty when remote
+    int transport;                               // TRANSPORT_* used when S1 itself talks to the node
+} BackendNode;
+
+// Point on the consistent hash ring, owned by one backend node
+typedef struct {
+    unsigned int hash;
+    int node;                                    // Index into RoutingTable.nodes
+} RingPoint;
+
+// Routing table - placement of .pdf/.txt/.zip files across backend nodes
+typedef struct {
+    BackendNode nodes[MAX_NODES];
+    int node_count;
+    RingPoint ring[MAX_NODES * VNODES_PER_NODE];
+    int ring_size;
+    int replicas;                                // Copies kept of every file (N-way replication)
+    int write_quorum;                            // Copies acknowledged before an upload succeeds
+    long cache_bytes;                            // Size bound of S1's hot-file cache, 0 disables it
+    int fanout;                                  // New files go into hashed buckets ("layout fanout")
+    struct timespec mtime;                       // mtime of ROUTING_FILE when loaded (zero for built-in defaults)
+} RoutingTable;
+
+static RoutingTable routing;                     // Routing table of this process, refreshed before each command
+
+// One entry directly below the directory removedir deletes, in one of the storage roots it opened
+typedef struct {
+    int root;                                    // Index into remove_dir's root descriptors
+    int dir;                                     // Subdirectory (a worker's unit) or file (removed by the parent)
+    char name[256];
+} RemoveUnit;
+
+// Load statistics for one backend node, shared by every forked S1 process
+typedef struct {
+    unsigned int id_hash;                        // hash_key(id) | 1, zero while the slot is free
+    char id[16];
+    int inflight;                                // Requests currently being served from this node
+    double latency_ms;                           // EWMA of request latency in milliseconds
+    time_t down_until;                           // Node is treated as unhealthy until this time
+} NodeStats;
+
+static NodeStats *node_stats;                    // MAP_SHARED array of STATS_SLOTS entries, set up in main
+
+// Size of the hot-file cache, shared by every forked S1 process
+typedef struct {
+    long bytes;                                  // Entries found by the last scan, plus fills and minus invalidations since
+    time_t scanned;                              // Time of the last scan
+} CacheUsage;
+
+static CacheUsage *cache_usage;                  // MAP_SHARED, set up in main
+static SegmentStore cfile_store;                 // Small .c files packed into segments, opened in main
+static Journal change_journal;                   // Shared change events for watchdir, opened in main
+static DirCache dir_cache;                       // Storage directories this process has open
+
+// Directory watched by the inotify watcher, indexed by its watch descriptor
+typedef struct {
+    char root[16];                               // "S1" or a node id; empty while the slot is free
+    char *rel;                                   // Path below the root ("" for the root itself)
+} WatchedDir;
+
+// inotify event waiting out WATCH_SETTLE_MS before it is compared with the journal
+typedef struct {
+    long long time_ms;
+    char kind;
+    char root[16];
+    char key[512];
+} PendingChange;
+
+// Entries of a downlm request, for download_path
+typedef struct {
+    char **paths;
+    char **validators;                           // Etag of the client's copy per entry, NULL when it sent none
+} DownloadList;
+
+// How a file response is announced to a client cache (see send_size); senders given none use "<size>\n"
+typedef struct {
+    int framed;                                  // downlm: "FILE <size> <etag>\n" instead of "ETAG <etag>\n<size>\n"
+    const char *validator;                       // Etag of the client's copy, "-" when it has none
+} FileFraming;
+
+// A file kept mmap()ed for repeated downloads; valid while dev/inode/size/mtime are unchanged
+typedef struct {
+    char path[600];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *base;                                  // NULL while the slot is free
+    unsigned long last_use;
+} MappedFile;
+
+static MappedFile map_cache[MAP_CACHE_ENTRIES];  // Per-process mapping cache, see map_file
+static unsigned long map_clock;
+static int splice_pipe[2] = { -1, -1 };          // Pipe for vmsplice()ing mapped data into sockets
 
 // Function prototypes 
 void prcclient(int client_sock);
+int handle_uploadf(CmdReader *r, Command *cmd);
+int handle_downlf(CmdReader *r, Command *cmd);
+int handle_removef(CmdReader *r, Command *cmd);
+int handle_copyf(CmdReader *r, Command *cmd);
+int handle_watchdir(CmdReader *r, Command *cmd);
+int handle_removedir(CmdReader *r, Command *cmd);
+int handle_batch(CmdReader *r, Command *cmd);
+int handle_dispfnames(CmdReader *r, Command *cmd);
+int handle_downltar(CmdReader *r, Command *cmd);
+int handle_addnode(CmdReader *r, Command *cmd);
+int handle_exit(CmdReader *r, Command *cmd);
 int create_directories(const char *path);
 int receive_file(int client_sock, const char *filepath);
+int receive_payload(int client_sock, long long file_size, const char *filepath);
+int receive_upload(Arena *arena, int client_sock, const char *filepath, const char *key);
+int receive_upload_sized(Arena *arena, int client_sock, long long file_size, const char *filepath, const char *key);
+int send_size(int client_sock, long long size, const FileFraming *framing, const char *etag);
+int serve_download(int client_sock, const char *filepath_arg, const char *validator, int framed, const char **err);
+int send_stored_file(int client_sock, const char *filepath_arg, const char *ext, const FileFraming *framing, const char **err);
+const char *remove_path(const char *filepath_arg);
+int remove_tree_at(int dirfd, const char *rel, int invalidate, long *files);
+int clone_file(const char *src, const char *dst);
+const char *copy_path(const char *src_arg, const char *dst_arg, int move);
+int remove_dir(int client_sock, const char *filepath_arg);
+const char *replicate_upload(const char *local_filepath, const char *filename, const char *destination,
+                             const char *key, const int *replicas, int replica_count);
+char *read_batch_body(Arena *arena, int client_sock, const char *start, long have, long len);
+int batch_reply_add(Arena *arena, char **reply, size_t *len, size_t *cap, const char *entry, const char *msg);
+int batch_count(const char *body);
+int batch_send_reply(int client_sock, int count, const char *reply, size_t len);
+int batch_remove(Arena *arena, int client_sock, char *body);
+int batch_download(Arena *arena, int client_sock, char *body);
+const char *download_path(void *ctx, int i, char *buf, size_t len);
+int receive_batch_entry(int client_sock, const char **extra, long *extra_len, long long size, const char *path);
+int batch_upload(Arena *arena, int client_sock, const char *destination, char *body, const char *extra, long extra_len);
+int send_buffer(int client_sock, const char *data, long len, const FileFraming *framing, const char *etag);
+char *map_whole_file(const char *path, long *len);
+int receive_delta(int client_sock, const char *basis, long basis_len, const char *out_path);
+int commit_upload(const char *tmp_path, const char *filepath, const char *key);
+const char *map_file(const char *path, long *size, char *etag);
+int send_file_mapped(int client_sock, const char *path, const FileFraming *framing);
+int write_tar_member(FILE *tar, const char *name, const char *data, FILE *src, long long size, time_t mtime);
+int tar_split_name(const char *name);
+int write_tar_header(FILE *tar, const char *name, long long size, time_t mtime, char type);
+int write_tar_data(FILE *tar, const char *data, FILE *src, long long size);
+int build_c_tar(Arena *arena, const char *tar_path, const char *home_dir);
+int build_node_tar(Arena *arena, const char *tar_path, const char *filetype, const char *home_dir);
+int write_tar_files(FILE *tar, char **entries, int count, int by_key);
+FILE *open_tar_entry(const char *entry, int by_key, char *name, size_t len, time_t *mtime);
+const char *tar_entry_path(void *ctx, int i, char *buf, size_t len);
 int send_file(int client_sock, const char *filepath);
+int send_stream(int client_sock, FILE *fp, const FileFraming *framing);
 int forward_file(const char *local_filepath, const char *filename, const char *target_dest, const char *target_ip, int target_port);   
-int request_tar_from_target(TargetServer target, const char *filetype, const char *temp_tar_path);
-void recursive_list_files(const char *dir_path, char ***file_array, int *count, int *capacity);
+int forward_stream(FILE *fp, const char *filename, const char *target_dest, const char *target_ip, int target_port);
+void recursive_list_files(const char *dir_path, StrList *files);
 int compare_string(const void *a, const void *b);
 void error_exit(const char *msg);
+unsigned int hash_key(const char *key);
+void build_ring_table(RoutingTable *rt);
+int load_routing_table(RoutingTable *rt);
+int save_routing_table(const RoutingTable *rt);
+void refresh_routing_table(void);
+int route_lookup(const RoutingTable *rt, const char *key);
+int route_replicas(const RoutingTable *rt, const char *key, int *nodes, int max);
+int replicate_file(const char *local_filepath, const char *filename, const char *destination, const int *nodes, int count, int quorum);
+int connect_node(const BackendNode *node, ShmRing *ring);
+int connect_target(const char *ip, int port, ShmRing *ring);
+int connect_local(const char *path);
+const BackendNode *find_node(const char *ip, int port);
+int commit_local(const BackendNode *node, const char *local_filepath, const char *filename, const char *target_dest, int move);
+int link_replicas(const char *filename, const char *destination, const char *digest, const int *nodes, int count);
+int send_with_fd(int sock, const char *msg, int fd);
+int node_is_local(const BackendNode *node);
+int node_request(const BackendNode *node, const char *request, char *reply, size_t len);
+int node_file_request(const BackendNode *node, const char *command, const char *key, const char *extra,
+                      char *reply, size_t len);
+int node_fetch(const BackendNode *node, const char *key, const char *path);
+int fetch_file(const char *key, char *path, size_t len);
+char *node_list(const BackendNode *node, const char *dir, int flat);
+int remove_remote(const char *key);
+int rank_download_nodes(const char *key, int *nodes);
+int proxy_download(int client_sock, const char *key, const FileFraming *framing);
+int handoff_to_node(const BackendNode *node, int client_sock, const char *cmd);
+void default_unix_path(BackendNode *node);
+int parse_transport(const char *name);
+int cache_serve(int client_sock, const char *key, const FileFraming *framing);
+void cache_invalidate(const char *key);
+void cache_evict(long max_bytes);
+void cache_note_fill(long long size);
+int trash_file(const char *path);
+void reclaim_trash(long budget);
+void cache_entry_path(const char *key, const char *suffix, char *path, size_t len);
+void home_entry_path(const char *dir, const char *key, const char *suffix, char *path, size_t len);
+int stat_path(const char *filepath_arg, char *msg, size_t len);
+int stat_remote(const char *key, char *msg, size_t len);
+int file_digest(const char *key, const char *identity, const char *path, const char *data, long size, char *hex);
+int batch_stat(Arena *arena, int client_sock, char *body);
+int key_exists(const char *key, const char *ext);
+void note_change(const char *key, int existed);
+int watch_dir(int client_sock, const char *dir_arg, const char *since_arg);
+int watch_matches(const char *prefix, const JournalRecord *rec);
+void watch_trees(void);
+void watch_add_tree(int ino_fd, const char *root, const char *rel, WatchedDir **dirs, int *dir_cap, int report);
+void watch_queue(char kind, const char *root, const char *key);
+int watch_stored_name(const char *root, const char *name);
+void watch_settle(PendingChange *change);
+NodeStats *node_stats_for(const char *id);
+void record_node_result(NodeStats *ns, double elapsed_ms, int ok);
+double elapsed_ms_since(const struct timespec *start);
+int make_route_key(const char *dir, const char *filename, char *key, size_t len);
+int locate_file(const char *key, char *full_path, size_t len);
+int stored_rel(const char *id, const char *key, char *rel, size_t len);
+int stored_path(const char *id, const char *key, char *full_path, size_t len);
+int node_dest(const char *id, const char *key, char *dest, size_t len);
+int plain_c_path(const char *key, char *full_path, size_t len);
+int replica_dest(const char *id, const char *destination, const char *filename, char *dest, size_t len);
+int collect_dir_files(const char *dir_path, const char *ext, StrList *files);
+int collect_bucket_files(const char *dir_path, int levels, const char *ext, StrList *files);
+int collect_node_files(const BackendNode *node, const char *dir, const char *ext, StrList *files);
+int collect_tree_files(const char *dir_path, const char *rel, const char *ext, StrList *entries);
+int collect_remote_files(int n, const char *ext, StrList *entries);
+void rebalance_tree(const RoutingTable *rt, int src, const char *dir_path, const char *rel, int *moved);
+void rebalance_remote(const RoutingTable *rt, int src, int *moved);
+void rebalance_file(const RoutingTable *rt, int src, const char *key, const char *path, int *moved);
 
 // main - Sets up the server socket on SERVER_PORT and handles incoming connections.
 // Entry point of S1 server
@@ -50,6 +310,8 @@ int main() {
     server_addr.sin_family = AF_INET;          // Set address family to IPv4
     server_addr.sin_addr.s_addr = INADDR_ANY;   // Accept connections on any network interface
     server_addr.sin_port = htons(SERVER_PORT);  // Set server port in network byte order
+    int reuse = 1;                              // Clients keep sessions open: rebind over their TIME_WAIT after a restart
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     
     if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)  // Bind socket to the address and port
         error_exit("S1: bind failed");         // Exit if bind fails
@@ -58,6 +320,45 @@ int main() {
         error_exit("S1: listen failed");       
     
     printf("S1 Server listening on port %d...\n", SERVER_PORT);  // Inform that server is up and running
+    load_routing_table(&routing);              // Load backend placement before serving clients
+    printf("S1 routing across %d backend node(s), %d replica(s), write quorum %d\n",
+           routing.node_count, routing.replicas, routing.write_quorum);
+    // Node load statistics live in shared memory so every forked client handler sees the same picture.
+    node_stats = mmap(NULL, sizeof(NodeStats) * STATS_SLOTS, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (node_stats == MAP_FAILED)
+        error_exit("S1: mmap of node statistics failed");
+    cache_usage = mmap(NULL, sizeof(CacheUsage), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache_usage == MAP_FAILED)
+        error_exit("S1: mmap of cache usage failed");
+    if (routing.cache_bytes > 0)
+        cache_evict(routing.cache_bytes);      // Sizes up what an earlier run left in the cache
+    char store_dir[512];
+    snprintf(store_dir, sizeof(store_dir), "%s/%s", getenv("HOME") ? getenv("HOME") : ".", STORE_DIR);
+    if (store_open(&cfile_store, store_dir) != 0)
+        error_exit("S1: cannot open segment store");
+    if (fork() == 0) {                         // Compactor: reclaims space of replaced and removed .c files
+        close(server_sock);
+        while (1) {
+            sleep(STORE_COMPACT_SECS);
+            store_compact(&cfile_store);
+        }
+    }
+    char journal_path[512];
+    snprintf(journal_path, sizeof(journal_path), "%s/%s", getenv("HOME") ? getenv("HOME") : ".", JOURNAL_FILE);
+    if (journal_open(&change_journal, journal_path) != 0)
+        perror("S1: cannot open change journal, watchdir reports nothing");
+    if (fork() == 0) {                         // Watcher: journals changes made behind S1's back (inotify)
+        close(server_sock);
+        watch_trees();
+    }
+    if (fork() == 0) {                         // Reclaimer: frees the space of removed files off the request path
+        close(server_sock);
+        while (1) {
+            sleep(1);
+            reclaim_trash(RECLAIM_BYTES_PER_SEC);
+        }
+    }
 
     while (1) {
         client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_addr_len); // Accept incoming connections
@@ -65,6 +366,8 @@ int main() {
             perror("S1: accept failed");   // Log accept failure
             continue;                       
         }
+        int nodelay = 1;                    // Replies go out as header + payload writes: no Nagle wait on the client's delayed ACK
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
         pid_t pid = fork();                 // Create a new process
         if (pid < 0) {                         // Check for fork errors
             perror("S1: fork failed");         
@@ -83,577 +386,1865 @@ int main() {
     return 0;                                  // End program successfully
 }
 
+// Commands S1 serves, with the reply to a request that lacks arguments
+static const CmdSpec s1_commands[] = {
+    { "uploadf",    2, handle_uploadf,    "ERROR: Invalid uploadf command format.\n" },
+    { "downlf",     1, handle_downlf,     "ERROR: Invalid downlf command format. Expected: downlf <filepath>\n" },
+    { "removef",    1, handle_removef,    "ERROR: Invalid removef command format. Expected: removef <filepath>\n" },
+    { "copyf",      2, handle_copyf,      "ERROR: Invalid copyf/movef command format. Expected: copyf <filepath> <destination>\n" },
+    { "movef",      2, handle_copyf,      "ERROR: Invalid copyf/movef command format. Expected: copyf <filepath> <destination>\n" },
+    { "watchdir",   1, handle_watchdir,   "ERROR: Invalid watchdir command format. Expected: watchdir <directory> [<seq>]\n" },
+    { "removedir",  1, handle_removedir,  "ERROR: Invalid removedir command format. Expected: removedir <directory>\n" },
+    { "removem",    1, handle_batch,      "ERROR: Invalid batch command format.\n" },
+    { "downlm",     1, handle_batch,      "ERROR: Invalid batch command format.\n" },
+    { "uploadm",    2, handle_batch,      "ERROR: Invalid batch command format.\n" },
+    { "statf",      1, handle_batch,      "ERROR: Invalid batch command format.\n" },
+    { "dispfnames", 1, handle_dispfnames, "ERROR: Invalid dispfnames command format. Expected: dispfnames <directory>\n" },
+    { "downltar",   1, handle_downltar,   "ERROR: Invalid downltar command format. Expected: downltar <filetype>\n" },
+    { "addnode",    3, handle_addnode,    "ERROR: Invalid addnode command format. Expected: addnode <id> <ip> <port>\n" },
+    { "exit",       0, handle_exit,       "" },
+    { NULL,         0, NULL,              "ERROR: Invalid command. Try again!\n" }
+};
+
 // prcclient - Processes commands received from a client
 void prcclient(int client_sock) {              // Function to handle a clients session
-    char buffer[BUFFER_SIZE];                  // Buffer for storing received commands
-    char *home_dir = getenv("HOME");           // Get user's home directory from environment variables
-    if (!home_dir)
-        home_dir = ".";                        
-    
-    while (1) {                                
-        memset(buffer, 0, sizeof(buffer));     // Clear the buffer before each new command
-        int bytes_received = recv(client_sock, buffer, sizeof(buffer)-1, 0);  
-        if (bytes_received <= 0)               
+    CmdReader reader;                          // What the client sent, parsed in place
+    Command cmd;
+    cmd_reader_init(&reader, client_sock);
+    while (cmd_next(&reader, &cmd)) {
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;                                  // Reap replica forwarders that finished after their quorum
+        if (cmd_dispatch(s1_commands, &reader, &cmd) != 0)
             break;
-        buffer[strcspn(buffer, "\r\n")] = 0;   // Remove any newline characters from the command
-        
-        char *command = strtok(buffer, " ");  
-        if (!command)
-            continue;                         
-        
-        if (strcmp(command, "uploadf") == 0) {   // Handle 'uploadf' command
-
-            // uploadf <filename> <destination_path>
-            char *filename = strtok(NULL, " ");  // Get filename parameter
-            char *destination = strtok(NULL, " ");  // Get destination path parameter
-            if (!filename || !destination) {    
-                send(client_sock, "ERROR: Invalid uploadf command format.\n", 41, 0); // error handling for incorrect format
-                continue;
-            }
-            // Get file extension
-            char *ext = strrchr(filename, '.');  
-            if (!ext) {                          // If no extension found
-                send(client_sock, "ERROR: File has no extension.\n", 30, 0);  
-                continue;                        
-            }
-        
-            // Ensure the destination path is valid and starts with "S1/"
-            if (strncmp(destination, "S1/", 3) != 0) {  
-                send(client_sock, "ERROR: Path must start with 'S1/'.\n", 34, 0);  // Send error message if not
-                continue;               
-            }
-            if (create_directories(destination) != 0) {  // Attempt to create necessary directories
-                send(client_sock, "ERROR: Failed to create local directory structure.\n", 52, 0);  // Error on failure
-                continue;                        // Continue to next command
-            }
-            char local_filepath[512]; 
-            snprintf(local_filepath, sizeof(local_filepath), "%s/%s/%s", home_dir, destination, filename); // string path construction
+    }
+    cmd_reader_close(&reader);
+    close(client_sock); // close the client socket when done
+}
 
-            if (strcmp(ext, ".c") == 0) {        
-                send(client_sock, "READY\n", 6, 0); 
-                if (receive_file(client_sock, local_filepath) == 0)  // file received successfully
-                    send(client_sock, "File uploaded successfully in S1.\n", 34, 0);  
-                else
-                    send(client_sock, "ERROR: Failed to receive .c file.\n", 34, 0); 
-            } else if (strcmp(ext, ".pdf") == 0 || strcmp(ext, ".txt") == 0 || strcmp(ext, ".zip") == 0) {  
-                send(client_sock, "READY\n", 6, 0);  
-                if (receive_file(client_sock, local_filepath) != 0) {  // file reception failed
-                    send(client_sock, "ERROR: Failed to receive file for forwarding.\n", 48, 0);
-                    continue;                    
-                }
-                TargetServer target;           // variable to hold the target server
-                if (strcmp(ext, ".pdf") == 0) {         
-                    target.server_id = "S2";            
-                    target.ip = "127.0.0.1";            
-                    target.port = PORT_S2;             
-                } else if (strcmp(ext, ".txt") == 0) {  
-                    target.server_id = "S3";            
-                    target.ip = "127.0.0.1";            
-                    target.port = PORT_S3;              
-                } else if (strcmp(ext, ".zip") == 0) {  
-                    target.server_id = "S4";            
-                    target.ip = "127.0.0.1";            
-                    target.port = PORT_S4;              
-                } else {  
-                    send(client_sock, "ERROR: Unsupported file type.\n", 31, 0); // error handling for unsupported file type  
-                    continue;                   
-                }
-                char target_dest[512];           
-                // Replace leading "S1" with the target server's identifier. 
-                // This ensures the file is sent to the correct server.
-                if (strncmp(destination, "S1", 2) == 0)
-                    snprintf(target_dest, sizeof(target_dest), "%s%s", target.server_id, destination + 2);  // destination modification
-                else
-                    strncpy(target_dest, destination, sizeof(target_dest));
-                printf("Forwarding %s to %s at %s:%d...\n", filename, target.server_id, target.ip, target.port);  // Log the forwarding action
-                if (forward_file(local_filepath, filename, target_dest, target.ip, target.port) == 0) {  // Attempt to forward the file
-                    if (remove(local_filepath) == 0)  // If forwarding succeeds then delete the local copy
-                        send(client_sock, "File created successfully.\n", 27, 0);  // Notify success
-                    else
-                        send(client_sock, "Success but local deletion in S1 failed.\n", 50, 0);  // file created but local deletion in S1 failed
-                } else {
-                    send(client_sock, "ERROR: Forwarding failed.\n", 26, 0);  // Report forwarding failure
-                }
-            } else {
-                send(client_sock, "ERROR: Unsupported file type.\n", 31, 0);  // Error for unknown file type uploads
-            }
-        }
-        
-        
-else if (strcmp(command, "downlf") == 0) {      // to download file
-    // Validate command format
-    // Expected format: downlf <filepath>
-    char *filepath_arg = strtok(NULL, " ");    // Extract the filepath from the command
-    if (!filepath_arg) { // check that filepath was provided
-        send(client_sock, "ERROR: Invalid downlf command format. Expected: downlf <filepath>\n", 68, 0);  // Inform client of format error
-        continue; // continue to next command
-        // 
+// handle_uploadf - uploadf <filename> <destination_path> [<sha256> [delta]]: stores one file, .c files on S1
+// (packed or plain) and the others on their replica set, from the whole payload or a delta.
+int handle_uploadf(CmdReader *r, Command *cmd) {
+    int client_sock = r->sock;
+    char *home_dir = getenv("HOME");
+    if (!home_dir)
+        home_dir = ".";
+    char *filename = cmd->args[0];  // Get filename parameter
+    char *destination = cmd->args[1];  // Get destination path parameter
+    char *digest = cmd->args[2];  // Content digest sent ahead of the payload, if any
+    char *mode = cmd->args[3];
+    int delta = mode && strcmp(mode, "delta") == 0;  // Client can send a delta against the stored version
+    // Get file extension
+    char *ext = strrchr(filename, '.');  
+    int type = cmd_file_type(filename);
+    if (!ext) {                          // If no extension found
+        send(client_sock, "ERROR: File has no extension.\n", 30, 0);  
+        return 0;                        
     }
 
-    char *ext = strrchr(filepath_arg, '.'); // Get the file extension from the provided path
-    if (!ext) {  // If no extension is found
-        send(client_sock, "ERROR: File has no extension.\n", 30, 0);  // Notify client about missing extension
-        continue; // continue to next command
+    // Ensure the destination path is valid and starts with "S1/"
+    if (strncmp(destination, "S1/", 3) != 0) {  
+        send(client_sock, "ERROR: Path must start with 'S1/'.\n", 34, 0);  // Send error message if not
+        return 0;               
     }
-    // Check that the path begins with "S1/"
-    if (strncmp(filepath_arg, "S1/", 3) != 0) {  // Ensure the file path starts with "S1/"
-        send(client_sock, "ERROR: Path must start with 'S1/'.\n", 34, 0);  // Inform client of the proper path format
-        continue; // Continue to next command
+    if (create_directories(destination) != 0) {  // Attempt to create necessary directories
+        send(client_sock, "ERROR: Failed to create local directory structure.\n", 52, 0);  // Error on failure
+        return 0;
     }
-
-    if (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 &&
-        strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0) {  // Only allow .c, .pdf, .txt, and .zip files
-        send(client_sock, "ERROR: Unsupported file extension for download.\n", 50, 0);  // Send error if extension is unsupported
-        continue; // continue to next command
+    char local_filepath[512]; 
+    if (snprintf(local_filepath, sizeof(local_filepath), "%s/%s/%s", home_dir, destination, filename) >=
+        (int)sizeof(local_filepath)) {  // string path construction
+        send(client_sock, "ERROR: Path too long.\n", 22, 0);
+        return 0;
     }
 
-    char full_filepath[512];                   // Buffer to store the full filesystem path of the file
-    // For .c files, use as-is; for others, substitute the corresponding base directory.
-    if (strcmp(ext, ".c") == 0) { // If downloading a .c file
-            snprintf(full_filepath, sizeof(full_filepath), "%s/%s", getenv("HOME"), filepath_arg);  // Use the given path directly
-    }
-    else if (strcmp(ext, ".pdf") == 0) {         // For .pdf files
-        char *subpath = NULL;                    // Pointer for subpath within the directory
-        
-        if (strncmp(filepath_arg, "S1/", 3) == 0)
-            subpath = filepath_arg + 3;          // Skip "S1/" prefix
-        else
-            subpath = filepath_arg;              // Use the entire string if no recognized prefix
-        snprintf(full_filepath, sizeof(full_filepath), "%s/%s/%s", getenv("HOME"), "S2", subpath);  // Construct full path using S2 directory
-    }
-    else if (strcmp(ext, ".txt") == 0) {         // For .txt files
-        char *subpath = NULL;                    // Pointer for subpath
-        
-        if (strncmp(filepath_arg, "S1/", 3) == 0)
-            subpath = filepath_arg + 3;          // Skip "S1/" prefix
-        else
-            subpath = filepath_arg;              // Use as-is if prefix is not found
-        snprintf(full_filepath, sizeof(full_filepath), "%s/%s/%s", getenv("HOME"), "S3", subpath);  // Build full path using S3 directory
-    }
-    else if (strcmp(ext, ".zip") == 0) {         // For .zip files
-        char *subpath = NULL;                    // Pointer for subpath
-        
-        if (strncmp(filepath_arg, "S1/", 3) == 0)
-            subpath = filepath_arg + 3;          // Remove "S1/" prefix
+    if (type == FILE_C) {        
+        char key[512];                   // Small .c files are packed into the segment store under this key
+        int keyed = make_route_key(destination + 3, filename, key, sizeof(key)) == 0;
+        if (keyed && plain_c_path(key, local_filepath, sizeof(local_filepath)) != 0) {
+            send(client_sock, "ERROR: Failed to create local directory structure.\n", 52, 0);
+            return 0;
+        }
+        int existed = keyed && key_exists(key, ext);
+        const char *basis = NULL;        // Stored version the client's delta refers to
+        char *mapped = NULL;
+        long basis_len = 0;
+        unsigned int view_len;
+        if (delta && keyed) {
+            if (store_view(&cfile_store, key, &basis, &view_len, NULL) == 0)
+                basis_len = view_len;
+            else
+                basis = mapped = map_whole_file(local_filepath, &basis_len);
+        }
+        int received = -2;
+        if (basis) {
+            char tmp_path[600];
+            snprintf(tmp_path, sizeof(tmp_path), "%s.delta.%d", local_filepath, (int)getpid());
+            received = receive_delta(client_sock, basis, basis_len, tmp_path);
+            if (received == 0)
+                received = commit_upload(tmp_path, local_filepath, key);
+            unlink(tmp_path);
+        }
+        if (mapped)
+            munmap(mapped, basis_len);
+        if (received == -3) {            // Out of step with the client: end the session
+            send(client_sock, "ERROR: Failed to receive .c file.\n", 34, 0);
+            return -1;
+        }
+        if (received == -2) {            // No usable basis: the whole file comes over
+            send(client_sock, "READY\n", 6, 0); 
+            received = keyed ? receive_upload(&r->arena, client_sock, local_filepath, key) : receive_file(client_sock, local_filepath);
+        }
+        if (received == 0 && keyed)
+            note_change(key, existed);
+        if (received == 0)  // file received successfully
+            send(client_sock, "File uploaded successfully in S1.\n", 34, 0);  
         else
-            subpath = filepath_arg;              // Otherwise, use as provided
-        snprintf(full_filepath, sizeof(full_filepath), "%s/%s/%s", getenv("HOME"), "S4", subpath);  // Construct path using S4 directory
-    }
-    else { // Fallback for unsupported file types
-        send(client_sock, "ERROR: Unsupported file type for download.\n", 45, 0);  // Notify client of error
-        continue; // continue to next command
-    }
-    
-    // Check that the file exists and is a regular file.
-    struct stat path_stat; // Structure for checking file status
-    if (stat(full_filepath, &path_stat) != 0 || !S_ISREG(path_stat.st_mode)) {  // Verify file existence and that it is a regular file
-        send(client_sock, "ERROR: Specified path is not a file.\n", 38, 0);  // Send error if file does not exist
-        continue; // continue to next command
+            send(client_sock, "ERROR: Failed to receive .c file.\n", 34, 0); 
+    } else if (type != FILE_OTHER) {     // .pdf, .txt and .zip
+        refresh_routing_table();
+        char key[512];
+        int replicas[MAX_NODES];         // Nodes that keep a copy, primary first
+        int replica_count = make_route_key(destination + 3, filename, key, sizeof(key)) == 0 ?
+                            route_replicas(&routing, key, replicas, routing.replicas) : 0;
+        if (replica_count == 0) {
+            send(client_sock, "ERROR: No backend node available.\n", 34, 0);
+            return 0;
+        }
+        int existed = key_exists(key, ext);
+        if (digest && link_replicas(filename, destination, digest, replicas, replica_count) == 0) {
+            cache_invalidate(key);       // Every replica had the content: no payload needed
+            note_change(key, existed);
+            send(client_sock, "File created successfully (deduplicated).\n", 42, 0);
+            return 0;
+        }
+        char basis_path[512];
+        char *basis = NULL;              // Stored version the client's delta refers to
+        long basis_len = 0;
+        int received = -2;
+        if (delta && locate_file(key, basis_path, sizeof(basis_path)) >= 0)
+            basis = map_whole_file(basis_path, &basis_len);
+        if (basis) {                     // Rebuild the new version here, then replicate it as usual
+            received = receive_delta(client_sock, basis, basis_len, local_filepath);
+            munmap(basis, basis_len);
+        }
+        if (received == -1 || received == -3) {
+            send(client_sock, "ERROR: Failed to receive file for forwarding.\n", 48, 0);
+            return received == -3 ? -1 : 0;  // After -3 the rest of the session cannot be parsed
+        }
+        if (received == -2 && replica_count == 1) {  // Single copy on a local node: it reads the upload from the client itself
+            const BackendNode *node = &routing.nodes[replicas[0]];
+            char handoff_cmd[BUFFER_SIZE], dest[600];
+            int handed = node_dest(node->id, key, dest, sizeof(dest)) < 0 ? -2 : 0;  // Too long: the normal path reports it
+            if (handed == 0) {
+                snprintf(handoff_cmd, sizeof(handoff_cmd), "uploadf %s %s\n", filename, dest);
+                handed = handoff_to_node(node, client_sock, handoff_cmd);
+            }
+            if (handed != -2) {
+                cache_invalidate(key);
+                if (handed == 0)
+                    note_change(key, existed);
+                if (handed == 0)
+                    send(client_sock, "File created successfully.\n", 27, 0);
+                else
+                    send(client_sock, "ERROR: Forwarding failed.\n", 26, 0);
+                return 0;
+            }
+        }
+        if (received == -2)
+            send(client_sock, "READY\n", 6, 0);  
+        if (received == -2 && receive_file(client_sock, local_filepath) != 0) {  // file reception failed
+            send(client_sock, "ERROR: Failed to receive file for forwarding.\n", 48, 0);
+            return 0;                    
+        }
+        const char *msg = replicate_upload(local_filepath, filename, destination, key, replicas, replica_count);
+        if (strncmp(msg, "ERROR", 5) != 0)
+            note_change(key, existed);
+        send(client_sock, msg, strlen(msg), 0);
+    } else {
+        send(client_sock, "ERROR: Unsupported file type.\n", 31, 0);  // Error for unknown file type uploads
     }
-    if (send_file(client_sock, full_filepath) != 0)  // Attempt to send the requested file to the client
-        send(client_sock, "ERROR: Failed to send file. File may not exist.\n", 49, 0);  // Inform the client if sending fails
+    return 0;
 }
 
-else if (strcmp(command, "removef") == 0) { // process 'removef' command to delete a file
-    // Expected: removef <filepath>
-    char *filepath_arg = strtok(NULL, " "); // Extract file path argument
-    if (!filepath_arg) { // validate that a filepath is provided
-        send(client_sock, "ERROR: Invalid removef command format. Expected: removef <filepath>\n", 69, 0);  // error message for invalid format
-        continue; // continue to next command
-    }
-    // Check that the path begins with "S1/"
-    if (strncmp(filepath_arg, "S1/", 3) != 0) {  // Verify that the file path starts with "S1/"
-        send(client_sock, "ERROR: Path must start with 'S1/'.\n", 34, 0);  // Notify client about proper path format
-        continue; // continue to next command
-    }
-    char *ext = strrchr(filepath_arg, '.');     // Extract file extension from the provided path
-    if (!ext) {                                  // If extension is missing
-        send(client_sock, "ERROR: File has no extension.\n", 30, 0);  // Error message for missing extension
-        continue; // continue to next command
-    }
-    char full_filepath[512];                   // Buffer for constructing the complete file path
-    if (strcmp(ext, ".c") == 0) {                // For .c files
-            snprintf(full_filepath, sizeof(full_filepath), "%s/%s", home_dir, filepath_arg);  // Build path directly
-    }
-    else if (strcmp(ext, ".pdf") == 0) { // For .pdf files use the S2 directory
-        char *subpath = NULL; // Temporary pointer for subpath
-        if (strncmp(filepath_arg, "S1/", 3)==0)
-            subpath = filepath_arg+3;            // Remove 'S1/' prefix
-        else
-            subpath = filepath_arg;              // Use as-is if no prefix
-        snprintf(full_filepath, sizeof(full_filepath), "%s/%s/%s", home_dir, "S2", subpath);  // Construct path in S2
-    }
-    else if (strcmp(ext, ".txt") == 0) {         // For .txt files use the S3 directory
-        char *subpath = NULL;                    // Temporary pointer for subpath
-        
-        if (strncmp(filepath_arg, "S1/", 3)==0)
-            subpath = filepath_arg+3;            // Remove 'S1/' prefix
-        else
-            subpath = filepath_arg;              // Use as-is if no prefix
-        snprintf(full_filepath, sizeof(full_filepath), "%s/%s/%s", home_dir, "S3", subpath);  // Build path in S3
-    }
-    else if (strcmp(ext, ".zip") == 0) {         // For .zip files use the S4 directory
-        char *subpath = NULL;                    // Temporary pointer for subpath
-        
-        if (strncmp(filepath_arg, "S1/", 3)==0)
-            subpath = filepath_arg+3;            // Remove 'S1/' prefix
-        else
-            subpath = filepath_arg;              // Otherwise, use as provided
-        snprintf(full_filepath, sizeof(full_filepath), "%s/%s/%s", home_dir, "S4", subpath);  // Build path in S4
-    }
-    else { // If file type is unsupported for removal
-        send(client_sock, "ERROR: Unsupported file type for removal.\n", 44, 0);  // Send error message
-        continue; // continue to next command
+// handle_downlf - downlf <filepath> [<validator>]: sends a stored file, or NOTMODIFIED when the client's
+// cached copy is current.
+int handle_downlf(CmdReader *r, Command *cmd) {
+    int client_sock = r->sock;
+    char *filepath_arg = cmd->args[0];    // Extract the filepath from the command
+    char *validator = cmd->args[1];       // Client cache validator, "-" when it has no copy yet
+    const char *err;
+    if (serve_download(client_sock, filepath_arg, validator, 0, &err) == -1)
+        send(client_sock, err, strlen(err), 0);  // Nothing (after the ETAG line) was sent: report why
+    return 0;
+}
+
+// handle_removef - removef <filepath>: removes one stored file.
+int handle_removef(CmdReader *r, Command *cmd) {
+    int client_sock = r->sock;
+    char *filepath_arg = cmd->args[0]; // Extract file path argument
+    const char *msg = remove_path(filepath_arg);
+    send(client_sock, msg, strlen(msg), 0);
+    return 0;
+}
+
+// handle_copyf - copyf|movef <source_path> <destination_directory_or_path>: copies or moves a stored file
+// on the servers.
+int handle_copyf(CmdReader *r, Command *cmd) {
+    int client_sock = r->sock;
+    char *src_arg = cmd->args[0];
+    char *dst_arg = cmd->args[1];
+    const char *msg = copy_path(src_arg, dst_arg, cmd->name[0] == 'm');
+    send(client_sock, msg, strlen(msg), 0);
+    return 0;
+}
+
+// handle_watchdir - watchdir S1/<directory> [<last sequence number seen>]: streams change events until
+// "unwatch".
+int handle_watchdir(CmdReader *r, Command *cmd) {
+    int client_sock = r->sock;
+    char *dir_arg = cmd->args[0];
+    char *since_arg = cmd->args[1];
+    if (watch_dir(client_sock, dir_arg, since_arg) != 0)
+        return -1;                             // Client went away while watching
+    return 0;
+}
+
+// handle_removedir - removedir S1/<directory>: deletes a whole directory tree in one request.
+int handle_removedir(CmdReader *r, Command *cmd) {
+    int client_sock = r->sock;
+    char *filepath_arg = cmd->args[0];
+    if (remove_dir(client_sock, filepath_arg) != 0)
+        return -1;                             // Client went away while the tree was removed
+    return 0;
+}
+
+// handle_batch - Batch commands, one round trip for any number of files:
+//   removem <len>\n followed by len bytes of "<path>\n" entries
+//   statf <len>\n followed by "<path>\n" entries; OK messages are "<size> <mtime> <sha256> <node>"
+//   downlm <len>\n followed by "<path> <validator>\n" entries
+//   uploadm <destination> <len>\n followed by "<filename> <size>\n" entries, then the payloads back-to-back
+// Reply: "MULTI <count>\n", then per entry "OK|ERR <entry> <message>" (removem, uploadm), or
+// "FILE <size> <etag>\n" and the data, "NOTMODIFIED\n" or "ERR <message>" (downlm)
+int handle_batch(CmdReader *r, Command *cmd) {
+    int client_sock = r->sock;
+    char *destination = cmd->name[0] == 'u' ? cmd->args[0] : NULL;
+    char *len_arg = cmd->args[destination ? 1 : 0];
+    long body_len = len_arg ? atol(len_arg) : 0;
+    if (body_len <= 0 || body_len > BATCH_MAX_BYTES) {
+        send(client_sock, "ERROR: Invalid batch command format.\n", 37, 0);
+        return 0;
     }
-    struct stat path_stat; // Structure for checking the file's status
-    if (stat(full_filepath, &path_stat) != 0 || !S_ISREG(path_stat.st_mode)) {  // Check if file exists and is regular
-        send(client_sock, "ERROR: Specified path or file is not valid.\n", 55, 0);  
-        continue; // continue to next command
+    long have = cmd_buffered(r);               // Part of the list (and of uploadm's payloads) came with the line
+    char *body = read_batch_body(&r->arena, client_sock, r->buf + r->start, have, body_len);
+    if (!body)
+        return -1;                             // Client went away mid-list
+    cmd_consume(r, body_len);
+    const char *extra = r->buf + r->start;     // Start of uploadm's payloads
+    long extra_len = have > body_len ? have - body_len : 0;
+    int broken;
+    if (cmd->name[0] == 'r')
+        broken = batch_remove(&r->arena, client_sock, body);
+    else if (cmd->name[0] == 's')
+        broken = batch_stat(&r->arena, client_sock, body);
+    else if (cmd->name[0] == 'd')
+        broken = batch_download(&r->arena, client_sock, body);
+    else {
+        broken = batch_upload(&r->arena, client_sock, destination, body, extra_len ? extra : NULL, extra_len);
+        cmd_consume(r, extra_len);             // batch_upload took the payload bytes that were buffered
     }
-    if (remove(full_filepath) == 0) // Attempt to remove the file
-        send(client_sock, "File removed successfully.\n", 29, 0);  // Inform client of success
-    else
-        send(client_sock, "ERROR: Failed to remove file. File may not exist.\n", 51, 0);  // Inform client of failure
+    if (broken)
+        return -1;                             // The stream is out of step: end the session
+    return 0;
 }
 
-else if (strcmp(command, "dispfnames") == 0) {  // Process 'dispfnames' command to list file names in a directory
+// handle_dispfnames - dispfnames S1/<directory>: lists the file names of a directory, grouped by extension.
+int handle_dispfnames(CmdReader *r, Command *cmd) {
+    int client_sock = r->sock;
+    char *home_dir = getenv("HOME");
+    if (!home_dir)
+        home_dir = ".";
     // Expected format: dispfnames S1/folder1/folder2 (or deeper)
-    char *dir_arg = strtok(NULL, " ");         
-    if (!dir_arg) {                            // Validate argument
-        send(client_sock, "ERROR: Invalid dispfnames command format. Expected: dispfnames <directory>\n", 70, 0);  // Error message if missing
-        continue;                              // Continue to next command
-    }
+    char *dir_arg = cmd->args[0];         
     // Check that the path begins with "S1/"
     if (strncmp(dir_arg, "S1/", 3) != 0) {        // Ensure directory path starts with "S1/"
         send(client_sock, "ERROR: Path must start with 'S1/'.\n", 34, 0); 
-        continue;                              // Continue to next command
+        return 0;
     }
     // Extract the relative path after "S1/"
     char relative[512];                        // Buffer for relative path
+    char check_path[512];                      // Buffer to hold full check path
+    if (strlen(dir_arg + 3) >= sizeof(relative) ||
+        snprintf(check_path, sizeof(check_path), "%s/S1/%s", home_dir, dir_arg + 3) >= (int)sizeof(check_path)) {
+        send(client_sock, "ERROR: Path too long.\n", 22, 0);
+        return 0;
+    }
     strcpy(relative, dir_arg + 3);             
      
     // Verify that the directory exists under S1.
-    char check_path[512];                      // Buffer to hold full check path
-    snprintf(check_path, sizeof(check_path), "%s/S1/%s", home_dir, relative);  
     struct stat st;                            // Structure for file/directory status
     if (stat(check_path, &st) != 0 || !S_ISDIR(st.st_mode)) {  
         send(client_sock, "ERROR: Path does not exist.\n", 29, 0);  
-        continue;                              // Continue to next command
+        return 0;
     }
     
     // Now gather files from the directories for each group in the required order.
-    // Order: .c from S1, .pdf from S2, .txt from S3, .zip from S4
+    // Order: .c from S1, then .pdf, .txt and .zip merged from every backend node
     const char *extensions[] = { ".c", ".pdf", ".txt", ".zip" };  
-    const char *bases[] = { "S1", "S2", "S3", "S4" };  // Corresponding base directories for each file type
+    refresh_routing_table();                   // Backend set may have grown since the last command
     
-    // Buffer to hold the combined file names.
-    char combined[8192];                       // Large buffer to accumulate file names
-    combined[0] = '\0';                   
+    // Buffer to hold the combined file names; the client reads the listing with one recv().
+    size_t listed = 0;
+    char *combined = arena_alloc(&r->arena, LIST_MAX_BYTES);
+    if (!combined) {
+        send(client_sock, "ERROR: Out of memory.\n", 22, 0);
+        return 0;
+    }
     
     for (int i = 0; i < 4; i++) {              // Loop over each file extension group
-        char dir_path[512];                    
-        // Construct the full directory path for this group.
-        snprintf(dir_path, sizeof(dir_path), "%s/%s/%s", home_dir, bases[i], relative);  // Build path using home directory, base, and relative path
-        
-        // Check if the directory exists; if not, skip this group.
-        if (stat(dir_path, &st) != 0 || !S_ISDIR(st.st_mode))
-            continue;                        // Skip if directory doesn't exist
-        
-        // Open the directory.
-        DIR *d = opendir(dir_path);            
-        if (d == NULL)
-            continue;                        // Skip if unable to open directory
-        // Allocate an array to store the matching file names.
-        int capacity = 10, count = 0;         
-        char **files = malloc(capacity * sizeof(char *));  // Allocate array of string pointers
-        if (!files) {                          // If allocation fails
-            closedir(d);                     
-            continue;                        // Skip to next group
-        }
-        struct dirent *entry;                  // Pointer to read directory entries
-        while ((entry = readdir(d)) != NULL) { 
-            // Skip "." and ".."
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                continue;                    // Ignore current and parent directory entries
-            // Check the file extension.
-            char *file_ext = strrchr(entry->d_name, '.');  // Get the extension of the file
-            if (file_ext && strcmp(file_ext, extensions[i]) == 0) { 
-                if (count >= capacity) {       
-                    capacity *= 2;             // Double the capacity
-                    files = realloc(files, capacity * sizeof(char *));  // Reallocate more space
-                }
-                files[count] = strdup(entry->d_name);  // Duplicate the file name and store it
-                count++;                  
+        // Gather the matching file names; they live until the next request.
+        StrList files;
+        strlist_init(&files, &r->arena);
+        int dir_count = (i == 0) ? 1 : routing.node_count;  // .c lives on S1, the rest on every node
+        for (int n = 0; n < dir_count; n++) {
+            char dir_path[512];                    
+            if (i > 0 && !node_is_local(&routing.nodes[n])) {
+                collect_node_files(&routing.nodes[n], relative, extensions[i], &files);  // Listed by the node
+                continue;
             }
+            // Construct the full directory path for this group.
+            snprintf(dir_path, sizeof(dir_path), "%s/%s/%s", home_dir,
+                     (i == 0) ? "S1" : routing.nodes[n].id, relative);  // Build path using home directory, base, and relative path
+            collect_dir_files(dir_path, extensions[i], &files);
+        }
+        if (i == 0) {                          // Plus the .c files packed into the segment store
+            char prefix[512] = "";
+            int first = files.count;
+            make_route_key(relative, NULL, prefix, sizeof(prefix));
+            store_collect(&cfile_store, prefix, 0, ".c", &files);
+            for (int j = first; j < files.count; j++)
+                if (strrchr(files.items[j], '/'))
+                    files.items[j] = strrchr(files.items[j], '/') + 1;  // Base name, in place
         }
-        closedir(d);                           // Close the directory after processing
         // Sort the file names for this file type.
-        if (count > 0)
-            qsort(files, count, sizeof(char *), compare_string);  // Alphabetically sort the file names
+        if (files.count > 0)
+            qsort(files.items, files.count, sizeof(char *), compare_string);  // Alphabetically sort the file names
         // Append the sorted file names to the combined buffer.
-        for (int j = 0; j < count; j++) {        
-            strncat(combined, files[j], sizeof(combined) - strlen(combined) - 1);  
-            strncat(combined, "\n", sizeof(combined) - strlen(combined) - 1);  
-            free(files[j]);                  // Free the allocated string for the file name
+        for (int j = 0; j < files.count; j++) {
+            if (j > 0 && strcmp(files.items[j], files.items[j - 1]) == 0)
+                continue;                      // Replicas list the same name once
+            size_t len = strlen(files.items[j]);
+            if (listed + len + 2 > LIST_MAX_BYTES)
+                break;                         // Full: the rest does not fit in one reply
+            memcpy(combined + listed, files.items[j], len);
+            listed += len;
+            combined[listed++] = '\n';
         }
-        free(files);                         // Free the file array pointer
     }
-    if (strlen(combined) == 0)            
+    if (listed == 0) {
         strcpy(combined, "No files found.\n"); // Set the message to inform the client
+        listed = strlen(combined);
+    }
     
-    send(client_sock, combined, strlen(combined), 0);  
+    send(client_sock, combined, listed, 0);  
+    return 0;
 }
-else if (strcmp(command, "downltar") == 0) {   // Process 'downltar' command to send a tar archive of files
+
+// handle_downltar - downltar <filetype>: sends a tar archive of every stored file of one type.
+int handle_downltar(CmdReader *r, Command *cmd) {
+    int client_sock = r->sock;
+    char *home_dir = getenv("HOME");
+    if (!home_dir)
+        home_dir = ".";
     // Expected format: downltar <filetype>
-    char *filetype = strtok(NULL, " ");        
-    if (!filetype) {                           // Validate that filetype is provided
-        send(client_sock, "ERROR: Invalid downltar command format. Expected: downltar <filetype>\n", 68, 0);  // Send error message
-        continue; // continue to next command
-    }
+    char *filetype = cmd->args[0];        
     
     if (strcmp(filetype, ".c") == 0) {          
         // Create tar archive for .c files from $HOME/S1.
         char tar_path[256];                    // Buffer for the tar file path
         snprintf(tar_path, sizeof(tar_path), "%s/cfiles.tar", home_dir);  // Construct tar file path for .c files
-        char cmd[2048];                        
-        /* Using 'find' to list all .c files under $HOME/S1, then piping those paths into tar.
-         * This preserves the relative directory structure.
-         */
-        snprintf(cmd, sizeof(cmd),
-                 "find \"%s/S1\" -type f -name \"*.c\" | tar -cf %s -T -",  
-                 home_dir, tar_path);           // Build command to create tar archive of .c files
-        if (system(cmd) != 0) {                
+        // Written directly: packed files have no path tar could read, and large ones are plain files.
+        if (build_c_tar(&r->arena, tar_path, home_dir) != 0) {
             send(client_sock, "ERROR: Failed to create tar file for .c files.\n", 48, 0);  
-            continue;                        // Continue to next command
+            return 0;
         }
         if (send_file(client_sock, tar_path) == 0)  // Send the tar file to the client
             remove(tar_path);                
         else
             send(client_sock, "ERROR: Failed to send tar file.\n", 31, 0);  // Inform client if sending fails
     }
-    else if (strcmp(filetype, ".pdf") == 0) {    // If tar archive requested for .pdf files
-        // Create tar archive for .pdf files from $HOME/S2.
+    else if (strcmp(filetype, ".pdf") == 0 || strcmp(filetype, ".txt") == 0) {  // .pdf/.txt are spread over the backend nodes
+        // Create tar archive from every node's storage root under $HOME.
         char tar_path[256];                 
-        snprintf(tar_path, sizeof(tar_path), "%s/pdf.tar", home_dir);  // Construct tar file path for PDFs
-        char cmd[2048];                       
-        snprintf(cmd, sizeof(cmd),
-                 "find \"%s/S2\" -type f -name \"*.pdf\" | tar -cf %s -T -",  
-                 home_dir, tar_path);           
-        if (system(cmd) != 0) {                // Execute the command and check for errors
-            send(client_sock, "ERROR: Failed to create tar file for .pdf files.\n", 48, 0);  // Inform client of error
-            continue;                        // Continue to next command
+        snprintf(tar_path, sizeof(tar_path), "%s/%s", home_dir,
+                 strcmp(filetype, ".pdf") == 0 ? "pdf.tar" : "text.tar");  // Construct tar file path
+        // Written directly, like the .c archive, so the next files are read ahead while one is copied.
+        if (build_node_tar(&r->arena, tar_path, filetype, home_dir) != 0) {
+            send(client_sock, "ERROR: Failed to create tar file.\n", 34, 0);  // Inform client of error
+            return 0;
         }
         if (send_file(client_sock, tar_path) == 0)  // Send the tar file
             remove(tar_path);                
         else
             send(client_sock, "ERROR: Failed to send tar file.\n", 31, 0);  // Error message on failure
     }
-    else if (strcmp(filetype, ".txt") == 0) {    // If tar archive requested for .txt files
-        // Create tar archive for .txt files from $HOME/S3.
-        char tar_path[256];                    // Buffer for tar file path
-        snprintf(tar_path, sizeof(tar_path), "%s/text.tar", home_dir); 
-        char cmd[2048];                        // Buffer for tar command
-        snprintf(cmd, sizeof(cmd),
-                 "find \"%s/S3\" -type f -name \"*.txt\" | tar -cf %s -T -",  
-                 home_dir, tar_path);           
-        if (system(cmd) != 0) {                // Execute command; check for errors
-            send(client_sock, "ERROR: Failed to create tar file for .txt files.\n", 48, 0);  // Inform client of error
-            continue;                        // Continue to next command
-        }
-        if (send_file(client_sock, tar_path) == 0)  
-            remove(tar_path);                // Delete the tar file after sending
-        else
-            send(client_sock, "ERROR: Failed to send tar file.\n", 31, 0);  
-    }
     else {                                    
         send(client_sock, "ERROR: Unsupported filetype for downltar.\n", 44, 0);  // Send error message
     }
+    return 0;
+}
+
+// handle_addnode - addnode <id> <ip> <port>: adds a backend node and moves the files it now owns onto it.
+int handle_addnode(CmdReader *r, Command *cmd) {
+    int client_sock = r->sock;
+    char *home_dir = getenv("HOME");
+    if (!home_dir)
+        home_dir = ".";
+    // Expected format: addnode <id> <ip> <port>
+    char *id = cmd->args[0];
+    char *ip = cmd->args[1];
+    char *port_arg = cmd->args[2];
+    int port = port_arg ? atoi(port_arg) : 0;
+    if (!id || !ip || port <= 0 || strlen(id) >= sizeof(((BackendNode *)0)->id) ||
+        strchr(id, '/') || strcmp(id, "S1") == 0 || strlen(ip) >= sizeof(((BackendNode *)0)->ip)) {
+        send(client_sock, "ERROR: Invalid addnode command format. Expected: addnode <id> <ip> <port>\n", 74, 0);
+        return 0;
+    }
+    // Serialize concurrent membership changes across S1 processes.
+    char lock_path[512];
+    snprintf(lock_path, sizeof(lock_path), "%s/%s.lock", home_dir, ROUTING_FILE);
+    int lock_fd = open(lock_path, O_CREAT | O_RDWR, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0) {
+        send(client_sock, "ERROR: Failed to lock routing table.\n", 37, 0);
+        if (lock_fd >= 0)
+            close(lock_fd);
+        return 0;
+    }
+    RoutingTable *updated = malloc(sizeof(RoutingTable));
+    int exists = 0;
+    if (updated) {
+        load_routing_table(updated);
+        for (int n = 0; n < updated->node_count; n++)
+            if (strcmp(updated->nodes[n].id, id) == 0)
+                exists = 1;
+    }
+    if (!updated || exists || updated->node_count >= MAX_NODES) {
+        send(client_sock, "ERROR: Node exists or routing table is full.\n", 45, 0);
+        free(updated);
+        close(lock_fd);                          // Closing the descriptor releases the lock
+        return 0;
+    }
+    BackendNode *node = &updated->nodes[updated->node_count++];
+    snprintf(node->id, sizeof(node->id), "%s", id);
+    snprintf(node->ip, sizeof(node->ip), "%s", ip);
+    node->port = port;
+    default_unix_path(node);                   // Same-host nodes are reached over their local socket
+    node->transport = node->unix_path[0] ? TRANSPORT_UNIX : TRANSPORT_TCP;
+    if (save_routing_table(updated) != 0) {
+        send(client_sock, "ERROR: Failed to save routing table.\n", 37, 0);
+        free(updated);
+        close(lock_fd);
+        return 0;
+    }
+    // The new table is live for every S1 process from here on; downloads that miss on the
+    // new owner fall back to probing the old nodes until the move below has finished.
+    build_ring_table(updated);
+    refresh_routing_table();                   // forward_file finds the new node's transport in the live table
+    int moved = 0;
+    for (int n = 0; n < updated->node_count - 1; n++) {
+        char root[512];
+        if (!node_is_local(&updated->nodes[n])) {
+            rebalance_remote(updated, n, &moved);  // Its files are listed and fetched over the network
+            continue;
+        }
+        snprintf(root, sizeof(root), "%s/%s", home_dir, updated->nodes[n].id);
+        rebalance_tree(updated, n, root, NULL, &moved);
+    }
+    free(updated);
+    close(lock_fd);
+    char reply[256];
+    snprintf(reply, sizeof(reply), "Node %s added. %d file(s) rebalanced.\n", id, moved);
+    send(client_sock, reply, strlen(reply), 0);
+    return 0;
 }
 
+// handle_exit - exit: ends the session.
+int handle_exit(CmdReader *r, Command *cmd) {
+    (void)r;
+    (void)cmd;
+    return -1;
+}
+
+
+// send_size - Sends the header of a file response whose data has the given etag (NULL when it has
+// none): send_file's "<size>\n" without a framing. With one the reply is "NOTMODIFIED\n" when the
+// client's copy has that etag, else "ETAG <etag>\n<size>\n" (downlf) or "FILE <size> <etag>\n"
+// (downlm), so that several files can follow each other on the stream. Returns 0 when the data is to
+// follow, 1 after NOTMODIFIED and -1 when sending failed.
+int send_size(int client_sock, long long size, const FileFraming *framing, const char *etag) {
+    char size_str[200];
+    if (!framing)
+        return file_send_size(client_sock, size) == 0 ? 0 : -1;
+    if (!etag)
+        etag = "-";                            // The client will not cache it
+    if (strcmp(etag, "-") != 0 && strcmp(etag, framing->validator) == 0)
+        return send(client_sock, "NOTMODIFIED\n", 12, 0) < 0 ? -1 : 1;
+    if (framing->framed)
+        snprintf(size_str, sizeof(size_str), "FILE %lld %s\n", size, etag);
+    else
+        snprintf(size_str, sizeof(size_str), "ETAG %s\n%lld\n", etag, size);
+    return send(client_sock, size_str, strlen(size_str), 0) < 0 ? -1 : 0;
+}
+
+// serve_download - Sends one file for downlf (framed = 0) or downlm (framed = 1). With a validator the
+// reply is "NOTMODIFIED\n" when the client's copy is current; otherwise the file follows "ETAG <etag>\n"
+// (downlf) or carries the etag in its size header (downlm). The etag is that of the copy actually
+// sent, the packed record, the cached copy or the replica that answered. Returns 0 when sent, -1 with
+// *err set to the message for the client when no file data was sent, and -2 when the transfer broke off.
+int serve_download(int client_sock, const char *filepath_arg, const char *validator, int framed, const char **err) {
+    char *ext = strrchr(filepath_arg, '.'); // Get the file extension from the provided path
+    if (!ext) {  // If no extension is found
+        *err = "ERROR: File has no extension.\n";
+        return -1;
+    }
+    // Check that the path begins with "S1/"
+    if (strncmp(filepath_arg, "S1/", 3) != 0) {
+        *err = "ERROR: Path must start with 'S1/'.\n";
+        return -1;
+    }
+    if (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 &&
+        strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0) {  // Only allow .c, .pdf, .txt, and .zip files
+        *err = "ERROR: Unsupported file extension for download.\n";
+        return -1;
+    }
+
+    FileFraming framing = { framed, validator ? validator : "-" };  // Conditional download
+    return send_stored_file(client_sock, filepath_arg, ext, framed || validator ? &framing : NULL, err);
+}
 
-else if (strcmp(command, "exit") == 0) {      
-            break;                           
+// send_stored_file - Sends a validated S1/ path in send_file's format from wherever it is kept: the
+// segment store or S1's tree for .c files, the cache or a replica for the others, with framing's size
+// header when given. Returns like serve_download.
+int send_stored_file(int client_sock, const char *filepath_arg, const char *ext, const FileFraming *framing, const char **err) {
+    char full_filepath[512];                   // Buffer to store the full filesystem path of the file
+    // .c files are stored on S1 itself; the others are fetched from the backend nodes that hold them.
+    if (strcmp(ext, ".c") == 0) { // If downloading a .c file
+        char key[512];
+        const char *data;
+        unsigned int len, crc;
+        if (make_route_key(filepath_arg + 3, NULL, key, sizeof(key)) != 0) {
+            *err = "ERROR: Specified path is not a file.\n";
+            return -1;
         }
-        else { // For any unrecognized command
-            send(client_sock, "ERROR: Invalid command. Try again!\n", 35, 0);  // Inform the client about an invalid command
+        if (store_view(&cfile_store, key, &data, &len, &crc) == 0) {  // Small files come straight out of a mapped segment
+            char etag[FILE_ETAG_MAX];
+            snprintf(etag, sizeof(etag), "s%x-%08x", len, crc);
+            return send_buffer(client_sock, data, len, framing, etag) == 0 ? 0 : -2;
         }
+        stored_path("S1", key, full_filepath, sizeof(full_filepath));  // Large ones are plain files
     }
-    close(client_sock); // close the client socket when done
+    else {                                       // For .pdf, .txt and .zip files ask the routing table
+        char key[512];
+        refresh_routing_table();
+        int served = make_route_key(filepath_arg + 3, NULL, key, sizeof(key)) == 0 ? cache_serve(client_sock, key, framing) : -1;
+        if (served == 1)                         // Cache miss: stream it from a replica and keep a copy
+            served = proxy_download(client_sock, key, framing);
+        if (served == -1)
+            *err = "ERROR: Specified path is not a file.\n";  // Not stored on any backend node
+        return served;
+    }
+
+    // Check that the file exists and is a regular file.
+    struct stat path_stat; // Structure for checking file status
+    if (stat(full_filepath, &path_stat) != 0 || !S_ISREG(path_stat.st_mode)) {  // Verify file existence and that it is a regular file
+        *err = "ERROR: Specified path is not a file.\n";
+        return -1;
+    }
+    if (send_file_mapped(client_sock, full_filepath, framing) != 0) {  // Attempt to send the requested file to the client
+        *err = "ERROR: Failed to send file. File may not exist.\n";
+        return -1;
+    }
+    return 0;
 }
 
+// remove_path - Removes one S1/ path for removef/removem: a packed or plain .c file, or every replica
+// of a backend file, on this host's nodes and on those of other hosts. Returns the message for the client.
+const char *remove_path(const char *filepath_arg) {
+    // Check that the path begins with "S1/"
+    if (strncmp(filepath_arg, "S1/", 3) != 0)  // Verify that the file path starts with "S1/"
+        return "ERROR: Path must start with 'S1/'.\n";
+    const char *ext = strrchr(filepath_arg, '.');  // Extract file extension from the provided path
+    if (!ext)                                    // If extension is missing
+        return "ERROR: File has no extension.\n";
+    char full_filepath[512];                   // Buffer for constructing the complete file path
+    char key[512];                             // Logical path: segment store key and placement
+    if (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 && strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0)
+        return "ERROR: Unsupported file type for removal.\n";
+    if (make_route_key(filepath_arg + 3, NULL, key, sizeof(key)) != 0)
+        return "ERROR: Specified path or file is not valid.\n";
+    if (strcmp(ext, ".c") == 0) {                // For .c files
+        if (store_remove(&cfile_store, key) == 0) {  // Packed in a segment: a tombstone removes it
+            journal_append(&change_journal, JOURNAL_DEL, key);
+            return "File removed successfully.\n";
+        }
+        stored_path("S1", key, full_filepath, sizeof(full_filepath));
+        struct stat path_stat; // Structure for checking the file's status
+        if (stat(full_filepath, &path_stat) != 0 || !S_ISREG(path_stat.st_mode))  // Check if file exists and is regular
+            return "ERROR: Specified path or file is not valid.\n";
+        if (trash_file(full_filepath) != 0) // Move the file out of sight; the reclaimer frees its space later
+            return "ERROR: Failed to remove file. File may not exist.\n";
+    }
+    else {                                       // .pdf, .txt and .zip files live on the backend nodes
+        int removed = 0, failed = 0;
+        refresh_routing_table();
+        while (!failed && locate_file(key, full_filepath, sizeof(full_filepath)) >= 0) {
+            failed = trash_file(full_filepath) != 0;  // Replicas on this host go to the trash
+            removed += !failed;
+        }
+        removed += remove_remote(key);           // Those on other hosts are unlinked by their node
+        if (removed == 0)
+            return failed ? "ERROR: Failed to remove file. File may not exist.\n"
+                          : "ERROR: Specified path or file is not valid.\n";
+        cache_invalidate(key);
+    }
+    journal_append(&change_journal, JOURNAL_DEL, key);
+    return "File removed successfully.\n";
+}
 
-// recursive_list_files - Recursively traverses dir_path and collects the base names of all regular files.
- 
-void recursive_list_files(const char *dir_path, char ***file_array, int *count, int *capacity) {  // Recursively list files in a directory
-    DIR *d = opendir(dir_path);                // Open the directory for reading
-    if (d == NULL)
-        return;                              
-    struct dirent *entry;                    
-    char full_path[512];                      
-    struct stat st;                          // File status structure
-    while ((entry = readdir(d)) != NULL) {    
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;                        // Skip "." and ".." entries
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);  // Build full path for the entry
-        if (stat(full_path, &st) == 0) {       
-            if (S_ISDIR(st.st_mode))
-                recursive_list_files(full_path, file_array, count, capacity);  // Recurse into subdirectories
-            else if (S_ISREG(st.st_mode)) {   // If it's a regular file
-                if (*count >= *capacity) {   
-                    *capacity *= 2;           // Double the capacity
-                    *file_array = realloc(*file_array, sizeof(char*) * (*capacity));  // Reallocate array with new capacity
-                }
-                (*file_array)[*count] = strdup(entry->d_name);  // Duplicate file name and store it
-                (*count)++; // Increment count of files
-            }
+// clone_file - Copies src to a new file dst without moving the data through S1: a FICLONE reflink
+// where the filesystem shares extents, otherwise copy_file_range(). Returns 0 or -1.
+int clone_file(const char *src, const char *dst) {
+    int in = open(src, O_RDONLY);
+    if (in < 0)
+        return -1;
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    int ok = ioctl(out, FICLONE, in) == 0;
+    if (!ok) {
+        struct stat st;
+        off_t remaining = fstat(in, &st) == 0 ? st.st_size : -1;
+        ok = remaining >= 0;
+        while (ok && remaining > 0) {          // In-kernel copy
+            ssize_t n = copy_file_range(in, NULL, out, NULL, remaining, 0);
+            if (n <= 0)
+                ok = 0;
+            else
+                remaining -= n;
         }
     }
-    closedir(d); // close the directory
+    close(in);
+    if (close(out) != 0 || !ok) {
+        unlink(dst);
+        return -1;
+    }
+    return 0;
 }
-// compare_string - Comparator function for qsort.
-int compare_string(const void *a, const void *b) {  // Comparator for sorting strings alphabetically
-    const char *s1 = *(const char **) a;      
-    const char *s2 = *(const char **) b;      
-    return strcmp(s1, s2);                   
+
+// copy_path - Copies (or moves) a stored file to another S1/ location for copyf/movef without the data
+// leaving the servers. dst_arg names a directory, or the new file when it ends in the source's extension.
+// .c files are copied within the segment store or cloned/renamed under $HOME/S1; backend files are
+// committed from a stored replica onto the destination's replica set (commitf), a node that holds the
+// source renaming its own copy on a move. A source kept only on other hosts' nodes is fetched to this
+// host first. Returns the message for the client.
+const char *copy_path(const char *src_arg, const char *dst_arg, int move) {
+    if (strncmp(src_arg, "S1/", 3) != 0 || strncmp(dst_arg, "S1/", 3) != 0)
+        return "ERROR: Path must start with 'S1/'.\n";
+    const char *ext = strrchr(src_arg, '.');
+    const char *src_name = strrchr(src_arg, '/') + 1;
+    if (!ext || strchr(ext, '/'))
+        return "ERROR: File has no extension.\n";
+    // Destination directory (below S1/) and file name
+    char dst_dir[512], filename[256];
+    const char *dst_ext = strrchr(dst_arg, '.');
+    if (dst_ext && strcmp(dst_ext, ext) == 0) {
+        const char *slash = strrchr(dst_arg, '/');
+        snprintf(dst_dir, sizeof(dst_dir), "%.*s", (int)(slash - dst_arg - 3 > 0 ? slash - dst_arg - 3 : 0), dst_arg + 3);
+        snprintf(filename, sizeof(filename), "%s", slash + 1);
+    } else {
+        snprintf(dst_dir, sizeof(dst_dir), "%s", dst_arg + 3);
+        snprintf(filename, sizeof(filename), "%s", src_name);
+    }
+    char src_key[512], dst_key[512], dst_path[600];
+    if (make_route_key(src_arg + 3, NULL, src_key, sizeof(src_key)) != 0 ||
+        make_route_key(dst_dir, filename, dst_key, sizeof(dst_key)) != 0 || strstr(dst_key, ".."))
+        return "ERROR: Specified path or file is not valid.\n";
+    if (strcmp(src_key, dst_key) == 0)
+        return "ERROR: Source and destination are the same file.\n";
+    const char *done = move ? "File moved successfully.\n" : "File copied successfully.\n";
+
+    if (strcmp(ext, ".c") == 0) {
+        char src_path[600], tmp_path[700];
+        char *data;
+        unsigned int len;
+        snprintf(dst_path, sizeof(dst_path), "S1/%s", dst_dir);
+        if (create_directories(dst_path) != 0 || plain_c_path(dst_key, dst_path, sizeof(dst_path)) != 0)
+            return "ERROR: Failed to create local directory structure.\n";
+        int existed = key_exists(dst_key, ext);
+        if (store_get(&cfile_store, src_key, &data, &len, NULL) == 0) {  // Packed: copy the record within the store
+            int ret = store_put(&cfile_store, dst_key, data, len);
+            free(data);
+            if (ret != 0)
+                return "ERROR: Failed to store file.\n";
+            remove(dst_path);                  // An older large version may exist as a plain file
+            if (move)
+                store_remove(&cfile_store, src_key);
+            note_change(dst_key, existed);
+            if (move)
+                journal_append(&change_journal, JOURNAL_DEL, src_key);
+            return done;
+        }
+        if (stored_path("S1", src_key, src_path, sizeof(src_path)) != 1)
+            return "ERROR: Specified path or file is not valid.\n";
+        snprintf(tmp_path, sizeof(tmp_path), "%s.copy.%d", dst_path, (int)getpid());
+        if (move ? rename(src_path, tmp_path) != 0 : clone_file(src_path, tmp_path) != 0)
+            return "ERROR: Failed to copy file.\n";
+        int ret = commit_upload(tmp_path, dst_path, dst_key);  // Packs it or renames it into place
+        if (ret != 0 && move)
+            rename(tmp_path, src_path);        // Put the source back
+        unlink(tmp_path);
+        if (ret != 0)
+            return "ERROR: Failed to copy file.\n";
+        note_change(dst_key, existed);
+        if (move)
+            journal_append(&change_journal, JOURNAL_DEL, src_key);
+        return done;
+    }
+    if (strcmp(ext, ".pdf") != 0 && strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0)
+        return "ERROR: Unsupported file type.\n";
+
+    refresh_routing_table();
+    char src_path[600];
+    int replicas[MAX_NODES];
+    int replica_count = route_replicas(&routing, dst_key, replicas, routing.replicas);
+    int fetched = locate_file(src_key, src_path, sizeof(src_path)) < 0;
+    if (fetched && fetch_file(src_key, src_path, sizeof(src_path)) < 0)  // Only on other hosts: copy it here first
+        return "ERROR: Specified path or file is not valid.\n";
+    const char *err = NULL;
+    snprintf(dst_path, sizeof(dst_path), "S1/%s", dst_dir);
+    if (replica_count == 0)
+        err = "ERROR: No backend node available.\n";
+    else if (create_directories(dst_path) != 0)  // dispfnames looks for the directory in S1's tree, as after uploadf
+        err = "ERROR: Failed to create local directory structure.\n";
+    // Nodes without a copy of the source first: a node that has one may rename it away on a move
+    int placed = 0, existed = key_exists(dst_key, ext);
+    for (int pass = 0; !err && pass < 2; pass++) {
+        for (int i = 0; i < replica_count; i++) {
+            const BackendNode *node = &routing.nodes[replicas[i]];
+            char own_path[600], target_dest[600];
+            int own = node_is_local(node) ? stored_path(node->id, src_key, own_path, sizeof(own_path)) : 0;
+            if (own != pass || node_dest(node->id, dst_key, target_dest, sizeof(target_dest)) < 0)
+                continue;
+            if ((own && move && commit_local(node, own_path, filename, target_dest, 1) == 0) ||
+                forward_file(own ? own_path : src_path, filename, target_dest, node->ip, node->port) == 0)
+                placed++;
+        }
+    }
+    if (fetched)
+        unlink(src_path);
+    if (err)
+        return err;
+    cache_invalidate(dst_key);
+    int quorum = routing.write_quorum < replica_count ? routing.write_quorum : replica_count;
+    if (placed < quorum)
+        return "ERROR: Forwarding failed.\n";
+    note_change(dst_key, existed);
+    if (move) {
+        cache_invalidate(src_key);
+        while (locate_file(src_key, src_path, sizeof(src_path)) >= 0 && trash_file(src_path) == 0)
+            ;                                  // Drop the source replicas nothing renamed
+        remove_remote(src_key);
+        journal_append(&change_journal, JOURNAL_DEL, src_key);
+    }
+    return done;
 }
 
-// request_tar_from_target - Contacts a target server (S2 or S3) to request a tar file.
-// It sends "downltar <filetype>" and saves the received file to temp_tar_path.
-int request_tar_from_target(TargetServer target, const char *filetype, const char *temp_tar_path) {  // Request tar archive from target server
-    int sock = socket(AF_INET, SOCK_STREAM, 0);  
-    if (sock < 0) {                       
-        perror("request_tar_from_target: socket creation failed");  // Print error message
-        return -1;                         // Return error code
-    }
-    struct sockaddr_in target_addr;          // Structure for target server address
-    memset(&target_addr, 0, sizeof(target_addr)); 
-    target_addr.sin_family = AF_INET;         
-    target_addr.sin_port = htons(target.port);  
-    if (inet_pton(AF_INET, target.ip, &target_addr.sin_addr) <= 0) {  // Convert target IP from text to binary form
-        perror("request_tar_from_target: invalid target address");  
-        close(sock); // Close the socket
-        return -1; // Return error code
-    }
-    if (connect(sock, (struct sockaddr *)&target_addr, sizeof(target_addr)) < 0) {  
-        perror("request_tar_from_target: connection to target server failed");  
-        close(sock); 
-        return -1; 
-    }
-    char cmd[256];                      
-    snprintf(cmd, sizeof(cmd), "downltar %s\n", filetype);  // Build command string (e.g., "downltar .pdf")
-    if (send(sock, cmd, strlen(cmd), 0) < 0) {  
-        perror("request_tar_from_target: sending command failed");  // Print error if sending fails
-        close(sock); 
-        return -1; 
-    }
-    int ret = receive_file(sock, temp_tar_path);  
-    close(sock);
-    return ret; 
+// remove_tree_at - Deletes everything inside the directory dirfd (logical path rel) with unlinkat(),
+// counting removed files in *files; with invalidate set they also leave S1's hot-file cache.
+// Returns 0, or -1 when an entry could not be removed.
+int remove_tree_at(int dirfd, const char *rel, int invalidate, long *files) {
+    int fd = dup(dirfd);                       // fdopendir() owns its descriptor
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (d == NULL) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    int ret = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char key[512];
+        struct stat st;
+        snprintf(key, sizeof(key), "%s/%s", rel, entry->d_name);
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN)       // Filesystem without d_type: ask the inode
+            is_dir = fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        if (is_dir) {
+            int sub = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (sub < 0 || remove_tree_at(sub, key, invalidate, files) != 0)
+                ret = -1;
+            if (sub >= 0)
+                close(sub);
+            if (unlinkat(dirfd, entry->d_name, AT_REMOVEDIR) != 0)
+                ret = -1;
+        } else if (unlinkat(dirfd, entry->d_name, 0) == 0) {
+            __atomic_add_fetch(files, 1, __ATOMIC_RELAXED);
+            fanout_strip(key);                 // The cache knows files by their logical path
+            if (invalidate)
+                cache_invalidate(key);
+        } else
+            ret = -1;
+    }
+    closedir(d);
+    return ret;
 }
-// send_file - Sends the file at 'filepath' to the client - It sends the file size as a string followed by the file data.
-int send_file(int client_sock, const char *filepath) {  
-    FILE *fp = fopen(filepath, "rb");       
-    if (!fp) {                               
-        perror("send_file: fopen failed");   
-        return -1;                           
+
+// remove_dir - Serves removedir: deletes the tree at an S1/ path from S1's own tree, the segment store
+// and every backend node's tree. The subdirectories are shared out among up to REMOVEDIR_WORKERS processes
+// while this one removes the files directly inside, the packed .c files and, with a removedir request
+// each, the trees of nodes on other hosts, and sends "PROGRESS <files>" lines; the reply ends with "DONE <files>" or "ERR <message>". Returns 0, or -1 when the client went away.
+int remove_dir(int client_sock, const char *filepath_arg) {
+    char *home_dir = getenv("HOME");
+    if (!home_dir)
+        home_dir = ".";
+    char key[512], line[256];
+    if (strncmp(filepath_arg, "S1/", 3) != 0 || make_route_key(filepath_arg + 3, NULL, key, sizeof(key)) != 0 ||
+        strcmp(key, "..") == 0 || strncmp(key, "../", 3) == 0 || strstr(key, "/../") ||
+        (strlen(key) >= 3 && strcmp(key + strlen(key) - 3, "/..") == 0)) {
+        const char *err = "ERR Path must name a directory below 'S1/'.\n";
+        return send(client_sock, err, strlen(err), 0) < 0 ? -1 : 0;
     }
-    fseek(fp, 0, SEEK_END);                  
-    long file_size = ftell(fp);              
-    rewind(fp);                              // Reset file pointer to beginning
-    char size_str[64];                       // Buffer to store the size as a string
-    snprintf(size_str, sizeof(size_str), "%ld", file_size);  // Convert file size to string
-    if (send(client_sock, size_str, strlen(size_str), 0) < 0) { 
-        perror("send_file: sending file size failed");  
-        fclose(fp); 
-        return -1; 
+    refresh_routing_table();
+    int root_fds[MAX_NODES + 1], invalidate[MAX_NODES + 1], roots = 0;
+    char root_paths[MAX_NODES + 1][600];
+    for (int n = -1; n < routing.node_count; n++) {  // S1's own tree first, then every backend node here
+        if (n >= 0 && !node_is_local(&routing.nodes[n]))
+            continue;                          // Removed by the node itself below
+        snprintf(root_paths[roots], sizeof(root_paths[roots]), "%s/%s/%s", home_dir,
+                 n < 0 ? "S1" : routing.nodes[n].id, key);
+        root_fds[roots] = open(root_paths[roots], O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        invalidate[roots] = n >= 0 && routing.cache_bytes > 0;
+        if (root_fds[roots] >= 0)
+            roots++;
     }
-    char file_buf[BUFFER_SIZE]; // Buffer to hold chunks of file data
-    while (!feof(fp)) { 
-        size_t n = fread(file_buf, 1, sizeof(file_buf), fp);  
-        if (n > 0) { // If data was read
-            if (send(client_sock, file_buf, n, 0) < 0) {  
-                perror("send_file: sending file data failed");  // Print error if send fails
-                fclose(fp); 
-                return -1; 
+
+    // List the entries directly below the directory in every root: subdirectories are the workers' units
+    int unit_count = 0, unit_capacity = 64, dir_count = 0;
+    RemoveUnit *units = malloc(unit_capacity * sizeof(RemoveUnit));
+    for (int r = 0; units && r < roots; r++) {
+        int fd = dup(root_fds[r]);
+        DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+        if (d == NULL) {
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(d)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            if (unit_count >= unit_capacity) {
+                RemoveUnit *grown = realloc(units, unit_capacity * 2 * sizeof(RemoveUnit));
+                if (!grown)
+                    break;
+                units = grown;
+                unit_capacity *= 2;
             }
+            RemoveUnit *u = &units[unit_count++];
+            struct stat st;
+            u->root = r;
+            snprintf(u->name, sizeof(u->name), "%s", entry->d_name);
+            u->dir = entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN &&
+                     fstatat(root_fds[r], u->name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+            dir_count += u->dir;
         }
+        closedir(d);
     }
-    fclose(fp); // Close the file after sending
-    return 0; // Return success
-}
 
-// receive_file - Receives file data from the client and writes it to disk - expects first a string representing the file size, 
-// then the file data.
-int receive_file(int client_sock, const char *filepath) {  
-    char size_buf[64];                       
-    int bytes_read = recv(client_sock, size_buf, sizeof(size_buf)-1, 0);  // Read file size from client
-    if (bytes_read <= 0)                    
-        return -1;                          
-    size_buf[bytes_read] = '\0';             
-    long file_size = atol(size_buf);         
-    if (file_size <= 0)                      
-        return -1;                           
-    FILE *fp = fopen(filepath, "wb");      
-    if (!fp) {                               
-        perror("fopen");                    
-        return -1;                           
+    // Shared by the workers: files removed so far and the next unit to take
+    struct { long files; int next; int failed; } *shared = mmap(NULL, 4096, PROT_READ | PROT_WRITE,
+                                                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (!units || shared == MAP_FAILED) {
+        for (int r = 0; r < roots; r++)
+            close(root_fds[r]);
+        free(units);
+        if (shared != MAP_FAILED)
+            munmap(shared, 4096);
+        const char *err = "ERR Out of memory.\n";
+        return send(client_sock, err, strlen(err), 0) < 0 ? -1 : 0;
     }
-    char file_buf[BUFFER_SIZE];              // Buffer to store chunks of file data
-    long remaining = file_size;              // Track remaining bytes to be received
-    while (remaining > 0) {                  
-        int to_read = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;  
-        int received = recv(client_sock, file_buf, to_read, 0);  
-        if (received <= 0) {                 // Check if receiving failed
-            fclose(fp);                   
-            return -1;                       
+    memset(shared, 0, sizeof(*shared));
+    pid_t workers[REMOVEDIR_WORKERS];
+    int running = 0;
+    for (int w = 0; w < REMOVEDIR_WORKERS && w < dir_count; w++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            break;                             // Fewer workers; the units are taken by whoever is free
+        if (pid == 0) {
+            int i;
+            while ((i = __atomic_fetch_add(&shared->next, 1, __ATOMIC_RELAXED)) < unit_count) {
+                RemoveUnit *u = &units[i];
+                if (!u->dir)
+                    continue;
+                char rel[512];
+                snprintf(rel, sizeof(rel), "%s/%s", key, u->name);
+                int sub = openat(root_fds[u->root], u->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+                if (sub < 0 || remove_tree_at(sub, rel, invalidate[u->root], &shared->files) != 0 ||
+                    unlinkat(root_fds[u->root], u->name, AT_REMOVEDIR) != 0)
+                    shared->failed = 1;
+                if (sub >= 0)
+                    close(sub);
+            }
+            _exit(0);
         }
-        fwrite(file_buf, 1, received, fp);   // Write received data to file
-        remaining -= received;               // Decrease remaining byte count
+        workers[running++] = pid;
     }
-    fclose(fp);                             
-    return 0;                               
-}
 
-// forward_file - Forwards a local file from S1 to a target server.
-// Opens the file, connects to the target server, sends an "uploadf" command, waits for "READY", and then sends file size and file data.
- 
-int forward_file(const char *local_filepath, const char *filename,
-                 const char *target_dest, const char *target_ip, int target_port) {  
-    FILE *fp = fopen(local_filepath, "rb");  
-    if (!fp) {                               
-        perror("forward_file: fopen failed");  
-        return -1;                        
+    // Meanwhile: the files directly inside the directory and the packed .c files below it
+    int failed = 0;
+    for (int i = 0; i < unit_count; i++) {
+        RemoveUnit *u = &units[i];
+        if (u->dir)
+            continue;
+        char rel[512];
+        snprintf(rel, sizeof(rel), "%s/%s", key, u->name);
+        if (unlinkat(root_fds[u->root], u->name, 0) == 0) {
+            __atomic_add_fetch(&shared->files, 1, __ATOMIC_RELAXED);
+            if (invalidate[u->root])
+                cache_invalidate(rel);
+        } else
+            failed = 1;
     }
-    fseek(fp, 0, SEEK_END);                  
-    long file_size = ftell(fp);             
-    rewind(fp);                             
-    int sock = socket(AF_INET, SOCK_STREAM, 0); 
-    if (sock < 0) {                         
-        perror("forward_file: socket creation failed");  
-        fclose(fp);                       
-        return -1;                         
+    int packed = store_remove_tree(&cfile_store, key);
+    if (packed > 0)
+        __atomic_add_fetch(&shared->files, packed, __ATOMIC_RELAXED);
+    int remote = 0;                            // Nodes on other hosts that had the directory
+    for (int n = 0; n < routing.node_count; n++) {
+        const BackendNode *node = &routing.nodes[n];
+        char request[BUFFER_SIZE], reply[256];
+        char *list = NULL;
+        long files;
+        if (node_is_local(node))
+            continue;
+        if (snprintf(request, sizeof(request), "removedir %s/%s\n", node->id, key) >= (int)sizeof(request)) {
+            failed = 1;
+            continue;
+        }
+        if (routing.cache_bytes > 0)
+            list = node_list(node, key, 0);    // The names to drop from the cache once they are gone
+        if (node_request(node, request, reply, sizeof(reply)) != 0)
+            failed = 1;                        // Unreachable: its copies stay
+        else if (sscanf(reply, "DONE %ld", &files) == 1 || sscanf(reply, "FAILED %ld", &files) == 1) {
+            remote++;
+            failed |= reply[0] == 'F';
+            __atomic_add_fetch(&shared->files, files, __ATOMIC_RELAXED);
+        }
+        char *save = NULL;
+        for (char *line = list ? strtok_r(list, "\n", &save) : NULL; line; line = strtok_r(NULL, "\n", &save)) {
+            char rel[1024];
+            line[strcspn(line, "\t")] = '\0';
+            snprintf(rel, sizeof(rel), "%s/%s", key, line);
+            fanout_strip(rel);
+            cache_invalidate(rel);
+        }
+        free(list);
     }
-    struct sockaddr_in target_addr;          // Structure to store target server address
-    memset(&target_addr, 0, sizeof(target_addr));  
-    target_addr.sin_family = AF_INET;        
-    target_addr.sin_port = htons(target_port);  // Set target port in network byte order
-    if (inet_pton(AF_INET, target_ip, &target_addr.sin_addr) <= 0) {  // Convert target IP address from text to binary format
-        perror("forward_file: invalid target address");  
-        fclose(fp);                       
-        close(sock);                       
-        return -1;                        
+    if (running == 0 && dir_count > 0) {       // No worker could be started: take the units here
+        int i;
+        while ((i = shared->next++) < unit_count) {
+            RemoveUnit *u = &units[i];
+            char rel[512];
+            snprintf(rel, sizeof(rel), "%s/%s", key, u->name);
+            int sub = u->dir ? openat(root_fds[u->root], u->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW) : -2;
+            if (sub == -2)
+                continue;
+            if (sub < 0 || remove_tree_at(sub, rel, invalidate[u->root], &shared->files) != 0 ||
+                unlinkat(root_fds[u->root], u->name, AT_REMOVEDIR) != 0)
+                failed = 1;
+            if (sub >= 0)
+                close(sub);
+        }
     }
-    if (connect(sock, (struct sockaddr *)&target_addr, sizeof(target_addr)) < 0) {  // Connect to the target server
-        perror("forward_file: connection to target server failed");  // Print error if connection fails
-        fclose(fp);                        
-        close(sock);                      
-        return -1;                       
+
+    // Report progress until every worker is done
+    int gone = 0, waited_ms = 0;
+    while (running > 0) {
+        usleep(10000);
+        waited_ms += 10;
+        for (int w = 0; w < running; w++) {
+            int status;
+            if (waitpid(workers[w], &status, WNOHANG) == workers[w]) {
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                    failed = 1;
+                workers[w--] = workers[--running];
+            }
+        }
+        if (running > 0 && waited_ms >= REMOVEDIR_PROGRESS_MS && !gone) {
+            waited_ms = 0;
+            snprintf(line, sizeof(line), "PROGRESS %ld\n", __atomic_load_n(&shared->files, __ATOMIC_RELAXED));
+            gone = send(client_sock, line, strlen(line), 0) < 0;  // Keep deleting: the work is half done
+        }
+    }
+    for (int r = 0; r < roots; r++) {
+        close(root_fds[r]);
+        if (unlinkat(AT_FDCWD, root_paths[r], AT_REMOVEDIR) != 0)
+            failed = 1;                        // An upload landed in the tree meanwhile
+    }
+    if (roots > 0)
+        dircache_bump(&dir_cache);             // Other processes may hold the removed directories open
+    long files = shared->files;
+    failed |= shared->failed;
+    if (roots > 0 || packed > 0 || remote > 0)
+        journal_append(&change_journal, JOURNAL_RMDIR, key);
+    munmap(shared, 4096);
+    free(units);
+
+    if (roots == 0 && packed <= 0 && remote == 0)
+        snprintf(line, sizeof(line), "ERR Path does not exist.\n");
+    else if (failed)
+        snprintf(line, sizeof(line), "ERR Removed %ld file(s), but some entries could not be removed.\n", files);
+    else
+        snprintf(line, sizeof(line), "DONE %ld\n", files);
+    return gone || send(client_sock, line, strlen(line), 0) < 0 ? -1 : 0;
+}
+
+// replicate_upload - Places a backend file received into local_filepath on its replica set, waiting for
+// the write quorum, and drops the local copy. Returns the message for the client.
+const char *replicate_upload(const char *local_filepath, const char *filename, const char *destination,
+                             const char *key, const int *replicas, int replica_count) {
+    // Place the file on the replica set that owns its logical path on the hash ring.
+    int quorum = routing.write_quorum < replica_count ? routing.write_quorum : replica_count;
+    int replicated = replicate_file(local_filepath, filename, destination, replicas, replica_count, quorum);  // Fan out and wait for the write quorum
+    cache_invalidate(key);                     // A cached copy of the previous version is stale now
+    if (replicated != 0)
+        return "ERROR: Forwarding failed.\n";  // Report forwarding failure
+    if (remove(local_filepath) == 0 || errno == ENOENT)  // Delete the local copy unless it was moved already
+        return "File created successfully.\n";
+    return "Success but local deletion in S1 failed.\n";
+}
+
+// read_batch_body - Reads the len-byte entry list of a batch command, of which have bytes arrived
+// together with the command line at start. Returns a NUL-terminated copy in arena, or NULL.
+char *read_batch_body(Arena *arena, int client_sock, const char *start, long have, long len) {
+    char *body = arena_alloc(arena, len + 1);
+    if (!body)
+        return NULL;
+    if (have > len)
+        have = len;
+    memcpy(body, start, have);
+    if (delta_recv_all(client_sock, body + have, len - have) != 0)
+        return NULL;
+    body[len] = '\0';
+    return body;
+}
+
+// batch_reply_add - Appends one "OK|ERR <entry> <message>" line of a multi-status reply kept in arena.
+int batch_reply_add(Arena *arena, char **reply, size_t *len, size_t *cap, const char *entry, const char *msg) {
+    size_t need = strlen(entry) + strlen(msg) + 8;
+    if (*len + need > *cap) {
+        size_t grown_cap = (*cap + need) * 2;
+        char *grown = arena_grow(arena, *reply, *len, grown_cap);
+        if (!grown)
+            return -1;
+        *reply = grown;
+        *cap = grown_cap;
+    }
+    int failed = strncmp(msg, "ERROR", 5) == 0;
+    *len += sprintf(*reply + *len, "%s %s %s", failed ? "ERR" : "OK", entry, msg);
+    if ((*reply)[*len - 1] != '\n')
+        (*reply)[(*len)++] = '\n';
+    return 0;
+}
+
+// batch_count - Number of entries in a batch list, counted like strtok_r() splits it: runs of "\n"
+// separate entries, so empty lines are no entries.
+int batch_count(const char *body) {
+    int count = 0;
+    for (const char *p = body; *p; p++)
+        if (*p != '\n' && (p == body || p[-1] == '\n'))
+            count++;
+    return count;
+}
+
+// batch_send_reply - Sends "MULTI <count>\n" and the collected lines. Returns 0 or -1.
+int batch_send_reply(int client_sock, int count, const char *reply, size_t len) {
+    char header[64];
+    snprintf(header, sizeof(header), "MULTI %d\n", count);
+    return delta_send_all(client_sock, header, strlen(header)) == 0 &&
+           delta_send_all(client_sock, reply, len) == 0 ? 0 : -1;
+}
+
+// batch_remove - removem: removes every listed path. Returns 0, or -1 when the reply could not be sent.
+int batch_remove(Arena *arena, int client_sock, char *body) {
+    char *reply = NULL, *save;
+    size_t len = 0, cap = 0;
+    int count = 0;
+    for (char *path = strtok_r(body, "\n", &save); path; path = strtok_r(NULL, "\n", &save)) {
+        if (batch_reply_add(arena, &reply, &len, &cap, path, remove_path(path)) != 0)
+            break;
+        count++;
+    }
+    return batch_send_reply(client_sock, count, reply ? reply : "", len);
+}
+
+// batch_stat - statf: answers every listed path with its metadata. Returns 0, or -1 when the reply failed.
+int batch_stat(Arena *arena, int client_sock, char *body) {
+    char *reply = NULL, *save, msg[256];
+    size_t len = 0, cap = 0;
+    int count = 0;
+    for (char *path = strtok_r(body, "\n", &save); path; path = strtok_r(NULL, "\n", &save)) {
+        stat_path(path, msg, sizeof(msg));
+        if (batch_reply_add(arena, &reply, &len, &cap, path, msg) != 0)
+            break;
+        count++;
+    }
+    return batch_send_reply(client_sock, count, reply ? reply : "", len);
+}
+
+// batch_download - downlm: streams every listed file back-to-back with framed headers, hinting the
+// local copies of the next entries to the kernel while one is sent. Returns 0, or -1 when the stream broke off.
+int batch_download(Arena *arena, int client_sock, char *body) {
+    char header[64], *save;
+    int count = batch_count(body), n = 0;
+    char **paths = arena_alloc(arena, (count > 0 ? count : 1) * sizeof(char *));
+    char **validators = arena_alloc(arena, (count > 0 ? count : 1) * sizeof(char *));
+    DownloadList list = { paths, validators };
+    Prefetch prefetch;
+    snprintf(header, sizeof(header), "MULTI %d\n", count);
+    if (!paths || !validators || send(client_sock, header, strlen(header), 0) < 0)
+        return -1;
+    for (char *line = strtok_r(body, "\n", &save); line && n < count; line = strtok_r(NULL, "\n", &save)) {
+        char *validator = strchr(line, ' ');
+        if (validator)
+            *validator++ = '\0';
+        paths[n] = line;
+        validators[n++] = validator;
+    }
+    prefetch_init(&prefetch, n, download_path, &list);
+    for (int i = 0; i < n; i++) {
+        const char *err;
+        prefetch_next(&prefetch, i);
+        int ret = serve_download(client_sock, paths[i], validators[i], 1, &err);
+        if (ret == -2)
+            return -1;
+        if (ret == -1 && (send(client_sock, "ERR ", 4, 0) < 0 || send(client_sock, err, strlen(err), 0) < 0))
+            return -1;
+    }
+    return 0;
+}
+
+// download_path - PrefetchPath of a DownloadList: the local file serving entry i reads, a plain .c
+// file, a cached copy or a replica in a node tree on this disk; NULL for packed files, remote replicas
+// and files whose etag is the entry's validator, which are answered with NOTMODIFIED instead of read.
+const char *download_path(void *ctx, int i, char *buf, size_t len) {
+    const DownloadList *list = ctx;
+    const char *filepath = list->paths[i];
+    const char *ext = strrchr(filepath, '.');
+    char key[512], etag[FILE_ETAG_MAX];
+    unsigned int size, crc;
+    struct stat st;
+    int found = 0;
+    if (!ext || strncmp(filepath, "S1/", 3) != 0 || make_route_key(filepath + 3, NULL, key, sizeof(key)) != 0)
+        return NULL;
+    if (strcmp(ext, ".c") == 0)
+        found = store_stat(&cfile_store, key, &size, &crc, NULL) != 0 && stored_path("S1", key, buf, len) == 1;
+    else {
+        if (routing.cache_bytes > 0)
+            cache_entry_path(key, "", buf, len);
+        found = (routing.cache_bytes > 0 && stat(buf, &st) == 0) || locate_file(key, buf, len) >= 0;
+    }
+    if (!found || stat(buf, &st) != 0)
+        return NULL;
+    file_stat_etag(&st, etag, sizeof(etag));   // Same etag send_size compares with the validator
+    return list->validators[i] && strcmp(list->validators[i], etag) == 0 ? NULL : buf;
+}
+
+// receive_batch_entry - Writes the next size bytes of an uploadm stream to path (discarded when path is
+// NULL), starting with the *extra_len bytes at *extra that arrived together with the command.
+// Returns 0, -1 when the file could not be written, or -2 when the stream broke off.
+int receive_batch_entry(int client_sock, const char **extra, long *extra_len, long long size, const char *path) {
+    FILE *fp = fopen(path ? path : "/dev/null", "wb");
+    int ret = fp ? 0 : -1;
+    long take = *extra_len < size ? *extra_len : (long)size;
+    if (take > 0) {
+        if (fp && fwrite(*extra, 1, take, fp) != (size_t)take)
+            ret = -1;
+        *extra += take;
+        *extra_len -= take;
+        size -= take;
+    }
+    char file_buf[BUFFER_SIZE];
+    while (size > 0) {                         // Read the whole payload even if it cannot be stored
+        int received = recv(client_sock, file_buf, size < BUFFER_SIZE ? size : BUFFER_SIZE, 0);
+        if (received <= 0) {
+            ret = -2;
+            break;
+        }
+        if (fp && ret == 0 && fwrite(file_buf, 1, received, fp) != (size_t)received)
+            ret = -1;
+        size -= received;
+    }
+    if (fp && fclose(fp) != 0 && ret == 0)
+        ret = -1;
+    return ret;
+}
+
+// batch_upload - uploadm: receives every listed file into destination and stores it like uploadf
+// (.c files on S1, the others on their replica sets). Returns 0, or -1 when the stream broke off.
+int batch_upload(Arena *arena, int client_sock, const char *destination, char *body, const char *extra, long extra_len) {
+    char *home_dir = getenv("HOME");
+    char *reply = NULL, *save;
+    size_t len = 0, cap = 0;
+    int count = 0, broken = 0;
+    const char *dest_err = NULL;               // Applies to every entry
+    if (!home_dir)
+        home_dir = ".";
+    if (strncmp(destination, "S1/", 3) != 0)
+        dest_err = "ERROR: Path must start with 'S1/'.\n";
+    else if (create_directories(destination) != 0)
+        dest_err = "ERROR: Failed to create local directory structure.\n";
+    refresh_routing_table();
+    for (char *line = strtok_r(body, "\n", &save); line && !broken; line = strtok_r(NULL, "\n", &save)) {
+        char filename[256];
+        long long size = 0;
+        const char *msg = dest_err;
+        if (sscanf(line, "%255s %lld", filename, &size) != 2 || size < 0) {
+            broken = 1;                        // Payload boundaries are unknown from here on
+            break;
+        }
+        char local_filepath[512], tmp_path[600], key[512];
+        const char *ext = strrchr(filename, '.');
+        int keyed = make_route_key(destination + 3, filename, key, sizeof(key)) == 0;
+        if (!msg && snprintf(local_filepath, sizeof(local_filepath), "%s/%s/%s", home_dir, destination, filename) >=
+                    (int)sizeof(local_filepath))
+            msg = "ERROR: Path too long.\n";
+        if (!msg && size == 0)
+            msg = "ERROR: Empty file.\n";
+        if (!msg && !ext)
+            msg = "ERROR: File has no extension.\n";
+        if (!msg && strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 && strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0)
+            msg = "ERROR: Unsupported file type.\n";
+        if (!msg && keyed && strcmp(ext, ".c") == 0 && plain_c_path(key, local_filepath, sizeof(local_filepath)) != 0)
+            msg = "ERROR: Failed to create local directory structure.\n";
+        int existed = !msg && keyed && key_exists(key, ext);
+        if (!msg && strcmp(ext, ".c") == 0) {
+            snprintf(tmp_path, sizeof(tmp_path), "%s.batch.%d", local_filepath, (int)getpid());
+            int received = receive_batch_entry(client_sock, &extra, &extra_len, size, tmp_path);
+            if (received == 0)
+                received = keyed ? commit_upload(tmp_path, local_filepath, key) : (rename(tmp_path, local_filepath) == 0 ? 0 : -1);
+            unlink(tmp_path);
+            broken = received == -2;
+            msg = received == 0 ? "File uploaded successfully in S1.\n" : "ERROR: Failed to receive .c file.\n";
+        } else if (!msg) {
+            int replicas[MAX_NODES];           // Nodes that keep a copy, primary first
+            int replica_count = keyed ? route_replicas(&routing, key, replicas, routing.replicas) : 0;
+            int received = receive_batch_entry(client_sock, &extra, &extra_len, size, replica_count ? local_filepath : NULL);
+            broken = received == -2;
+            if (replica_count == 0)
+                msg = "ERROR: No backend node available.\n";
+            else if (received != 0)
+                msg = "ERROR: Failed to receive file for forwarding.\n";
+            else
+                msg = replicate_upload(local_filepath, filename, destination, key, replicas, replica_count);
+        } else if (receive_batch_entry(client_sock, &extra, &extra_len, size, NULL) == -2)
+            broken = 1;                        // Rejected entries still have their payload drained
+        if (keyed && strncmp(msg, "ERROR", 5) != 0)
+            note_change(key, existed);
+        if (batch_reply_add(arena, &reply, &len, &cap, filename, msg) != 0)
+            broken = 1;
+        count++;
+    }
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;                                      // Reap replica forwarders that finished after their quorum
+    return broken ? -1 : batch_send_reply(client_sock, count, reply ? reply : "", len);
+}
+
+
+// recursive_list_files - Recursively traverses dir_path and collects the base names of all regular files.
+ 
+void recursive_list_files(const char *dir_path, StrList *files) {  // Recursively list files in a directory
+    DIR *d = opendir(dir_path);                // Open the directory for reading
+    if (d == NULL)
+        return;                              
+    struct dirent *entry;                    
+    char full_path[512];                      
+    struct stat st;                          // File status structure
+    while ((entry = readdir(d)) != NULL) {    
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;                        // Skip "." and ".." entries
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);  // Build full path for the entry
+        if (stat(full_path, &st) == 0) {       
+            if (S_ISDIR(st.st_mode))
+                recursive_list_files(full_path, files);  // Recurse into subdirectories
+            else if (S_ISREG(st.st_mode) && strlist_add(files, entry->d_name) != 0)  // Copy the file name into the arena
+                break;                         // Out of memory
+        }
+    }
+    closedir(d); // close the directory
+}
+// compare_string - Comparator function for qsort.
+int compare_string(const void *a, const void *b) {  // Comparator for sorting strings alphabetically
+    const char *s1 = *(const char **) a;      
+    const char *s2 = *(const char **) b;      
+    return strcmp(s1, s2);                   
+}
+
+// send_file - Sends the file at 'filepath' to the client - It sends the size header ("<size>\n") followed by the file data.
+int send_file(int client_sock, const char *filepath) {  
+    FILE *fp = fopen(filepath, "rb");       
+    if (!fp) {                               
+        perror("send_file: fopen failed");   
+        return -1;                           
+    }
+    return send_stream(client_sock, fp, NULL);
+}
+
+// send_stream - Sends an already opened file to the client in send_file's format, or with framing's
+// size header, and closes it.
+int send_stream(int client_sock, FILE *fp, const FileFraming *framing) {
+    struct stat st;
+    char etag[FILE_ETAG_MAX];
+    long long file_size = fstat(fileno(fp), &st) == 0 ? (long long)st.st_size : -1;
+    int header = -1;
+    if (file_size >= 0) {
+        file_stat_etag(&st, etag, sizeof(etag));
+        header = send_size(client_sock, file_size, framing, etag);  // Send the size header
+    }
+    if (header != 0) {
+        if (header < 0)
+            perror("send_file: sending file size failed");
+        fclose(fp); 
+        return header < 0 ? -1 : 0;            // Or the client's copy is current
+    }
+    char file_buf[BUFFER_SIZE]; // Buffer to hold chunks of file data
+    while (!feof(fp)) { 
+        size_t n = fread(file_buf, 1, sizeof(file_buf), fp);  
+        if (n > 0) { // If data was read
+            if (send(client_sock, file_buf, n, 0) < 0) {  
+                perror("send_file: sending file data failed");  // Print error if send fails
+                fclose(fp); 
+                return -1; 
+            }
+        }
+    }
+    file_send_done(fp, file_size);           // A large file leaves the page cache to the hot ones
+    fclose(fp); // Close the file after sending
+    return 0; // Return success
+}
+
+// receive_file - Receives file data from the client and writes it to disk - expects first the size header
+// ("<size>\n"), then the file data.
+int receive_file(int client_sock, const char *filepath) {  
+    long long file_size;
+    if (file_recv_size(client_sock, &file_size) != 0 || file_size <= 0)  // Read file size from client
+        return -1;                           
+    return receive_payload(client_sock, file_size, filepath);
+}
+
+// receive_payload - Receives file_size bytes into a temporary file and renames it over filepath, so
+// a download still sending (or mapping) the old file keeps reading the old inode.
+int receive_payload(int client_sock, long long file_size, const char *filepath) {
+    char part_path[600];
+    snprintf(part_path, sizeof(part_path), "%s.part.%d", filepath, (int)getpid());
+    // Preallocated, large files bypass the cache
+    if (file_recv_payload(client_sock, file_size, part_path) != 0 || rename(part_path, filepath) != 0) {
+        unlink(part_path);
+        return -1;
+    }
+    return 0;
+}
+
+// receive_upload - receive_file for .c uploads: files up to STORE_SMALL_MAX are appended to the
+// segment store under key, larger ones are written to filepath. Whichever copy is not the new
+// one is dropped, so a path lives in exactly one of the two places.
+int receive_upload(Arena *arena, int client_sock, const char *filepath, const char *key) {
+    long long file_size;
+    if (file_recv_size(client_sock, &file_size) != 0 || file_size <= 0)  // Read file size from client
+        return -1;
+    return receive_upload_sized(arena, client_sock, file_size, filepath, key);
+}
+
+// receive_upload_sized - receive_upload once the size is known.
+int receive_upload_sized(Arena *arena, int client_sock, long long file_size, const char *filepath, const char *key) {
+    if (file_size > STORE_SMALL_MAX) {
+        if (receive_payload(client_sock, file_size, filepath) != 0)
+            return -1;
+        store_remove(&cfile_store, key);       // An older small version may still be packed
+        return 0;
+    }
+    char *data = arena_alloc(arena, file_size ? file_size : 1);  // At most STORE_SMALL_MAX, kept for the request
+    long got = 0;
+    while (data && got < file_size) {
+        int received = recv(client_sock, data + got, file_size - got, 0);
+        if (received <= 0)
+            break;
+        got += received;
+    }
+    int ret = (data && got == file_size) ? store_put(&cfile_store, key, data, file_size) : -1;
+    if (ret == 0)
+        remove(filepath);                      // An older large version may exist as a plain file
+    return ret;
+}
+
+// map_whole_file - Maps a stored file read-only as the basis of a delta upload; the caller
+// munmap()s *len bytes. Returns NULL when the file is missing or empty.
+char *map_whole_file(const char *path, long *len) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    char *base = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 ?
+                 mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+    *len = st.st_size;
+    return base;
+}
+
+// receive_delta - Delta mode of uploadf: sends "SIGS <block_size> <count>\n" and the block
+// signatures of basis, then rebuilds the client's new version from its instructions into out_path.
+// Returns 0 when the result matched the client's digest, -1 on failure, -2 without sending
+// anything when basis is too small to be worth it (the caller asks for the whole file instead),
+// and -3 when the delta stream broke off, so the session can no longer be followed.
+int receive_delta(int client_sock, const char *basis, long basis_len, const char *out_path) {
+    if (basis_len < DELTA_MIN_BLOCK)
+        return -2;
+    int bs = delta_block_size(basis_len);
+    DeltaSig *sigs;
+    int count = delta_make_sigs((const unsigned char *)basis, basis_len, bs, &sigs);
+    if (count < 0)
+        return -2;
+    char header[64];
+    snprintf(header, sizeof(header), "SIGS %d %d\n", bs, count);
+    int ret = -3;                            // Partly sent signatures leave the client out of step
+    if (delta_send_all(client_sock, header, strlen(header)) == 0 &&
+        delta_send_all(client_sock, sigs, count * sizeof(DeltaSig)) == 0) {
+        FILE *out = fopen(out_path, "wb");     // Without it delta_apply still reads the delta
+        ret = delta_apply(client_sock, (const unsigned char *)basis, basis_len, bs,
+                          delta_max_output(basis_len), out);
+        if (ret == -2)
+            ret = -3;
+        if (out && fclose(out) != 0 && ret == 0)
+            ret = -1;
+    }
+    free(sigs);
+    return ret;
+}
+
+// commit_upload - Stores a .c upload that was assembled in tmp_path, like receive_upload: small
+// files go into the segment store, larger ones are renamed over filepath. Returns 0 or -1.
+int commit_upload(const char *tmp_path, const char *filepath, const char *key) {
+    long len;
+    char *data = map_whole_file(tmp_path, &len);
+    if (!data)
+        return -1;
+    int ret;
+    if (len > STORE_SMALL_MAX) {
+        ret = rename(tmp_path, filepath) == 0 ? 0 : -1;
+        if (ret == 0)
+            store_remove(&cfile_store, key);   // An older small version may still be packed
+    } else {
+        ret = store_put(&cfile_store, key, data, len);
+        if (ret == 0)
+            remove(filepath);                  // An older large version may exist as a plain file
+    }
+    munmap(data, len);
+    return ret;
+}
+
+// send_buffer - Sends len bytes from memory to the client in send_file's format. The data is
+// vmsplice()d into a pipe and spliced into the socket, so mapped pages go out without being
+// copied through a user buffer; plain send() takes over where splicing is not possible.
+int send_buffer(int client_sock, const char *data, long len, const FileFraming *framing, const char *etag) {
+    int header = send_size(client_sock, len, framing, etag);
+    if (header != 0)
+        return header < 0 ? -1 : 0;            // Or the client's copy is current
+    long sent = 0;
+    if (splice_pipe[0] < 0 && pipe(splice_pipe) == 0)
+        fcntl(splice_pipe[1], F_SETPIPE_SZ, 1024 * 1024);
+    while (splice_pipe[0] >= 0 && sent < len) {
+        struct iovec iov = { (void *)(data + sent), len - sent };
+        ssize_t queued = vmsplice(splice_pipe[1], &iov, 1, 0);
+        if (queued <= 0)
+            break;                             // Pipe is empty again: fall back to send()
+        while (queued > 0) {
+            ssize_t n = splice(splice_pipe[0], NULL, client_sock, NULL, queued, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n <= 0)
+                return -1;                     // Bytes are stuck in the pipe: the stream is broken
+            queued -= n;
+            sent += n;
+        }
+    }
+    while (sent < len) {
+        ssize_t n = send(client_sock, data + sent, len - sent, 0);
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// map_file - Returns a read-only mapping of path from the per-process mapping cache, mapping it
+// on first use. Entries are checked against the file's device, inode, size and mtime with one
+// stat(), so a hot file costs no open/seek/read calls; the least recently used mappings are dropped
+// to stay within MAP_CACHE_ENTRIES and MAP_CACHE_BYTES. Uploads replace files by rename(), so a
+// mapping never sees its file shrink. When etag is set it receives the mapped file's etag.
+// Returns NULL for missing, empty or large files.
+const char *map_file(const char *path, long *size, char *etag) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > MAP_FILE_MAX)
+        return NULL;
+    MappedFile *slot = NULL;
+    long mapped_bytes = 0;
+    for (int i = 0; i < MAP_CACHE_ENTRIES; i++) {
+        MappedFile *m = &map_cache[i];
+        if (m->base && strcmp(m->path, path) == 0) {
+            if (m->dev == st.st_dev && m->ino == st.st_ino && m->size == st.st_size &&
+                m->mtime.tv_sec == st.st_mtim.tv_sec && m->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                m->last_use = ++map_clock;
+                *size = m->size;
+                if (etag)
+                    file_stat_etag(&st, etag, FILE_ETAG_MAX);  // Same size, mtime and inode as the mapping
+                return m->base;
+            }
+            munmap(m->base, m->size);          // Replaced or resized since it was mapped
+            m->base = NULL;
+        }
+        if (m->base)
+            mapped_bytes += m->size;
+    }
+    while (1) {                                // Evict until there is a free slot and room for the file
+        MappedFile *lru = NULL;
+        slot = NULL;
+        for (int i = 0; i < MAP_CACHE_ENTRIES; i++) {
+            if (!map_cache[i].base && !slot)
+                slot = &map_cache[i];
+            else if (map_cache[i].base && (!lru || map_cache[i].last_use < lru->last_use))
+                lru = &map_cache[i];
+        }
+        if (slot && mapped_bytes + st.st_size <= MAP_CACHE_BYTES)
+            break;
+        if (!lru)
+            return NULL;
+        mapped_bytes -= lru->size;
+        munmap(lru->base, lru->size);
+        lru->base = NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    char *base = MAP_FAILED;                   // Sized from the file opened, which may not be the one stat()ed
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= MAP_FILE_MAX &&
+        mapped_bytes + st.st_size <= MAP_CACHE_BYTES)
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);                                 // The mapping keeps the file referenced
+    if (base == MAP_FAILED)
+        return NULL;
+    madvise(base, st.st_size, MADV_WILLNEED);  // Read the whole file ahead: it is about to be sent
+    snprintf(slot->path, sizeof(slot->path), "%s", path);
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->size = st.st_size;
+    slot->mtime = st.st_mtim;
+    slot->base = base;
+    slot->last_use = ++map_clock;
+    *size = st.st_size;
+    if (etag)
+        file_stat_etag(&st, etag, FILE_ETAG_MAX);
+    return base;
+}
+
+// send_file_mapped - send_file through the mapping cache, streaming files map_file does not take.
+int send_file_mapped(int client_sock, const char *path, const FileFraming *framing) {
+    long size;
+    char etag[FILE_ETAG_MAX];
+    const char *data = map_file(path, &size, etag);
+    if (data)
+        return send_buffer(client_sock, data, size, framing, etag);
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror("send_file: fopen failed");
+        return -1;
+    }
+    return send_stream(client_sock, fp, framing);
+}
+
+// write_tar_member - Appends one ustar member: a header for name, then size bytes taken from
+// data, or read from src when data is NULL, padded to the 512-byte block size. A name ustar cannot
+// hold goes ahead of the member in a GNU long name record ("././@LongLink", type 'L'), which tar and
+// other readers use in place of the header's name.
+int write_tar_member(FILE *tar, const char *name, const char *data, FILE *src, long long size, time_t mtime) {
+    long long name_size = strlen(name) + 1;    // The long name is stored with its NUL
+    if (tar_split_name(name) < 0 &&
+        (write_tar_header(tar, "././@LongLink", name_size, 0, 'L') != 0 ||
+         write_tar_data(tar, name, NULL, name_size) != 0))
+        return -1;
+    if (write_tar_header(tar, name, size, mtime, '0') != 0)
+        return -1;
+    return write_tar_data(tar, data, src, size);
+}
+
+// tar_split_name - Where a ustar header splits name into prefix and name: 0 when it fits the name
+// field as it is, the offset of the '/' between the two parts, or -1 when it fits neither way.
+int tar_split_name(const char *name) {
+    size_t name_len = strlen(name);
+    if (name_len <= 100)
+        return 0;
+    const char *split = strchr(name, '/');
+    while (split && (size_t)(name + name_len - split - 1) > 100)
+        split = strchr(split + 1, '/');
+    return split && split > name && split - name <= 155 ? (int)(split - name) : -1;
+}
+
+// write_tar_header - Writes one 512-byte ustar header of the given type. A name that does not fit is
+// cut to the name field (write_tar_member sent it in full before); sizes of 8 GiB and more, which
+// the 11 octal digits cannot hold, are stored in GNU's base-256 form.
+int write_tar_header(FILE *tar, const char *name, long long size, time_t mtime, char type) {
+    char header[512];
+    size_t name_len = strlen(name);
+    int split = tar_split_name(name);          // Long names are split into prefix and name at a '/'
+    memset(header, 0, sizeof(header));
+    if (split > 0) {
+        memcpy(header + 345, name, split);
+        memcpy(header, name + split + 1, name_len - split - 1);
+    } else
+        memcpy(header, name, name_len < 100 ? name_len : 100);
+    snprintf(header + 100, 8, "%07o", 0644);
+    snprintf(header + 108, 8, "%07o", 0);
+    snprintf(header + 116, 8, "%07o", 0);
+    if (size > 077777777777LL) {               // 0x80, then the size big-endian in the other 11 bytes
+        unsigned long long left = size;
+        header[124] = (char)0x80;
+        for (int i = 11; i > 0; i--, left >>= 8)
+            header[124 + i] = (char)(left & 0xff);
+    } else
+        snprintf(header + 124, 12, "%011llo", size);
+    snprintf(header + 136, 12, "%011lo", (unsigned long)mtime);
+    memset(header + 148, ' ', 8);              // Checksum field counts as spaces while summing
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += (unsigned char)header[i];
+    snprintf(header + 148, 8, "%06o", sum);
+    return fwrite(header, 1, sizeof(header), tar) == sizeof(header) ? 0 : -1;
+}
+
+// write_tar_data - Appends size bytes from data, or read from src when data is NULL, padded to the
+// 512-byte block size. Returns 0 or -1.
+int write_tar_data(FILE *tar, const char *data, FILE *src, long long size) {
+    char buf[BUFFER_SIZE];
+    for (long long done = 0; done < size; ) {
+        size_t n = size - done < BUFFER_SIZE ? size - done : BUFFER_SIZE;
+        if (data)
+            memcpy(buf, data + done, n);
+        else if (fread(buf, 1, n, src) != n)
+            return -1;
+        if (fwrite(buf, 1, n, tar) != n)
+            return -1;
+        done += n;
+    }
+    memset(buf, 0, 512);
+    if (size % 512 && fwrite(buf, 1, 512 - size % 512, tar) != (size_t)(512 - size % 512))
+        return -1;
+    return 0;
+}
+
+// build_c_tar - Writes every .c file under S1, plain or packed, into a tar archive at tar_path.
+// Members are named like tar names the files found under $HOME/S1; the file lists are kept in arena.
+int build_c_tar(Arena *arena, const char *tar_path, const char *home_dir) {
+    StrList entries, packed;
+    char root[512], name[1024];
+    FILE *tar = fopen(tar_path, "wb");
+    int ok = tar != NULL;
+    const char *base = home_dir[0] == '/' ? home_dir + 1 : home_dir;  // tar strips the leading '/'
+    snprintf(root, sizeof(root), "%s/S1", home_dir);
+    strlist_init(&entries, arena);
+    strlist_init(&packed, arena);
+    if (ok)
+        ok = collect_tree_files(root, NULL, ".c", &entries) == 0 &&
+             store_collect(&cfile_store, "", 1, ".c", &packed) == 0;
+    if (ok)                                    // "key\tpath" entries of the plain files
+        ok = write_tar_files(tar, entries.items, entries.count, 0) == 0;
+    for (int i = 0; ok && i < packed.count; i++) {
+        char *data;
+        unsigned int len;
+        time_t mtime;
+        if (store_get(&cfile_store, packed.items[i], &data, &len, &mtime) != 0)
+            continue;                          // Removed since it was listed
+        snprintf(name, sizeof(name), "%s/S1/%s", base, packed.items[i]);
+        ok = write_tar_member(tar, name, data, NULL, len, mtime) == 0;
+        free(data);
+    }
+    if (ok) {                                  // Two zero blocks end the archive
+        char zero[1024];
+        memset(zero, 0, sizeof(zero));
+        ok = fwrite(zero, 1, sizeof(zero), tar) == sizeof(zero);
+    }
+    if (tar && fclose(tar) != 0)
+        ok = 0;
+    if (!ok)
+        remove(tar_path);
+    return ok ? 0 : -1;
+}
+
+// build_node_tar - Writes one replica of every .pdf or .txt file of the node trees into a tar archive at
+// tar_path: the trees under $HOME and those of nodes on other hosts as listed by the nodes, each member
+// named "./<key>" after its logical path below S1/; the file lists are kept in arena.
+int build_node_tar(Arena *arena, const char *tar_path, const char *filetype, const char *home_dir) {
+    StrList entries;
+    int collected = 0, kept = 0;
+    // Gather "key\tpath" entries from every node, then keep one replica per logical path.
+    strlist_init(&entries, arena);
+    refresh_routing_table();
+    for (int n = 0; collected == 0 && n < routing.node_count; n++) {
+        char root[512];
+        if (!node_is_local(&routing.nodes[n])) {
+            collected = collect_remote_files(n, filetype, &entries);
+            continue;
+        }
+        snprintf(root, sizeof(root), "%s/%s", home_dir, routing.nodes[n].id);
+        collected = collect_tree_files(root, NULL, filetype, &entries);
+    }
+    if (collected != 0)
+        return -1;
+    qsort(entries.items, entries.count, sizeof(char *), compare_string);
+    for (int j = 0; j < entries.count; j++) {
+        size_t key_len = strcspn(entries.items[j], "\t");
+        if (kept == 0 || strncmp(entries.items[j], entries.items[kept - 1], key_len + 1) != 0)  // Skip further replicas
+            entries.items[kept++] = entries.items[j];
+        else if (entries.items[kept - 1][key_len + 1] == '\t')
+            entries.items[kept - 1] = entries.items[j];  // A copy on this host rather than one to fetch
+    }
+    FILE *tar = fopen(tar_path, "wb");
+    int ok = tar != NULL && write_tar_files(tar, entries.items, kept, 1) == 0;
+    if (ok) {                                  // Two zero blocks end the archive
+        char zero[1024];
+        memset(zero, 0, sizeof(zero));
+        ok = fwrite(zero, 1, sizeof(zero), tar) == sizeof(zero);
+    }
+    if (tar && fclose(tar) != 0)
+        ok = 0;
+    if (!ok)
+        remove(tar_path);
+    return ok ? 0 : -1;
+}
+
+// write_tar_files - Appends the files of count "key\tpath" entries, and of "key\t\t<node>\t<mtime>"
+// entries of nodes on other hosts (collect_remote_files), named by open_tar_entry according to by_key.
+// The next local files are hinted to the kernel while one is copied; files removed since they were
+// listed are left out. Returns 0 or -1.
+int write_tar_files(FILE *tar, char **entries, int count, int by_key) {
+    Prefetch prefetch;
+    char name[1024];
+    prefetch_init(&prefetch, count, tar_entry_path, entries);
+    for (int i = 0; i < count; i++) {
+        time_t mtime;
+        int ret = 0;
+        prefetch_next(&prefetch, i);
+        FILE *src = open_tar_entry(entries[i], by_key, name, sizeof(name), &mtime);
+        if (src) {
+            ret = write_tar_member(tar, name, NULL, src, file_stream_size(src), mtime);
+            fclose(src);
+        }
+        if (ret != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// open_tar_entry - Opens the file of a write_tar_files entry, fetching one of another host's node into
+// $HOME/FETCH_DIR first (unlinked again once open), and sets its mtime and member name: "./<key>" with
+// by_key, else the path without the leading '/' and the fan-out buckets (or, for a file of another
+// host, the path it would have under $HOME). Returns the file, or NULL when it is gone.
+FILE *open_tar_entry(const char *entry, int by_key, char *name, size_t len, time_t *mtime) {
+    const char *path = strchr(entry, '\t') + 1;
+    int key_len = (int)(path - 1 - entry);
+    struct stat st;
+    FILE *src;
+    if (path[0] == '\t') {                     // On a node of another host
+        char key[512], fetched[600];
+        int n;
+        long when;
+        char *home_dir = getenv("HOME");
+        if (sscanf(path + 1, "%d\t%ld", &n, &when) != 2 || n < 0 || n >= routing.node_count ||
+            snprintf(key, sizeof(key), "%.*s", key_len, entry) >= (int)sizeof(key))
+            return NULL;
+        snprintf(fetched, sizeof(fetched), "%s/%s", home_dir ? home_dir : ".", FETCH_DIR);
+        mkdir(fetched, 0755);
+        snprintf(fetched, sizeof(fetched), "%s/%s/%d-tar", home_dir ? home_dir : ".", FETCH_DIR, (int)getpid());
+        src = node_fetch(&routing.nodes[n], key, fetched) == 0 ? fopen(fetched, "rb") : NULL;
+        unlink(fetched);
+        home_dir = home_dir ? home_dir : ".";
+        if (by_key)
+            snprintf(name, len, "./%s", key);
+        else
+            snprintf(name, len, "%s/%s/%s", home_dir[0] == '/' ? home_dir + 1 : home_dir, routing.nodes[n].id, key);
+        *mtime = when;
+        return src;
+    }
+    src = fopen(path, "rb");
+    if (src && fstat(fileno(src), &st) != 0) {
+        fclose(src);
+        src = NULL;
+    }
+    if (by_key)
+        snprintf(name, len, "./%.*s", key_len, entry);
+    else {
+        snprintf(name, len, "%s", path[0] == '/' ? path + 1 : path);  // tar strips the leading '/'
+        fanout_strip(name);
+    }
+    *mtime = src ? st.st_mtime : 0;
+    return src;
+}
+
+// tar_entry_path - PrefetchPath of write_tar_files entries: the path after the tab, NULL for a file
+// still on another host.
+const char *tar_entry_path(void *ctx, int i, char *buf, size_t len) {
+    (void)buf;
+    (void)len;
+    const char *path = strchr(((char **)ctx)[i], '\t') + 1;
+    return path[0] == '\t' ? NULL : path;
+}
+
+// forward_file - Forwards a local file from S1 to a target server.
+// Opens the file, connects to the target server, sends an "uploadf" command, waits for "READY", and then sends file size and file data.
+ 
+int forward_file(const char *local_filepath, const char *filename,
+                 const char *target_dest, const char *target_ip, int target_port) {  
+    const BackendNode *node = find_node(target_ip, target_port);
+    if (node && commit_local(node, local_filepath, filename, target_dest, 0) == 0)
+        return 0;                            // Same host: the backend copied it from disk
+    FILE *fp = fopen(local_filepath, "rb");  
+    if (!fp) {                               
+        perror("forward_file: fopen failed");  
+        return -1;                        
+    }
+    return forward_stream(fp, filename, target_dest, target_ip, target_port);
+}
+
+// forward_stream - Sends an already opened file to a target server and closes it.
+// Returns 0 only once the target server has acknowledged the stored copy.
+int forward_stream(FILE *fp, const char *filename,
+                   const char *target_dest, const char *target_ip, int target_port) {
+    long long file_size = file_stream_size(fp);
+    ShmRing ring;                            // Set up when the node uses the shared-memory transport
+    int sock = connect_target(target_ip, target_port, &ring);
+    if (sock < 0) {
+        fclose(fp);
+        return -1;
     }
     char cmd[BUFFER_SIZE];                   // Buffer for constructing the upload command for target server
-    snprintf(cmd, sizeof(cmd), "uploadf %s %s", filename, target_dest);  
+    snprintf(cmd, sizeof(cmd), "uploadf %s %s\n", filename, target_dest);  
     if (send(sock, cmd, strlen(cmd), 0) < 0) { 
         perror("forward_file: sending command failed");  
         fclose(fp);                        
+        ring_close(&ring);
         close(sock);                       
         return -1;                         
     }
@@ -663,25 +2254,34 @@ int forward_file(const char *local_filepath, const char *filename,
     if (bytes <= 0 || strncmp(response, "READY", 5) != 0) { 
         fprintf(stderr, "forward_file: target server did not send READY\n");  
         fclose(fp);                       
+        ring_close(&ring);
         close(sock);                       
         return -1;                         
     }
-    char size_str[64];                       
-    snprintf(size_str, sizeof(size_str), "%ld", file_size); 
-    if (send(sock, size_str, strlen(size_str), 0) < 0) {  
+    if (ring.sock >= 0 && ring_send_stream(&ring, fp, file_size) != 0) {  // File data through shared memory
+        perror("forward_file: ring transfer failed");
+        fclose(fp);
+        shutdown(sock, SHUT_RDWR);             // The backend may be waiting for the next slot: make it give up
+        ring_close(&ring);
+        close(sock);
+        return -1;
+    }
+    if (ring.sock < 0 && file_send_size(sock, file_size) != 0) {
         perror("forward_file: sending file size failed");  
         fclose(fp);                        
+        ring_close(&ring);
         close(sock);                    
         return -1;                          
     }
     char file_buf[BUFFER_SIZE];              
-    while (!feof(fp)) {                      
+    while (ring.sock < 0 && !feof(fp)) {    
         size_t n = fread(file_buf, 1, sizeof(file_buf), fp);  // Read a chunk of the file
         if (n > 0) {                       
             if (send(sock, file_buf, n, 0) < 0) {  
                 perror("forward_file: sending file data failed");  
                 fclose(fp);               
-                close(sock);               
+                ring_close(&ring);
+                close(sock);
                 return -1;                
             }
         }
@@ -690,58 +2290,1664 @@ int forward_file(const char *local_filepath, const char *filename,
     bytes = recv(sock, response, sizeof(response)-1, 0);  // Receive final response from target server
     if (bytes > 0)
         printf("Target server response: %s\n", response);  // Log the final response from target server
+    file_send_done(fp, file_size);
     fclose(fp);                             
+    ring_close(&ring);
     close(sock);                            
-    return 0;                                
+    return (bytes > 0 && strncmp(response, "ERROR", 5) != 0) ? 0 : -1;  // Only an acknowledged copy counts
 }
 
-// create_directories
+// create_directories - Makes sure $HOME/<path> exists, creating missing components. A directory this
+// process has used before is found in the descriptor cache without a system call.
 int create_directories(const char *path) {     
-    char full_path[512];                     // Buffer for the full directory path
-    char tmp[512];                           // Temporary buffer for manipulation
-    char *p;                                 
-    size_t len;                              
-    
-    // Get the home directory; if not set, use the current directory.
-    char *home_dir = getenv("HOME");         // Retrieve user's HOME directory
-    if (!home_dir)
-        home_dir = ".";                      
-    
-    // Build the full path: "$HOME/path"
-    snprintf(full_path, sizeof(full_path), "%s/%s", home_dir, path);  // Combine home directory with provided path
-    
-    // Copy full_path into a temporary buffer we can modify.
-    strncpy(tmp, full_path, sizeof(tmp));     // Copy the full path to a temporary variable
-    tmp[sizeof(tmp) - 1] = '\0';              
-    len = strlen(tmp);                      
-    
-    // Remove trailing slash, if any.
-    if(tmp[len - 1] == '/')                  
-        tmp[len - 1] = '\0';                 
-    
-    // Create intermediate directories by iterating over the path.
-    for(p = tmp + 1; *p; p++) {             
-        if(*p == '/') {                   
-            *p = '\0';                       
-            if(access(tmp, F_OK) != 0) {       
-                if(mkdir(tmp, 0755) != 0) {    
-                    perror("mkdir");         
-                    return -1;               
+    if (dircache_dir(&dir_cache, path, 1) < 0) {
+        perror("mkdir");                 
+        return -1;                       
+    }
+    return 0;
+}
+
+// hash_key - FNV-1a hash with a final avalanche step, used to place keys and virtual nodes on the ring.
+unsigned int hash_key(const char *key) {
+    unsigned int h = 2166136261u;              // FNV offset basis
+    for (; *key; key++) {
+        h ^= (unsigned char)*key;
+        h *= 16777619u;                        // FNV prime
+    }
+    h ^= h >> 16;                              // Spread similar keys ("S2#1", "S2#2") across the ring
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// compare_ring_point - Comparator for sorting ring points by hash.
+int compare_ring_point(const void *a, const void *b) {
+    unsigned int h1 = ((const RingPoint *)a)->hash;
+    unsigned int h2 = ((const RingPoint *)b)->hash;
+    return (h1 > h2) - (h1 < h2);
+}
+
+// build_ring_table - Places VNODES_PER_NODE virtual nodes per backend on the ring and sorts them.
+void build_ring_table(RoutingTable *rt) {
+    rt->ring_size = 0;
+    for (int i = 0; i < rt->node_count; i++) {
+        for (int v = 0; v < VNODES_PER_NODE; v++) {
+            char vkey[64];
+            snprintf(vkey, sizeof(vkey), "%s#%d", rt->nodes[i].id, v);
+            rt->ring[rt->ring_size].hash = hash_key(vkey);
+            rt->ring[rt->ring_size].node = i;
+            rt->ring_size++;
+        }
+    }
+    qsort(rt->ring, rt->ring_size, sizeof(RingPoint), compare_ring_point);
+}
+
+// routing_file_path - Builds the path of the routing table file under $HOME.
+static void routing_file_path(char *path, size_t len) {
+    char *home_dir = getenv("HOME");
+    snprintf(path, len, "%s/%s", home_dir ? home_dir : ".", ROUTING_FILE);
+}
+
+// load_routing_table - Reads "node <id> <ip> <port>" lines from ROUTING_FILE.
+// Without a routing file the classic S2/S3/S4 trio on localhost is used.
+int load_routing_table(RoutingTable *rt) {
+    char path[512];
+    routing_file_path(path, sizeof(path));
+    memset(rt, 0, sizeof(*rt));
+    rt->cache_bytes = CACHE_MAX_BYTES;
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        struct stat st;
+        if (fstat(fileno(fp), &st) == 0)
+            rt->mtime = st.st_mtim;
+        char line[256];
+        while (fgets(line, sizeof(line), fp)) {
+            BackendNode *node = &rt->nodes[rt->node_count];
+            int used = 0;
+            if (rt->node_count < MAX_NODES &&
+                sscanf(line, "node %15s %63s %d%n", node->id, node->ip, &node->port, &used) == 3 && node->port > 0) {
+                char *opt = strstr(line + used, "unix=");  // Optional "unix=<path>" ("unix=none" disables handoff)
+                node->unix_path[0] = '\0';
+                if (opt)
+                    sscanf(opt, "unix=%107s", node->unix_path);
+                else
+                    default_unix_path(node);
+                if (strcmp(node->unix_path, "none") == 0)
+                    node->unix_path[0] = '\0';
+                char transport[16];                // Optional "transport=tcp|unix|shm", needs a local socket
+                node->transport = node->unix_path[0] ? TRANSPORT_UNIX : TRANSPORT_TCP;
+                opt = strstr(line + used, "transport=");
+                if (opt && node->unix_path[0] && sscanf(opt, "transport=%15s", transport) == 1)
+                    node->transport = parse_transport(transport);
+                rt->node_count++;
+            }
+            else {                           // Replication settings; comments and unknown lines are ignored
+                sscanf(line, "replicas %d", &rt->replicas);
+                sscanf(line, "write_quorum %d", &rt->write_quorum);
+                sscanf(line, "cache_bytes %ld", &rt->cache_bytes);
+                if (strncmp(line, "layout ", 7) == 0)
+                    rt->fanout = strncmp(line + 7, "fanout", 6) == 0;
+            }
+        }
+        fclose(fp);
+    }
+    if (rt->node_count == 0) {                 // No routing file (or an empty one): built-in defaults
+        const char *ids[] = { "S2", "S3", "S4" };
+        int ports[] = { PORT_S2, PORT_S3, PORT_S4 };
+        for (int i = 0; i < 3; i++) {
+            snprintf(rt->nodes[i].id, sizeof(rt->nodes[i].id), "%s", ids[i]);
+            snprintf(rt->nodes[i].ip, sizeof(rt->nodes[i].ip), "127.0.0.1");
+            rt->nodes[i].port = ports[i];
+            default_unix_path(&rt->nodes[i]);
+            rt->nodes[i].transport = TRANSPORT_UNIX;
+        }
+        rt->node_count = 3;
+    }
+    if (rt->replicas < 1)
+        rt->replicas = 1;                      // Single copy unless configured otherwise
+    if (rt->replicas > rt->node_count)
+        rt->replicas = rt->node_count;
+    if (rt->write_quorum < 1 || rt->write_quorum > rt->replicas)
+        rt->write_quorum = rt->replicas / 2 + 1;  // Default to a majority of the replicas
+    build_ring_table(rt);
+    return 0;
+}
+
+// save_routing_table - Writes the table to a temporary file and renames it over ROUTING_FILE,
+// so other S1 processes never read a half-written table.
+int save_routing_table(const RoutingTable *rt) {
+    char path[512], tmp_path[600];
+    routing_file_path(path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        perror("save_routing_table: fopen failed");
+        return -1;
+    }
+    fprintf(fp, "# node <id> <ip> <port> [unix=<path>|unix=none] [transport=tcp|unix|shm]\n");
+    fprintf(fp, "replicas %d\nwrite_quorum %d\ncache_bytes %ld\nlayout %s\n", rt->replicas, rt->write_quorum,
+            rt->cache_bytes, rt->fanout ? "fanout" : "flat");
+    for (int i = 0; i < rt->node_count; i++) {
+        BackendNode derived = rt->nodes[i];
+        default_unix_path(&derived);
+        fprintf(fp, "node %s %s %d", rt->nodes[i].id, rt->nodes[i].ip, rt->nodes[i].port);
+        if (strcmp(derived.unix_path, rt->nodes[i].unix_path) != 0)  // Only write paths that differ from the default
+            fprintf(fp, " unix=%s", rt->nodes[i].unix_path[0] ? rt->nodes[i].unix_path : "none");
+        if (rt->nodes[i].transport != (rt->nodes[i].unix_path[0] ? TRANSPORT_UNIX : TRANSPORT_TCP))
+            fprintf(fp, " transport=%s", rt->nodes[i].transport == TRANSPORT_SHM ? "shm" : "tcp");
+        fprintf(fp, "\n");
+    }
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        perror("save_routing_table: write failed");
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// refresh_routing_table - Reloads the routing table when another S1 process changed ROUTING_FILE.
+void refresh_routing_table(void) {
+    char path[512];
+    struct stat st;
+    routing_file_path(path, sizeof(path));
+    if (stat(path, &st) != 0) {
+        if (routing.mtime.tv_sec != 0 || routing.mtime.tv_nsec != 0)
+            load_routing_table(&routing);      // Routing file was removed: fall back to defaults
+        return;
+    }
+    if (st.st_mtim.tv_sec != routing.mtime.tv_sec || st.st_mtim.tv_nsec != routing.mtime.tv_nsec)
+        load_routing_table(&routing);
+}
+
+// route_lookup - Returns the index of the node owning key: the first ring point clockwise from its hash.
+int route_lookup(const RoutingTable *rt, const char *key) {
+    int node;
+    return route_replicas(rt, key, &node, 1) == 1 ? node : -1;
+}
+
+// route_replicas - Fills nodes with up to max distinct nodes walking clockwise from key's hash.
+// The first entry is the primary owner; the rest hold the replicas. Returns the count found.
+int route_replicas(const RoutingTable *rt, const char *key, int *nodes, int max) {
+    if (rt->ring_size == 0)
+        return 0;
+    unsigned int h = hash_key(key);
+    int lo = 0, hi = rt->ring_size;
+    while (lo < hi) {                          // Binary search for the first point with hash >= h
+        int mid = lo + (hi - lo) / 2;
+        if (rt->ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int count = 0;
+    for (int k = 0; k < rt->ring_size && count < max; k++) {
+        int node = rt->ring[(lo + k) % rt->ring_size].node;  // Wrap around the ring
+        int seen = 0;
+        for (int j = 0; j < count; j++)
+            if (nodes[j] == node)
+                seen = 1;
+        if (!seen)
+            nodes[count++] = node;             // Skip further virtual nodes of an already chosen backend
+    }
+    return count;
+}
+
+// make_route_key - Builds the placement key "dir/filename" relative to S1/, with empty
+// components and trailing slashes dropped so "S1/a//b/" and "S1/a/b" place identically.
+int make_route_key(const char *dir, const char *filename, char *key, size_t len) {
+    size_t n = 0;
+    const char *parts[2] = { dir, filename };
+    for (int i = 0; i < 2; i++) {
+        const char *p = parts[i];
+        while (p && *p) {
+            if (*p == '/' && (n == 0 || key[n - 1] == '/')) {
+                p++;                           // Skip leading and repeated slashes
+                continue;
+            }
+            if (n + 1 >= len)
+                return -1;
+            key[n++] = *p++;
+        }
+        if (n > 0 && key[n - 1] != '/' && i == 0 && filename) {
+            if (n + 1 >= len)
+                return -1;
+            key[n++] = '/';
+        }
+    }
+    while (n > 0 && key[n - 1] == '/')
+        n--;
+    key[n] = '\0';
+    return n > 0 && !fanout_reserved(key) ? 0 : -1;  // FANOUT_DIR only names bucket trees
+}
+
+// locate_file - Resolves a stored copy of a logical path to its full path on a node of this host and
+// returns the node, trying nodes in rank_download_nodes order.
+int locate_file(const char *key, char *full_path, size_t len) {
+    char *home_dir = getenv("HOME");
+    int nodes[MAX_NODES];
+    int count = rank_download_nodes(key, nodes);
+    for (int i = 0; i < count; i++) {
+        char rel[600];
+        if (node_is_local(&routing.nodes[nodes[i]]) && stored_rel(routing.nodes[nodes[i]].id, key, rel, sizeof(rel)) == 1) {
+            snprintf(full_path, len, "%s/%s", home_dir ? home_dir : ".", rel);
+            return nodes[i];
+        }
+    }
+    return -1;
+}
+
+// stored_rel - Path of key below $HOME in node id's tree ("S1" for plain .c files): where the file is
+// kept in either layout, so toggling "layout" never hides a file, or else where the configured layout
+// puts a new one. Returns 1 when the file exists, 0 otherwise, and -1 (rel empty) when the path does
+// not fit in len bytes.
+int stored_rel(const char *id, const char *key, char *rel, size_t len) {
+    char physical[600];
+    struct stat st;
+    for (int i = 0; i < 2; i++) {
+        int fanout = i == 0 ? routing.fanout : !routing.fanout;  // Configured layout first
+        if (fanout_key(key, fanout, physical, sizeof(physical)) == 0 &&
+            snprintf(rel, len, "%s/%s", id, physical) < (int)len &&
+            dircache_stat(&dir_cache, rel, &st) == 0 && S_ISREG(st.st_mode))
+            return 1;
+    }
+    if (fanout_key(key, routing.fanout, physical, sizeof(physical)) != 0 ||
+        snprintf(rel, len, "%s/%s", id, physical) >= (int)len) {
+        rel[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+// stored_path - stored_rel as a full path below $HOME. Returns like stored_rel.
+int stored_path(const char *id, const char *key, char *full_path, size_t len) {
+    char rel[600];
+    char *home_dir = getenv("HOME");
+    int found = stored_rel(id, key, rel, sizeof(rel));
+    if (found < 0 || snprintf(full_path, len, "%s/%s", home_dir ? home_dir : ".", rel) >= (int)len) {
+        full_path[0] = '\0';                   // Fails every stat() and open()
+        return -1;
+    }
+    return found;
+}
+
+// node_dest - Destination directory ("<id>/...") that uploadf, linkf and commitf on node id need to
+// store key at its stored_rel path. Returns like stored_rel.
+int node_dest(const char *id, const char *key, char *dest, size_t len) {
+    int found = stored_rel(id, key, dest, len);
+    if (found >= 0)
+        *strrchr(dest, '/') = '\0';            // Keys always have a name after the node id
+    return found;
+}
+
+// replica_dest - node_dest for filename uploaded to the S1/ directory destination. Returns 0, or -1
+// when the destination is too long for dest.
+int replica_dest(const char *id, const char *destination, const char *filename, char *dest, size_t len) {
+    char key[512];
+    if (make_route_key(destination + 3, filename, key, sizeof(key)) == 0)
+        return node_dest(id, key, dest, len) < 0 ? -1 : 0;
+    return snprintf(dest, len, "%s%s", id, destination + 2) < (int)len ? 0 : -1;  // Replace leading "S1" with the node id
+}
+
+// plain_c_path - Full path of key as a plain .c file under $HOME/S1, creating the bucket directories
+// a new file needs in the fan-out layout. Returns 0 or -1.
+int plain_c_path(const char *key, char *full_path, size_t len) {
+    char dir[600];
+    char *home_dir = getenv("HOME");
+    const char *name = strrchr(key, '/') ? strrchr(key, '/') + 1 : key;
+    int found = node_dest("S1", key, dir, sizeof(dir));
+    if (found < 0 || (found == 0 && create_directories(dir) != 0))
+        return -1;
+    return snprintf(full_path, len, "%s/%s/%s", home_dir ? home_dir : ".", dir, name) < (int)len ? 0 : -1;
+}
+
+// stat_path - Describes one stored S1/ path for statf as "<size> <mtime> <sha256> <node>" in msg.
+// Returns 0, or -1 with an ERROR message.
+int stat_path(const char *filepath_arg, char *msg, size_t len) {
+    const char *ext = strrchr(filepath_arg, '.');
+    char key[512], full_path[600], identity[128], hex[CAS_DIGEST_LEN + 1];
+    const char *node = "S1";
+    struct stat st;
+    if (strncmp(filepath_arg, "S1/", 3) != 0 || !ext || make_route_key(filepath_arg + 3, NULL, key, sizeof(key)) != 0) {
+        snprintf(msg, len, "ERROR: Specified path or file is not valid.");
+        return -1;
+    }
+    if (strcmp(ext, ".c") == 0) {
+        unsigned int data_len, crc;
+        const char *data;
+        time_t mtime;
+        if (store_stat(&cfile_store, key, &data_len, &crc, &mtime) == 0) {
+            snprintf(identity, sizeof(identity), "s %x %08x", data_len, crc);
+            if (file_digest(key, identity, NULL, NULL, 0, hex) != 0 &&
+                (store_view(&cfile_store, key, &data, &data_len, NULL) != 0 ||
+                 file_digest(key, identity, NULL, data, data_len, hex) != 0)) {
+                snprintf(msg, len, "ERROR: Cannot read file.");
+                return -1;
+            }
+            snprintf(msg, len, "%u %ld %s %s", data_len, (long)mtime, hex, node);
+            return 0;
+        }
+        stored_path("S1", key, full_path, sizeof(full_path));
+    } else if (strcmp(ext, ".pdf") == 0 || strcmp(ext, ".txt") == 0 || strcmp(ext, ".zip") == 0) {
+        refresh_routing_table();
+        int n = locate_file(key, full_path, sizeof(full_path));
+        if (n < 0)
+            return stat_remote(key, msg, len);  // Not on this host: ask the nodes of other hosts
+        node = routing.nodes[n].id;
+    } else {
+        snprintf(msg, len, "ERROR: Unsupported file type.");
+        return -1;
+    }
+    if (stat(full_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        snprintf(msg, len, "ERROR: Specified path or file is not valid.");
+        return -1;
+    }
+    snprintf(identity, sizeof(identity), "f %lx %lx %lx %lx.%lx", (long)st.st_dev, (long)st.st_ino,
+             (long)st.st_size, (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+    if (file_digest(key, identity, full_path, NULL, 0, hex) != 0) {
+        snprintf(msg, len, "ERROR: Cannot read file.");
+        return -1;
+    }
+    snprintf(msg, len, "%ld %ld %s %s", (long)st.st_size, (long)st.st_mtim.tv_sec, hex, node);
+    return 0;
+}
+
+// stat_remote - stat_path for a backend file kept only on nodes of other hosts, which hash it themselves.
+// Returns 0, or -1 with an ERROR message.
+int stat_remote(const char *key, char *msg, size_t len) {
+    int nodes[MAX_NODES];
+    int count = rank_download_nodes(key, nodes);
+    for (int i = 0; i < count; i++) {
+        const BackendNode *node = &routing.nodes[nodes[i]];
+        char reply[256], hex[CAS_DIGEST_LEN + 1];
+        long long size;
+        long mtime;
+        if (!node_is_local(node) && node_file_request(node, "statf", key, " sha256", reply, sizeof(reply)) == 0 &&
+            sscanf(reply, "OK %lld %ld %64s", &size, &mtime, hex) == 3) {
+            snprintf(msg, len, "%lld %ld %s %s", size, mtime, hex, node->id);
+            return 0;
+        }
+    }
+    snprintf(msg, len, "ERROR: Specified path or file is not valid.");
+    return -1;
+}
+
+// file_digest - Looks up the SHA-256 of key in $HOME/META_DIR, valid while the stored version matches
+// identity (device, inode, size and mtime, or length and CRC of a packed record). On a miss it hashes
+// path, or size bytes of data, and records the result; with neither given a miss just fails.
+// Returns 0 with hex filled in, or -1.
+int file_digest(const char *key, const char *identity, const char *path, const char *data, long size, char *hex) {
+    char meta_path[600], tmp_path[700], line[256];
+    home_entry_path(META_DIR, key, "", meta_path, sizeof(meta_path));
+    FILE *fp = fopen(meta_path, "r");
+    if (fp) {
+        int hit = fgets(line, sizeof(line), fp) != NULL;
+        fclose(fp);
+        char *tab = hit ? strchr(line, '\t') : NULL;
+        if (tab && (size_t)(tab - line) == strlen(identity) && strncmp(line, identity, tab - line) == 0 &&
+            sscanf(tab + 1, "%64s", hex) == 1 && cas_valid_digest(hex))
+            return 0;
+    }
+    if (path) {
+        if (cas_hash_file(path, hex) != 0)
+            return -1;
+    } else if (data) {
+        CasHash h;
+        cas_hash_init(&h);
+        cas_hash_update(&h, data, size);
+        cas_hash_final(&h, hex);
+    } else
+        return -1;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", meta_path, (int)getpid());
+    char *slash = strrchr(meta_path, '/');
+    *slash = '\0';
+    mkdir(meta_path, 0755);
+    *slash = '/';
+    fp = fopen(tmp_path, "w");                 // Written aside and renamed: readers see whole entries
+    if (fp) {
+        fprintf(fp, "%s\t%s\n", identity, hex);
+        if (fclose(fp) != 0 || rename(tmp_path, meta_path) != 0)
+            unlink(tmp_path);
+    }
+    return 0;
+}
+
+// key_exists - Tells whether a path below S1/ is stored: packed or plain for .c files, on any
+// node otherwise.
+int key_exists(const char *key, const char *ext) {
+    char full_path[600];
+    unsigned int len, crc;
+    if (ext && strcmp(ext, ".c") == 0)
+        return store_stat(&cfile_store, key, &len, &crc, NULL) == 0 || stored_rel("S1", key, full_path, sizeof(full_path)) == 1;
+    if (locate_file(key, full_path, sizeof(full_path)) >= 0)
+        return 1;
+    for (int n = 0; n < routing.node_count; n++) {
+        if (!node_is_local(&routing.nodes[n]) &&
+            node_file_request(&routing.nodes[n], "statf", key, "", full_path, sizeof(full_path)) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// note_change - Journals a successful upload or copy to key as an addition or a modification.
+void note_change(const char *key, int existed) {
+    journal_append(&change_journal, existed ? JOURNAL_MOD : JOURNAL_ADD, key);
+}
+
+// watch_matches - Tells whether an event concerns the watched directory prefix ("" for all of S1/):
+// a path at or below it, or a removed tree that contains it or lies below it.
+int watch_matches(const char *prefix, const JournalRecord *rec) {
+    size_t len = strlen(prefix), key_len = strlen(rec->key);
+    if (len == 0 || (strncmp(rec->key, prefix, len) == 0 && (rec->key[len] == '\0' || rec->key[len] == '/')))
+        return 1;
+    return rec->kind == JOURNAL_RMDIR && strncmp(prefix, rec->key, key_len) == 0 && prefix[key_len] == '/';
+}
+
+// watch_dir - Serves watchdir: answers "WATCHING <seq>" and then pushes "EVENT <seq> <ADD|MOD|DEL|RMDIR>
+// S1/<path>" for every journaled change at or below the directory, until the client sends anything
+// (normally "unwatch"), which is answered with "UNWATCHED <seq>". Given the last sequence number a
+// client saw, delivery resumes after it; "RESYNC <seq>" tells it that events were lost (too old for
+// the journal, or never journaled because the inotify queue overflowed) and it has to list the
+// directory again. Returns 0, or -1 when the client went away.
+int watch_dir(int client_sock, const char *dir_arg, const char *since_arg) {
+    char prefix[512] = "", out[8192], line[700];
+    if (strcmp(dir_arg, "S1") != 0 && strcmp(dir_arg, "S1/") != 0 &&
+        (strncmp(dir_arg, "S1/", 3) != 0 || make_route_key(dir_arg + 3, NULL, prefix, sizeof(prefix)) != 0)) {
+        const char *err = "ERR Path must start with 'S1/'.\n";
+        return send(client_sock, err, strlen(err), 0) < 0 ? -1 : 0;
+    }
+    unsigned long long head = journal_head(&change_journal);
+    unsigned long long next = since_arg ? strtoull(since_arg, NULL, 10) + 1 : head + 1;
+    int len = snprintf(out, sizeof(out), "WATCHING %llu\n", next - 1);
+    if (next > head + 1) {                     // Numbers from before the journal was reset
+        next = head + 1;
+        len += snprintf(out + len, sizeof(out) - len, "RESYNC %llu\n", head);
+    }
+    long long stalled_since = 0;
+    while (1) {
+        JournalRecord rec;
+        head = journal_head(&change_journal);
+        while (next <= head) {
+            int got = journal_read(&change_journal, next, &rec);
+            if (got == 0) {                    // Claimed by a writer that has not published it yet
+                if (stalled_since == 0)
+                    stalled_since = journal_now_ms();
+                if (journal_now_ms() - stalled_since < WATCH_STALL_MS)
+                    break;
+                got = 2;                       // Its writer died: skip the hole
+            }
+            stalled_since = 0;
+            if (got < 0) {
+                next = head + 1;
+                snprintf(line, sizeof(line), "RESYNC %llu\n", head);
+            } else if (got == 1 && rec.kind == JOURNAL_LOST)
+                snprintf(line, sizeof(line), "RESYNC %llu\n", next++);  // The watcher missed changes anywhere
+            else if (got == 1 && watch_matches(prefix, &rec))
+                snprintf(line, sizeof(line), "EVENT %llu %s S1/%s\n", next++, journal_kind_name(rec.kind), rec.key);
+            else {
+                next++;
+                continue;
+            }
+            if (len + strlen(line) >= sizeof(out)) {
+                if (send(client_sock, out, len, 0) < 0)
+                    return -1;
+                len = 0;
+            }
+            len += snprintf(out + len, sizeof(out) - len, "%s", line);
+        }
+        if (len > 0 && send(client_sock, out, len, 0) < 0)
+            return -1;
+        len = 0;
+        struct pollfd pfd = { client_sock, POLLIN, 0 };
+        if (poll(&pfd, 1, WATCH_POLL_MS) > 0) {
+            char cmd[BUFFER_SIZE];
+            if (recv(client_sock, cmd, sizeof(cmd), 0) <= 0)
+                return -1;
+            len = snprintf(out, sizeof(out), "UNWATCHED %llu\n", next - 1);
+            return send(client_sock, out, len, 0) < 0 ? -1 : 0;
+        }
+    }
+}
+
+// Changes seen by the watcher process, journaled once they are WATCH_SETTLE_MS old
+static PendingChange *watch_pending;
+static int watch_pending_count, watch_pending_cap;
+
+// watch_queue - Queues a change of root/key for watch_settle.
+void watch_queue(char kind, const char *root, const char *key) {
+    if (watch_pending_count >= watch_pending_cap) {
+        int cap = watch_pending_cap ? watch_pending_cap * 2 : 64;
+        PendingChange *grown = realloc(watch_pending, cap * sizeof(PendingChange));
+        if (!grown)
+            return;
+        watch_pending = grown;
+        watch_pending_cap = cap;
+    }
+    PendingChange *c = &watch_pending[watch_pending_count++];
+    c->time_ms = journal_now_ms();
+    c->kind = kind;
+    snprintf(c->root, sizeof(c->root), "%s", root);
+    snprintf(c->key, sizeof(c->key), "%s", key);
+}
+
+// watch_stored_name - Tells whether a file name below root is one S1 stores there (not a temporary).
+int watch_stored_name(const char *root, const char *name) {
+    const char *ext = strrchr(name, '.');
+    if (name[0] == '.' || !ext)
+        return 0;
+    if (strcmp(root, "S1") == 0)
+        return strcmp(ext, ".c") == 0;
+    return strcmp(ext, ".pdf") == 0 || strcmp(ext, ".txt") == 0 || strcmp(ext, ".zip") == 0;
+}
+
+// watch_add_tree - Adds inotify watches for root/rel and every directory below it. With report set
+// (a directory that appeared while watching), files already in it are queued as additions, since
+// they may have been written before its watch existed.
+void watch_add_tree(int ino_fd, const char *root, const char *rel, WatchedDir **dirs, int *dir_cap, int report) {
+    char *home_dir = getenv("HOME");
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s%s%s", home_dir ? home_dir : ".", root, rel[0] ? "/" : "", rel);
+    int wd = inotify_add_watch(ino_fd, path, IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                              IN_DELETE | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0)
+        return;
+    if (wd >= *dir_cap) {                      // Watch descriptors are small integers: index by them
+        int cap = *dir_cap ? *dir_cap : 256;
+        while (cap <= wd)
+            cap *= 2;
+        WatchedDir *grown = realloc(*dirs, cap * sizeof(WatchedDir));
+        if (!grown)
+            return;
+        memset(grown + *dir_cap, 0, (cap - *dir_cap) * sizeof(WatchedDir));
+        *dirs = grown;
+        *dir_cap = cap;
+    }
+    WatchedDir *w = &(*dirs)[wd];
+    free(w->rel);
+    snprintf(w->root, sizeof(w->root), "%s", root);
+    w->rel = strdup(rel);
+    DIR *d = opendir(path);
+    if (d == NULL)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        char sub[512];
+        snprintf(sub, sizeof(sub), "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name);
+        if (entry->d_name[0] == '.' && strcmp(entry->d_name, FANOUT_DIR) != 0)
+            continue;
+        if (entry->d_type == DT_DIR)
+            watch_add_tree(ino_fd, root, sub, dirs, dir_cap, report);
+        else if (report && entry->d_type == DT_REG && watch_stored_name(root, entry->d_name)) {
+            fanout_strip(sub);
+            watch_queue(JOURNAL_ADD, root, sub);
+        }
+    }
+    closedir(d);
+}
+
+// watch_settle - Journals an inotify change unless S1 journaled the same path itself or the change
+// is replica housekeeping: a copy appearing while another node holds the file, or one going away
+// while a copy remains.
+void watch_settle(PendingChange *change) {
+    if (journal_recent(&change_journal, change->key, change->time_ms - WATCH_SETTLE_MS))
+        return;                                // Made through S1, which reported it already
+    int is_c = strcmp(change->root, "S1") == 0;
+    if (change->kind == JOURNAL_DEL) {
+        if (key_exists(change->key, is_c ? ".c" : NULL))
+            return;
+    } else if (!is_c) {
+        for (int n = 0; n < routing.node_count; n++) {
+            char other[1024];
+            if (strcmp(routing.nodes[n].id, change->root) != 0 && change->kind == JOURNAL_ADD &&
+                stored_rel(routing.nodes[n].id, change->key, other, sizeof(other)) == 1)
+                return;                        // Another replica exists: rebalancing or copying
+        }
+    }
+    journal_append_at(&change_journal, change->kind, change->key, change->time_ms);
+}
+
+// watch_trees - Body of the watcher process: follows S1's tree and every node's tree with inotify and
+// journals changes of stored files that did not come through S1's own request paths (files written
+// into a node directory directly, backends handling uploads on their own). Never returns.
+void watch_trees(void) {
+    int ino_fd = inotify_init1(IN_CLOEXEC);
+    if (ino_fd < 0) {
+        perror("S1: inotify_init1 failed, changes behind S1's back are not journaled");
+        exit(0);
+    }
+    WatchedDir *dirs = NULL;
+    int dir_cap = 0;
+    char created[64][16 + JOURNAL_KEY_MAX];    // "<root>/<key>" of files created recently: their first close is an addition
+    int created_next = 0;
+    char roots[MAX_NODES + 1][16];
+    int root_count = 0;
+    long rounds = 0;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    memset(created, 0, sizeof(created));
+    while (1) {
+        refresh_routing_table();               // New nodes and roots created since the last round
+        for (int n = -1; n < routing.node_count; n++) {
+            const char *root = n < 0 ? "S1" : routing.nodes[n].id;
+            int known = 0;
+            for (int r = 0; r < root_count; r++)
+                known |= strcmp(roots[r], root) == 0;
+            char path[600];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", getenv("HOME") ? getenv("HOME") : ".", root);
+            if (!known && root_count <= MAX_NODES && stat(path, &st) == 0) {
+                watch_add_tree(ino_fd, root, "", &dirs, &dir_cap, rounds > 0);  // Created while watching
+                snprintf(roots[root_count++], sizeof(roots[0]), "%s", root);
+            }
+        }
+        struct pollfd pfd = { ino_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, WATCH_SETTLE_MS) > 0) {
+            ssize_t got = read(ino_fd, buf, sizeof(buf));
+            for (char *p = buf; got > 0 && p < buf + got; ) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) {   // Events were dropped: watchers have to list again
+                    journal_append(&change_journal, JOURNAL_LOST, "");
+                    continue;
+                }
+                if (ev->wd < 0 || ev->wd >= dir_cap || !dirs[ev->wd].rel)
+                    continue;
+                WatchedDir *w = &dirs[ev->wd];
+                if (ev->mask & IN_IGNORED) {
+                    free(w->rel);
+                    w->rel = NULL;
+                    continue;
+                }
+                if (ev->len == 0)
+                    continue;
+                char key[512];
+                snprintf(key, sizeof(key), "%s%s%s", w->rel, w->rel[0] ? "/" : "", ev->name);
+                if (ev->mask & IN_ISDIR) {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                        watch_add_tree(ino_fd, w->root, key, &dirs, &dir_cap, 1);
+                    else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                        dircache_bump(&dir_cache);  // Removed behind S1's back: cached descriptors are stale
+                    continue;
+                }
+                if (!watch_stored_name(w->root, ev->name))
+                    continue;                  // Temporary names (x.c.copy.123, ...) and other files
+                char kind;
+                if (ev->mask & IN_CREATE) {
+                    snprintf(created[created_next++ % 64], sizeof(created[0]), "%s/%s", w->root, key);
+                    continue;                  // Reported when it is closed, with its contents
+                }
+                if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                    kind = JOURNAL_DEL;
+                else if (ev->mask & IN_MOVED_TO)
+                    kind = JOURNAL_ADD;
+                else {
+                    char full[600];
+                    snprintf(full, sizeof(full), "%s/%s", w->root, key);
+                    kind = JOURNAL_MOD;
+                    for (int i = 0; i < 64; i++)
+                        if (strcmp(created[i], full) == 0) {
+                            kind = JOURNAL_ADD;
+                            created[i][0] = '\0';
+                        }
                 }
+                fanout_strip(key);             // Journaled under the logical path
+                watch_queue(kind, w->root, key);
             }
-            *p = '/';                        // Restore the slash after checking/creating directory
         }
+        rounds++;
+        // Changes old enough that S1 has journaled them if they were its own
+        long long now = journal_now_ms();
+        int kept = 0;
+        for (int i = 0; i < watch_pending_count; i++) {
+            if (now - watch_pending[i].time_ms >= WATCH_SETTLE_MS)
+                watch_settle(&watch_pending[i]);
+            else
+                watch_pending[kept++] = watch_pending[i];
+        }
+        watch_pending_count = kept;
     }
-    
-    // Create the final directory if it does not exist.
-    if(access(tmp, F_OK) != 0) {              // Check if the complete directory path exists
-        if(mkdir(tmp, 0755) != 0) {           // Create the final directory if necessary
-            perror("mkdir");                 
-            return -1;                       
+}
+
+// rank_download_nodes - Orders the nodes to try for a download: the file's replicas, healthy ones first
+// and by fewest in-flight requests weighted by latency, then every other node in case a rebalance
+// has not moved the file yet. Returns the number of entries written to nodes.
+int rank_download_nodes(const char *key, int *nodes) {
+    int count = route_replicas(&routing, key, nodes, routing.replicas);
+    double scores[MAX_NODES];
+    time_t now = time(NULL);
+    for (int i = 0; i < count; i++) {
+        NodeStats *ns = node_stats_for(routing.nodes[nodes[i]].id);
+        scores[i] = ns ? (ns->inflight + 1) * (ns->latency_ms > 0 ? ns->latency_ms : 1.0) : 0;
+        if (ns && ns->down_until > now)
+            scores[i] += 1e12;                 // Unhealthy replicas only as a last resort
+    }
+    for (int i = 1; i < count; i++) {          // Insertion sort, replica sets are small
+        for (int j = i; j > 0 && scores[j] < scores[j - 1]; j--) {
+            double score = scores[j]; scores[j] = scores[j - 1]; scores[j - 1] = score;
+            int node = nodes[j]; nodes[j] = nodes[j - 1]; nodes[j - 1] = node;
         }
     }
-    
-    return 0;  // return success
+    int replica_count = count;
+    for (int n = 0; n < routing.node_count; n++) {
+        int seen = 0;
+        for (int i = 0; i < replica_count; i++)
+            if (nodes[i] == n)
+                seen = 1;
+        if (!seen)
+            nodes[count++] = n;
+    }
+    return count;
+}
+
+// connect_node - Opens a connection to a backend node over its configured transport, falling back
+// to TCP when the local socket is not there. For TRANSPORT_SHM a shared-memory ring is set up in
+// *ring as well; ring->sock stays -1 when ring is NULL or the backend declined it.
+// Returns the socket or -1.
+int connect_node(const BackendNode *node, ShmRing *ring) {
+    if (ring)
+        ring_reset(ring);
+    if (node->transport != TRANSPORT_TCP && node->unix_path[0]) {
+        int sock = connect_local(node->unix_path);
+        if (sock >= 0) {
+            if (node->transport == TRANSPORT_SHM && ring && ring_create(ring, sock) == 0) {
+                char msg[64], reply[64];
+                size_t len = 0;
+                snprintf(msg, sizeof(msg), "shmring %d %d\n", ring->slots, ring->slot_size);
+                if (send_with_fd(sock, msg, ring->fd) == 0) {
+                    while (len < sizeof(reply) - 1 && recv(sock, reply + len, 1, 0) == 1 && reply[len] != '\n')
+                        len++;
+                }
+                reply[len] = '\0';
+                if (strncmp(reply, "OK", 2) != 0)
+                    ring_close(ring);          // Backend declined: plain Unix socket it is
+            }
+            return sock;
+        }                                      // Not running here: fall back to TCP
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("connect_node: socket creation failed");
+        return -1;
+    }
+    struct sockaddr_in target_addr;
+    memset(&target_addr, 0, sizeof(target_addr));
+    target_addr.sin_family = AF_INET;
+    target_addr.sin_port = htons(node->port);
+    if (inet_pton(AF_INET, node->ip, &target_addr.sin_addr) <= 0 ||
+        connect(sock, (struct sockaddr *)&target_addr, sizeof(target_addr)) < 0) {
+        perror("connect_node: connection to backend failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// connect_target - connect_node for an ip/port pair: uses the routing table's transport for that
+// node and plain TCP for addresses it does not know.
+int connect_target(const char *ip, int port, ShmRing *ring) {
+    const BackendNode *known = find_node(ip, port);
+    if (known)
+        return connect_node(known, ring);
+    BackendNode node;
+    memset(&node, 0, sizeof(node));
+    snprintf(node.ip, sizeof(node.ip), "%s", ip);
+    node.port = port;
+    node.transport = TRANSPORT_TCP;
+    return connect_node(&node, ring);
+}
+
+// find_node - Returns the routing table entry for ip/port, or NULL.
+const BackendNode *find_node(const char *ip, int port) {
+    for (int i = 0; i < routing.node_count; i++) {
+        if (routing.nodes[i].port == port && strcmp(routing.nodes[i].ip, ip) == 0)
+            return &routing.nodes[i];
+    }
+    return NULL;
+}
+
+// connect_local - Connects to a Unix stream socket. Returns the socket or -1.
+int connect_local(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        sock = -1;
+    }
+    return sock;
+}
+
+// commit_local - Asks a backend on this host to take local_filepath straight from disk
+// ("commitf"): it renames the file when move is set and both trees share a filesystem, else
+// reflinks or copy_file_range()s it. Returns 0 when the backend stored it, -1 when the file has
+// to be streamed (remote node, TCP transport, different $HOME, older backend).
+int commit_local(const BackendNode *node, const char *local_filepath, const char *filename, const char *target_dest, int move) {
+    if (node->transport == TRANSPORT_TCP || node->unix_path[0] == '\0' || local_filepath[0] != '/')
+        return -1;
+    int sock = connect_local(node->unix_path);
+    if (sock < 0)
+        return -1;
+    char cmd[BUFFER_SIZE], reply[BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "commitf %s %s %s %s\n", filename, target_dest, move ? "move" : "copy", local_filepath);
+    memset(reply, 0, sizeof(reply));
+    int ok = send(sock, cmd, strlen(cmd), 0) >= 0 && recv(sock, reply, sizeof(reply) - 1, 0) > 0 &&
+             strncmp(reply, "File committed", 14) == 0;
+    close(sock);
+    return ok ? 0 : -1;
+}
+
+// link_replicas - Digest-first upload: asks each replica node to link the file from the content
+// store of its host ("linkf"). Returns 0 when every node had the content, so the client can skip
+// the payload, and -1 when it has to be uploaded (nodes that linked it just get it written again).
+int link_replicas(const char *filename, const char *destination, const char *digest, const int *nodes, int count) {
+    for (int i = 0; i < count; i++) {
+        const BackendNode *node = &routing.nodes[nodes[i]];
+        char cmd[BUFFER_SIZE], reply[BUFFER_SIZE], dest[600];
+        if (replica_dest(node->id, destination, filename, dest, sizeof(dest)) != 0)
+            return -1;
+        int sock = connect_node(node, NULL);
+        if (sock < 0)
+            return -1;
+        snprintf(cmd, sizeof(cmd), "linkf %s %s %s\n", filename, dest, digest);
+        memset(reply, 0, sizeof(reply));
+        int ok = send(sock, cmd, strlen(cmd), 0) >= 0 && recv(sock, reply, sizeof(reply) - 1, 0) > 0 &&
+                 strncmp(reply, "File linked", 11) == 0;
+        close(sock);
+        if (!ok)
+            return -1;
+    }
+    return 0;
+}
+
+// node_is_local - Tells whether a node runs on this host, so that its tree is $HOME/<id> on S1's disk.
+// Nodes on other hosts are asked for their files with listf, removef, removedir, statf and downlf.
+int node_is_local(const BackendNode *node) {
+    return strcmp(node->ip, "127.0.0.1") == 0 || strcmp(node->ip, "localhost") == 0;
+}
+
+// node_request - Sends one request line to a node and reads its one-line reply, without the newline,
+// into reply. Returns 0, or -1 when the node could not be reached or did not answer.
+int node_request(const BackendNode *node, const char *request, char *reply, size_t len) {
+    int sock = connect_node(node, NULL);
+    if (sock < 0)
+        return -1;
+    size_t n = 0;
+    if (send(sock, request, strlen(request), 0) >= 0) {
+        while (n < len - 1 && recv(sock, reply + n, 1, 0) == 1 && reply[n] != '\n')
+            n++;
+    }
+    reply[n] = '\0';
+    close(sock);
+    return n > 0 ? 0 : -1;
+}
+
+// node_file_request - Sends "<command> <id>/<stored path of key><extra>" to a node on another host,
+// with key's path in the configured layout and then in the other one, like stored_rel.
+// Returns 0 with the first reply that is not an ERROR line, or -1.
+int node_file_request(const BackendNode *node, const char *command, const char *key, const char *extra,
+                      char *reply, size_t len) {
+    for (int i = 0; i < 2; i++) {
+        char physical[600], request[BUFFER_SIZE];
+        if (fanout_key(key, i == 0 ? routing.fanout : !routing.fanout, physical, sizeof(physical)) != 0 ||
+            snprintf(request, sizeof(request), "%s %s/%s%s\n", command, node->id, physical, extra) >= (int)sizeof(request) ||
+            node_request(node, request, reply, len) != 0)
+            return -1;
+        if (strncmp(reply, "ERROR", 5) != 0)
+            return 0;
+    }
+    return -1;
+}
+
+// node_fetch - Copies key from a node on another host to path on this host (downlf), in either layout.
+// Returns 0, or -1 when the node does not hold it or the transfer failed.
+int node_fetch(const BackendNode *node, const char *key, const char *path) {
+    for (int i = 0; i < 2; i++) {
+        char physical[600], request[BUFFER_SIZE], header[256];
+        long long size;
+        size_t n = 0;
+        if (fanout_key(key, i == 0 ? routing.fanout : !routing.fanout, physical, sizeof(physical)) != 0 ||
+            snprintf(request, sizeof(request), "downlf %s/%s\n", node->id, physical) >= (int)sizeof(request))
+            return -1;
+        int sock = connect_node(node, NULL);
+        if (sock < 0)
+            return -1;
+        if (send(sock, request, strlen(request), 0) >= 0) {
+            while (n < sizeof(header) - 1 && recv(sock, header + n, 1, 0) == 1 && header[n] != '\n')
+                n++;                           // "OK <size> <etag>\n", then the data
+        }
+        header[n] = '\0';
+        int ret = sscanf(header, "OK %lld", &size) == 1 && size >= 0 ? file_recv_payload(sock, size, path) : 1;
+        close(sock);
+        if (ret <= 0)
+            return ret;
+    }
+    return -1;
+}
+
+// fetch_file - Copies a replica of key from a node on another host into $HOME/FETCH_DIR, for work that
+// needs the data on this host. Returns the node, with path set to the copy, or -1.
+int fetch_file(const char *key, char *path, size_t len) {
+    static unsigned int seq;
+    char *home_dir = getenv("HOME");
+    int nodes[MAX_NODES];
+    int count = rank_download_nodes(key, nodes);
+    snprintf(path, len, "%s/%s", home_dir ? home_dir : ".", FETCH_DIR);
+    mkdir(path, 0755);
+    snprintf(path, len, "%s/%s/%d-%u", home_dir ? home_dir : ".", FETCH_DIR, (int)getpid(), seq++);
+    for (int i = 0; i < count; i++) {
+        if (!node_is_local(&routing.nodes[nodes[i]]) && node_fetch(&routing.nodes[nodes[i]], key, path) == 0)
+            return nodes[i];
+    }
+    unlink(path);
+    return -1;
+}
+
+// node_list - Lists a node's files below the logical directory dir ("" for the whole tree) with
+// listf; flat leaves out its subdirectories. Returns the reply's "<path>\t<size>\t<mtime>" lines, paths
+// below dir as stored, as one malloc()ed string, or NULL.
+char *node_list(const BackendNode *node, const char *dir, int flat) {
+    char request[BUFFER_SIZE];
+    long long size, done = 0;
+    if (snprintf(request, sizeof(request), "listf %s/%s%s\n", node->id, dir, flat ? " flat" : "") >= (int)sizeof(request))
+        return NULL;
+    int sock = connect_node(node, NULL);
+    if (sock < 0)
+        return NULL;
+    char *list = NULL;
+    if (send(sock, request, strlen(request), 0) >= 0 && file_recv_size(sock, &size) == 0 &&
+        (list = malloc(size + 1)) != NULL) {
+        while (done < size) {
+            ssize_t n = recv(sock, list + done, size - done, 0);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        list[done] = '\0';
+        if (done < size) {
+            free(list);
+            list = NULL;
+        }
+    }
+    close(sock);
+    return list;
+}
+
+// remove_remote - Removes the copies of key on nodes of other hosts (removef). Returns how many went.
+int remove_remote(const char *key) {
+    int removed = 0;
+    for (int n = 0; n < routing.node_count; n++) {
+        char reply[256];
+        if (!node_is_local(&routing.nodes[n]) &&
+            node_file_request(&routing.nodes[n], "removef", key, "", reply, sizeof(reply)) == 0)
+            removed++;
+    }
+    return removed;
+}
+
+// send_with_fd - Sends msg over a Unix socket with descriptor fd attached (SCM_RIGHTS).
+int send_with_fd(int sock, const char *msg, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { (void *)msg, strlen(msg) };
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &hdr, 0) < 0 ? -1 : 0;
+}
+
+// parse_transport - Maps "tcp", "unix" or "shm" to TRANSPORT_*; anything else is TCP.
+int parse_transport(const char *name) {
+    if (strcmp(name, "shm") == 0)
+        return TRANSPORT_SHM;
+    if (strcmp(name, "unix") == 0)
+        return TRANSPORT_UNIX;
+    return TRANSPORT_TCP;
+}
+
+// default_unix_path - Backends on this host listen on $HOME/LOCAL_SOCK_DIR/backend-<port>.sock;
+// remote nodes get an empty path and are always reached over TCP.
+void default_unix_path(BackendNode *node) {
+    char *home_dir = getenv("HOME");
+    node->unix_path[0] = '\0';
+    if (node_is_local(node))
+        snprintf(node->unix_path, sizeof(node->unix_path), "%s/%s/backend-%d.sock",
+                 home_dir ? home_dir : ".", LOCAL_SOCK_DIR, node->port);
+}
+
+// handoff_to_node - Passes the client connection to a backend on this host over its Unix socket
+// (SCM_RIGHTS) together with cmd, so the file moves between backend and client without S1 copying it.
+// Returns the backend's status from "DONE <status>" (0 served, 1 not stored there, -1 failed), or -2
+// when the node has no local socket and the caller has to fall back to TCP. The node counts as busy
+// with one more request until it answers, like a proxied transfer.
+int handoff_to_node(const BackendNode *node, int client_sock, const char *cmd) {
+    int sock = node->unix_path[0] ? connect_local(node->unix_path) : -1;
+    if (sock < 0)
+        return -2;                             // Backend not running here, or an older build without the socket
+    if (send_with_fd(sock, cmd, client_sock) != 0) {
+        close(sock);
+        return -2;                             // Nothing reached the client yet
+    }
+    NodeStats *ns = node_stats_for(node->id);
+    if (ns)
+        __sync_fetch_and_add(&ns->inflight, 1);
+    char reply[32];
+    size_t len = 0;
+    while (len < sizeof(reply) - 1 && recv(sock, reply + len, 1, 0) == 1 && reply[len] != '\n')
+        len++;
+    reply[len] = '\0';
+    close(sock);
+    if (ns)
+        __sync_fetch_and_sub(&ns->inflight, 1);
+    int status;
+    if (sscanf(reply, "DONE %d", &status) != 1)
+        return -1;                             // Backend died while it owned the client connection
+    return status;
+}
+
+// proxy_download - Streams a backend file to the client in send_file's format, trying the ranked nodes
+// in turn, and keeps a copy in the hot-file cache when it fits. The client's validator goes to the node,
+// which answers with the etag of its copy or NOTMODIFIED. A downlm file (framed) is relayed by S1
+// itself, since a backend handed the connection only writes downlf's reply.
+// Returns 0 when sent, -1 when no node holds the file and -2 when the transfer broke off.
+int proxy_download(int client_sock, const char *key, const FileFraming *framing) {
+    int nodes[MAX_NODES];
+    int count = rank_download_nodes(key, nodes);
+    for (int i = 0; i < count; i++) {
+        const BackendNode *node = &routing.nodes[nodes[i]];
+        NodeStats *ns = node_stats_for(node->id);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        char cmd[BUFFER_SIZE], rel[600];
+        stored_rel(node->id, key, rel, sizeof(rel));  // Configured layout when S1 cannot see the node's disk
+        if (framing)
+            snprintf(cmd, sizeof(cmd), "downlf %s %s\n", rel, framing->validator);
+        else
+            snprintf(cmd, sizeof(cmd), "downlf %s\n", rel);
+        int handed = framing && framing->framed ? -2 : handoff_to_node(node, client_sock, cmd);  // Same host: the node writes to the client itself
+        if (handed == 0 || handed == -1) {
+            record_node_result(ns, elapsed_ms_since(&start), handed == 0);
+            return handed == 0 ? 0 : -2;       // The client may have seen part of the file already
+        }
+        if (handed == 1)
+            continue;                          // Not stored on this node
+        int sock = connect_node(node, NULL);  // Replies are framed on the socket, no ring needed
+        if (sock < 0) {
+            record_node_result(ns, 0, 0);      // Unreachable: skip this node for a while
+            continue;
+        }
+        char header[256];                      // "OK <size> <etag>\n", "NOTMODIFIED\n" or an error line
+        size_t header_len = 0;
+        struct timespec fill_start;            // Invalidations from here on may predate the data we get
+        clock_gettime(CLOCK_REALTIME, &fill_start);
+        if (send(sock, cmd, strlen(cmd), 0) >= 0) {
+            while (header_len < sizeof(header) - 1 && recv(sock, header + header_len, 1, 0) == 1 &&
+                   header[header_len] != '\n')
+                header_len++;                  // Read the header byte by byte, the payload follows it
+        }
+        header[header_len] = '\0';
+        long long file_size;
+        char etag[FILE_ETAG_MAX] = "-";        // Older nodes send no etag: the client will not cache it
+        int answer = -1;
+        if (framing && strcmp(header, "NOTMODIFIED") == 0)
+            answer = send_size(client_sock, 0, framing, framing->validator);
+        else if (sscanf(header, "OK %lld %127s", &file_size, etag) >= 1 && file_size >= 0)
+            answer = send_size(client_sock, file_size, framing, etag);
+        else {
+            close(sock);
+            if (header_len == 0)
+                record_node_result(ns, 0, 0);  // No answer at all
+            continue;                          // Not stored on this node
+        }
+        if (answer != 0) {                     // Failed, or the client's copy is current
+            close(sock);
+            if (answer > 0)
+                record_node_result(ns, elapsed_ms_since(&start), 1);
+            return answer < 0 ? -2 : 0;
+        }
+        // Stage a cache copy next to the cache entry; it only becomes visible once complete.
+        char *home_dir = getenv("HOME");
+        char cache_dir[512], tmp_path[600];
+        FILE *cache_fp = NULL;
+        snprintf(cache_dir, sizeof(cache_dir), "%s/%s", home_dir ? home_dir : ".", CACHE_DIR);
+        if (routing.cache_bytes > 0 && file_size <= routing.cache_bytes / 8) {
+            mkdir(cache_dir, 0755);
+            cache_entry_path(key, ".tmp", tmp_path, sizeof(tmp_path));
+            snprintf(tmp_path + strlen(tmp_path), sizeof(tmp_path) - strlen(tmp_path), ".%d", (int)getpid());
+            cache_fp = fopen(tmp_path, "wb");
+        }
+        if (ns)
+            __sync_fetch_and_add(&ns->inflight, 1);
+        char buf[BUFFER_SIZE];
+        long long remaining = file_size;
+        int ok = 1;
+        while (remaining > 0) {
+            int n = recv(sock, buf, remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE, 0);
+            if (n <= 0 || send(client_sock, buf, n, 0) < 0) {
+                ok = 0;
+                break;
+            }
+            if (cache_fp && fwrite(buf, 1, n, cache_fp) != (size_t)n) {
+                fclose(cache_fp);              // Cache disk full: keep serving, skip caching
+                remove(tmp_path);
+                cache_fp = NULL;
+            }
+            remaining -= n;
+        }
+        close(sock);
+        if (ns) {
+            __sync_fetch_and_sub(&ns->inflight, 1);
+            record_node_result(ns, elapsed_ms_since(&start), 1);
+        }
+        if (cache_fp) {
+            char entry_path[600], marker_path[600];
+            struct stat st;
+            cache_entry_path(key, "", entry_path, sizeof(entry_path));
+            cache_entry_path(key, ".inv", marker_path, sizeof(marker_path));
+            int stale = stat(marker_path, &st) == 0 &&
+                        (st.st_mtim.tv_sec > fill_start.tv_sec ||
+                         (st.st_mtim.tv_sec == fill_start.tv_sec && st.st_mtim.tv_nsec >= fill_start.tv_nsec));
+            if (fclose(cache_fp) == 0 && ok && !stale && rename(tmp_path, entry_path) == 0)
+                cache_note_fill(file_size);
+            else
+                remove(tmp_path);              // Incomplete, or invalidated by an upload/remove meanwhile
+        }
+        return ok ? 0 : -2;
+    }
+    return -1;
+}
+
+// cache_entry_path - Builds "$HOME/CACHE_DIR/<64-bit FNV-1a of key><suffix>".
+void cache_entry_path(const char *key, const char *suffix, char *path, size_t len) {
+    home_entry_path(CACHE_DIR, key, suffix, path, len);
+}
+
+// home_entry_path - Builds "$HOME/<dir>/<64-bit FNV-1a of key><suffix>".
+void home_entry_path(const char *dir, const char *key, const char *suffix, char *path, size_t len) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (const char *p = key; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    char *home_dir = getenv("HOME");
+    snprintf(path, len, "%s/%s/%016llx%s", home_dir ? home_dir : ".", dir, h, suffix);
+}
+
+// cache_serve - Sends a cached copy of key to the client and marks it most recently used.
+// Returns 1 on a miss, 0 when served and -2 when the transfer failed.
+int cache_serve(int client_sock, const char *key, const FileFraming *framing) {
+    char path[600];
+    if (routing.cache_bytes <= 0)
+        return 1;
+    cache_entry_path(key, "", path, sizeof(path));
+    long size;
+    char etag[FILE_ETAG_MAX];
+    const struct timespec used[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };  // The mtime stays part of the etag
+    const char *data = map_file(path, &size, etag);  // Hot entries stay mapped across requests
+    if (data) {
+        utimensat(AT_FDCWD, path, used, 0);    // LRU order is kept in the entries' atimes
+        return send_buffer(client_sock, data, size, framing, etag) == 0 ? 0 : -2;
+    }
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return 1;
+    futimens(fileno(fp), used);
+    return send_stream(client_sock, fp, framing) == 0 ? 0 : -2;
+}
+
+// cache_invalidate - Drops the cached copy of key and leaves a marker so that a download which
+// started before the change cannot publish its now stale copy.
+void cache_invalidate(const char *key) {
+    char path[600];
+    struct stat st;
+    cache_entry_path(key, "", path, sizeof(path));
+    if (stat(path, &st) == 0 && remove(path) == 0 && cache_usage)
+        __sync_fetch_and_sub(&cache_usage->bytes, (long)st.st_size);
+    cache_entry_path(key, ".inv", path, sizeof(path));
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd >= 0) {
+        futimens(fd, NULL);
+        close(fd);
+    }
+}
+
+// cache_note_fill - Counts a new cache entry of size bytes. The cache directory is only scanned
+// (cache_evict) once the count passes the bound, or CACHE_MARKER_SECS after the last scan so that old
+// markers still expire, instead of on every fill.
+void cache_note_fill(long long size) {
+    long total = __sync_add_and_fetch(&cache_usage->bytes, (long)size);
+    if (total > routing.cache_bytes || time(NULL) - cache_usage->scanned > CACHE_MARKER_SECS)
+        cache_evict(routing.cache_bytes);
+}
+
+// cache_evict - Deletes least recently used cache entries until the cache fits in max_bytes,
+// expires old invalidation markers and resets the shared size count to what is left.
+void cache_evict(long max_bytes) {
+    char *home_dir = getenv("HOME");
+    char cache_dir[512];
+    snprintf(cache_dir, sizeof(cache_dir), "%s/%s", home_dir ? home_dir : ".", CACHE_DIR);
+    cache_usage->scanned = time(NULL);
+    DIR *d = opendir(cache_dir);
+    if (d == NULL) {
+        cache_usage->bytes = 0;                // No cache yet
+        return;
+    }
+    int capacity = 64, count = 0;
+    char **entries = malloc(capacity * sizeof(char *));  // "<atime>\t<name>\t<size>", sortable by last use
+    long total = 0;
+    time_t now = time(NULL);
+    struct dirent *entry;
+    while (entries && (entry = readdir(d)) != NULL) {
+        char path[1024];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name);
+        if (entry->d_name[0] == '.' || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (strchr(entry->d_name, '.')) {      // Marker or in-progress fill
+            if (strstr(entry->d_name, ".inv") && now - st.st_mtime > CACHE_MARKER_SECS)
+                remove(path);
+            continue;
+        }
+        if (count >= capacity) {
+            char **grown = realloc(entries, capacity * 2 * sizeof(char *));
+            if (!grown)
+                break;
+            entries = grown;
+            capacity *= 2;
+        }
+        char line[512];
+        snprintf(line, sizeof(line), "%020lld.%09ld\t%s\t%lld", (long long)st.st_atim.tv_sec,
+                 st.st_atim.tv_nsec, entry->d_name, (long long)st.st_size);
+        entries[count++] = strdup(line);
+        total += st.st_size;
+    }
+    closedir(d);
+    if (!entries)
+        return;
+    qsort(entries, count, sizeof(char *), compare_string);  // Oldest first
+    for (int i = 0; i < count; i++) {
+        if (total > max_bytes) {
+            char name[256], path[1024];
+            long long size;
+            if (sscanf(entries[i], "%*s %255s %lld", name, &size) == 2) {
+                snprintf(path, sizeof(path), "%s/%s", cache_dir, name);
+                if (remove(path) == 0)
+                    total -= size;
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    cache_usage->bytes = total;                // Fills finishing meanwhile are counted at the next scan
+}
+
+// trash_file - Removes path from the tree by renaming it into $HOME/TRASH_DIR, which takes the same time
+// for any file size; the reclaimer unlinks it later. Falls back to remove() across filesystems.
+// Returns 0 or -1.
+int trash_file(const char *path) {
+    static unsigned int seq;
+    char *home_dir = getenv("HOME");
+    char trash_path[600];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    snprintf(trash_path, sizeof(trash_path), "%s/%s", home_dir ? home_dir : ".", TRASH_DIR);
+    mkdir(trash_path, 0755);
+    snprintf(trash_path, sizeof(trash_path), "%s/%s/%lld.%09ld-%d-%u", home_dir ? home_dir : ".", TRASH_DIR,
+             (long long)now.tv_sec, now.tv_nsec, (int)getpid(), seq++);
+    if (rename(path, trash_path) == 0)
+        return 0;
+    return errno == EXDEV && remove(path) == 0 ? 0 : -1;
+}
+
+// reclaim_trash - Frees up to budget bytes of removed files in $HOME/TRASH_DIR by unlinking them. A file
+// larger than what is left of the budget waits, and the unspent budget is saved for it across rounds
+// until it covers the file, so the rate holds on average. Trashed files are never truncated: a sender
+// may still be reading or mapping one. Files that still have other links free nothing and cost nothing.
+void reclaim_trash(long budget) {
+    static long saved;                         // Budget of earlier rounds held for one large file
+    char *home_dir = getenv("HOME");
+    char trash_dir[512];
+    snprintf(trash_dir, sizeof(trash_dir), "%s/%s", home_dir ? home_dir : ".", TRASH_DIR);
+    int dir_fd = open(trash_dir, O_RDONLY | O_DIRECTORY);
+    DIR *d = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (d == NULL) {
+        if (dir_fd >= 0)
+            close(dir_fd);
+        return;                                // Nothing was removed yet
+    }
+    budget += saved;
+    saved = 0;                                 // Only kept while a file is waiting for it
+    struct dirent *entry;
+    while (budget > 0 && (entry = readdir(d)) != NULL) {
+        struct stat st;
+        if (entry->d_name[0] == '.' || fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        long cost = (S_ISREG(st.st_mode) && st.st_nlink == 1) ? (long)st.st_blocks * 512 : 0;
+        if (cost > budget) {
+            saved = budget;                    // Unlinked in a later round, once enough was saved
+            break;
+        }
+        if (unlinkat(dir_fd, entry->d_name, 0) == 0)
+            budget -= cost;
+    }
+    closedir(d);
+}
+
+// node_stats_for - Finds or claims the shared statistics slot of a backend node.
+NodeStats *node_stats_for(const char *id) {
+    if (!node_stats)
+        return NULL;
+    unsigned int h = hash_key(id) | 1;         // Never zero, zero marks a free slot
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        NodeStats *ns = &node_stats[(h + i) % STATS_SLOTS];
+        if (ns->id_hash == h && strcmp(ns->id, id) == 0)
+            return ns;
+        if (ns->id_hash == 0 && __sync_bool_compare_and_swap(&ns->id_hash, 0, h)) {
+            snprintf(ns->id, sizeof(ns->id), "%s", id);
+            return ns;
+        }
+    }
+    return NULL;
+}
+
+// elapsed_ms_since - Milliseconds elapsed on the monotonic clock since start.
+double elapsed_ms_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// record_node_result - Folds one request into a node's latency EWMA, or marks the node down on failure.
+void record_node_result(NodeStats *ns, double elapsed_ms, int ok) {
+    if (!ns)
+        return;
+    if (!ok) {
+        ns->down_until = time(NULL) + NODE_DOWN_SECS;
+        return;
+    }
+    ns->latency_ms = ns->latency_ms > 0 ?
+                     ns->latency_ms * (1 - LATENCY_EWMA_WEIGHT) + elapsed_ms * LATENCY_EWMA_WEIGHT : elapsed_ms;
+    ns->down_until = 0;
+}
+
+// replicate_file - Forwards a received upload to every node in nodes in parallel, one child per replica.
+// Returns 0 as soon as quorum replicas acknowledged; slower replicas finish in the background.
+int replicate_file(const char *local_filepath, const char *filename, const char *destination,
+                   const int *nodes, int count, int quorum) {
+    pid_t pids[MAX_NODES];
+    int started = 0, acked = 0, failed = 0;
+    for (int i = 0; i < count; i++) {
+        const BackendNode *node = &routing.nodes[nodes[i]];
+        // Each replica gets its own open file so S1 can drop its copy before stragglers finish.
+        FILE *fp = fopen(local_filepath, "rb");
+        if (!fp) {
+            perror("replicate_file: fopen failed");
+            failed++;
+            continue;
+        }
+        char target_dest[600];
+        if (replica_dest(node->id, destination, filename, target_dest, sizeof(target_dest)) != 0) {
+            fclose(fp);
+            failed++;
+            continue;
+        }
+        printf("Forwarding %s to %s at %s:%d...\n", filename, node->id, node->ip, node->port);  // Log the forwarding action
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("replicate_file: fork failed");
+            fclose(fp);
+            failed++;
+            continue;
+        }
+        if (pid == 0) {                        // Child: push one replica and report through the exit status
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            // A single copy is moved into place; several copies are reflinked/copied from S1's file.
+            int ok = commit_local(node, local_filepath, filename, target_dest, count == 1) == 0 ||
+                     forward_stream(fp, filename, target_dest, node->ip, node->port) == 0;
+            record_node_result(node_stats_for(node->id), elapsed_ms_since(&start), ok);
+            _exit(ok ? 0 : 1);
+        }
+        fclose(fp);
+        pids[started++] = pid;
+    }
+    while (acked < quorum && count - failed >= quorum) {  // Stop early once the quorum is out of reach
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+            break;
+        int ours = 0;
+        for (int i = 0; i < started; i++)
+            if (pids[i] == pid)
+                ours = 1;
+        if (!ours)
+            continue;                          // Straggler of an earlier upload
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            acked++;
+        else
+            failed++;
+    }
+    return acked >= quorum ? 0 : -1;
+}
+
+// collect_dir_files - Appends the names of files in dir_path ending in ext to files, including those
+// kept in its fan-out buckets.
+// Returns 0, or -1 when the arena ran out of memory.
+int collect_dir_files(const char *dir_path, const char *ext, StrList *files) {
+    DIR *d = opendir(dir_path);
+    if (d == NULL)
+        return 0;                              // Skip if the node has no such directory
+    struct dirent *entry;
+    int ret = 0;
+    while (ret == 0 && (entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;                          // Ignore current and parent directory entries
+        if (strcmp(entry->d_name, FANOUT_DIR) == 0) {
+            char fan_path[512];
+            snprintf(fan_path, sizeof(fan_path), "%s/%s", dir_path, FANOUT_DIR);
+            ret = collect_bucket_files(fan_path, 2, ext, files);
+            continue;
+        }
+        char *file_ext = strrchr(entry->d_name, '.');
+        if (file_ext && strcmp(file_ext, ext) == 0)
+            ret = strlist_add(files, entry->d_name);
+    }
+    closedir(d);
+    return ret;
+}
+
+// collect_node_files - collect_dir_files for the directory dir of a node on another host, listed by
+// the node itself. Returns 0, or -1 when the arena ran out of memory.
+int collect_node_files(const BackendNode *node, const char *dir, const char *ext, StrList *files) {
+    char *list = node_list(node, dir, 1);
+    char *save = NULL;
+    int ret = 0;
+    for (char *line = list ? strtok_r(list, "\n", &save) : NULL; ret == 0 && line; line = strtok_r(NULL, "\n", &save)) {
+        line[strcspn(line, "\t")] = '\0';
+        fanout_strip(line);                    // Files in buckets are listed under their own name
+        char *file_ext = strrchr(line, '.');
+        if (file_ext && strcmp(file_ext, ext) == 0 && !strchr(file_ext, '/'))
+            ret = strlist_add(files, line);
+    }
+    free(list);
+    return ret;
+}
+
+// collect_bucket_files - collect_dir_files for the files levels directories below a fan-out bucket tree.
+// Returns 0, or -1 when the arena ran out of memory.
+int collect_bucket_files(const char *dir_path, int levels, const char *ext, StrList *files) {
+    if (levels == 0)
+        return collect_dir_files(dir_path, ext, files);
+    DIR *d = opendir(dir_path);
+    if (d == NULL)
+        return 0;
+    struct dirent *entry;
+    int ret = 0;
+    while (ret == 0 && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;                          // Buckets are named by hex digits
+        char bucket_path[512];
+        snprintf(bucket_path, sizeof(bucket_path), "%s/%s", dir_path, entry->d_name);
+        ret = collect_bucket_files(bucket_path, levels - 1, ext, files);
+    }
+    closedir(d);
+    return ret;
+}
+
+// collect_tree_files - Recursively appends "key\tpath" for every file ending in ext below dir_path,
+// key being the logical path in either layout.
+// Returns 0, or -1 when the arena ran out of memory.
+int collect_tree_files(const char *dir_path, const char *rel, const char *ext, StrList *entries) {
+    DIR *d = opendir(dir_path);
+    if (d == NULL)
+        return 0;
+    struct dirent *entry;
+    int ret = 0;
+    while (ret == 0 && (entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char full_path[512], key[512];
+        struct stat st;
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
+        snprintf(key, sizeof(key), "%s%s%s", rel ? rel : "", rel ? "/" : "", entry->d_name);
+        if (stat(full_path, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            ret = collect_tree_files(full_path, key, ext, entries);  // Recurse into subdirectories
+            continue;
+        }
+        char *file_ext = strrchr(entry->d_name, '.');
+        if (S_ISREG(st.st_mode) && file_ext && strcmp(file_ext, ext) == 0) {
+            fanout_strip(key);                 // Files in buckets are listed under their logical path
+            ret = strlist_push(entries, arena_printf(entries->arena, "%s\t%s", key, full_path));
+        }
+    }
+    closedir(d);
+    return ret;
+}
+
+// collect_remote_files - Appends a "key\t\t<node>\t<mtime>" entry for every file ending in ext that node n,
+// on another host, lists in its tree. Returns 0, or -1 when the arena ran out of memory.
+int collect_remote_files(int n, const char *ext, StrList *entries) {
+    char *list = node_list(&routing.nodes[n], "", 0);
+    char *save = NULL;
+    int ret = 0;
+    for (char *line = list ? strtok_r(list, "\n", &save) : NULL; ret == 0 && line; line = strtok_r(NULL, "\n", &save)) {
+        char *tab = strchr(line, '\t');
+        long mtime = 0;
+        if (!tab || sscanf(tab + 1, "%*s %ld", &mtime) != 1)
+            continue;
+        *tab = '\0';
+        fanout_strip(line);                    // Listed under the logical path, like collect_tree_files
+        char *file_ext = strrchr(line, '.');
+        if (file_ext && strcmp(file_ext, ext) == 0 && !strchr(file_ext, '/'))
+            ret = strlist_push(entries, arena_printf(entries->arena, "%s\t\t%d\t%ld", line, n, mtime));
+    }
+    free(list);
+    return ret;
+}
+
+// rebalance_tree - Walks one node's storage tree and rebalances every file in it.
+void rebalance_tree(const RoutingTable *rt, int src, const char *dir_path, const char *rel, int *moved) {
+    DIR *d = opendir(dir_path);
+    if (d == NULL)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char full_path[512], key[512];
+        struct stat st;
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
+        snprintf(key, sizeof(key), "%s%s%s", rel ? rel : "", rel ? "/" : "", entry->d_name);
+        if (stat(full_path, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            rebalance_tree(rt, src, full_path, key, moved);  // Recurse into subdirectories
+            continue;
+        }
+        if (S_ISREG(st.st_mode)) {
+            fanout_strip(key);                 // Placed by its logical path, whichever layout holds it
+            rebalance_file(rt, src, key, full_path, moved);
+        }
+    }
+    closedir(d);
+}
+
+// rebalance_remote - rebalance_tree for node src on another host, whose files it lists itself.
+void rebalance_remote(const RoutingTable *rt, int src, int *moved) {
+    char *list = node_list(&rt->nodes[src], "", 0);
+    char *save = NULL;
+    for (char *line = list ? strtok_r(list, "\n", &save) : NULL; line; line = strtok_r(NULL, "\n", &save)) {
+        line[strcspn(line, "\t")] = '\0';
+        fanout_strip(line);
+        rebalance_file(rt, src, line, NULL, moved);
+    }
+    free(list);
+}
+
+// rebalance_file - Copies the file key of node src to the members of its replica set that lack it,
+// deleting src's copy once src has left the set and every new replica acknowledged. path is src's copy
+// on this host, or NULL when src is on another host: the file is then fetched from it first.
+void rebalance_file(const RoutingTable *rt, int src, const char *key, const char *path, int *moved) {
+    const char *ext = strrchr(key, '.');
+    const char *name = strrchr(key, '/') ? strrchr(key, '/') + 1 : key;
+    if (!ext || (strcmp(ext, ".pdf") != 0 && strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0))
+        return;
+    int replicas[MAX_NODES];
+    int replica_count = route_replicas(rt, key, replicas, rt->replicas);
+    int keep = 0, copied = 1;
+    char fetched[600] = "", reply[256];
+    for (int i = 0; i < replica_count; i++) {
+        const BackendNode *node = &rt->nodes[replicas[i]];
+        char target_dest[600];
+        if (replicas[i] == src) {
+            keep = 1;                          // Still part of this file's replica set
+            continue;
+        }
+        int present = node_dest(node->id, key, target_dest, sizeof(target_dest));
+        if (present == 0 && !node_is_local(node))
+            present = node_file_request(node, "statf", key, "", reply, sizeof(reply)) == 0;
+        if (present == 1)
+            continue;                          // Replica already in place
+        if (present < 0) {
+            copied = 0;                        // No valid destination: keep the source copy
+            continue;
+        }
+        if (!path && !fetched[0]) {            // Source on another host: fetch it once
+            snprintf(fetched, sizeof(fetched), "%s/%s", getenv("HOME") ? getenv("HOME") : ".", FETCH_DIR);
+            mkdir(fetched, 0755);
+            snprintf(fetched, sizeof(fetched), "%s/%s/%d-rebalance", getenv("HOME") ? getenv("HOME") : ".",
+                     FETCH_DIR, (int)getpid());
+            if (node_fetch(&rt->nodes[src], key, fetched) != 0) {
+                unlink(fetched);
+                return;                        // Unreadable now: left where it is
+            }
+        }
+        printf("Rebalancing %s from %s to %s...\n", key, rt->nodes[src].id, node->id);
+        if (forward_file(path ? path : fetched, name, target_dest, node->ip, node->port) != 0)
+            copied = 0;
+        else
+            (*moved)++;
+    }
+    if (fetched[0])
+        unlink(fetched);
+    if (!keep && copied) {                     // Ownership moved on and every new replica holds a copy
+        if (path)
+            remove(path);
+        else
+            node_file_request(&rt->nodes[src], "removef", key, "", reply, sizeof(reply));
+    }
 }
 
 // error_exit - Prints an error message and exits.
@@ -1,4 +1,5 @@
 // S4 handles .zip files only 
+ #define _GNU_SOURCE                // copy_file_range, O_DIRECT/fallocate
  #include <stdio.h>                       // Include standard I/O functions              
  #include <stdlib.h>                      // Include standard library functions          
  #include <string.h>                      // Include string handling functions           
@@ -9,21 +10,59 @@
  #include <netinet/in.h>                  // Include internet protocol family definitions
  #include <errno.h>                       // Include error handling functions            
  #include <sys/stat.h>                    // Include file status and directory functions 
+ #include <sys/un.h>              // Unix domain sockets for co-located S1
+ #include <poll.h>                // Waiting on the TCP and local listeners
+ #include <fcntl.h>               // open() flags for committing local files
+ #include <limits.h>              // PATH_MAX for realpath()
+ #include <sys/ioctl.h>           // FICLONE reflinks
+ #include <linux/fs.h>            // FICLONE
+ #include <dirent.h>              // Directory traversal for listings and removedir
+ #include "s25ring.h"            // Shared-memory ring for same-host S1 transfers
+ #include "s25cas.h"             // Content-addressed store shared by the backends on this host
+ #include "s25parse.h"           // Request lines and command dispatch shared with S1
+ #include "s25dirfd.h"            // Open storage directories, resolved with openat()
+ #include "s25fanout.h"           // Fan-out bucket directory name for listings
+ #include "s25file.h"             // Size headers and preallocated, cache-friendly payload writes
  
  #define SERVER_PORT 4644 // Define server port for S4 
  #define BUFFER_SIZE 1024 // Define buffer size for data transfers
+ #define LOCAL_SOCK_DIR ".s25"  // Local sockets live in $HOME/.s25/backend-<port>.sock
+ #define CAS_SWEEP_SECS 60      // Interval of the sweep for content no path refers to
  
  // Function prototypes
  void prcclient(int client_sock);               // Declare function to process client commands
+ int handle_uploadf(CmdReader *r, Command *cmd);  // Receive an upload into $HOME/<destination>
+ int handle_commitf(CmdReader *r, Command *cmd);  // Commit a file S1 holds on this host
+ int handle_linkf(CmdReader *r, Command *cmd);  // Link stored content by digest
+ int handle_downlf(CmdReader *r, Command *cmd);  // Send a stored file to S1
+ int handle_listf(CmdReader *r, Command *cmd);  // List a storage directory for S1 on another host
+ int handle_removef(CmdReader *r, Command *cmd);  // Remove a stored file for S1 on another host
+ int handle_removedir(CmdReader *r, Command *cmd);  // Remove a storage directory for S1 on another host
+ int handle_statf(CmdReader *r, Command *cmd);  // Describe a stored file for S1 on another host
+ int handle_exit(CmdReader *r, Command *cmd);  // End the session
  int create_directories(const char *path);      // Declare function to create directories recursively
  int receive_file(int client_sock, const char *filepath);  // Declare function to receive a file from client
+ int receive_data(int client_sock, const char *filepath);  // receive the payload of an upload into filepath
+ int send_file(int client_sock, const char *filepath);  // send a file to the client
+ int send_stored_file(int client_sock, const char *filepath, const char *validator, int to_client);  // serve a stored file with a framed header
+ int open_local_listener(int port);  // listen on the Unix socket used by a co-located S1
+ int accept_connection(int server_sock, int local_sock, struct sockaddr *addr, socklen_t *addr_len);  // accept from whichever listener is ready
+ void handle_handoff(int control_sock, int client_fd, Command *cmd);  // serve a client connection handed over by S1
+ int commit_local_file(const char *src, const char *dst, int move);  // move/reflink/copy a file already on this host
+ int is_local_connection(int sock);  // whether sock came in over the Unix socket
+ int list_files(const char *dir_path, const char *rel, int levels, FILE *out);  // List stored files below a directory
+ int remove_tree(const char *path, long *files);  // Delete a directory tree
  void error_exit(const char *msg);              // Prints error and exits
  
+static ShmRing ring = { -1, -1, NULL, 0, 0 };  // Ring S1 attached to this connection, if any
+static DirCache dir_cache;  // Storage directories this process has open
+
 // main - Sets up the S4 server to listen on SERVER_PORT and handles connections.
- int main() {                                     // Begin main function of S4 server
+ int main(int argc, char *argv[]) {               // Begin main function of S4 server
      int server_sock, client_sock;              // Declare variables for server and client sockets  
      struct sockaddr_in server_addr, client_addr; // Declare structures for server and client addresses
      socklen_t client_addr_len = sizeof(client_addr);  // Determine length of client address structure
+     int port = (argc > 1 && atoi(argv[1]) > 0) ? atoi(argv[1]) : SERVER_PORT;  // Optional port lets this binary serve an extra node
  
      if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) // Create TCP socket; check for errors
          error_exit("S4: socket creation failed");  // Exit if socket creation fails
@@ -31,7 +70,7 @@
      memset(&server_addr, 0, sizeof(server_addr)); // Zero out server address structure
      server_addr.sin_family = AF_INET;            // Set address family to IPv4
      server_addr.sin_addr.s_addr = INADDR_ANY;     // Accept connections from any IP 
-     server_addr.sin_port = htons(SERVER_PORT);    // Set port number in network byte order
+     server_addr.sin_port = htons(port);    // Set port number in network byte order
  
      if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) // Bind socket to address/port; check error
          error_exit("S4: bind failed");           // Exit if binding fails
@@ -39,10 +78,20 @@
      if (listen(server_sock, 10) < 0)              // Start listening with a backlog of 10 connections
          error_exit("S4: listen failed");         // Exit if listen fails
  
-     printf("S4 Server (Zip file handler) listening on port %d...\n", SERVER_PORT); // Inform that S4 is running
+     printf("S4 Server (Zip file handler) listening on port %d...\n", port); // Inform that S4 is running
+     int local_sock = open_local_listener(port);  // Same-host S1 hands client connections over here
+     if (fork() == 0) {  // Sweeper: drops stored content that no file links to any more
+         close(server_sock);
+         if (local_sock >= 0)
+             close(local_sock);
+         while (1) {
+             sleep(CAS_SWEEP_SECS);
+             cas_sweep(getenv("HOME") ? getenv("HOME") : ".");
+         }
+     }
  
      while (1) {                                // Loop forever to accept new connections
-         client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_addr_len); // Accept a new connection; returns client socket
+         client_sock = accept_connection(server_sock, local_sock, (struct sockaddr *)&client_addr, &client_addr_len); // Accept a new connection; returns client socket
          if (client_sock < 0) {                 // Check if accept failed
              perror("S4: accept failed");       // Print error message if accept fails
              continue;                          // Continue to next connection
@@ -55,6 +104,8 @@
          }
          if (pid == 0) {                        // Child process branch
              close(server_sock);                // Child doesn't need the listening socket; close it
+             if (local_sock >= 0)
+                 close(local_sock);
              prcclient(client_sock);            // Process client commands in the child process
              exit(0);                           // Exit child process when done
          } else {                               // Parent process branch
@@ -65,139 +116,392 @@
      return 0;                                  // Return success
  }
  
+ // Commands S1 sends to this node; each handler checks its own arguments
+ static const CmdSpec backend_commands[] = {
+     { "uploadf",  0, handle_uploadf,  NULL },
+     { "commitf",  0, handle_commitf,  NULL },
+     { "linkf",    0, handle_linkf,    NULL },
+     { "downlf",   0, handle_downlf,   NULL },
+     { "listf",    0, handle_listf,    NULL },
+     { "removef",  0, handle_removef,  NULL },
+     { "removedir", 0, handle_removedir, NULL },
+     { "statf",    0, handle_statf,    NULL },
+     { "exit",     0, handle_exit,     NULL },
+     { NULL,        0, NULL,             "ERROR: Unknown command in S4.\n" }
+ };
+
  // prcclient - Processes commands from a connected client.
- // Only "uploadf" (for .zip files) and "exit" are supported.
+ // Only "uploadf" (for .pdf/.txt/.zip files placed here by S1) and "exit" are supported.
   
  void prcclient(int client_sock) {              // Begin function to process client commands
-     char buffer[BUFFER_SIZE];                  // Buffer to store incoming data from the client
-     char *home_dir = getenv("HOME");           // Get the user's home directory from environment variables
-     if (!home_dir)                             // If HOME is not set,
-         home_dir = ".";                        // default to the current directory
- 
-     while (1) {                                // Loop to process commands continuously
-         memset(buffer, 0, sizeof(buffer));     // Clear the buffer for new data
-         int bytes = recv(client_sock, buffer, sizeof(buffer)-1, 0); // Receive data from the client
-         if (bytes <= 0)                        // If no data received or connection error occurs,
-             break;                             // exit the loop
-         buffer[strcspn(buffer, "\r\n")] = 0;     // Remove newline characters from the received message
- 
-         char *command = strtok(buffer, " ");   // Tokenize the first word as the command
-         if (!command)                          // If no command is present,
-             continue;                          // skip to the next iteration
- 
-         if (strcmp(command, "uploadf") == 0) {   // If the command is "uploadf"
-             // Expected format: uploadf <filename> <destination_path>
-
-             char *filename = strtok(NULL, " ");  // Extract the filename
-             char *destination = strtok(NULL, " "); // Extract the destination path
-             if (!filename || !destination) {     // Validate that both parameters are provided
-                 send(client_sock, "ERROR: Invalid uploadf command format.\n", 41, 0); // Inform client of format error
-                 continue;                      // Continue to next command if parameters are missing
-             }
-             // Check that the file has a .zip extension.
-             char *ext = strrchr(filename, '.');  // Find the last occurrence of '.' to get the extension
-             if (!ext || strcmp(ext, ".zip") != 0) { // Verify that the extension exists and equals ".zip"
-                 send(client_sock, "ERROR: Only .zip files allowed in S4.\n", 38, 0); // Notify client of invalid extension
-                 continue;                      // Continue to next command if extension invalid
-             }
-             // Create destination directory under $HOME/S4.
-             if (create_directories(destination) != 0) { // Try to create necessary directories
-                 send(client_sock, "ERROR: Failed to create directory structure.\n", 48, 0); // Inform client if creation fails
-                 continue;                      // Continue if directory creation failed
+     CmdReader reader;  // Bytes received from S1, parsed in place
+     Command cmd;
+     cmd_reader_init(&reader, client_sock);
+     while (cmd_next(&reader, &cmd)) {  // One request line at a time, however the reads split them
+         if (cmd.fd >= 0) {  // S1 handed the client over: stream directly with it
+             if (strcmp(cmd.name, "shmring") == 0 && cmd.argc == 2) {  // S1 uses a shared-memory ring for bulk data
+                 ring_close(&ring);
+                 if (ring_attach(&ring, client_sock, cmd.fd, atoi(cmd.args[0]), atoi(cmd.args[1])) == 0)
+                     send(client_sock, "OK\n", 3, 0);
+                 else {
+                     close(cmd.fd);
+                     send(client_sock, "ERROR: Cannot map ring.\n", 24, 0);
+                 }
              }
-             char local_filepath[512];          // Buffer for constructing full file path
-             // Construct the full file path: $HOME/S4/<destination>/<filename>.
-             snprintf(local_filepath, sizeof(local_filepath), "%s/%s/%s", home_dir, destination, filename); // Build path where file will be saved
-             // Send READY to inform client that we're ready to receive.
-             send(client_sock, "READY\n", 6, 0);  // Send "READY" response to client to start file transfer
-             if (receive_file(client_sock, local_filepath) == 0) // Attempt to receive and store the file
-                 send(client_sock, "File uploaded successfully to S4.\n", 34, 0); // Notify client of successful upload
              else
-                 send(client_sock, "ERROR: Failed to receive file in S4.\n", 38, 0); // Notify client of reception failure
-         }
-         else if (strcmp(command, "exit") == 0) { // If the command is "exit"
-             break;                             // Exit the loop and close the connection
-         }
-         else {                                   // If the command is unrecognized
-             send(client_sock, "ERROR: Unknown command in S4.\n", 30, 0); // Notify client about unknown command
+                 handle_handoff(client_sock, cmd.fd, &cmd);
+             continue;
          }
+         if (cmd_dispatch(backend_commands, &reader, &cmd) != 0)
+             break;
      }
+     cmd_reader_close(&reader);
      close(client_sock);                        // Close the client socket after processing is complete
  }
+
+ // handle_uploadf - Receives an upload from S1 (or a client it handed over) into $HOME/<destination>.
+ int handle_uploadf(CmdReader *r, Command *cmd) {
+     int client_sock = r->sock;
+     char *home_dir = getenv("HOME");
+     if (!home_dir)
+         home_dir = ".";
+     // Expected format: uploadf <filename> <destination_path>
+
+     char *filename = cmd->args[0];  // Extract the filename
+     char *destination = cmd->args[1]; // Extract the destination path
+     if (!filename || !destination) {     // Validate that both parameters are provided
+         send(client_sock, "ERROR: Invalid uploadf command format.\n", 41, 0); // Inform client of format error
+         return 0;                      // Continue to next command if parameters are missing
+     }
+     // Check that the file has an extension S1 places on backend nodes.
+     if (cmd_file_type(filename) < FILE_PDF) {  // S1 places .pdf/.txt/.zip on any node
+         send(client_sock, "ERROR: Only .pdf, .txt and .zip files allowed in S4.\n", 53, 0); // Notify client of invalid extension
+         return 0;                      // Continue to next command if extension invalid
+     }
+     // Create destination directory under $HOME/S4.
+     if (create_directories(destination) != 0) { // Try to create necessary directories
+         send(client_sock, "ERROR: Failed to create directory structure.\n", 48, 0); // Inform client if creation fails
+         return 0;                      // Continue if directory creation failed
+     }
+     char local_filepath[512];          // Buffer for constructing full file path
+     // Construct the full file path: $HOME/S4/<destination>/<filename>.
+     if (snprintf(local_filepath, sizeof(local_filepath), "%s/%s/%s", home_dir, destination, filename) >=
+         (int)sizeof(local_filepath)) {
+         send(client_sock, "ERROR: Path too long.\n", 22, 0);
+         return 0;
+     }
+     // Send READY to inform client that we're ready to receive.
+     send(client_sock, "READY\n", 6, 0);  // Send "READY" response to client to start file transfer
+     if (receive_file(client_sock, local_filepath) == 0) // Attempt to receive and store the file
+         send(client_sock, "File uploaded successfully to S4.\n", 34, 0); // Notify client of successful upload
+     else
+         send(client_sock, "ERROR: Failed to receive file in S4.\n", 38, 0); // Notify client of reception failure
+     return 0;
+ }
+
+ // handle_commitf - Commits a file S1 on this host already holds on disk, without streaming it.
+ int handle_commitf(CmdReader *r, Command *cmd) {
+     int client_sock = r->sock;
+     char *home_dir = getenv("HOME");
+     if (!home_dir)
+         home_dir = ".";
+     // Expected: commitf <filename> <destination_path> <copy|move> <source_path>
+     char *filename = cmd->args[0];
+     char *destination = cmd->args[1];
+     char *mode = cmd->args[2];
+     char *source = cmd->args[3];
+     char local_filepath[512], real_home[PATH_MAX], real_source[PATH_MAX];
+     if (!source || cmd_file_type(filename) < FILE_PDF ||
+         !is_local_connection(client_sock)) {
+         send(client_sock, "ERROR: Invalid commitf command.\n", 32, 0);
+         return 0;
+     }
+     // Only files below this server's $HOME, so a local peer cannot make us read arbitrary files.
+     size_t home_len = realpath(home_dir, real_home) ? strlen(real_home) : 0;
+     if (home_len == 0 || !realpath(source, real_source) || strncmp(real_source, real_home, home_len) != 0 ||
+         real_source[home_len] != '/' || create_directories(destination) != 0) {
+         send(client_sock, "ERROR: Cannot commit file in S4.\n", 33, 0);
+         return 0;
+     }
+     if (snprintf(local_filepath, sizeof(local_filepath), "%s/%s/%s", home_dir, destination, filename) >=
+         (int)sizeof(local_filepath)) {
+         send(client_sock, "ERROR: Path too long.\n", 22, 0);
+         return 0;
+     }
+     if (commit_local_file(real_source, local_filepath, strcmp(mode, "move") == 0) != 0) {
+         send(client_sock, "ERROR: Cannot commit file in S4.\n", 33, 0);  // S1 streams the file instead
+         return 0;
+     }
+     if (cas_ingest(home_dir, local_filepath) != 0)  // The commit stands; the file just is not deduplicated
+         perror("S4: cas_ingest failed");
+     send(client_sock, "File committed in S4.\n", 22, 0);
+     return 0;
+ }
+
+ // handle_linkf - Stores an upload by digest, linking content this host already stores.
+ int handle_linkf(CmdReader *r, Command *cmd) {
+     int client_sock = r->sock;
+     char *home_dir = getenv("HOME");
+     if (!home_dir)
+         home_dir = ".";
+     // Expected: linkf <filename> <destination_path> <sha256>
+     char *filename = cmd->args[0];
+     char *destination = cmd->args[1];
+     char *digest = cmd->args[2];
+     if (!digest || cmd_file_type(filename) < FILE_PDF ||
+         !cas_valid_digest(digest) || create_directories(destination) != 0) {
+         send(client_sock, "ERROR: Invalid linkf command.\n", 30, 0);
+         return 0;
+     }
+     char local_filepath[512];
+     if (snprintf(local_filepath, sizeof(local_filepath), "%s/%s/%s", home_dir, destination, filename) >=
+         (int)sizeof(local_filepath)) {
+         send(client_sock, "ERROR: Path too long.\n", 22, 0);
+         return 0;
+     }
+     if (cas_link(home_dir, digest, local_filepath) == 0)
+         send(client_sock, "File linked in S4.\n", 19, 0);
+     else
+         send(client_sock, "ERROR: Content not stored in S4.\n", 33, 0);  // S1 asks for the payload
+     return 0;
+ }
+
+ // handle_downlf - Sends a stored file to S1 with a framed header.
+ int handle_downlf(CmdReader *r, Command *cmd) {
+     int client_sock = r->sock;
+     char *home_dir = getenv("HOME");
+     if (!home_dir)
+         home_dir = ".";
+     // Expected: downlf <storage_path> [<validator>], e.g. downlf S4/folder/file.pdf -
+     char *path_arg = cmd->args[0];
+     char local_filepath[512];
+     struct stat st;
+     if (path_arg && snprintf(local_filepath, sizeof(local_filepath), "%s/%s", home_dir, path_arg) >=
+                     (int)sizeof(local_filepath)) {
+         send(client_sock, "ERROR: Path too long.\n", 22, 0);
+         return 0;
+     }
+     if (!path_arg || path_arg[0] == '/' || strstr(path_arg, "..") ||
+         stat(local_filepath, &st) != 0 || !S_ISREG(st.st_mode)) {  // Only files inside $HOME are served
+         send(client_sock, "ERROR: File not found in S4.\n", 29, 0);
+         return 0;
+     }
+     if (send_stored_file(client_sock, local_filepath, cmd->args[1], 0) != 0)
+         perror("S4: downlf failed");
+     return 0;
+ }
+
+ // handle_listf - Lists the files below a storage directory for S1 on another host: a "<size>\n"
+ // header, then one "<path>\t<size>\t<mtime>\n" line per file, path below the directory as stored.
+ // With "flat" only the files directly inside it, fan-out buckets included, are listed.
+ int handle_listf(CmdReader *r, Command *cmd) {
+     int client_sock = r->sock;
+     char *home_dir = getenv("HOME");
+     if (!home_dir)
+         home_dir = ".";
+     // Expected: listf <storage_dir> [flat], e.g. listf S4/folder flat
+     char *path_arg = cmd->args[0];
+     char dir_path[512];
+     if (!path_arg || path_arg[0] == '/' || strstr(path_arg, "..") ||
+         snprintf(dir_path, sizeof(dir_path), "%s/%s", home_dir, path_arg) >= (int)sizeof(dir_path)) {
+         send(client_sock, "ERROR: Invalid listf command.\n", 30, 0);
+         return 0;
+     }
+     char *list = NULL;
+     size_t len = 0;
+     FILE *out = open_memstream(&list, &len);  // The listing is sized before it is sent
+     int ok = out && list_files(dir_path, "", cmd->args[1] && strcmp(cmd->args[1], "flat") == 0 ? 0 : -1, out) == 0;
+     if (out && fclose(out) != 0)
+         ok = 0;
+     if (!ok)
+         send(client_sock, "ERROR: Cannot list directory in S4.\n", 36, 0);
+     else if (file_send_size(client_sock, len) == 0) {
+         for (size_t sent = 0; sent < len; ) {
+             ssize_t n = send(client_sock, list + sent, len - sent, 0);
+             if (n <= 0)
+                 break;
+             sent += n;
+         }
+     }
+     free(list);
+     return 0;
+ }
+
+ // handle_removef - Removes a stored file for S1 on another host (removef <storage_path>). Content
+ // shared with other paths stays in the content store until its sweep.
+ int handle_removef(CmdReader *r, Command *cmd) {
+     int client_sock = r->sock;
+     char *home_dir = getenv("HOME");
+     if (!home_dir)
+         home_dir = ".";
+     char *path_arg = cmd->args[0];
+     char local_filepath[512];
+     struct stat st;
+     if (!path_arg || path_arg[0] == '/' || strstr(path_arg, "..") ||
+         snprintf(local_filepath, sizeof(local_filepath), "%s/%s", home_dir, path_arg) >= (int)sizeof(local_filepath) ||
+         lstat(local_filepath, &st) != 0 || !S_ISREG(st.st_mode)) {
+         send(client_sock, "ERROR: File not found in S4.\n", 29, 0);
+         return 0;
+     }
+     if (unlink(local_filepath) == 0)
+         send(client_sock, "File removed from S4.\n", 22, 0);
+     else
+         send(client_sock, "ERROR: Cannot remove file in S4.\n", 33, 0);
+     return 0;
+ }
+
+ // handle_removedir - Deletes a storage directory with everything below it for S1 on another host
+ // (removedir <storage_dir>). Replies "DONE <files>\n", "FAILED <files>\n" when some entries stayed,
+ // or an ERROR line when there is no such directory.
+ int handle_removedir(CmdReader *r, Command *cmd) {
+     int client_sock = r->sock;
+     char *home_dir = getenv("HOME");
+     if (!home_dir)
+         home_dir = ".";
+     char *path_arg = cmd->args[0];
+     char dir_path[512], reply[64];
+     struct stat st;
+     long files = 0;
+     if (!path_arg || path_arg[0] == '/' || strstr(path_arg, "..") ||
+         snprintf(dir_path, sizeof(dir_path), "%s/%s", home_dir, path_arg) >= (int)sizeof(dir_path) ||
+         lstat(dir_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+         send(client_sock, "ERROR: Directory not found in S4.\n", 34, 0);
+         return 0;
+     }
+     int failed = remove_tree(dir_path, &files) != 0;
+     dircache_bump(&dir_cache);  // Other processes may hold the removed directories open
+     snprintf(reply, sizeof(reply), "%s %ld\n", failed ? "FAILED" : "DONE", files);
+     send(client_sock, reply, strlen(reply), 0);
+     return 0;
+ }
+
+ // handle_statf - Describes a stored file for S1 on another host (statf <storage_path> [sha256]):
+ // "OK <size> <mtime>\n", with the file's SHA-256 before the newline when asked for.
+ int handle_statf(CmdReader *r, Command *cmd) {
+     int client_sock = r->sock;
+     char *home_dir = getenv("HOME");
+     if (!home_dir)
+         home_dir = ".";
+     char *path_arg = cmd->args[0];
+     char local_filepath[512], hex[CAS_DIGEST_LEN + 1] = "", reply[256];
+     struct stat st;
+     int digest = cmd->args[1] && strcmp(cmd->args[1], "sha256") == 0;
+     if (!path_arg || path_arg[0] == '/' || strstr(path_arg, "..") ||
+         snprintf(local_filepath, sizeof(local_filepath), "%s/%s", home_dir, path_arg) >= (int)sizeof(local_filepath) ||
+         stat(local_filepath, &st) != 0 || !S_ISREG(st.st_mode) || (digest && cas_hash_file(local_filepath, hex) != 0)) {
+         send(client_sock, "ERROR: File not found in S4.\n", 29, 0);
+         return 0;
+     }
+     snprintf(reply, sizeof(reply), "OK %lld %ld%s%s\n", (long long)st.st_size, (long)st.st_mtime, digest ? " " : "", hex);
+     send(client_sock, reply, strlen(reply), 0);
+     return 0;
+ }
+
+ // list_files - Writes "<path>\t<size>\t<mtime>\n" to out for every regular file below dir_path, path
+ // being rel plus the stored name. levels bounds the subdirectories entered (-1 for no bound); the
+ // two bucket levels of a fan-out tree do not count. Returns 0, or -1 when out failed.
+ int list_files(const char *dir_path, const char *rel, int levels, FILE *out) {
+     DIR *d = opendir(dir_path);
+     if (d == NULL)
+         return 0;  // Nothing stored there
+     struct dirent *entry;
+     int ret = 0;
+     while (ret == 0 && (entry = readdir(d)) != NULL) {
+         char path[1024], name[1024];
+         struct stat st;
+         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+             snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(path) ||
+             snprintf(name, sizeof(name), "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name) >= (int)sizeof(name) ||
+             stat(path, &st) != 0)
+             continue;
+         if (S_ISDIR(st.st_mode) && strcmp(entry->d_name, FANOUT_DIR) == 0)
+             ret = list_files(path, name, levels < 0 ? levels : 2, out);  // Buckets hold this directory's own files
+         else if (S_ISDIR(st.st_mode) && levels != 0)
+             ret = list_files(path, name, levels - 1, out);
+         else if (S_ISREG(st.st_mode) && fprintf(out, "%s\t%lld\t%ld\n", name, (long long)st.st_size, (long)st.st_mtime) < 0)
+             ret = -1;
+     }
+     closedir(d);
+     return ret;
+ }
+
+ // remove_tree - Deletes path and everything below it, counting removed files in *files.
+ // Returns 0, or -1 when an entry could not be removed.
+ int remove_tree(const char *path, long *files) {
+     DIR *d = opendir(path);
+     if (d == NULL)
+         return -1;
+     struct dirent *entry;
+     int ret = 0;
+     while ((entry = readdir(d)) != NULL) {
+         char sub[1024];
+         struct stat st;
+         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+             continue;
+         if (snprintf(sub, sizeof(sub), "%s/%s", path, entry->d_name) >= (int)sizeof(sub) || lstat(sub, &st) != 0)
+             ret = -1;
+         else if (S_ISDIR(st.st_mode) ? remove_tree(sub, files) != 0 : unlink(sub) != 0)
+             ret = -1;
+         else if (!S_ISDIR(st.st_mode))
+             (*files)++;
+     }
+     closedir(d);
+     return rmdir(path) == 0 ? ret : -1;
+ }
+
+ // handle_exit - Ends the session.
+ int handle_exit(CmdReader *r, Command *cmd) {
+     (void)r;
+     (void)cmd;
+     return -1;
+ }
  
- // create_directories - Recursively creates the directory structure under $HOME.
+ // create_directories - Makes sure $HOME/<path> exists; directories used before come from the descriptor cache.
  int create_directories(const char *path) {     // Function to create directories recursively
-     char full_path[512];                     // Buffer to hold the complete path
-     char tmp[512];                           // Temporary buffer for manipulation
-     char *p;                                 // Pointer to iterate through the path string
-     size_t len;                              // Variable to store the length of the path string
- 
-     char *home_dir = getenv("HOME");         // Retrieve the HOME directory
-     if (!home_dir)                           // If HOME is not set
-         home_dir = ".";                      // Default to current directory
-     snprintf(full_path, sizeof(full_path), "%s/%s", home_dir, path); // Construct the full path by concatenating HOME and provided path
-     strncpy(tmp, full_path, sizeof(tmp));     // Copy full path to temporary buffer
-     tmp[sizeof(tmp) - 1] = '\0';               // Ensure the temporary string is null-terminated
-     len = strlen(tmp);                       // Calculate the length of the temporary path
-     if (tmp[len - 1] == '/')                 // If the path ends with a slash
-         tmp[len - 1] = '\0';                 // Remove the trailing slash
- 
-     for (p = tmp + 1; *p; p++) {             // Iterate through the temporary path starting after the first character
-         if (*p == '/') {                     // When a slash is encountered (indicating a subdirectory)
-             *p = '\0';                       // Temporarily terminate the string to get the current subdirectory path
-             if (access(tmp, F_OK) != 0) {      // Check if the current subdirectory does not exist
-                 if (mkdir(tmp, 0755) != 0) {   // Attempt to create the subdirectory with permissions 0755
-                     perror("mkdir");         // Print error if directory creation fails
-                     return -1;               // Return error code
-                 }
-             }
-             *p = '/';                        // Restore the slash for further processing of the path
-         }
+     if (dircache_dir(&dir_cache, path, 1) < 0) {
+         perror("mkdir");  // Print error if a component could not be created
+         return -1;
      }
-     if (access(tmp, F_OK) != 0) {              // After processing, check if the complete directory exists
-         if (mkdir(tmp, 0755) != 0) {           // If not, try to create it
-             perror("mkdir");                 // Print error message if creation fails
-             return -1;                       // Return error code
-         }
+     return 0;
+ }
+ 
+ // receive_file - Receives an upload into a temporary file and renames it over filepath, so a stored
+ // file sharing its inode with other paths is replaced rather than rewritten, then adds it to the
+ // content store.
+ int receive_file(int client_sock, const char *filepath) {
+     char part_path[600];
+     snprintf(part_path, sizeof(part_path), "%s.part.%d", filepath, (int)getpid());
+     if (receive_data(client_sock, part_path) != 0 || rename(part_path, filepath) != 0) {
+         unlink(part_path);
+         return -1;
      }
-     return 0;                                // Return success if directories exist or were created
+     cas_ingest(getenv("HOME") ? getenv("HOME") : ".", filepath);
+     return 0;
  }
  
- // receive_file - Receives a file from the client and writes it to disk.
- // Expects first a string with the file size, then the file data.
+ // receive_data - Receives a file from the client and writes it to disk.
+ // Expects first the size header ("<size>\n"), then the file data.
   
- int receive_file(int client_sock, const char *filepath) { // Function to receive file data and save it to "filepath"
-     char size_buf[64];                       // Buffer to hold file size (as string)
-     int bytes = recv(client_sock, size_buf, sizeof(size_buf)-1, 0); // Receive file size from client
-     if (bytes <= 0)                          // If receiving size fails
-         return -1;                           // Return error code
-     size_buf[bytes] = '\0';                  // Null-terminate the received size string
-     long file_size = atol(size_buf);         // Convert size string to a long integer representing file size
-     if (file_size <= 0)                      // If file size is not positive
-         return -1;                           // Return error code
-     FILE *fp = fopen(filepath, "wb");        // Open destination file in binary write mode
-     if (!fp) {                               // If file cannot be opened
-         perror("fopen");                     // Print error message
-         return -1;                           // Return error code
-     }
-     char buf[BUFFER_SIZE];                   // Buffer to store chunks of incoming file data
-     long remaining = file_size;              // Initialize remaining bytes counter with total file size
-     while (remaining > 0) {                  // Loop until all expected file data is received
-         int to_read = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE; // Determine number of bytes to read in this iteration
-         int rec = recv(client_sock, buf, to_read, 0); // Receive a chunk of file data
-         if (rec <= 0) {                      // If receiving chunk fails
-             fclose(fp);                      // Close the file
-             return -1;                       // Return error code
-         }
-         fwrite(buf, 1, rec, fp);             // Write the received chunk to file
-         remaining -= rec;                    // Decrement remaining byte count by number of bytes received
+ int receive_data(int client_sock, const char *filepath) { // Function to receive file data and save it to "filepath"
+     if (ring.sock == client_sock) {  // Same-host S1 sends the data through the ring
+         FILE *fp = fopen(filepath, "wb");
+         int ret = fp ? 0 : -1;
+         if (!fp)
+             fp = fopen("/dev/null", "wb");  // Still drain the ring so the connection stays usable
+         if (!fp || ring_recv_stream(&ring, fp) != 0)
+             ret = -1;
+         if (fp)
+             fclose(fp);
+         return ret;
      }
-     fclose(fp);                              // Close file after all data has been received
-     return 0;                                // Return success code
+     long long file_size;  // 64-bit size from the "<size>\n" header
+     if (file_recv_size(client_sock, &file_size) != 0 || file_size <= 0)  // Receive the size header
+         return -1;
+     return file_recv_payload(client_sock, file_size, filepath);  // Preallocated, large files bypass the page cache
  }
  
  // send_file - Sends the file at filepath to the client.
- // First sends the file size as a string, then streams the file data.
+ // First sends the size header ("<size>\n"), then streams the file data.
 
  int send_file(int client_sock, const char *filepath) { // Function to send a file to the client
      FILE *fp = fopen(filepath, "rb");        // Open the file in binary read mode
@@ -205,12 +509,13 @@
          perror("send_file: fopen failed");   // Print error message
          return -1;                           // Return error code
      }
-     fseek(fp,0,SEEK_END);                    // Move file pointer to the end to determine size
-     long file_size = ftell(fp);              // Get file size using ftell
-     rewind(fp);                              // Reset file pointer to the beginning of the file
-     char size_str[64];                       // Buffer to hold file size as a string
-     snprintf(size_str, sizeof(size_str), "%ld", file_size); // Convert file size to string format
-     if(send(client_sock, size_str, strlen(size_str), 0) < 0) { // Send file size string to client
+     long long file_size = file_stream_size(fp);  // Size for the header
+     if (ring.sock == client_sock) {  // Same-host S1: hand the data over in shared memory
+         int ret = ring_send_stream(&ring, fp, file_size);
+         fclose(fp);
+         return ret;
+     }
+     if (file_send_size(client_sock, file_size) != 0) { // Send the size header to the client
          perror("send_file: sending file size failed"); // Print error if sending size fails
          fclose(fp);                          // Close file
          return -1;                           // Return error code
@@ -226,10 +531,164 @@
              }
          }
      }
+     file_send_done(fp, file_size);  // A large file leaves the page cache to the hot ones
      fclose(fp);                              // Close the file after all data is sent
      return 0;                                // Return success code
  }
  
+ // send_stored_file - Sends "OK <size> <etag>\n" followed by the file data, so S1 can tell the
+ // header from the payload however the stream is split; a client handed over by S1 (to_client) gets
+ // downlf's "ETAG <etag>\n<size>\n" instead. Either gets just "NOTMODIFIED\n" when validator is the
+ // etag of the file, which is taken from the copy being sent.
+ int send_stored_file(int client_sock, const char *filepath, const char *validator, int to_client) {
+     FILE *fp = fopen(filepath, "rb");
+     struct stat st;
+     if (!fp || fstat(fileno(fp), &st) != 0) {
+         if (fp)
+             fclose(fp);
+         if (!to_client)
+             send(client_sock, "ERROR: File not found in S4.\n", 29, 0);
+         return -1;
+     }
+     long long file_size = st.st_size;
+     char etag[FILE_ETAG_MAX], header[FILE_ETAG_MAX + 64];
+     file_stat_etag(&st, etag, sizeof(etag));
+     int current = validator && strcmp(validator, etag) == 0;  // The requester's copy is this one
+     if (current)
+         snprintf(header, sizeof(header), "NOTMODIFIED\n");
+     else if (to_client)
+         snprintf(header, sizeof(header), "ETAG %s\n%lld\n", etag, file_size);
+     else
+         snprintf(header, sizeof(header), "OK %lld %s\n", file_size, etag);
+     if (send(client_sock, header, strlen(header), 0) < 0 || current) {
+         fclose(fp);
+         return current ? 0 : -1;
+     }
+     char buf[BUFFER_SIZE];
+     size_t n;
+     while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+         if (send(client_sock, buf, n, 0) < 0) {
+             fclose(fp);
+             return -1;
+         }
+     }
+     file_send_done(fp, file_size);
+     fclose(fp);
+     return 0;
+ }
+ 
+ // open_local_listener - Listens on $HOME/.s25/backend-<port>.sock for S1 processes on this host.
+ // Returns the socket, or -1 when no local listener could be set up (TCP keeps working).
+ int open_local_listener(int port) {
+     char *home_dir = getenv("HOME");
+     char dir[256];
+     struct sockaddr_un addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sun_family = AF_UNIX;
+     snprintf(dir, sizeof(dir), "%s/%s", home_dir ? home_dir : ".", LOCAL_SOCK_DIR);
+     mkdir(dir, 0700);
+     if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/backend-%d.sock", dir, port) >= (int)sizeof(addr.sun_path))
+         return -1;                               // Path too long for a Unix socket
+     unlink(addr.sun_path);                       // Remove a socket left behind by an earlier run
+     int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+     if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 10) < 0) {
+         perror("S4: local listener failed");
+         if (sock >= 0)
+             close(sock);
+         return -1;
+     }
+     return sock;
+ }
+ 
+ // accept_connection - Waits on the TCP and local listeners and accepts from whichever is ready.
+ int accept_connection(int server_sock, int local_sock, struct sockaddr *addr, socklen_t *addr_len) {
+     struct pollfd fds[2] = { { server_sock, POLLIN, 0 }, { local_sock, POLLIN, 0 } };
+     if (poll(fds, local_sock >= 0 ? 2 : 1, -1) < 0)
+         return -1;
+     if (fds[0].revents & POLLIN)
+         return accept(server_sock, addr, addr_len);
+     return accept(local_sock, NULL, NULL);
+ }
+ 
+ // commit_local_file - Puts src at dst without streaming it: rename() when moving within one
+ // filesystem, otherwise a FICLONE reflink, otherwise copy_file_range(). The copy goes to a temporary
+ // name first so readers never see a partial file. Returns 0, or -1 when the caller should stream it.
+ int commit_local_file(const char *src, const char *dst, int move) {
+     if (move && rename(src, dst) == 0)
+         return 0;                                // Same filesystem: a pure metadata operation
+     char tmp_path[600];
+     snprintf(tmp_path, sizeof(tmp_path), "%s.commit.%d", dst, (int)getpid());
+     int in = open(src, O_RDONLY);
+     if (in < 0)
+         return -1;
+     int out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+     if (out < 0) {
+         close(in);
+         return -1;
+     }
+     int ok = ioctl(out, FICLONE, in) == 0;       // Shares the extents on btrfs/XFS
+     if (!ok) {
+         struct stat st;
+         off_t remaining = fstat(in, &st) == 0 ? st.st_size : -1;
+         ok = remaining >= 0;
+         while (ok && remaining > 0) {            // In-kernel copy, no trip through user space
+             ssize_t n = copy_file_range(in, NULL, out, NULL, remaining, 0);
+             if (n <= 0)
+                 ok = 0;
+             else
+                 remaining -= n;
+         }
+     }
+     close(in);
+     if (close(out) != 0 || !ok || rename(tmp_path, dst) != 0) {
+         unlink(tmp_path);
+         return -1;
+     }
+     if (move)
+         unlink(src);                             // Different filesystem: finish the move by hand
+     return 0;
+ }
+ 
+ // is_local_connection - Tells whether sock was accepted on the Unix socket, i.e. the peer is on this host.
+ int is_local_connection(int sock) {
+     struct sockaddr_storage addr;
+     socklen_t len = sizeof(addr);
+     return getsockname(sock, (struct sockaddr *)&addr, &len) == 0 && addr.ss_family == AF_UNIX;
+ }
+ 
+ // handle_handoff - Serves an uploadf/downlf whose client connection S1 passed over the local socket.
+ // The data moves directly between this server and the client; S1 only gets "DONE <status>\n" back,
+ // 0 on success, 1 when the file is not stored here and -1 on failure.
+ void handle_handoff(int control_sock, int client_fd, Command *cmd) {
+     char *home_dir = getenv("HOME");
+     char path[512];
+     struct stat st;
+     int status = -1;
+     char *command = cmd->name;
+     char *arg1 = cmd->args[0];
+     char *arg2 = cmd->args[1];
+     if (!home_dir)
+         home_dir = ".";
+     if (command && arg1 && arg2 && strcmp(command, "uploadf") == 0) {  // uploadf <filename> <destination_path>
+         if (cmd_file_type(arg1) >= FILE_PDF && create_directories(arg2) == 0 &&
+             snprintf(path, sizeof(path), "%s/%s/%s", home_dir, arg2, arg1) < (int)sizeof(path)) {
+             send(client_fd, "READY\n", 6, 0);  // The client streams the file straight to us
+             status = receive_file(client_fd, path);
+         }
+     }
+     else if (command && arg1 && strcmp(command, "downlf") == 0) {  // downlf <storage_path> [<validator>]
+         if (snprintf(path, sizeof(path), "%s/%s", home_dir, arg1) >= (int)sizeof(path) ||
+             arg1[0] == '/' || strstr(arg1, "..") || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+             status = 1;
+         else
+             status = arg2 ? send_stored_file(client_fd, path, arg2, 1) : send_file(client_fd, path);  // Same format the client gets from S1
+     }
+     close(client_fd);                            // Hand the client connection back to S1
+     char reply[32];
+     snprintf(reply, sizeof(reply), "DONE %d\n", status);
+     send(control_sock, reply, strlen(reply), 0);
+ }
+ 
  // error_exit - Prints an error message and exits the program.
  void error_exit(const char *msg) {            // Function to print an error message and exit
      perror(msg);                             // Print the error message along with system error details
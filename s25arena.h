@@ -0,0 +1,160 @@
+// s25arena.h - Bump allocator for the memory of one request.
+//
+// Serving a request takes many short-lived allocations (file names of a listing, the entry list of a
+// batch command, reply lines, a small upload's data) that all die once the request is answered. An
+// Arena hands them out of large chunks by moving an offset, and arena_reset() releases them together
+// instead of one free() each. The first chunk survives a reset, so a connection serving ordinary
+// requests settles on ARENA_CHUNK bytes and stops calling malloc(); the extra chunks a large request
+// needed are returned when it ends.
+#ifndef S25ARENA_H
+#define S25ARENA_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK (64 * 1024)                  // Chunk size, and what a connection keeps between requests
+#define ARENA_ALIGN 8                            // Requests store pointers and strings only
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;                     // Chunk filled before this one
+    size_t size, used;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;                            // Chunk being filled, NULL before the first allocation
+    char *last;                                  // Latest allocation, which arena_grow() extends in place
+} Arena;
+
+// Growing array of strings kept in an arena
+typedef struct {
+    Arena *arena;
+    char **items;
+    int count, capacity;
+} StrList;
+
+// arena_init - Prepares an empty arena; no memory is taken until the first allocation.
+static inline void arena_init(Arena *a) {
+    a->head = NULL;
+    a->last = NULL;
+}
+
+// arena_alloc - Returns size bytes valid until the next arena_reset(), or NULL when out of memory.
+static inline void *arena_alloc(Arena *a, size_t size) {
+    ArenaChunk *c = a->head;
+    size_t off = c ? (c->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : 0;
+    if (!c || off + size > c->size) {
+        size_t chunk = size > ARENA_CHUNK ? size : ARENA_CHUNK;  // Oversized requests get a chunk of their own
+        c = malloc(sizeof(ArenaChunk) + chunk);
+        if (!c)
+            return NULL;
+        c->size = chunk;
+        c->used = 0;
+        c->next = a->head;
+        a->head = c;
+        off = 0;
+    }
+    c->used = off + size;
+    a->last = c->data + off;
+    return a->last;
+}
+
+// arena_grow - Resizes the old_size-byte block p (NULL for a new one) to size bytes. The latest
+// allocation grows in place while its chunk has room; otherwise the contents move to a new block.
+static inline void *arena_grow(Arena *a, void *p, size_t old_size, size_t size) {
+    ArenaChunk *c = a->head;
+    if (p && p == a->last && (size_t)(a->last - c->data) + size <= c->size) {
+        c->used = (size_t)(a->last - c->data) + size;
+        return p;
+    }
+    void *grown = arena_alloc(a, size);
+    if (grown && p)
+        memcpy(grown, p, old_size < size ? old_size : size);
+    return grown;
+}
+
+// arena_strdup - Copies s into the arena.
+static inline char *arena_strdup(Arena *a, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = arena_alloc(a, len);
+    if (copy)
+        memcpy(copy, s, len);
+    return copy;
+}
+
+// arena_printf - Formats into a string allocated to fit from the arena.
+static inline char *arena_printf(Arena *a, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    char *s = len >= 0 ? arena_alloc(a, len + 1) : NULL;
+    if (s) {
+        va_start(ap, fmt);
+        vsnprintf(s, len + 1, fmt, ap);
+        va_end(ap);
+    }
+    return s;
+}
+
+// arena_reset - Releases everything allocated since the last reset, keeping the first chunk.
+static inline void arena_reset(Arena *a) {
+    ArenaChunk *keep = NULL;
+    while (a->head) {
+        ArenaChunk *c = a->head;
+        a->head = c->next;
+        if (!a->head && c->size == ARENA_CHUNK)
+            keep = c;                            // The oldest ordinary chunk serves the next request
+        else
+            free(c);
+    }
+    if (keep) {
+        keep->used = 0;
+        keep->next = NULL;
+    }
+    a->head = keep;
+    a->last = NULL;
+}
+
+// arena_free - Returns all of the arena's memory.
+static inline void arena_free(Arena *a) {
+    while (a->head) {
+        ArenaChunk *c = a->head;
+        a->head = c->next;
+        free(c);
+    }
+    a->last = NULL;
+}
+
+// strlist_init - Prepares an empty list whose array and strings come from a.
+static inline void strlist_init(StrList *l, Arena *a) {
+    l->arena = a;
+    l->items = NULL;
+    l->count = l->capacity = 0;
+}
+
+// strlist_push - Appends s, which already lives in the arena (NULL counts as out of memory).
+// Returns 0 or -1.
+static inline int strlist_push(StrList *l, char *s) {
+    if (!s)
+        return -1;
+    if (l->count >= l->capacity) {
+        int capacity = l->capacity ? l->capacity * 2 : 64;
+        char **grown = arena_grow(l->arena, l->items, l->capacity * sizeof(char *), capacity * sizeof(char *));
+        if (!grown)
+            return -1;
+        l->items = grown;
+        l->capacity = capacity;
+    }
+    l->items[l->count++] = s;
+    return 0;
+}
+
+// strlist_add - Appends a copy of s. Returns 0 or -1.
+static inline int strlist_add(StrList *l, const char *s) {
+    return strlist_push(l, arena_strdup(l->arena, s));
+}
+
+#endif
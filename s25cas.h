@@ -0,0 +1,226 @@
+// s25cas.h - Content-addressed file store shared by the backends on one host.
+//
+// Every stored .pdf/.txt/.zip file is also linked under $HOME/CAS_DIR/<d0d1>/<sha256>, so files with
+// the same content share one inode: the path in a node tree is a hard link to the object and the
+// link count is the reference count. An object whose only remaining link is the CAS entry belongs to
+// no path any more and is removed by cas_sweep. Stored files are replaced with rename(), never
+// rewritten in place, because the inode may be shared by other paths.
+// The client uses the SHA-256 code to send a digest ahead of the payload.
+#ifndef S25CAS_H
+#define S25CAS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CAS_DIR ".s25cas"                        // Objects live in $HOME/.s25cas/<2 hex>/<64 hex>
+#define CAS_DIGEST_LEN 64                        // Hex characters of a SHA-256 digest
+
+// Running SHA-256 state
+typedef struct {
+    unsigned int h[8];
+    unsigned char block[64];
+    unsigned long long total;                    // Bytes hashed so far
+    unsigned int fill;                           // Bytes waiting in block
+} CasHash;
+
+static const unsigned int cas_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define CAS_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// cas_hash_block - Runs the SHA-256 compression function over one 64-byte block.
+static inline void cas_hash_block(CasHash *c, const unsigned char *p) {
+    unsigned int w[64], v[8];
+    for (int i = 0; i < 16; i++)
+        w[i] = (unsigned int)p[i * 4] << 24 | (unsigned int)p[i * 4 + 1] << 16 | (unsigned int)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    for (int i = 16; i < 64; i++) {
+        unsigned int s0 = CAS_ROR(w[i - 15], 7) ^ CAS_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        unsigned int s1 = CAS_ROR(w[i - 2], 17) ^ CAS_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, c->h, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        unsigned int t1 = v[7] + (CAS_ROR(v[4], 6) ^ CAS_ROR(v[4], 11) ^ CAS_ROR(v[4], 25)) +
+                          ((v[4] & v[5]) ^ (~v[4] & v[6])) + cas_k[i] + w[i];
+        unsigned int t2 = (CAS_ROR(v[0], 2) ^ CAS_ROR(v[0], 13) ^ CAS_ROR(v[0], 22)) +
+                          ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v + 1, v, 7 * sizeof(v[0]));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++)
+        c->h[i] += v[i];
+}
+
+// cas_hash_init - Starts a new SHA-256 computation.
+static inline void cas_hash_init(CasHash *c) {
+    static const unsigned int iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(c->h, iv, sizeof(iv));
+    c->total = 0;
+    c->fill = 0;
+}
+
+// cas_hash_update - Feeds len bytes into the digest.
+static inline void cas_hash_update(CasHash *c, const void *data, size_t len) {
+    const unsigned char *p = data;
+    c->total += len;
+    while (len > 0) {
+        size_t n = 64 - c->fill < len ? 64 - c->fill : len;
+        memcpy(c->block + c->fill, p, n);
+        c->fill += n;
+        p += n;
+        len -= n;
+        if (c->fill == 64) {
+            cas_hash_block(c, c->block);
+            c->fill = 0;
+        }
+    }
+}
+
+// cas_hash_digest - Finishes the digest and writes its 32 raw bytes.
+static inline void cas_hash_digest(CasHash *c, unsigned char *out) {
+    unsigned long long bits = c->total * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t pad_len = (c->fill < 56 ? 56 : 120) - c->fill;
+    for (int i = 0; i < 8; i++)
+        pad[pad_len + i] = (unsigned char)(bits >> (56 - 8 * i));
+    cas_hash_update(c, pad, pad_len + 8);
+    for (int i = 0; i < 32; i++)
+        out[i] = (unsigned char)(c->h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+// cas_hash_final - Finishes the digest and writes it as 64 lowercase hex characters plus NUL.
+static inline void cas_hash_final(CasHash *c, char *hex) {
+    unsigned char raw[32];
+    cas_hash_digest(c, raw);
+    for (int i = 0; i < 32; i++)
+        sprintf(hex + i * 2, "%02x", raw[i]);
+}
+
+// cas_hash_file - Computes the SHA-256 of a file. Returns 0 or -1.
+static inline int cas_hash_file(const char *path, char *hex) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+    CasHash c;
+    char buf[65536];
+    size_t n;
+    cas_hash_init(&c);
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        cas_hash_update(&c, buf, n);
+    int failed = ferror(fp);
+    fclose(fp);
+    if (failed)
+        return -1;
+    cas_hash_final(&c, hex);
+    return 0;
+}
+
+// cas_valid_digest - Tells whether hex is a well-formed digest (and so safe to use in a path).
+static inline int cas_valid_digest(const char *hex) {
+    if (!hex || strlen(hex) != CAS_DIGEST_LEN)
+        return 0;
+    for (const char *p = hex; *p; p++)
+        if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f')))
+            return 0;
+    return 1;
+}
+
+// cas_object_path - Builds the path of the object for hex; with mkdirs set the fan-out directory is created.
+static inline void cas_object_path(const char *home_dir, const char *hex, char *path, size_t len, int mkdirs) {
+    snprintf(path, len, "%s/%s", home_dir, CAS_DIR);
+    if (mkdirs)
+        mkdir(path, 0755);
+    snprintf(path, len, "%s/%s/%.2s", home_dir, CAS_DIR, hex);
+    if (mkdirs)
+        mkdir(path, 0755);
+    snprintf(path, len, "%s/%s/%.2s/%s", home_dir, CAS_DIR, hex, hex);
+}
+
+// cas_replace_with - Atomically points dst at the inode of obj (link to a temporary name, then rename).
+static inline int cas_replace_with(const char *obj, const char *dst) {
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.cas.%d", dst, (int)getpid());
+    unlink(tmp_path);
+    if (link(obj, tmp_path) != 0)
+        return -1;
+    if (rename(tmp_path, dst) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// cas_link - Stores the content with digest hex at dst without any data transfer.
+// Returns 0, or -1 when the object is not in the store (the caller needs the payload).
+static inline int cas_link(const char *home_dir, const char *hex, const char *dst) {
+    char obj[1024];
+    if (!cas_valid_digest(hex))
+        return -1;
+    cas_object_path(home_dir, hex, obj, sizeof(obj), 0);
+    return cas_replace_with(obj, dst);
+}
+
+// cas_ingest - Adds a freshly written file to the store: it becomes the object for its digest, or,
+// when that content is stored already, is replaced by a link to the existing object so the new
+// copy's blocks are freed. Returns 0, or -1 when the file stays a private copy.
+static inline int cas_ingest(const char *home_dir, const char *path) {
+    char hex[CAS_DIGEST_LEN + 1], obj[1024];
+    struct stat st_path, st_obj;
+    if (cas_hash_file(path, hex) != 0)
+        return -1;
+    cas_object_path(home_dir, hex, obj, sizeof(obj), 1);
+    if (link(path, obj) == 0)
+        return 0;                                // First copy of this content
+    if (errno != EEXIST || stat(path, &st_path) != 0 || stat(obj, &st_obj) != 0)
+        return -1;
+    if (st_path.st_ino == st_obj.st_ino && st_path.st_dev == st_obj.st_dev)
+        return 0;                                // Already the object
+    if (st_path.st_size != st_obj.st_size)
+        return -1;                               // Corrupted object: leave both alone
+    return cas_replace_with(obj, path);
+}
+
+// cas_sweep - Removes objects no path refers to any more (link count 1). Returns the number removed.
+static inline int cas_sweep(const char *home_dir) {
+    char root[512], sub[800], obj[1100];
+    struct dirent *d, *e;
+    struct stat st;
+    int removed = 0;
+    snprintf(root, sizeof(root), "%s/%s", home_dir, CAS_DIR);
+    DIR *top = opendir(root);
+    if (!top)
+        return 0;
+    while ((d = readdir(top)) != NULL) {
+        if (d->d_name[0] == '.')
+            continue;
+        snprintf(sub, sizeof(sub), "%s/%s", root, d->d_name);
+        DIR *fan = opendir(sub);
+        if (!fan)
+            continue;
+        while ((e = readdir(fan)) != NULL) {
+            snprintf(obj, sizeof(obj), "%s/%s", sub, e->d_name);
+            if (cas_valid_digest(e->d_name) && stat(obj, &st) == 0 && st.st_nlink == 1 && unlink(obj) == 0)
+                removed++;
+        }
+        closedir(fan);
+    }
+    closedir(top);
+    return removed;
+}
+
+#endif
@@ -1,361 +1,404 @@
 // Client program for distributed file system
 
-#include <stdio.h>              // Standard I/O functions
-#include <stdlib.h>             // Standard library functions
-#include <string.h>             // String handling functions
-#include <unistd.h>             // POSIX functions
-#include <sys/types.h>          // System data types
-#include <sys/socket.h>         // Socket functions
-#include <arpa/inet.h>          // Internet operations functions
-#include <netinet/in.h>         // Internet address structures
-#include <errno.h>              // Error handling functions
-
-#define SERVER_IP "127.0.0.1"   // S1 server IP address
-#define SERVER_PORT 4641        // S1 server port
-#define BUFFER_SIZE 1024        // Buffer size for network operations
+#define _GNU_SOURCE             // O_DIRECT and fallocate() of large downloads (s25file.h)
+#include <time.h>               // Timing of manifest runs
+#include "s25client.h"          // Sessions, requests and the asynchronous API
+
+#define MANIFEST_WINDOW 8       // Default number of requests in flight with --manifest
+#define MANIFEST_BATCH 64       // Manifest uploads/downloads sent as one batch command
+#define MANIFEST_BATCH_REMOVES 10000  // Manifest removals sent as one removem
+#define COMMAND_MAX (64 * 1024) // Longest command line; multi-file commands have no file limit
 
 // Function prototypes for client operations
 void print_menu();  // Display client command menu
 
-/* helper: get base filename from a path */
-static const char* base_of_path(const char *p) {
-    const char *s = strrchr(p, '/');
-    return s ? s + 1 : p;
-}
+// Helper function to run one command line on the session. Returns 0, -1 when a request failed, or 1 on exit.
+int run_command(Session *s, const char *input) {
+    char command[BUFFER_SIZE];
 
-// Helper function to receive a file from the server
-int receive_file_client(int sock, const char *filename) {
-    // Receive file size or error message
-    char header[BUFFER_SIZE] = {0};
-    int bytes_received = recv(sock, header, sizeof(header) - 1, 0);
-    if (bytes_received <= 0) {
-        printf("Error receiving file header.\n");
+    // Parse the command name from input
+    if (sscanf(input, "%s", command) != 1) {
+        printf("Invalid command format. Please try again.\n");
         return -1;
     }
 
-    // Check if server responded with error
-    if (strncmp(header, "ERR", 3) == 0) {
-        printf("ERROR: File not found.\n");
-        return -1;
+    // Handle exit command
+    if (strcmp(command, "exit") == 0) {
+        if (s->sock >= 0)
+            send(s->sock, "exit\n", 5, 0);  // Lets S1 end the child at once
+        printf("Exiting client.\n");
+        return 1;
     }
 
-    // Parse file size
-    long filesize = atol(header);
-    if (filesize <= 0) {
-        printf("ERROR: Invalid file size received.\n");
+    // Unknown commands never reach S1: its error reply would be read as the answer to the next request
+    if (strcmp(command, "uploadf") != 0 && strcmp(command, "downlf") != 0 && strcmp(command, "removef") != 0 &&
+        strcmp(command, "removedir") != 0 && strcmp(command, "copyf") != 0 && strcmp(command, "movef") != 0 &&
+        strcmp(command, "statf") != 0 && strcmp(command, "watchdir") != 0 &&
+        strcmp(command, "dispfnames") != 0 && strcmp(command, "downltar") != 0 && strcmp(command, "addnode") != 0) {
+        printf("Unknown command. Please try again.\n");
+        print_menu();
         return -1;
     }
-
-    // Create file and receive content
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
-        perror("Error opening file");
+    printf("Command sent to S1: %s\n", input);
+
+    /* For multi-file commands we will NOT send the whole input line;
+       one file goes as a per-file subcommand, several as one batch command. */
+    char *tmp = strdup(input);
+    char **args = malloc((strlen(input) / 2 + 1) * sizeof(char *));
+    char *list = malloc(strlen(input) + 2);
+    if (!tmp || !args || !list) {
+        free(tmp); free(args); free(list);
+        printf("ERROR: Out of memory.\n");
         return -1;
     }
 
-    long total_received = 0;
-    char buffer[BUFFER_SIZE];
-    while (total_received < filesize) {
-        int chunk = recv(sock, buffer, sizeof(buffer), 0);
-        if (chunk <= 0) break;
-        fwrite(buffer, 1, chunk, file);
-        total_received += chunk;
+    char *tok = strtok(tmp, " \t\r\n");
+    int n = 0;
+    while ((tok = strtok(NULL, " \t\r\n"))) args[n++] = tok;
+    int failed = 0;
+    int files = strcmp(command, "uploadf") == 0 ? n - 1 : n;  // uploadf: last token is destination
+    list[0] = '\0';
+    for (int i = 0; i < files; i++) {          // "\n"-separated entries of a batch command
+        strcat(list, args[i]);
+        strcat(list, "\n");
     }
 
-    fclose(file);
-
-    if (total_received == filesize) {
-        return 0; // Success
-    } else {
-        printf("ERROR: Incomplete file received.\n");
-        return -1; // Failure
+    // Handle uploadf — any number of files, last token is destination. A whole-file upload is
+    // replayed safely: a second copy of the same bytes replaces the first.
+    if (strcmp(command, "uploadf") == 0) {
+        /* Expected: uploadf f1 [f2 ...] S1/path */
+        if (n < 2) {
+            printf("ERROR: Invalid uploadf command format.\n");
+            failed = 1;
+        } else if (files == 1)
+            failed = session_request(s, upload_one, args[0], args[n-1], 1) != 0;
+        else
+            failed = session_request(s, upload_many, list, args[n-1], 1) != 0;
     }
-}
 
-// Main function entry point for the client
-int main() {
-    int sock;
-    struct sockaddr_in server_addr;
-    char input[BUFFER_SIZE];
-    char command[BUFFER_SIZE];
-    char filename[BUFFER_SIZE];
-    char dest_path[BUFFER_SIZE];
-    char filepath[BUFFER_SIZE];
-    char filetype[BUFFER_SIZE];
-    char directory[BUFFER_SIZE];
-
-    printf("Connecting to S1 at %s:%d...\n", SERVER_IP, SERVER_PORT);
+    // Handle downloading files (downlf) — any number of files
+    else if (strcmp(command, "downlf") == 0) {
+        /* Expected: downlf path1 [path2 ...] */
+        if (n < 1) {
+            printf("ERROR: Invalid downlf command format. Expected: downlf <filepath>\n");
+            failed = 1;
+        } else
+            failed = session_request(s, n == 1 ? download_one : download_many, n == 1 ? args[0] : list, NULL, 1) != 0;
+    }
 
-    // Create a socket for communication with S1
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Error creating socket");
-        return EXIT_FAILURE;
+    // Handle deleting files (removef) — any number of files. Not replayed: a removal that went
+    // through before the drop would be reported as a missing file.
+    else if (strcmp(command, "removef") == 0) {
+        /* Expected: removef path1 [path2 ...] */
+        if (n < 1) {
+            printf("ERROR: Invalid removef command format. Expected: removef <filepath>\n");
+            failed = 1;
+        } else
+            failed = session_request(s, n == 1 ? remove_one : remove_many, n == 1 ? args[0] : list, NULL, 0) != 0;
     }
 
-    // Configure server address struct for S1 connection
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
+    // Handle querying file metadata (statf) — any number of files in one request
+    else if (strcmp(command, "statf") == 0) {
+        /* Expected: statf path1 [path2 ...] */
+        if (n < 1) {
+            printf("ERROR: Invalid statf command format. Expected: statf <filepath>\n");
+            failed = 1;
+        } else
+            failed = session_request(s, stat_many, list, NULL, 1) != 0;
+    }
 
-    // Convert and set server IP address
-    if (inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr) <= 0) {
-        perror("Invalid server address");
-        close(sock);
-        return EXIT_FAILURE;
+    // Handle deleting a directory tree (removedir). Not replayed, like removef.
+    else if (strcmp(command, "removedir") == 0) {
+        /* Expected: removedir S1/directory */
+        if (n != 1) {
+            printf("ERROR: Invalid removedir command format. Expected: removedir <directory>\n");
+            failed = 1;
+        } else
+            failed = session_request(s, remove_dir, args[0], NULL, 0) != 0;
     }
 
-    // Connect to the server (S1)
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection to S1 failed");
-        close(sock);
-        return EXIT_FAILURE;
+    // Handle watching a directory for changes (watchdir). Replayed from the last event received.
+    else if (strcmp(command, "watchdir") == 0) {
+        /* Expected: watchdir S1/directory [last_event] */
+        if (n < 1 || n > 2) {
+            printf("ERROR: Invalid watchdir command format. Expected: watchdir <directory> [<event>]\n");
+            failed = 1;
+        } else
+            failed = session_request(s, watch_dir, args[0], n == 2 ? args[1] : NULL, 1) != 0;
     }
 
-    printf("Connected to S1.\n");
+    // Handle listing file names (dispfnames) and downltar, which only read, copying a file on the
+    // servers (copyf), which is repeated safely, and adding a backend node (addnode) or moving a
+    // file (movef), which are not replayed
+    else
+        failed = session_request(s, simple_command, input, NULL,
+                                 strcmp(command, "addnode") != 0 && strcmp(command, "movef") != 0) != 0;
+
+    free(list);
+    free(args);
+    free(tmp);
+    return failed ? -1 : 0;
+}
 
-    print_menu();  // Display available commands to the user
+// Progress of a --manifest run
+static int manifest_ok, manifest_failed;
+
+// One submitted manifest operation: a description for failure messages and the entries it covers
+typedef struct {
+    char *desc;
+    int entries;
+} ManifestOp;
+
+// Helper function to record one completed manifest operation. Status is 0, -1 (nothing done) or, for a
+// batch, the number of failed entries, which the worker has already printed.
+void manifest_done(int id, int status, void *user) {
+    ManifestOp *mo = user;
+    (void)id;
+    if (status == 0)
+        manifest_ok += mo->entries;
+    else if (status > 0) {
+        manifest_ok += mo->entries - status;
+        manifest_failed += status;
+    } else {
+        manifest_failed += mo->entries;
+        printf("FAILED: %s\n", mo->desc);
+    }
+    free(mo->desc);
+    free(mo);
+}
 
-    while (1) {
-        printf("Enter command —> ");
+// Entries of the same kind (and destination) waiting to be sent as one batch command
+typedef struct {
+    int kind;                   // S25_UPLOAD, S25_DOWNLOAD or S25_REMOVE; 0 when empty
+    char dest[BUFFER_SIZE];
+    char *list;                 // "\n"-separated entries
+    size_t len, cap;
+    int entries;
+    char first[BUFFER_SIZE];    // Single entries are sent as a plain request
+} ManifestBatch;
+
+// Helper function to submit one operation with its description; counts it as failed when out of memory
+static void manifest_submit(S25Client *c, int kind, const char *arg, const char *list, const char *dest,
+                            int entries, const char *desc) {
+    ManifestOp *mo = malloc(sizeof(*mo));
+    if (mo)
+        mo->desc = strdup(desc);
+    if (!mo || !mo->desc || s25_submit_list(c, kind, arg, list, dest, manifest_done, mo) < 0) {
+        if (mo)
+            free(mo->desc);
+        free(mo);
+        printf("FAILED: %s (out of memory)\n", desc);
+        manifest_failed += entries;
+        return;
+    }
+    mo->entries = entries;
+    s25_poll(c, 0);             // Keep the window full while reading
+}
 
-        // Read user input command
-        if (!fgets(input, sizeof(input), stdin)) {
-            printf("Error reading input.\n");
-            continue;            // Continue to next command
-        }
+// Helper function to send the pending batch: one entry as uploadf/downlf/removef, more as one
+// uploadm/downlm/removem request
+static void manifest_flush(S25Client *c, ManifestBatch *b) {
+    static const char *names[] = { "", "uploadf", "downlf", "removef" };
+    char desc[BUFFER_SIZE * 2 + 64];
+    if (b->entries == 1) {
+        if (b->kind == S25_UPLOAD)
+            snprintf(desc, sizeof(desc), "uploadf %s %s", b->first, b->dest);
+        else
+            snprintf(desc, sizeof(desc), "%s %s", names[b->kind], b->first);
+        manifest_submit(c, b->kind, b->first, NULL, b->kind == S25_UPLOAD ? b->dest : NULL, 1, desc);
+    } else if (b->entries > 1) {
+        snprintf(desc, sizeof(desc), "%s of %d files starting with %s", names[b->kind], b->entries, b->first);
+        int kind = b->kind == S25_UPLOAD ? S25_UPLOAD_MANY : b->kind == S25_DOWNLOAD ? S25_DOWNLOAD_MANY : S25_REMOVE_MANY;
+        manifest_submit(c, kind, "", b->list, b->kind == S25_UPLOAD ? b->dest : NULL, b->entries, desc);
+    }
+    b->kind = 0;
+    b->len = 0;
+    b->entries = 0;
+}
 
-        // Parse the command name from input
-        if (sscanf(input, "%s", command) != 1) {
-            printf("Invalid command format. Please try again.\n");
-            continue;            // Continue to next command
+// Helper function to add one file to the pending batch, sending the batch first when the kind or
+// destination changes and afterwards when it is full
+static void manifest_add(S25Client *c, ManifestBatch *b, int kind, const char *file, const char *dest) {
+    int limit = kind == S25_REMOVE ? MANIFEST_BATCH_REMOVES : MANIFEST_BATCH;
+    size_t need = strlen(file) + 1;
+    if (b->entries > 0 && (b->kind != kind || (kind == S25_UPLOAD && strcmp(b->dest, dest) != 0)))
+        manifest_flush(c, b);
+    if (b->len + need + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 65536;
+        while (cap < b->len + need + 1)
+            cap *= 2;
+        char *l = realloc(b->list, cap);
+        if (!l) {
+            printf("FAILED: %s (out of memory)\n", file);
+            manifest_failed++;
+            return;
         }
+        b->list = l;
+        b->cap = cap;
+    }
+    if (b->entries == 0) {
+        b->kind = kind;
+        snprintf(b->dest, sizeof(b->dest), "%s", dest ? dest : "");
+        snprintf(b->first, sizeof(b->first), "%s", file);
+    }
+    memcpy(b->list + b->len, file, need - 1);
+    b->len += need;
+    b->list[b->len - 1] = '\n';
+    b->list[b->len] = '\0';
+    if (++b->entries >= limit)
+        manifest_flush(c, b);
+}
 
-        /* For multi-arg commands we will NOT send the whole input line.
-           We'll print the same "Command sent..." line for consistency,
-           then send per-file subcommands below. */
-        int is_multi = (strcmp(command, "uploadf")==0) || (strcmp(command, "downlf")==0) || (strcmp(command, "removef")==0);
-        if (!is_multi) {
-            if (send(sock, input, strlen(input), 0) < 0) {
-                perror("Error sending command");
-                close(sock);
-                continue;
-            }
-        }
-        printf("Command sent to S1: %s\n", input);
-
-        // Handle uploadf — up to 3 files, last token is destination
-        if (strcmp(command, "uploadf") == 0) {
-            /* Expected: uploadf f1 [f2] [f3] S1/path */
-            char tmp[BUFFER_SIZE];
-            strncpy(tmp, input, sizeof(tmp));
-            tmp[sizeof(tmp)-1] = 0;
-
-            char *tok = strtok(tmp, " \t\r\n");
-            char *args[16]; int n=0;
-            while ((tok = strtok(NULL, " \t\r\n")) && n < 16) args[n++] = tok;
-
-            if (n < 2) {
-                printf("ERROR: Invalid uploadf command format.\n");
-                close(sock);
-                continue;
-            }
-            if (n > 4) {
-                /* ignore extras beyond 3 files */
-                n = 4;
-            }
-            const char *dest = args[n-1];
-            int files_cnt = n - 1; /* up to 3 */
-
-            for (int i = 0; i < files_cnt; i++) {
-                const char *onefile = args[i];
-
-                // Send per-file command to S1
-                char percmd[BUFFER_SIZE];
-                snprintf(percmd, sizeof(percmd), "uploadf %s %s", onefile, dest);
-                if (send(sock, percmd, strlen(percmd), 0) < 0) {
-                    perror("Error sending command");
-                    break;
-                }
-
-                // Receive server response (READY or error)
-                char response[BUFFER_SIZE] = {0};
-                int bytes = recv(sock, response, sizeof(response) - 1, 0);
-                if (bytes <= 0) {
-                    printf("No response from S1.\n");
-                    break;
-                }
-                printf("Received from S1: %s\n", response);
-
-                // If server is ready, send the file
-                if (strncmp(response, "READY", 5) == 0) {
-                    FILE *fp = fopen(onefile, "rb");
-                    if (!fp) { perror("File open failed"); break; }
-
-                    fseek(fp, 0, SEEK_END);
-                    long file_size = ftell(fp);
-                    fseek(fp, 0, SEEK_SET);
-
-                    // Send file size as a string (unchanged protocol)
-                    char size_str[64];
-                    snprintf(size_str, sizeof(size_str), "%ld", file_size);
-                    if (send(sock, size_str, strlen(size_str), 0) < 0) {
-                        perror("Error sending file size");
-                        fclose(fp);
-                        break;
-                    }
-
-                    // Send file data
-                    char file_buffer[BUFFER_SIZE];
-                    int read_bytes;
-                    long total_sent = 0;
-
-                    while ((read_bytes = (int)fread(file_buffer, 1, sizeof(file_buffer), fp)) > 0) {
-                        int sent = (int)send(sock, file_buffer, (size_t)read_bytes, 0);
-                        if (sent < 0) {
-                            perror("Error sending file data");
-                            break;
-                        }
-                        total_sent += sent;
-                    }
-                    fclose(fp);
-
-                    printf("File upload completed.\n");
-                } else {
-                    printf("Upload aborted. Try Again!\n");
-                    continue;
-                }
-
-                // Read final server confirmation message
-                char finalmsg[BUFFER_SIZE] = {0};
-                int fb = recv(sock, finalmsg, sizeof(finalmsg)-1, 0);
-                if (fb > 0) printf("%s\n", finalmsg);
-                else printf("No final response from S1.\n");
-            }
+// Helper function to run a manifest: uploadf/downlf/removef lines with one or several files and other
+// commands as typed, submitted to the asynchronous API with up to window requests in flight. Consecutive
+// files of the same kind (and destination) go as one batch request. Work starts while the list is still
+// being read. Returns the exit status.
+int run_manifest(const char *path, int window) {
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char line[COMMAND_MAX], command[COMMAND_MAX], tmp_arg[BUFFER_SIZE];
+    struct timespec t0, t1;
+    S25Client client;
+    ManifestBatch batch = { 0 };
+
+    if (!in) {
+        perror("Error opening manifest");
+        return EXIT_FAILURE;
+    }
+    s25_open(&client, window, S25_QUIET);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "%s", command) != 1 || command[0] == '#')
+            continue;            // Blank lines and comments
+
+        int kind = strcmp(command, "uploadf") == 0 ? S25_UPLOAD : strcmp(command, "downlf") == 0 ? S25_DOWNLOAD :
+                   strcmp(command, "removef") == 0 ? S25_REMOVE : S25_COMMAND;
+        if (kind == S25_COMMAND && strcmp(command, "removedir") == 0 && sscanf(line, "%*s %1023s", tmp_arg) == 1)
+            kind = S25_REMOVE_DIR;           // Streams progress lines: not a one-reply command
+        if (kind == S25_COMMAND || kind == S25_REMOVE_DIR) {
+            manifest_flush(&client, &batch);     // Keep the order of the manifest around other commands
+            manifest_submit(&client, kind, kind == S25_COMMAND ? line : tmp_arg, NULL, NULL, 1, line);
+            continue;
         }
 
-        // Handle downloading files (downlf) — up to 2 files
-        else if (strncmp(command, "downlf", 6) == 0) {
-            /* Expected: downlf path1 [path2] */
-            char tmp[BUFFER_SIZE];
-            strncpy(tmp, input, sizeof(tmp));
-            tmp[sizeof(tmp)-1] = 0;
-
-            char *tok = strtok(tmp, " \t\r\n");
-            char *paths[4]; int np = 0;
-            while ((tok = strtok(NULL, " \t\r\n")) && np < 4) paths[np++] = tok;
-
-            if (np < 1) {
-                printf("ERROR: Invalid downlf command format. Expected: downlf <filepath>\n");
-                close(sock);
-                continue;
-            }
-            if (np > 2) np = 2;  // accept at most 2
-
-            for (int i = 0; i < np; i++) {
-                const char *filepath_arg = paths[i];
-
-                char *ext = strrchr(filepath_arg, '.');
-                if (!ext) { printf("ERROR: File has no extension.\n"); continue; }
-
-                if (strncmp(filepath_arg, "S1/", 3) != 0) { printf("ERROR: Path must start with 'S1/'.\n"); continue; }
-
-                if (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 &&
-                    strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0) {
-                    printf("ERROR: Unsupported file extension for download.\n");
-                    continue;
-                }
-
-                // Send per-file downlf request
-                char percmd[BUFFER_SIZE];
-                snprintf(percmd, sizeof(percmd), "downlf %s", filepath_arg);
-                if (send(sock, percmd, strlen(percmd), 0) < 0) {
-                    perror("send downlf");
-                    break;
-                }
-
-                const char *base = base_of_path(filepath_arg);
-                printf("Receiving file and saving as %s...\n", base);
-
-                if (receive_file_client(sock, base) == 0)
-                    printf("File downloaded successfully as %s\n", base);
-                else
-                    printf("ERROR: File not found.\n");
-            }
-            close(sock);
+        char tmp[COMMAND_MAX];
+        snprintf(tmp, sizeof(tmp), "%s", line);
+        char *args[COMMAND_MAX / 2]; int n = 0;
+        char *tok = strtok(tmp, " \t");
+        while ((tok = strtok(NULL, " \t"))) args[n++] = tok;
+
+        int files = kind == S25_UPLOAD ? n - 1 : n;
+        if (files < 1) {
+            printf("FAILED: %s (invalid format)\n", line);
+            manifest_failed++;
             continue;
         }
+        for (int i = 0; i < files; i++)
+            manifest_add(&client, &batch, kind, args[i], kind == S25_UPLOAD ? args[n-1] : NULL);
+    }
+    if (in != stdin)
+        fclose(in);
+    manifest_flush(&client, &batch);
+    free(batch.list);
+    s25_wait(&client);
+    s25_close(&client);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("Manifest done: %d succeeded, %d failed in %.2f s (%.0f files/s, %d in flight).\n",
+           manifest_ok, manifest_failed, secs, secs > 0 ? (manifest_ok + manifest_failed) / secs : 0.0, client.window);
+    return manifest_failed > 0 ? EXIT_FAILURE : 0;
+}
 
-        // Handle deleting files (removef) — up to 2 files
-        else if (strcmp(command, "removef") == 0) {
-            /* Expected: removef path1 [path2] */
-            char tmp[BUFFER_SIZE];
-            strncpy(tmp, input, sizeof(tmp));
-            tmp[sizeof(tmp)-1] = 0;
-
-            char *tok = strtok(tmp, " \t\r\n");
-            char *paths[4]; int np=0;
-            while ((tok = strtok(NULL, " \t\r\n")) && np < 4) paths[np++] = tok;
-
-            if (np < 1) {
-                printf("ERROR: Invalid removef command format. Expected: removef <filepath>\n");
-                close(sock);
-                continue;
-            }
-            if (np > 2) np = 2; // at most 2
-
-            for (int i=0;i<np;i++) {
-                char percmd[BUFFER_SIZE];
-                snprintf(percmd, sizeof(percmd), "removef %s", paths[i]);
-                if (send(sock, percmd, strlen(percmd), 0) < 0) {
-                    perror("send removef");
-                    break;
-                }
-                char response[4096] = {0};
-                int bytes = recv(sock, response, sizeof(response)-1, 0);
-                if (bytes > 0) printf("%s\n", response); else printf("No response received from S1.\n");
-            }
+// Main function entry point for the client: interactive, or with --batch <file> (- for stdin)
+// running one command per line over the same session and exiting non-zero if any of them failed,
+// or with --manifest <file> [window] for bulk transfers over parallel sessions
+int main(int argc, char *argv[]) {
+    Session session = { -1 };
+    char input[COMMAND_MAX];
+    FILE *in = stdin;
+    int batch = 0, failures = 0;
+
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "--manifest") == 0)
+        return run_manifest(argv[2], argc == 4 ? atoi(argv[3]) : MANIFEST_WINDOW);
+    if (argc == 3 && strcmp(argv[1], "--batch") == 0) {
+        batch = 1;
+        if (strcmp(argv[2], "-") != 0 && !(in = fopen(argv[2], "r"))) {
+            perror("Error opening batch file");
+            return EXIT_FAILURE;
         }
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [--batch <file>|- | --manifest <file>|- [window]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
 
-        // Handle listing file names in a directory (dispfnames)
-        else if (strcmp(command, "dispfnames") == 0) {
-            char response[4096] = {0};
-            int bytes = recv(sock, response, sizeof(response)-1, 0);
-            if (bytes > 0) { printf("%s\n", response); } else { printf("No response received from S1.\n"); }
-        }
+    // A send() on a connection S1 has closed must fail with EPIPE, not kill the client
+    signal(SIGPIPE, SIG_IGN);
 
-        // Handle downltar and other commands exactly as before
-        else if (strcmp(command, "downltar") == 0) { // If command is "downltar"
-            char response[4096] = {0};
-            int bytes = recv(sock, response, sizeof(response)-1, 0);
-            if (bytes > 0) { printf("%s\n", response); } else { printf("No response received from S1.\n"); }
-        }
+    printf("Connecting to S1 at %s:%d...\n", SERVER_IP, SERVER_PORT);
+
+    // Connect to the server (S1)
+    if (session_connect(&session) < 0) {
+        perror("Connection to S1 failed");
+        return EXIT_FAILURE;
+    }
+
+    printf("Connected to S1.\n");
+
+    if (!batch)
+        print_menu();  // Display available commands to the user
 
-        // Handle exit command
-        else if (strcmp(command, "exit") == 0) {
-            printf("Exiting client.\n");
-            break; // Exit the loop and close client
+    while (1) {
+        if (!batch)
+            printf("Enter command —> ");
+
+        // Read the next command; end of input ends the session like exit
+        if (!fgets(input, sizeof(input), in)) {
+            if (!batch)
+                printf("\n");
+            break;
         }
+        input[strcspn(input, "\r\n")] = '\0';
 
-        // Handle unknown commands
-        else {
-            printf("Unknown command. Please try again.\n");
-            print_menu();
+        if (batch) {
+            if (input[strspn(input, " \t")] == '\0' || input[strspn(input, " \t")] == '#')
+                continue;        // Blank lines and comments
+            printf("> %s\n", input);
         }
+
+        int ret = run_command(&session, input);
+        if (ret == 1)
+            break;               // Exit the loop and close client
+        if (ret != 0)
+            failures++;
     }
 
+    if (in != stdin)
+        fclose(in);
+
     // Close the socket after finishing communication
-    close(sock);
+    if (session.sock >= 0)
+        close(session.sock);
+    if (batch && failures > 0) {
+        printf("%d command(s) failed.\n", failures);
+        return EXIT_FAILURE;
+    }
     return 0; // Return success code
 }
 
 // Function to display the client menu options
 void print_menu() {
     printf("Select an option:\n");
-    printf("i. To upload files use uploadf <filename> <destination_path>\n");
-    printf("ii. To download files use downlf <filepath>\n");
-    printf("iii. To remove the files use removef <filepath>\n");
-    printf("iv. To download tar use downltar <filetype>\n");
-    printf("v. to list files use dispfnames <directory>\n");
+    printf("i. To upload files use uploadf <filename> [<filename> ...] <destination_path>\n");
+    printf("ii. To download files use downlf <filepath> [<filepath> ...]\n");
+    printf("iii. To remove the files use removef <filepath> [<filepath> ...]\n");
+    printf("iv. To remove a directory tree use removedir <directory>\n");
+    printf("v. To show size, mtime, SHA-256 and node of files use statf <filepath> [<filepath> ...]\n");
+    printf("vi. To copy or move a file on the servers use copyf|movef <filepath> <destination>\n");
+    printf("vii. To follow changes below a directory use watchdir <directory> [<event>]\n");
+    printf("viii. To download tar use downltar <filetype>\n");
+    printf("ix. to list files use dispfnames <directory>\n");
+    printf("x. to add a storage node use addnode <id> <ip> <port>\n");
     printf("Type 'exit' to quit the client.\n");
     printf("*********************************************\n");
 }
@@ -0,0 +1,1173 @@
+// s25client.h - Client library for the distributed file system.
+//
+// Synchronous layer: a Session is one long-lived connection to S1 with TCP keep-alive; session_request()
+// runs one request on it, reconnecting after a drop and repeating the request when that is safe.
+// The per-file requests (upload_one, download_one, remove_one, simple_command) speak the S1 protocol,
+// including content digests, delta uploads and the validated download cache in $HOME/CACHE_DIR;
+// upload_many, download_many and remove_many move any number of files in one round trip,
+// stat_many fetches their size, mtime, SHA-256 and node, and watch_dir follows a directory's changes.
+// Included by s25client.c; programs that upload or fetch many files use the asynchronous API at the end.
+#ifndef S25CLIENT_H
+#define S25CLIENT_H
+
+#include <stdio.h>              // Standard I/O functions
+#include <stdlib.h>             // Standard library functions
+#include <string.h>             // String handling functions
+#include <unistd.h>             // POSIX functions
+#include <sys/types.h>          // System data types
+#include <sys/socket.h>         // Socket functions
+#include <arpa/inet.h>          // Internet operations functions
+#include <netinet/in.h>         // Internet address structures
+#include <errno.h>              // Error handling functions
+#include <fcntl.h>              // open() for mapping files to upload
+#include <sys/mman.h>           // mmap() of files sent as a delta
+#include <sys/stat.h>           // Validators of cached downloads
+#include <netinet/tcp.h>        // Keep-alive timing of the session connection
+#include <poll.h>               // Checking an idle session for a closed connection
+#include <signal.h>             // Ignoring SIGPIPE on a dropped connection
+#include <sys/wait.h>           // Reaping worker processes of the asynchronous API
+#include <sys/sendfile.h>       // Streaming batch uploads
+#include "s25cas.h"             // SHA-256 digests for uploads the servers may already store
+#include "s25delta.h"           // Delta uploads of modified files
+#include "s25file.h"            // Size headers and large payloads
+
+#define SERVER_IP "127.0.0.1"   // S1 server IP address
+#define SERVER_PORT 4641        // S1 server port
+#define BUFFER_SIZE 1024        // Buffer size for network operations
+#define CACHE_DIR ".s25client"  // Download cache under $HOME: <sha256 of server path>.meta/.data
+#define KEEPALIVE_IDLE 60       // Seconds of silence before keep-alive probes start
+#define KEEPALIVE_INTERVAL 10   // Seconds between probes
+#define KEEPALIVE_PROBES 3      // Unanswered probes before the connection counts as dead
+#define RECONNECT_ATTEMPTS 4    // Connection attempts after a drop, 1, 2 and 4 s apart
+#define REPLAY_ATTEMPTS 2       // Times an idempotent request is sent before giving up
+#define SESSION_LOST -2         // Request result: the connection dropped, the outcome is unknown
+
+// Cached download of one server path
+typedef struct {
+    char etag[128];             // Server validator, sent back with the next downlf
+    long size;                  // Size and mtime of the copy last written to the working directory
+    long mtime_sec, mtime_nsec;
+    char sha256[CAS_DIGEST_LEN + 1];  // Checksum of the cached data
+} CacheMeta;
+
+// Long-lived connection to S1 shared by all commands of a client run
+typedef struct {
+    int sock;                   // -1 while disconnected
+} Session;
+
+// One request on the session's socket: returns 0, -1 (failed), or SESSION_LOST
+typedef int (*SessionOp)(int sock, const char *arg, const char *dest);
+
+/* helper: get base filename from a path */
+static inline const char* base_of_path(const char *p) {
+    const char *s = strrchr(p, '/');
+    return s ? s + 1 : p;
+}
+
+// Helper function to read one "\n"-terminated reply line without consuming anything after it
+static inline int recv_line(int sock, char *line, size_t len) {
+    size_t n = 0;
+    while (n < len - 1 && recv(sock, line + n, 1, 0) == 1 && line[n] != '\n')
+        n++;
+    line[n] = '\0';
+    return n > 0 ? 0 : -1;
+}
+
+// Helper function to receive a file from the server; SESSION_LOST when the connection drops
+static inline int receive_file_client(int sock, const char *filename) {
+    // Receive the "<size>\n" header or an error message
+    char header[BUFFER_SIZE];
+    if (recv_line(sock, header, sizeof(header)) != 0) {
+        printf("Error receiving file header.\n");
+        return SESSION_LOST;
+    }
+
+    // Check if server responded with error
+    if (strncmp(header, "ERR", 3) == 0) {
+        printf("ERROR: File not found.\n");
+        return -1;
+    }
+
+    // Parse file size
+    long long filesize;
+    if (file_parse_size(header, &filesize) != 0) {
+        printf("ERROR: Invalid file size received.\n");
+        return -1;
+    }
+
+    // Create the file and receive its content, preallocated and written past the page cache when large
+    if (file_recv_payload(sock, filesize, filename) != 0) {
+        printf("ERROR: Incomplete file received.\n");
+        return SESSION_LOST; // Connection dropped mid-file
+    }
+    return 0; // Success
+}
+
+// Helper function to build the cache file names of a server path
+static inline void cache_paths(const char *server_path, char *meta_path, char *data_path, size_t len) {
+    CasHash c;
+    char hex[CAS_DIGEST_LEN + 1];
+    char *home = getenv("HOME");
+    cas_hash_init(&c);
+    cas_hash_update(&c, server_path, strlen(server_path));
+    cas_hash_final(&c, hex);
+    snprintf(meta_path, len, "%s/%s", home ? home : ".", CACHE_DIR);
+    mkdir(meta_path, 0700);
+    snprintf(meta_path, len, "%s/%s/%s.meta", home ? home : ".", CACHE_DIR, hex);
+    snprintf(data_path, len, "%s/%s/%s.data", home ? home : ".", CACHE_DIR, hex);
+}
+
+// Helper function to load the cache entry of a server path; returns 0 when there is one
+static inline int cache_load(const char *server_path, CacheMeta *meta) {
+    char meta_path[BUFFER_SIZE], data_path[BUFFER_SIZE];
+    cache_paths(server_path, meta_path, data_path, sizeof(meta_path));
+    FILE *fp = fopen(meta_path, "r");
+    if (!fp)
+        return -1;
+    int n = fscanf(fp, "etag %127s size %ld mtime %ld.%ld sha256 %64s", meta->etag, &meta->size,
+                   &meta->mtime_sec, &meta->mtime_nsec, meta->sha256);
+    fclose(fp);
+    return n == 5 ? 0 : -1;
+}
+
+// Helper function to copy a file through a temporary name; returns 0 on success
+static inline int copy_file(const char *src, const char *dst) {
+    char tmp_path[BUFFER_SIZE + 16];
+    char buf[65536];
+    size_t n;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp%d", dst, (int)getpid());
+    FILE *in = fopen(src, "rb");
+    FILE *out = in ? fopen(tmp_path, "wb") : NULL;
+    int ok = in && out;
+    while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+        ok = fwrite(buf, 1, n, out) == n;
+    if (in)
+        fclose(in);
+    if (out && fclose(out) != 0)
+        ok = 0;
+    if (!ok || rename(tmp_path, dst) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Helper function to remember a downloaded file: keeps a copy and its validators
+static inline void cache_store(const char *server_path, const char *etag, const char *local_file) {
+    char meta_path[BUFFER_SIZE], data_path[BUFFER_SIZE];
+    CacheMeta meta;
+    struct stat st;
+    cache_paths(server_path, meta_path, data_path, sizeof(meta_path));
+    unlink(meta_path);          // Never leave a validator next to data it does not describe
+    if (copy_file(local_file, data_path) != 0 || cas_hash_file(data_path, meta.sha256) != 0 ||
+        stat(local_file, &st) != 0)
+        return;
+    FILE *fp = fopen(meta_path, "w");
+    if (!fp)
+        return;
+    fprintf(fp, "etag %s\nsize %ld\nmtime %ld.%ld\nsha256 %s\n", etag, (long)st.st_size,
+            (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, meta.sha256);
+    fclose(fp);
+}
+
+// Helper function to serve a "not modified" answer: the working copy is kept when it is unchanged
+// since the download, else restored from the cache. Returns 0, or -1 when the cache is damaged.
+static inline int cache_restore(const char *server_path, const CacheMeta *meta, const char *local_file) {
+    char meta_path[BUFFER_SIZE], data_path[BUFFER_SIZE], sha[CAS_DIGEST_LEN + 1];
+    struct stat st;
+    cache_paths(server_path, meta_path, data_path, sizeof(meta_path));
+    if (stat(local_file, &st) == 0 && st.st_size == meta->size &&
+        st.st_mtim.tv_sec == meta->mtime_sec && st.st_mtim.tv_nsec == meta->mtime_nsec)
+        return 0;
+    if (cas_hash_file(data_path, sha) != 0 || strcmp(sha, meta->sha256) != 0 ||
+        copy_file(data_path, local_file) != 0) {
+        unlink(meta_path);
+        return -1;
+    }
+    if (stat(local_file, &st) == 0) {  // Track the restored copy so the next hit skips the copy
+        FILE *fp = fopen(meta_path, "w");
+        if (fp) {
+            fprintf(fp, "etag %s\nsize %ld\nmtime %ld.%ld\nsha256 %s\n", meta->etag, (long)st.st_size,
+                    (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, meta->sha256);
+            fclose(fp);
+        }
+    }
+    return 0;
+}
+
+// Helper function to upload a file as a delta: reply holds the server's "SIGS <block_size> <count>\n"
+// header and possibly the first signature bytes; the remaining signatures are read from the socket.
+static inline int send_delta(int sock, const char *filename, const char *digest, const char *reply, int reply_len) {
+    int bs, count;
+    const char *eol = memchr(reply, '\n', reply_len);
+    if (!eol || sscanf(reply, "SIGS %d %d", &bs, &count) != 2 || bs <= 0 || count < 0)
+        return -1;
+    DeltaSig *sigs = malloc(count > 0 ? count * sizeof(DeltaSig) : 1);
+    long have = reply_len - (eol + 1 - reply);
+    long want = (long)count * sizeof(DeltaSig);
+    if (!sigs || have > want) {
+        free(sigs);
+        return -1;
+    }
+    memcpy(sigs, eol + 1, have);
+    if (delta_recv_all(sock, (char *)sigs + have, want - have) != 0) {
+        free(sigs);
+        return -1;
+    }
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    unsigned char *data = fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0 ?
+                          mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (fd >= 0)
+        close(fd);
+    int ret = -1;
+    if (data != MAP_FAILED) {
+        ret = delta_encode(sock, data, st.st_size, sigs, count, bs, digest);
+        munmap(data, st.st_size);
+    }
+    free(sigs);
+    return ret;
+}
+
+// Helper function to connect the session to S1 with TCP keep-alive, so a peer that vanished
+// without closing the connection (crash, network loss) is noticed even while the client is idle
+static inline int session_connect(Session *s) {
+    struct sockaddr_in server_addr;
+    int on = 1, idle = KEEPALIVE_IDLE, interval = KEEPALIVE_INTERVAL, probes = KEEPALIVE_PROBES;
+
+    s->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (s->sock < 0)
+        return -1;
+
+    // Configure server address struct for S1 connection
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(SERVER_PORT);
+    if (inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr) <= 0 ||
+        connect(s->sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        close(s->sock);
+        s->sock = -1;
+        return -1;
+    }
+
+    setsockopt(s->sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(s->sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(s->sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(s->sock, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    return 0;
+}
+
+// Helper function to check, without blocking, that S1 has not closed the connection since the last request
+static inline int session_alive(Session *s) {
+    struct pollfd p = { s->sock, POLLIN, 0 };
+    char c;
+    if (s->sock < 0)
+        return 0;
+    if (poll(&p, 1, 0) == 0)
+        return 1;                                // Nothing pending: still open
+    return recv(s->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0;  // EOF or error: gone
+}
+
+// Helper function to replace a lost connection, waiting 1, 2, 4... seconds between attempts
+static inline int session_reconnect(Session *s) {
+    if (s->sock >= 0)
+        close(s->sock);
+    s->sock = -1;
+    for (int attempt = 0; attempt < RECONNECT_ATTEMPTS; attempt++) {
+        if (attempt > 0)
+            sleep(1 << (attempt - 1));
+        if (session_connect(s) == 0) {
+            printf("Reconnected to S1.\n");
+            return 0;
+        }
+    }
+    printf("ERROR: Cannot reach S1 at %s:%d.\n", SERVER_IP, SERVER_PORT);
+    return -1;
+}
+
+// Helper function to run one request on the session. When the connection drops mid-request it is
+// re-established; the request is sent again only if repeating it cannot change the outcome.
+static inline int session_request(Session *s, SessionOp op, const char *arg, const char *dest, int idempotent) {
+    for (int attempt = 0; ; attempt++) {
+        if (!session_alive(s) && session_reconnect(s) != 0)
+            return -1;
+        int ret = op(s->sock, arg, dest);
+        if (ret != SESSION_LOST)
+            return ret;
+        printf("Connection to S1 lost.\n");
+        close(s->sock);
+        s->sock = -1;
+        if (!idempotent) {
+            printf("Request not repeated; check its result before retrying.\n");
+            return -1;
+        }
+        if (attempt + 1 >= REPLAY_ATTEMPTS)
+            return -1;
+        printf("Repeating request.\n");
+    }
+}
+
+// Helper function to upload one file to dest. Returns 0, -1, or SESSION_LOST.
+static inline int upload_one(int sock, const char *onefile, const char *dest) {
+    // Open the file first, so a missing file never leaves S1 waiting for data
+    FILE *fp = fopen(onefile, "rb");
+    if (!fp) {
+        perror("File open failed");
+        return -1;
+    }
+
+    // Send per-file command to S1, with the content digest so stored content is not sent again;
+    // edited source and text files may go as a delta against the stored version
+    char percmd[BUFFER_SIZE];
+    char digest[CAS_DIGEST_LEN + 1];
+    const char *fext = strrchr(onefile, '.');
+    // An empty file has nothing to delta-encode: it goes as a whole upload
+    int can_delta = fext && (strcmp(fext, ".c") == 0 || strcmp(fext, ".txt") == 0) && file_stream_size(fp) > 0;
+    if (cas_hash_file(onefile, digest) == 0)
+        snprintf(percmd, sizeof(percmd), "uploadf %s %s %s%s\n", onefile, dest, digest, can_delta ? " delta" : "");
+    else
+        snprintf(percmd, sizeof(percmd), "uploadf %s %s\n", onefile, dest);
+    if (send(sock, percmd, strlen(percmd), 0) < 0) {
+        fclose(fp);
+        return SESSION_LOST;
+    }
+
+    // Receive server response (READY or error)
+    char response[BUFFER_SIZE] = {0};
+    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    if (bytes <= 0) {
+        fclose(fp);
+        return SESSION_LOST;
+    }
+
+    if (strncmp(response, "SIGS ", 5) != 0)
+        printf("Received from S1: %s\n", response);
+
+    // Server holds a version: send only what changed
+    if (strncmp(response, "SIGS ", 5) == 0) {
+        fclose(fp);
+        if (send_delta(sock, onefile, digest, response, bytes) != 0) {
+            printf("Delta upload failed.\n");
+            return SESSION_LOST;                 // S1 is mid-stream: only a new connection resynchronizes
+        }
+        printf("Delta upload completed.\n");
+    }
+    // If server is ready, send the file
+    else if (strncmp(response, "READY", 5) == 0) {
+        long long file_size = file_stream_size(fp);
+
+        // Send the "<size>\n" header
+        if (file_size < 0 || file_send_size(sock, file_size) != 0) {
+            fclose(fp);
+            return SESSION_LOST;
+        }
+
+        // Send file data
+        char file_buffer[BUFFER_SIZE];
+        int read_bytes;
+        while ((read_bytes = (int)fread(file_buffer, 1, sizeof(file_buffer), fp)) > 0) {
+            if (send(sock, file_buffer, (size_t)read_bytes, 0) < 0) {
+                fclose(fp);
+                return SESSION_LOST;
+            }
+        }
+        file_send_done(fp, file_size);
+        fclose(fp);
+
+        printf("File upload completed.\n");
+    } else if (strncmp(response, "File created", 12) == 0) {
+        fclose(fp);
+        return 0;   // Server already had the content: nothing to send
+    } else {
+        fclose(fp);
+        printf("Upload aborted. Try Again!\n");
+        return -1;
+    }
+
+    // Read final server confirmation message
+    char finalmsg[BUFFER_SIZE] = {0};
+    int fb = recv(sock, finalmsg, sizeof(finalmsg)-1, 0);
+    if (fb <= 0)
+        return SESSION_LOST;
+    printf("%s\n", finalmsg);
+    return 0;
+}
+
+// Helper function to download one file into the working directory. Returns 0, -1, or SESSION_LOST.
+static inline int download_one(int sock, const char *filepath_arg, const char *unused) {
+    (void)unused;
+    char *ext = strrchr(filepath_arg, '.');
+    if (!ext) { printf("ERROR: File has no extension.\n"); return -1; }
+
+    if (strncmp(filepath_arg, "S1/", 3) != 0) { printf("ERROR: Path must start with 'S1/'.\n"); return -1; }
+
+    if (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 &&
+        strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0) {
+        printf("ERROR: Unsupported file extension for download.\n");
+        return -1;
+    }
+
+    // Send per-file downlf request, conditional on the cached copy if there is one
+    const char *base = base_of_path(filepath_arg);
+    CacheMeta meta;
+    int cached = cache_load(filepath_arg, &meta) == 0;
+    char percmd[BUFFER_SIZE], reply[BUFFER_SIZE];
+    snprintf(percmd, sizeof(percmd), "downlf %s %s\n", filepath_arg, cached ? meta.etag : "-");
+    if (send(sock, percmd, strlen(percmd), 0) < 0 || recv_line(sock, reply, sizeof(reply)) != 0)
+        return SESSION_LOST;
+    if (strcmp(reply, "NOTMODIFIED") == 0 && cache_restore(filepath_arg, &meta, base) == 0) {
+        printf("File %s is up to date (cached).\n", base);
+        return 0;
+    }
+    if (strcmp(reply, "NOTMODIFIED") == 0) {  // Cached copy is damaged: fetch it again
+        snprintf(percmd, sizeof(percmd), "downlf %s -\n", filepath_arg);
+        if (send(sock, percmd, strlen(percmd), 0) < 0 || recv_line(sock, reply, sizeof(reply)) != 0)
+            return SESSION_LOST;
+    }
+    if (strncmp(reply, "ETAG ", 5) != 0) {
+        printf("%s\n", reply);  // Request rejected by S1
+        return -1;
+    }
+
+    printf("Receiving file and saving as %s...\n", base);
+
+    int ret = receive_file_client(sock, base);
+    if (ret == 0) {
+        printf("File downloaded successfully as %s\n", base);
+        if (strcmp(reply + 5, "-") != 0)
+            cache_store(filepath_arg, reply + 5, base);
+    } else if (ret != SESSION_LOST)
+        printf("ERROR: File not found.\n");
+    return ret;
+}
+
+// Helper function to remove one file. Returns 0 or SESSION_LOST.
+static inline int remove_one(int sock, const char *path, const char *unused) {
+    (void)unused;
+    char percmd[BUFFER_SIZE + 16];
+    snprintf(percmd, sizeof(percmd), "removef %s\n", path);
+    if (send(sock, percmd, strlen(percmd), 0) < 0)
+        return SESSION_LOST;
+    char response[4096] = {0};
+    int bytes = recv(sock, response, sizeof(response)-1, 0);
+    if (bytes <= 0)
+        return SESSION_LOST;
+    printf("%s\n", response);
+    return 0;
+}
+
+// Helper function to send a single-reply command line as typed and print the reply. Returns 0 or SESSION_LOST.
+static inline int simple_command(int sock, const char *input, const char *unused) {
+    (void)unused;
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "%.*s\n", (int)strcspn(input, "\r\n"), input);  // S1 reads up to the '\n'
+    if (send(sock, line, strlen(line), 0) < 0)
+        return SESSION_LOST;
+    char response[4096] = {0};
+    int bytes = recv(sock, response, sizeof(response)-1, 0);
+    if (bytes <= 0)
+        return SESSION_LOST;
+    printf("%s\n", response);
+    return 0;
+}
+
+// Buffered reader for replies that mix lines and file data (batch commands)
+typedef struct {
+    int sock;
+    char buf[65536];
+    size_t pos, len;
+} BatchReader;
+
+// Helper function to read one "\n"-terminated line of a batch reply. Returns 0 or SESSION_LOST.
+static inline int batch_read_line(BatchReader *r, char *line, size_t len) {
+    size_t n = 0;
+    while (1) {
+        if (r->pos == r->len) {
+            ssize_t got = recv(r->sock, r->buf, sizeof(r->buf), 0);
+            if (got <= 0)
+                return SESSION_LOST;
+            r->pos = 0;
+            r->len = got;
+        }
+        char c = r->buf[r->pos++];
+        if (c == '\n')
+            break;
+        if (n < len - 1)
+            line[n++] = c;
+    }
+    line[n] = '\0';
+    return 0;
+}
+
+// Helper function to copy the next size bytes of a batch reply to fp (skipped when fp is NULL).
+// Returns 0, -1 when writing failed (the bytes are still consumed), or SESSION_LOST.
+static inline int batch_read_data(BatchReader *r, long long size, FILE *fp) {
+    int ret = 0;
+    while (size > 0) {
+        if (r->pos == r->len) {
+            ssize_t got = recv(r->sock, r->buf, sizeof(r->buf), 0);
+            if (got <= 0)
+                return SESSION_LOST;
+            r->pos = 0;
+            r->len = got;
+        }
+        size_t n = r->len - r->pos < (size_t)size ? r->len - r->pos : (size_t)size;
+        if (fp && fwrite(r->buf + r->pos, 1, n, fp) != n)
+            ret = -1;
+        r->pos += n;
+        size -= n;
+    }
+    return ret;
+}
+
+// Helper function to send a batch command line followed by its entry list
+static inline int batch_send(int sock, const char *line, const char *body, size_t body_len) {
+    return delta_send_all(sock, line, strlen(line)) == 0 && delta_send_all(sock, body, body_len) == 0 ? 0 : -1;
+}
+
+// Helper function to read a "MULTI <count>\n" multi-status reply of count "OK|ERR <entry> <message>" lines,
+// printing each result; failed entries go to stderr. Returns the number that failed, or SESSION_LOST.
+static inline int batch_read_status(BatchReader *r, int expected) {
+    char line[BUFFER_SIZE];
+    int count, failed = 0;
+    if (batch_read_line(r, line, sizeof(line)) != 0)
+        return SESSION_LOST;
+    if (sscanf(line, "MULTI %d", &count) != 1) {
+        fprintf(stderr, "FAILED: %s\n", line);  // The whole request was rejected
+        return expected;
+    }
+    for (int i = 0; i < count; i++) {
+        if (batch_read_line(r, line, sizeof(line)) != 0)
+            return SESSION_LOST;
+        char *entry = strchr(line, ' ');
+        char *msg = entry ? strchr(entry + 1, ' ') : NULL;
+        if (!msg)
+            continue;
+        *entry++ = '\0';
+        *msg++ = '\0';
+        if (strcmp(line, "OK") == 0)
+            printf("%s: %s\n", entry, msg);
+        else {
+            fprintf(stderr, "FAILED: %s: %s\n", entry, msg);
+            failed++;
+        }
+    }
+    return failed + (expected > count ? expected - count : 0);
+}
+
+// Helper function to count the entries of a "\n"-separated list
+static inline int batch_count_entries(const char *list) {
+    int n = 0;
+    for (const char *p = list; *p; p++)
+        if (*p != '\n' && (p[1] == '\n' || p[1] == '\0'))
+            n++;
+    return n;
+}
+
+// Helper function to split a "\n"-separated list in place. Returns the number of entries.
+static inline int batch_split(char *list, char **entries, int max) {
+    int n = 0;
+    char *save;
+    for (char *e = strtok_r(list, "\n", &save); e && n < max; e = strtok_r(NULL, "\n", &save))
+        entries[n++] = e;
+    return n;
+}
+
+// Helper function to upload the "\n"-separated files of list to dest in one uploadm round trip: the
+// entry list and all payloads are streamed back-to-back, then one multi-status reply is read.
+// Returns the number of files that failed, -1, or SESSION_LOST.
+static inline int upload_many(int sock, const char *list, const char *dest) {
+    char *copy = strdup(list);
+    int max = batch_count_entries(list);
+    char **files = malloc((max > 0 ? max : 1) * sizeof(char *));
+    long long *sizes = malloc((max > 0 ? max : 1) * sizeof(long long));
+    size_t body_cap = strlen(list) + (size_t)max * 24 + 1, body_len = 0;
+    char *body = malloc(body_cap);
+    int n = copy && files && sizes && body ? batch_split(copy, files, max) : -1;
+    int sent = 0, failed = 0, ret = -1;
+    struct stat st;
+    BatchReader *r = NULL;
+
+    for (int i = 0; i < n; i++) {              // Files that cannot be read are reported here and left out
+        if (stat(files[i], &st) != 0 || !S_ISREG(st.st_mode) || access(files[i], R_OK) != 0) {
+            fprintf(stderr, "FAILED: %s: cannot read file\n", files[i]);
+            failed++;
+            continue;
+        }
+        files[sent] = files[i];
+        sizes[sent] = st.st_size;
+        body_len += sprintf(body + body_len, "%s %lld\n", files[i], (long long)st.st_size);
+        sent++;
+    }
+    if (n < 0 || sent == 0) {
+        ret = n < 0 ? -1 : failed;
+        goto out;
+    }
+
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "uploadm %s %zu\n", dest, body_len);
+    ret = SESSION_LOST;
+    if (batch_send(sock, line, body, body_len) != 0)
+        goto out;
+    for (int i = 0; i < sent; i++) {
+        int fd = open(files[i], O_RDONLY);
+        off_t off = 0;
+        while (fd >= 0 && off < sizes[i] && sendfile(sock, fd, &off, sizes[i] - off) > 0)
+            ;
+        if (fd >= 0)
+            close(fd);
+        if (off != sizes[i])
+            goto out;                          // Short file or broken connection: the stream is out of step
+    }
+    printf("Sent %d file(s), waiting for S1.\n", sent);
+    r = malloc(sizeof(*r));
+    if (!r)
+        goto out;
+    r->sock = sock;
+    r->pos = r->len = 0;
+    ret = batch_read_status(r, sent);
+    if (ret >= 0)
+        ret += failed;
+out:
+    free(r);
+    free(body);
+    free(sizes);
+    free(files);
+    free(copy);
+    return ret;
+}
+
+// Helper function to download the "\n"-separated S1 paths of list in one downlm round trip, conditional
+// on cached copies; the files come back-to-back behind framed headers. Returns the number that failed, -1,
+// or SESSION_LOST.
+static inline int download_many(int sock, const char *list, const char *unused) {
+    (void)unused;
+    char *copy = strdup(list);
+    int max = batch_count_entries(list);
+    char **paths = malloc((max > 0 ? max : 1) * sizeof(char *));
+    CacheMeta *metas = malloc((max > 0 ? max : 1) * sizeof(CacheMeta));
+    char *body = malloc(strlen(list) + (size_t)max * 130 + 1);
+    BatchReader *r = malloc(sizeof(BatchReader));
+    int n = copy && paths && metas && body && r ? batch_split(copy, paths, max) : -1;
+    int failed = 0, ret = -1;
+    size_t body_len = 0;
+    char line[BUFFER_SIZE];
+
+    if (n <= 0)
+        goto out;
+    for (int i = 0; i < n; i++) {
+        if (cache_load(paths[i], &metas[i]) != 0)
+            strcpy(metas[i].etag, "-");
+        body_len += sprintf(body + body_len, "%s %s\n", paths[i], metas[i].etag);
+    }
+    snprintf(line, sizeof(line), "downlm %zu\n", body_len);
+    ret = SESSION_LOST;
+    r->sock = sock;
+    r->pos = r->len = 0;
+    if (batch_send(sock, line, body, body_len) != 0 || batch_read_line(r, line, sizeof(line)) != 0)
+        goto out;
+    if (strncmp(line, "MULTI ", 6) != 0) {
+        fprintf(stderr, "FAILED: %s\n", line);  // The whole request was rejected
+        ret = n;
+        goto out;
+    }
+    for (int i = 0; i < n; i++) {
+        const char *base = base_of_path(paths[i]);
+        long long size;
+        char etag[128];
+        if (batch_read_line(r, line, sizeof(line)) != 0)
+            goto out;
+        if (strcmp(line, "NOTMODIFIED") == 0) {
+            if (cache_restore(paths[i], &metas[i], base) == 0)
+                printf("File %s is up to date (cached).\n", base);
+            else
+                paths[failed++] = paths[i];    // Damaged cache copy: fetched again below
+            continue;
+        }
+        if (sscanf(line, "FILE %lld %127s", &size, etag) != 2) {
+            fprintf(stderr, "FAILED: %s: %s\n", paths[i], strncmp(line, "ERR ", 4) == 0 ? line + 4 : line);
+            paths[failed++] = NULL;
+            continue;
+        }
+        FILE *fp = fopen(base, "wb");
+        int got = batch_read_data(r, size, fp);
+        if (fp && fclose(fp) != 0)
+            got = -1;
+        if (got == SESSION_LOST)
+            goto out;
+        if (!fp || got != 0) {
+            fprintf(stderr, "FAILED: %s: cannot write %s\n", paths[i], base);
+            paths[failed++] = NULL;
+            continue;
+        }
+        printf("File downloaded successfully as %s\n", base);
+        if (strcmp(etag, "-") != 0)
+            cache_store(paths[i], etag, base);
+    }
+    ret = 0;
+    for (int i = 0; i < failed; i++) {         // Stale cache entries: one plain download each
+        if (!paths[i])
+            ret++;
+        else {
+            int one = download_one(sock, paths[i], NULL);
+            if (one == SESSION_LOST) {
+                ret = SESSION_LOST;
+                break;
+            }
+            ret += one != 0;
+        }
+    }
+out:
+    free(r);
+    free(body);
+    free(metas);
+    free(paths);
+    free(copy);
+    return ret;
+}
+
+// Helper function to remove the "\n"-separated S1 paths of list in one removem round trip.
+// Returns the number that failed, -1, or SESSION_LOST.
+static inline int remove_many(int sock, const char *list, const char *unused) {
+    (void)unused;
+    char line[BUFFER_SIZE];
+    size_t body_len = strlen(list);
+    BatchReader *r = malloc(sizeof(BatchReader));
+    if (!r)
+        return -1;
+    snprintf(line, sizeof(line), "removem %zu\n", body_len);
+    int ret = SESSION_LOST;
+    r->sock = sock;
+    r->pos = r->len = 0;
+    if (batch_send(sock, line, list, body_len) == 0)
+        ret = batch_read_status(r, batch_count_entries(list));
+    free(r);
+    return ret;
+}
+
+// Helper function to query the metadata of the "\n"-separated S1 paths of list in one statf round trip,
+// printing "<path>: <size> <mtime> <sha256> <node>" per file. Returns the number that failed, -1, or SESSION_LOST.
+static inline int stat_many(int sock, const char *list, const char *unused) {
+    (void)unused;
+    char line[BUFFER_SIZE];
+    size_t body_len = strlen(list);
+    BatchReader *r = malloc(sizeof(BatchReader));
+    if (!r)
+        return -1;
+    snprintf(line, sizeof(line), "statf %zu\n", body_len);
+    int ret = SESSION_LOST;
+    r->sock = sock;
+    r->pos = r->len = 0;
+    if (batch_send(sock, line, list, body_len) == 0)
+        ret = batch_read_status(r, batch_count_entries(list));
+    free(r);
+    return ret;
+}
+
+// Helper function to remove a whole S1 directory tree with removedir, printing S1's progress lines.
+// Returns 0, -1, or SESSION_LOST.
+static inline int remove_dir(int sock, const char *path, const char *unused) {
+    (void)unused;
+    char line[BUFFER_SIZE];
+    BatchReader *r = malloc(sizeof(BatchReader));
+    if (!r)
+        return -1;
+    snprintf(line, sizeof(line), "removedir %s\n", path);
+    int ret = SESSION_LOST;
+    long files;
+    r->sock = sock;
+    r->pos = r->len = 0;
+    if (send(sock, line, strlen(line), 0) >= 0) {
+        while (batch_read_line(r, line, sizeof(line)) == 0) {
+            if (sscanf(line, "PROGRESS %ld", &files) == 1) {
+                printf("%s: %ld file(s) removed so far...\n", path, files);
+                fflush(stdout);
+                continue;
+            }
+            if (sscanf(line, "DONE %ld", &files) == 1) {
+                printf("%s: Directory removed, %ld file(s).\n", path, files);
+                ret = 0;
+            } else {
+                fprintf(stderr, "FAILED: %s: %s\n", path, strncmp(line, "ERR ", 4) == 0 ? line + 4 : line);
+                ret = -1;
+            }
+            break;
+        }
+    }
+    free(r);
+    return ret;
+}
+
+// Last event seen by watch_dir, so that a watch repeated after a dropped connection resumes after it
+static char watch_path[BUFFER_SIZE];
+static unsigned long long watch_seq;
+static int watch_resume;
+
+// Helper function to watch an S1 directory with watchdir, printing one line per change until a line
+// is entered on stdin (or stdin ends). since is the last event number already seen, or NULL for
+// changes from now on. Returns 0, -1, or SESSION_LOST.
+static inline int watch_dir(int sock, const char *path, const char *since) {
+    char line[BUFFER_SIZE], kind[16], file[BUFFER_SIZE];
+    unsigned long long seq;
+    BatchReader *r = malloc(sizeof(BatchReader));
+    if (!r)
+        return -1;
+    if (watch_resume && strcmp(watch_path, path) == 0)
+        snprintf(line, sizeof(line), "watchdir %s %llu\n", path, watch_seq);
+    else if (since && since[0])
+        snprintf(line, sizeof(line), "watchdir %s %s\n", path, since);
+    else
+        snprintf(line, sizeof(line), "watchdir %s\n", path);
+    snprintf(watch_path, sizeof(watch_path), "%s", path);
+    watch_resume = 0;
+    int ret = SESSION_LOST, stopping = 0;
+    r->sock = sock;
+    r->pos = r->len = 0;
+    if (send(sock, line, strlen(line), 0) < 0 || batch_read_line(r, line, sizeof(line)) != 0)
+        goto lost;
+    if (sscanf(line, "WATCHING %llu", &watch_seq) != 1) {
+        fprintf(stderr, "FAILED: %s: %s\n", path, strncmp(line, "ERR ", 4) == 0 ? line + 4 : line);
+        free(r);
+        return -1;
+    }
+    printf("Watching %s from event %llu; press Enter to stop.\n", path, watch_seq);
+    fflush(stdout);
+    while (1) {
+        if (r->pos == r->len && !stopping) {     // Nothing buffered: wait for S1 or the user
+            struct pollfd fds[2] = { { sock, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+            if (poll(fds, 2, -1) < 0)
+                continue;
+            if (fds[1].revents) {
+                if (!fgets(file, sizeof(file), stdin))
+                    clearerr(stdin);
+                if (send(sock, "unwatch\n", 8, 0) < 0)
+                    goto lost;
+                stopping = 1;
+            }
+            if (!fds[0].revents)
+                continue;
+        }
+        if (batch_read_line(r, line, sizeof(line)) != 0)
+            goto lost;
+        if (sscanf(line, "EVENT %llu %15s %1023s", &seq, kind, file) == 3) {
+            watch_seq = seq;
+            printf("%llu %-5s %s\n", seq, kind, file);
+        } else if (sscanf(line, "RESYNC %llu", &seq) == 1) {
+            watch_seq = seq;
+            printf("%s: Events were missed, list the directory again (resuming at %llu).\n", path, seq);
+        } else if (sscanf(line, "UNWATCHED %llu", &seq) == 1) {
+            printf("%s: Stopped watching at event %llu.\n", path, seq);
+            ret = 0;
+            break;
+        }
+        fflush(stdout);
+    }
+    free(r);
+    return ret;
+lost:
+    watch_resume = 1;
+    free(r);
+    return SESSION_LOST;
+}
+
+// Asynchronous API. Operations are queued with s25_submit() and run by a window of worker processes,
+// each holding its own Session, so up to window requests are in flight at once: S1 reads one request
+// per connection at a time, so overlapping requests need separate connections. s25_poll() hands queued
+// operations to idle workers, collects completions and runs their callbacks in the caller's process.
+
+#define S25_MAX_WINDOW 64       // Largest number of worker sessions
+#define S25_QUIET 1             // s25_open() flag: workers discard the per-request messages
+
+// Operation kinds
+#define S25_UPLOAD 1            // arg = local file, dest = S1 directory
+#define S25_DOWNLOAD 2          // arg = S1 path, saved under its base name
+#define S25_REMOVE 3            // arg = S1 path
+#define S25_COMMAND 4           // arg = dispfnames/downltar/addnode/copyf/movef command line
+#define S25_UPLOAD_MANY 5       // list = "\n"-separated local files, dest = S1 directory (one uploadm)
+#define S25_DOWNLOAD_MANY 6     // list = "\n"-separated S1 paths (one downlm)
+#define S25_REMOVE_MANY 7       // list = "\n"-separated S1 paths (one removem)
+#define S25_REMOVE_DIR 8        // arg = S1 directory, removed with everything below it
+#define S25_LIST_CHUNK 32768    // Lists go to workers in messages of this size
+
+// status: 0, -1 when the request failed, or the number of entries of a batch operation that failed
+typedef void (*S25Callback)(int id, int status, void *user);
+
+// One queued or running operation
+typedef struct {
+    int id;
+    int kind;
+    char arg[BUFFER_SIZE];
+    char dest[BUFFER_SIZE];
+    char *list;                 // Entries of a batch operation (malloc()ed), NULL otherwise
+    size_t list_len;
+    S25Callback cb;
+    void *user;
+} S25Op;
+
+// Completion sent back by a worker
+typedef struct {
+    int id;
+    int status;
+} S25Done;
+
+// Worker process and the operation it is running
+typedef struct {
+    pid_t pid;                  // 0 when not running
+    int fd;                     // Parent end of the SOCK_SEQPACKET pair
+    int busy;
+    S25Op op;
+} S25Worker;
+
+typedef struct {
+    int window;
+    int flags;
+    int next_id;
+    S25Worker workers[S25_MAX_WINDOW];
+    S25Op *queue;               // Submitted, not yet handed to a worker (FIFO)
+    int queue_head, queue_len, queue_cap;
+    int in_flight;
+} S25Client;
+
+// s25_run_op - Runs one operation on a session with the same replay rules as the interactive client.
+static inline int s25_run_op(Session *s, const S25Op *op) {
+    switch (op->kind) {
+    case S25_UPLOAD:   return session_request(s, upload_one, op->arg, op->dest, 1);
+    case S25_DOWNLOAD: return session_request(s, download_one, op->arg, NULL, 1);
+    case S25_REMOVE:   return session_request(s, remove_one, op->arg, NULL, 0);
+    case S25_COMMAND:  return session_request(s, simple_command, op->arg, NULL, strncmp(op->arg, "addnode", 7) != 0 &&
+                                                             strncmp(op->arg, "movef", 5) != 0);
+    case S25_UPLOAD_MANY:   return session_request(s, upload_many, op->list, op->dest, 1);
+    case S25_DOWNLOAD_MANY: return session_request(s, download_many, op->list, NULL, 1);
+    case S25_REMOVE_MANY:   return session_request(s, remove_many, op->list, NULL, 0);
+    case S25_REMOVE_DIR:    return session_request(s, remove_dir, op->arg, NULL, 0);
+    }
+    return -1;
+}
+
+// s25_worker_main - Body of a worker: runs operations from fd until the parent closes it.
+static inline void s25_worker_main(int fd, int flags) {
+    Session session = { -1 };
+    S25Op op;
+    if (flags & S25_QUIET) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+    }
+    session_connect(&session);                   // A failure is retried by the first request
+    while (recv(fd, &op, sizeof(op), 0) == (ssize_t)sizeof(op)) {
+        if (op.list_len > 0) {                   // The entry list follows in chunks
+            size_t got = 0;
+            ssize_t n = 0;
+            op.list = malloc(op.list_len + 1);
+            while (op.list && got < op.list_len && (n = recv(fd, op.list + got, op.list_len - got, 0)) > 0)
+                got += n;
+            if (!op.list || got < op.list_len)
+                break;
+            op.list[got] = '\0';
+        }
+        int ret = s25_run_op(&session, &op);
+        S25Done done = { op.id, ret > 0 ? ret : ret == 0 ? 0 : -1 };
+        free(op.list);
+        fflush(stdout);
+        if (send(fd, &done, sizeof(done), 0) != (ssize_t)sizeof(done))
+            break;
+    }
+    if (session.sock >= 0) {
+        send(session.sock, "exit\n", 5, 0);
+        close(session.sock);
+    }
+    _exit(0);
+}
+
+// s25_spawn - Starts worker w. Returns 0 or -1.
+static inline int s25_spawn(S25Client *c, int w) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) < 0)
+        return -1;
+    fflush(stdout);                              // Buffered output must not be written twice
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(pair[0]);
+        for (int i = 0; i < c->window; i++)
+            if (c->workers[i].pid > 0)
+                close(c->workers[i].fd);
+        s25_worker_main(pair[1], c->flags);
+    }
+    close(pair[1]);
+    c->workers[w].pid = pid;
+    c->workers[w].fd = pair[0];
+    c->workers[w].busy = 0;
+    return 0;
+}
+
+// s25_reap - Forgets a worker whose channel failed; its operation completes as failed.
+static inline void s25_reap(S25Client *c, int w) {
+    S25Worker *wk = &c->workers[w];
+    close(wk->fd);
+    kill(wk->pid, SIGTERM);
+    waitpid(wk->pid, NULL, 0);
+    wk->pid = 0;
+    if (wk->busy) {
+        wk->busy = 0;
+        c->in_flight--;
+        if (wk->op.cb)
+            wk->op.cb(wk->op.id, -1, wk->op.user);
+        free(wk->op.list);
+    }
+}
+
+// s25_open - Prepares a client with up to window requests in flight. Workers start on first use.
+static inline int s25_open(S25Client *c, int window, int flags) {
+    memset(c, 0, sizeof(*c));
+    c->window = window < 1 ? 1 : window > S25_MAX_WINDOW ? S25_MAX_WINDOW : window;
+    c->flags = flags;
+    c->next_id = 1;
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+// s25_submit_list - Queues an operation without blocking; list (copied) carries the entries of the batch
+// kinds. Returns its id, or -1 when out of memory.
+static inline int s25_submit_list(S25Client *c, int kind, const char *arg, const char *list, const char *dest,
+                                  S25Callback cb, void *user) {
+    if (c->queue_head + c->queue_len == c->queue_cap) {
+        if (c->queue_head > 0) {                 // Reuse the space of dispatched operations first
+            memmove(c->queue, c->queue + c->queue_head, c->queue_len * sizeof(S25Op));
+            c->queue_head = 0;
+        }
+        if (c->queue_len == c->queue_cap) {
+            int cap = c->queue_cap ? c->queue_cap * 2 : 64;
+            S25Op *q = realloc(c->queue, cap * sizeof(S25Op));
+            if (!q)
+                return -1;
+            c->queue = q;
+            c->queue_cap = cap;
+        }
+    }
+    S25Op *op = &c->queue[c->queue_head + c->queue_len++];
+    memset(op, 0, sizeof(*op));
+    op->id = c->next_id++;
+    op->kind = kind;
+    snprintf(op->arg, sizeof(op->arg), "%s", arg ? arg : "");
+    snprintf(op->dest, sizeof(op->dest), "%s", dest ? dest : "");
+    if (list) {
+        op->list_len = strlen(list);
+        op->list = strdup(list);
+        if (!op->list) {
+            c->queue_len--;
+            return -1;
+        }
+    }
+    op->cb = cb;
+    op->user = user;
+    return op->id;
+}
+
+// s25_submit - Queues a single-file operation or command.
+static inline int s25_submit(S25Client *c, int kind, const char *arg, const char *dest, S25Callback cb, void *user) {
+    return s25_submit_list(c, kind, arg, NULL, dest, cb, user);
+}
+
+// s25_pending - Operations submitted and not completed yet.
+static inline int s25_pending(const S25Client *c) {
+    return c->queue_len + c->in_flight;
+}
+
+// s25_dispatch - Hands queued operations to idle workers, starting workers as needed.
+static inline void s25_dispatch(S25Client *c) {
+    for (int w = 0; w < c->window && c->queue_len > 0; w++) {
+        S25Worker *wk = &c->workers[w];
+        if (wk->busy || (wk->pid == 0 && s25_spawn(c, w) != 0))
+            continue;
+        wk->op = c->queue[c->queue_head++];
+        c->queue_len--;
+        int sent = send(wk->fd, &wk->op, sizeof(wk->op), 0) == (ssize_t)sizeof(wk->op);
+        for (size_t off = 0; sent && off < wk->op.list_len; off += S25_LIST_CHUNK) {
+            size_t n = wk->op.list_len - off < S25_LIST_CHUNK ? wk->op.list_len - off : S25_LIST_CHUNK;
+            sent = send(wk->fd, wk->op.list + off, n, 0) == (ssize_t)n;
+        }
+        if (!sent) {
+            c->queue[--c->queue_head] = wk->op;  // Put it back for another worker
+            c->queue_len++;
+            s25_reap(c, w);
+            continue;
+        }
+        wk->busy = 1;
+        c->in_flight++;
+    }
+}
+
+// s25_poll - Dispatches queued operations and waits up to timeout_ms (-1: until one completes) for
+// completions, running their callbacks. Returns the number of operations completed.
+static inline int s25_poll(S25Client *c, int timeout_ms) {
+    struct pollfd fds[S25_MAX_WINDOW];
+    int map[S25_MAX_WINDOW], n = 0, completed = 0;
+    s25_dispatch(c);
+    for (int w = 0; w < c->window; w++)
+        if (c->workers[w].busy) {
+            fds[n].fd = c->workers[w].fd;
+            fds[n].events = POLLIN;
+            map[n++] = w;
+        }
+    if (n == 0) {
+        while (c->queue_len > 0) {               // No worker could be started: fail what is queued
+            S25Op *op = &c->queue[c->queue_head++];
+            c->queue_len--;
+            completed++;
+            if (op->cb)
+                op->cb(op->id, -1, op->user);
+            free(op->list);
+        }
+        return completed;
+    }
+    if (poll(fds, n, timeout_ms) <= 0)
+        return 0;
+    for (int i = 0; i < n; i++) {
+        if (!fds[i].revents)
+            continue;
+        S25Worker *wk = &c->workers[map[i]];
+        S25Done done;
+        if (recv(wk->fd, &done, sizeof(done), 0) != (ssize_t)sizeof(done) || done.id != wk->op.id) {
+            s25_reap(c, map[i]);                 // Worker died mid-operation
+            completed++;
+            continue;
+        }
+        wk->busy = 0;
+        c->in_flight--;
+        completed++;
+        if (wk->op.cb)
+            wk->op.cb(done.id, done.status, wk->op.user);
+        free(wk->op.list);
+    }
+    s25_dispatch(c);                             // Keep the window full while callbacks were running
+    return completed;
+}
+
+// s25_wait - Runs until every submitted operation has completed.
+static inline void s25_wait(S25Client *c) {
+    while (s25_pending(c) > 0)
+        s25_poll(c, -1);
+}
+
+// s25_close - Stops the workers (each ends its session) and frees the queue.
+static inline void s25_close(S25Client *c) {
+    for (int w = 0; w < c->window; w++)
+        if (c->workers[w].pid > 0) {
+            close(c->workers[w].fd);
+            waitpid(c->workers[w].pid, NULL, 0);
+            c->workers[w].pid = 0;
+        }
+    for (int i = 0; i < c->queue_len; i++)
+        free(c->queue[c->queue_head + i].list);
+    free(c->queue);
+    c->queue = NULL;
+}
+
+#endif
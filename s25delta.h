@@ -0,0 +1,252 @@
+// s25delta.h - rsync-style delta transfer for re-uploads of modified files.
+//
+// The receiver splits its current copy (the basis) into blocks and sends one DeltaSig per full block:
+// a rolling weak checksum and the first bytes of the block's SHA-256. The sender slides a window over
+// the new file, and wherever the weak sum and then the strong hash match a block it sends DELTA_COPY
+// with the block number instead of the data; everything else goes out as DELTA_LITERAL runs.
+// DELTA_END carries the SHA-256 of the whole new file, so the receiver only commits a verified result.
+// Integers travel in network byte order. Included by S1.c and the client.
+#ifndef S25DELTA_H
+#define S25DELTA_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "s25cas.h"
+
+#define DELTA_MIN_BLOCK 512                      // Smallest block size, used for small files
+#define DELTA_MAX_BLOCK (64 * 1024)              // Largest block size, reached at 4 GB
+#define DELTA_LITERAL_MAX (64 * 1024)            // Longest literal run in one instruction
+#define DELTA_STRONG_LEN 16                      // Bytes of the block SHA-256 kept in a signature
+#define DELTA_MAX_GROWTH 4                       // A rebuilt file may be this many times its basis
+#define DELTA_MAX_EXTRA (64L * 1024 * 1024)      // plus this many bytes, at most
+#define DELTA_COPY 1                             // value = basis block number
+#define DELTA_LITERAL 2                          // value = length, the bytes follow
+#define DELTA_END 3                              // followed by the hex SHA-256 of the new file
+
+// Signature of one basis block
+typedef struct {
+    unsigned int weak;
+    unsigned char strong[DELTA_STRONG_LEN];
+} DeltaSig;
+
+// One instruction of the delta stream
+typedef struct {
+    unsigned int kind;
+    unsigned int value;
+} DeltaOp;
+
+// delta_block_size - Picks a block size around sqrt(len), so signatures and matching stay cheap.
+static inline int delta_block_size(long len) {
+    int bs = DELTA_MIN_BLOCK;
+    while (bs < DELTA_MAX_BLOCK && (long)bs * bs < len)
+        bs *= 2;
+    return bs;
+}
+
+// delta_weak - Computes the two halves of the rolling checksum over len bytes.
+static inline void delta_weak(const unsigned char *p, int len, unsigned int *a, unsigned int *b) {
+    *a = 0;
+    *b = 0;
+    for (int i = 0; i < len; i++) {
+        *a += p[i];
+        *b += (unsigned int)(len - i) * p[i];
+    }
+}
+
+// delta_strong - Truncated SHA-256 of one block.
+static inline void delta_strong(const unsigned char *p, int len, unsigned char *out) {
+    CasHash c;
+    unsigned char raw[32];
+    cas_hash_init(&c);
+    cas_hash_update(&c, p, len);
+    cas_hash_digest(&c, raw);
+    memcpy(out, raw, DELTA_STRONG_LEN);
+}
+
+// delta_send_all - send() until len bytes are out. Returns 0 or -1.
+static inline int delta_send_all(int sock, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, 0);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// delta_recv_all - recv() exactly len bytes. Returns 0 or -1.
+static inline int delta_recv_all(int sock, void *buf, size_t len) {
+    return len == 0 || recv(sock, buf, len, MSG_WAITALL) == (ssize_t)len ? 0 : -1;
+}
+
+// delta_make_sigs - Builds the signatures of every full block of the basis. Returns the block
+// count, with *sigs malloc()ed (the caller frees it), or -1.
+static inline int delta_make_sigs(const unsigned char *basis, long len, int bs, DeltaSig **sigs) {
+    int count = len / bs;
+    *sigs = malloc(count > 0 ? count * sizeof(DeltaSig) : 1);
+    if (!*sigs)
+        return -1;
+    for (int i = 0; i < count; i++) {
+        unsigned int a, b;
+        delta_weak(basis + (long)i * bs, bs, &a, &b);
+        (*sigs)[i].weak = htonl((a & 0xffff) | (b << 16));
+        delta_strong(basis + (long)i * bs, bs, (*sigs)[i].strong);
+    }
+    return count;
+}
+
+// delta_send_op - Sends one instruction, followed by len bytes of data when data is set.
+static inline int delta_send_op(int sock, unsigned int kind, unsigned int value, const void *data, size_t len) {
+    DeltaOp op = { htonl(kind), htonl(value) };
+    return delta_send_all(sock, &op, sizeof(op)) == 0 && (!data || delta_send_all(sock, data, len) == 0) ? 0 : -1;
+}
+
+// delta_send_literal - Sends data[from, to) as literal runs.
+static inline int delta_send_literal(int sock, const unsigned char *data, long from, long to) {
+    while (from < to) {
+        long n = to - from < DELTA_LITERAL_MAX ? to - from : DELTA_LITERAL_MAX;
+        if (delta_send_op(sock, DELTA_LITERAL, n, data + from, n) != 0)
+            return -1;
+        from += n;
+    }
+    return 0;
+}
+
+// delta_encode - Sender side: turns data into copy/literal instructions against the peer's block
+// signatures and sends them, ending with DELTA_END and the SHA-256 of data (digest when the caller
+// has it already, else computed here). Returns 0 or -1.
+static inline int delta_encode(int sock, const unsigned char *data, long len, const DeltaSig *sigs, int count, int bs,
+                               const char *digest) {
+    int table_size = 1;
+    while (table_size < count * 2)
+        table_size *= 2;
+    int *table = malloc(table_size * sizeof(int));  // Open addressing on the weak sum, block number + 1
+    if (!table)
+        return -1;
+    memset(table, 0, table_size * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        unsigned int slot = ntohl(sigs[i].weak) & (table_size - 1);
+        while (table[slot])
+            slot = (slot + 1) & (table_size - 1);
+        table[slot] = i + 1;
+    }
+    long pos = 0, literal_from = 0;
+    unsigned int a = 0, b = 0;
+    if (count > 0 && len >= bs)
+        delta_weak(data, bs, &a, &b);
+    while (count > 0 && pos + bs <= len) {
+        unsigned int weak = (a & 0xffff) | (b << 16);
+        int match = -1, strong_done = 0;
+        unsigned char strong[DELTA_STRONG_LEN];
+        for (unsigned int slot = weak & (table_size - 1); table[slot]; slot = (slot + 1) & (table_size - 1)) {
+            const DeltaSig *sig = &sigs[table[slot] - 1];
+            if (ntohl(sig->weak) != weak)
+                continue;
+            if (!strong_done) {                  // Only hash the window once the cheap sum agrees
+                delta_strong(data + pos, bs, strong);
+                strong_done = 1;
+            }
+            if (memcmp(strong, sig->strong, DELTA_STRONG_LEN) == 0) {
+                match = table[slot] - 1;
+                break;
+            }
+        }
+        if (match >= 0) {
+            if (delta_send_literal(sock, data, literal_from, pos) != 0 ||
+                delta_send_op(sock, DELTA_COPY, match, NULL, 0) != 0) {
+                free(table);
+                return -1;
+            }
+            pos += bs;
+            literal_from = pos;
+            if (pos + bs <= len)
+                delta_weak(data + pos, bs, &a, &b);
+            continue;
+        }
+        if (pos + bs < len) {                    // Roll the window one byte forward
+            a += data[pos + bs] - data[pos];
+            b += a - (unsigned int)bs * data[pos];
+        }
+        pos++;
+        if (pos - literal_from >= DELTA_LITERAL_MAX) {
+            if (delta_send_literal(sock, data, literal_from, pos) != 0) {
+                free(table);
+                return -1;
+            }
+            literal_from = pos;
+        }
+    }
+    free(table);
+    char hex[CAS_DIGEST_LEN + 1];
+    if (!digest) {
+        CasHash c;
+        cas_hash_init(&c);
+        cas_hash_update(&c, data, len);
+        cas_hash_final(&c, hex);
+        digest = hex;
+    }
+    if (delta_send_literal(sock, data, literal_from, len) != 0 ||
+        delta_send_op(sock, DELTA_END, 0, digest, CAS_DIGEST_LEN) != 0)
+        return -1;
+    return 0;
+}
+
+// delta_max_output - Largest file delta_apply rebuilds from a basis of basis_len bytes, so a few
+// copy instructions cannot make the receiver write without bound.
+static inline long delta_max_output(long basis_len) {
+    return basis_len * DELTA_MAX_GROWTH + DELTA_MAX_EXTRA;
+}
+
+// delta_apply - Receiver side: reads instructions from sock and writes the new file to out,
+// copying referenced blocks from the basis. Returns 0 once the result matches the sender's
+// SHA-256, -1 on a mismatch or a result that could not be written (NULL out, a write error, or
+// longer than max_len), and -2 on a broken stream. Only after -2 is the rest of the stream unread:
+// when writing fails the instructions are still read through DELTA_END.
+static inline int delta_apply(int sock, const unsigned char *basis, long basis_len, int bs, long max_len, FILE *out) {
+    int count = basis_len / bs;
+    long written = 0;
+    unsigned char *literal = malloc(DELTA_LITERAL_MAX);
+    CasHash c;
+    DeltaOp op;
+    if (!literal)
+        return -2;
+    cas_hash_init(&c);
+    while (delta_recv_all(sock, &op, sizeof(op)) == 0) {
+        unsigned int kind = ntohl(op.kind), value = ntohl(op.value);
+        const unsigned char *data;
+        size_t len;
+        if (kind == DELTA_COPY && value < (unsigned int)count) {
+            data = basis + (long)value * bs;
+            len = bs;
+        } else if (kind == DELTA_LITERAL && value > 0 && value <= DELTA_LITERAL_MAX &&
+                   delta_recv_all(sock, literal, value) == 0) {
+            data = literal;
+            len = value;
+        } else if (kind == DELTA_END) {
+            char expected[CAS_DIGEST_LEN + 1], actual[CAS_DIGEST_LEN + 1];
+            free(literal);
+            if (delta_recv_all(sock, expected, CAS_DIGEST_LEN) != 0)
+                return -2;
+            expected[CAS_DIGEST_LEN] = '\0';
+            cas_hash_final(&c, actual);
+            return out && strcmp(expected, actual) == 0 ? 0 : -1;
+        } else
+            break;                               // Malformed instruction
+        if (!out)
+            continue;                            // Writing failed already: only keep the stream in step
+        if ((long)len > max_len - written || fwrite(data, 1, len, out) != len) {
+            out = NULL;
+            continue;
+        }
+        written += len;
+        cas_hash_update(&c, data, len);
+    }
+    free(literal);
+    return -2;
+}
+
+#endif
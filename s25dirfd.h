@@ -0,0 +1,183 @@
+// s25dirfd.h - Cache of open directory descriptors below $HOME.
+//
+// Storage paths are resolved relative to the deepest directory already open instead of from $HOME on
+// every request: the cache keeps up to DIRCACHE_SLOTS directory descriptors, keyed by their path
+// below $HOME and evicted least recently used first, and walks the remaining components with openat()
+// (mkdirat() when creating). An upload into a directory the process has used before resolves it with
+// no system call at all, leaving only the open of the file itself.
+//
+// A descriptor keeps referring to its directory after the path is removed, so every process that
+// removes directories bumps a generation counter kept in a shared file ($HOME/.s25/dirgen), and a
+// cache that sees a new generation closes all of its descriptors before the next lookup.
+#ifndef S25DIRFD_H
+#define S25DIRFD_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DIRCACHE_SLOTS 64                        // Directories kept open per process
+#define DIRCACHE_PATH 512                        // Longest cached path below $HOME
+#define DIRCACHE_GEN_FILE ".s25/dirgen"          // Shared generation counter, below $HOME
+
+typedef struct {
+    int fd;                                      // -1 when the slot is free
+    size_t len;
+    unsigned long long used;                     // Tick of the last lookup, for eviction
+    char path[DIRCACHE_PATH];
+} DirCacheSlot;
+
+// Zero-initialized (a static) is a valid, not yet opened cache
+typedef struct {
+    int ready;
+    int home_fd;
+    unsigned long long *gen;                     // Shared counter, NULL when it could not be mapped
+    unsigned long long seen_gen;
+    unsigned long long tick;
+    DirCacheSlot slots[DIRCACHE_SLOTS];
+} DirCache;
+
+// dircache_flush - Closes every cached descriptor.
+static inline void dircache_flush(DirCache *c) {
+    for (int i = 0; i < DIRCACHE_SLOTS; i++) {
+        if (c->slots[i].fd >= 0)
+            close(c->slots[i].fd);
+        c->slots[i].fd = -1;
+    }
+}
+
+// dircache_sync - Opens $HOME and the generation counter on first use, and drops the cached
+// descriptors when some process removed directories since the last lookup. Returns 0 or -1.
+static inline int dircache_sync(DirCache *c) {
+    if (!c->ready) {
+        const char *home = getenv("HOME") ? getenv("HOME") : ".";
+        c->home_fd = open(home, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (c->home_fd < 0)
+            return -1;
+        for (int i = 0; i < DIRCACHE_SLOTS; i++)
+            c->slots[i].fd = -1;
+        mkdirat(c->home_fd, ".s25", 0755);
+        int fd = openat(c->home_fd, DIRCACHE_GEN_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && (st.st_size >= 4096 || ftruncate(fd, 4096) == 0)) {
+            void *map = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            c->gen = map == MAP_FAILED ? NULL : map;
+        }
+        if (fd >= 0)
+            close(fd);
+        c->seen_gen = c->gen ? __atomic_load_n(c->gen, __ATOMIC_ACQUIRE) : 0;
+        c->ready = 1;
+        return 0;
+    }
+    unsigned long long gen = c->gen ? __atomic_load_n(c->gen, __ATOMIC_ACQUIRE) : c->seen_gen + 1;
+    if (gen != c->seen_gen) {                    // Without the counter nothing stays cached
+        dircache_flush(c);
+        c->seen_gen = gen;
+    }
+    return 0;
+}
+
+// dircache_bump - Tells every process's cache that directories were removed.
+static inline void dircache_bump(DirCache *c) {
+    if (dircache_sync(c) == 0 && c->gen)
+        __atomic_add_fetch(c->gen, 1, __ATOMIC_ACQ_REL);
+    dircache_flush(c);
+}
+
+// dircache_find - Cached descriptor of the first len bytes of path, or -1.
+static inline int dircache_find(DirCache *c, const char *path, size_t len) {
+    for (int i = 0; i < DIRCACHE_SLOTS; i++) {
+        DirCacheSlot *s = &c->slots[i];
+        if (s->fd >= 0 && s->len == len && memcmp(s->path, path, len) == 0) {
+            s->used = ++c->tick;
+            return s->fd;
+        }
+    }
+    return -1;
+}
+
+// dircache_store - Caches fd as the directory at the first len bytes of path, evicting the least
+// recently used slot when all are taken.
+static inline void dircache_store(DirCache *c, const char *path, size_t len, int fd) {
+    DirCacheSlot *victim = &c->slots[0];
+    for (int i = 0; i < DIRCACHE_SLOTS && victim->fd >= 0; i++)
+        if (c->slots[i].fd < 0 || c->slots[i].used < victim->used)
+            victim = &c->slots[i];
+    if (victim->fd >= 0)
+        close(victim->fd);
+    victim->fd = fd;
+    victim->len = len;
+    victim->used = ++c->tick;
+    memcpy(victim->path, path, len);
+}
+
+// dircache_dir - Descriptor of the directory rel below $HOME, creating missing components when create
+// is set. The descriptor belongs to the cache and is valid until the next dircache call.
+// Returns -1 with errno set when the directory cannot be opened or created.
+static inline int dircache_dir(DirCache *c, const char *rel, int create) {
+    char path[DIRCACHE_PATH];
+    size_t len = strlen(rel);
+    if (dircache_sync(c) != 0)
+        return -1;
+    while (len > 0 && rel[len - 1] == '/')
+        len--;
+    if (len >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(path, rel, len);
+    path[len] = '\0';
+    size_t done = len;                           // Length of the deepest cached ancestor
+    int fd = -1;
+    while (done > 0 && (fd = dircache_find(c, path, done)) < 0) {
+        while (done > 0 && path[done - 1] != '/')
+            done--;
+        while (done > 0 && path[done - 1] == '/')
+            done--;
+    }
+    if (fd < 0)
+        fd = c->home_fd;
+    while (done < len) {                         // Open (or create) the components below it
+        size_t start = done, end;
+        while (start < len && path[start] == '/')
+            start++;
+        for (end = start; end < len && path[end] != '/'; end++)
+            ;
+        path[end] = '\0';
+        int next = openat(fd, path + start, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (next < 0 && errno == ENOENT && create &&
+            (mkdirat(fd, path + start, 0755) == 0 || errno == EEXIST))
+            next = openat(fd, path + start, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (next < 0)
+            return -1;
+        dircache_store(c, path, end, next);
+        if (end < len)
+            path[end] = '/';
+        fd = next;
+        done = end;
+    }
+    return fd;
+}
+
+// dircache_stat - fstatat() of the file rel below $HOME through its cached directory.
+// Returns 0, or -1 with errno set.
+static inline int dircache_stat(DirCache *c, const char *rel, struct stat *st) {
+    const char *slash = strrchr(rel, '/');
+    size_t dir_len = slash ? (size_t)(slash - rel) : 0;
+    char dir[DIRCACHE_PATH];
+    if (dir_len >= sizeof(dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(dir, rel, dir_len);
+    dir[dir_len] = '\0';
+    int fd = dircache_dir(c, dir, 0);            // $HOME itself for a name without a directory
+    return fd < 0 ? -1 : fstatat(fd, slash ? slash + 1 : rel, st, 0);
+}
+
+#endif
@@ -0,0 +1,72 @@
+// s25fanout.h - Hashed fan-out layout of the storage trees.
+//
+// A logical directory holding hundreds of thousands of files makes every create, lookup and readdir
+// in it slow on the storage filesystem. With the fan-out layout a file "dir/name" is stored as
+// "dir/.fan/xx/yy/name", where xx and yy are two levels of FANOUT_WIDTH buckets picked by a hash of
+// the name, so no physical directory holds more than a small share of a large logical one. Logical
+// subdirectories stay real directories next to ".fan", which is therefore a reserved name.
+//
+// The layout only decides physical paths: keys, listings, events and archives always use the logical
+// path, which fanout_strip() recovers from a physical one.
+#ifndef S25FANOUT_H
+#define S25FANOUT_H
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FANOUT_DIR ".fan"                        // Bucket tree below each logical directory
+#define FANOUT_WIDTH 32                          // Buckets per level, 1024 leaf directories in all
+
+// tar option that stores fanned members under their logical names (FANOUT_DIR spelled out)
+#define FANOUT_TAR_TRANSFORM "--transform 's,\\(^\\|/\\)\\.fan/[0-9a-f][0-9a-f]/[0-9a-f][0-9a-f]/,\\1,'"
+
+// fanout_hash - FNV-1a of a file name; independent of the node ring so buckets spread on every node.
+static inline unsigned int fanout_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+        h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+// fanout_key - Physical path of the logical path key: key itself in the flat layout, otherwise
+// "dir/.fan/xx/yy/name". Returns 0, or -1 when out is too small.
+static inline int fanout_key(const char *key, int fanout, char *out, size_t len) {
+    int n;
+    if (!fanout)
+        n = snprintf(out, len, "%s", key);
+    else {
+        const char *slash = strrchr(key, '/');
+        const char *name = slash ? slash + 1 : key;
+        unsigned int h = fanout_hash(name);
+        n = snprintf(out, len, "%.*s%s/%02x/%02x/%s", (int)(name - key), key, FANOUT_DIR,
+                     h % FANOUT_WIDTH, (h / FANOUT_WIDTH) % FANOUT_WIDTH, name);
+    }
+    return n >= 0 && (size_t)n < len ? 0 : -1;
+}
+
+// fanout_strip - Turns a physical path back into the logical one, in place, by dropping every
+// ".fan/xx/yy/" it contains.
+static inline void fanout_strip(char *path) {
+    const size_t dir_len = strlen(FANOUT_DIR);
+    char *p = path;
+    while ((p = strstr(p, FANOUT_DIR "/")) != NULL) {
+        char *bucket = p + dir_len + 1;
+        if ((p == path || p[-1] == '/') && isxdigit((unsigned char)bucket[0]) && isxdigit((unsigned char)bucket[1]) &&
+            bucket[2] == '/' && isxdigit((unsigned char)bucket[3]) && isxdigit((unsigned char)bucket[4]) && bucket[5] == '/')
+            memmove(p, bucket + 6, strlen(bucket + 6) + 1);
+        else
+            p++;
+    }
+}
+
+// fanout_reserved - Tells whether a logical path uses FANOUT_DIR as one of its components.
+static inline int fanout_reserved(const char *key) {
+    size_t dir_len = strlen(FANOUT_DIR);
+    for (const char *p = key; (p = strstr(p, FANOUT_DIR)) != NULL; p++)
+        if ((p == key || p[-1] == '/') && (p[dir_len] == '\0' || p[dir_len] == '/'))
+            return 1;
+    return 0;
+}
+
+#endif
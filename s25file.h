@@ -0,0 +1,164 @@
+// s25file.h - File payloads on the wire and on disk, shared by the client and the servers.
+//
+// A payload is announced by its size as decimal digits ended by '\n', so the receiver can tell the
+// header from the data however the stream is split, even when the file itself starts with digits.
+// Sizes are long long from the header to the last write. A stored file's etag, the validator client
+// caches keep, is built by file_stat_etag() wherever the file is opened for sending.
+//
+// file_recv_payload() reserves the announced size with fallocate() before the first byte arrives, so
+// a multi-GB upload is laid out in a few large extents and a full disk fails the transfer up front
+// instead of after gigabytes. Payloads of FILE_STREAM_MIN bytes or more bypass the page cache: they
+// are written with O_DIRECT from an aligned buffer, or, on filesystems that refuse O_DIRECT, written
+// back and dropped with posix_fadvise(POSIX_FADV_DONTNEED) as they go. file_send_done() drops a large
+// file a sender just streamed in the same way, so one big transfer does not evict the small hot files.
+//
+// Needs _GNU_SOURCE (O_DIRECT, fallocate, sync_file_range) before the first system header.
+#ifndef S25FILE_H
+#define S25FILE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define FILE_STREAM_MIN (64LL * 1024 * 1024)     // Payloads from this size on bypass the page cache; 0 disables
+#define FILE_IO_CHUNK (1024 * 1024)              // Bytes per write while receiving
+#define FILE_IO_ALIGN 4096                       // Buffer, offset and length alignment of O_DIRECT writes
+#define FILE_ETAG_MAX 128                        // Buffer size for an etag
+
+// file_send_size - Sends the size header of a payload. Returns 0 or -1.
+static inline int file_send_size(int sock, long long size) {
+    char header[32];
+    int len = snprintf(header, sizeof(header), "%lld\n", size);
+    return send(sock, header, len, 0) == len ? 0 : -1;
+}
+
+// file_parse_size - Parses a size header line (without its '\n'). Returns 0, or -1 when it is not one.
+static inline int file_parse_size(const char *line, long long *size) {
+    char *end;
+    if (line[0] < '0' || line[0] > '9')
+        return -1;
+    errno = 0;
+    *size = strtoll(line, &end, 10);
+    return errno == 0 && *end == '\0' ? 0 : -1;
+}
+
+// file_recv_size - Reads a size header byte by byte, leaving the payload in the socket.
+// Returns 0, or -1 when the connection failed or the line is not a size.
+static inline int file_recv_size(int sock, long long *size) {
+    char line[32];
+    size_t n = 0;
+    while (n < sizeof(line) - 1 && recv(sock, line + n, 1, 0) == 1 && line[n] != '\n')
+        n++;
+    if (n == sizeof(line) - 1 || n == 0 || line[n] != '\n')
+        return -1;
+    line[n] = '\0';
+    return file_parse_size(line, size);
+}
+
+// file_stream_size - Size of an open file, for the header that announces it. Returns -1 on failure.
+static inline long long file_stream_size(FILE *fp) {
+    struct stat st;
+    return fstat(fileno(fp), &st) == 0 ? (long long)st.st_size : -1;
+}
+
+// file_stat_etag - Etag of a stored file from its size, mtime and inode: a file replaced by rename()
+// or rewritten gets a new one, and paths sharing an inode through the content store share it.
+static inline void file_stat_etag(const struct stat *st, char *etag, size_t len) {
+    snprintf(etag, len, "%lx-%lx.%lx-%lx", (long)st->st_size, (long)st->st_mtim.tv_sec,
+             (long)st->st_mtim.tv_nsec, (long)st->st_ino);
+}
+
+// file_send_done - Drops a file of size bytes that was just streamed from the page cache when it is
+// large enough to push hot files out.
+static inline void file_send_done(FILE *fp, long long size) {
+    if (FILE_STREAM_MIN > 0 && size >= FILE_STREAM_MIN)
+        posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// file_write_all - pwrite() of len bytes at off that finishes short writes. Returns 0 or -1.
+static inline int file_write_all(int fd, const char *buf, size_t len, long long off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+// file_recv_payload - Receives size bytes from sock into a new file at path, preallocated and, for a
+// large payload, kept out of the page cache. On failure the file holds what arrived, without the
+// reservation. Returns 0 or -1.
+static inline int file_recv_payload(int sock, long long size, const char *path) {
+    int large = FILE_STREAM_MIN > 0 && size >= FILE_STREAM_MIN;
+    int direct = large;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (direct ? O_DIRECT : 0), 0644);
+    if (fd < 0 && direct && errno == EINVAL) {   // tmpfs and some others: write back and drop instead
+        direct = 0;
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    if (size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) != 0 && errno == ENOSPC) {
+        close(fd);
+        return -1;
+    }
+    char *buf = NULL;
+    size_t cap = size < FILE_IO_CHUNK ? (size_t)(size + FILE_IO_ALIGN - 1) & ~(size_t)(FILE_IO_ALIGN - 1) : FILE_IO_CHUNK;
+    if (posix_memalign((void **)&buf, FILE_IO_ALIGN, cap ? cap : FILE_IO_ALIGN) != 0) {
+        close(fd);
+        return -1;
+    }
+    long long done = 0, written = 0, dropped = 0;
+    size_t fill = 0;
+    int ret = 0;
+    while (ret == 0 && written < size) {
+        size_t want = cap - fill;
+        if ((long long)want > size - done)
+            want = size - done;
+        ssize_t n = recv(sock, buf + fill, want, 0);
+        if (n <= 0) {
+            ret = -1;
+            break;
+        }
+        fill += n;
+        done += n;
+        if (fill < cap && done < size)
+            continue;                            // Whole chunks keep O_DIRECT writes aligned
+        if (direct && fill % FILE_IO_ALIGN)      // The unaligned tail goes through the page cache
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        int ok = file_write_all(fd, buf, fill, written) == 0;
+        if (!ok && direct && errno == EINVAL) {  // Opened, but the filesystem rejects direct writes
+            direct = 0;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            ok = file_write_all(fd, buf, fill, written) == 0;
+        }
+        if (!ok)
+            ret = -1;
+        written += fill;
+        fill = 0;
+        if (large && !direct && (written - dropped >= 8LL * FILE_IO_CHUNK || written == size)) {
+            sync_file_range(fd, dropped, written - dropped,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd, dropped, written - dropped, POSIX_FADV_DONTNEED);
+            dropped = written;
+        }
+    }
+    free(buf);
+    if (ret != 0 && ftruncate(fd, written) != 0)  // Give back the reservation past the data
+        perror("ftruncate");
+    if (close(fd) != 0)
+        ret = -1;
+    return ret;
+}
+
+#endif
@@ -0,0 +1,164 @@
+// s25journal.h - Change journal behind S1's directory watches.
+//
+// Every change to a stored path (added, modified, deleted, directory tree removed) is recorded as a
+// numbered event in a ring of JOURNAL_SLOTS fixed-size records. The ring lives in an mmap()ed file,
+// so every forked S1 process appends to and reads from the same journal and the numbering survives a
+// restart. A writer claims the next sequence number with an atomic add on the header, fills the slot
+// and publishes it by storing the number last; a reader follows the ring from the last number it saw,
+// so a watcher that reconnects resumes where it stopped until its events have been overwritten.
+#ifndef S25JOURNAL_H
+#define S25JOURNAL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_SLOTS 16384                      // Events kept before the oldest is overwritten
+#define JOURNAL_MAGIC 0x53324a32u                // "S2J2", changed with the record layout
+#define JOURNAL_KEY_MAX 512                      // Longest key plus its NUL, as S1 builds keys
+#define JOURNAL_DEDUP_SCAN 256                   // Recent events journal_recent looks at
+
+// Event kinds
+#define JOURNAL_ADD 'A'                          // Path created
+#define JOURNAL_MOD 'M'                          // Existing path replaced
+#define JOURNAL_DEL 'D'                          // Path removed
+#define JOURNAL_RMDIR 'R'                        // Directory and everything below it removed
+#define JOURNAL_LOST 'L'                         // Changes may have gone unrecorded (key is empty)
+
+// One event; seq is 0 while the slot is being written
+typedef struct {
+    unsigned long long seq;
+    long long time_ms;                           // Wall clock time of the change
+    char kind;
+    char key[JOURNAL_KEY_MAX];                   // Path below S1/
+} JournalRecord;
+
+// Header at the start of the journal file, padded to one record
+typedef struct {
+    unsigned int magic;
+    unsigned int slots;
+    unsigned long long next;                     // Next sequence number to hand out, starting at 1
+    char pad[sizeof(JournalRecord) - 16];
+} JournalHeader;
+
+typedef struct {
+    JournalHeader *hdr;                          // NULL when the journal could not be opened
+    JournalRecord *recs;
+    size_t map_len;
+} Journal;
+
+// journal_now_ms - Wall clock time in milliseconds.
+static inline long long journal_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// journal_open - Maps the journal file at path, creating it (sparse) on first use. Returns 0 or -1.
+static inline int journal_open(Journal *j, const char *path) {
+    memset(j, 0, sizeof(*j));
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return -1;
+    size_t len = sizeof(JournalHeader) + (size_t)JOURNAL_SLOTS * sizeof(JournalRecord);
+    struct stat st;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0 ||
+        ((size_t)st.st_size < len && ftruncate(fd, len) != 0)) {
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    j->hdr = base;
+    j->recs = (JournalRecord *)((char *)base + sizeof(JournalHeader));
+    j->map_len = len;
+    if (j->hdr->magic != JOURNAL_MAGIC || j->hdr->slots != JOURNAL_SLOTS) {
+        memset(base, 0, len);                    // New or foreign file: start numbering at 1
+        j->hdr->slots = JOURNAL_SLOTS;
+        j->hdr->next = 1;
+        j->hdr->magic = JOURNAL_MAGIC;
+    }
+    close(fd);                                   // The mapping stays; closing drops the lock
+    return 0;
+}
+
+// journal_head - Number of the newest event handed out (0 when there is none).
+static inline unsigned long long journal_head(const Journal *j) {
+    return j->hdr ? __atomic_load_n(&j->hdr->next, __ATOMIC_ACQUIRE) - 1 : 0;
+}
+
+// journal_append_at - Records a change of key made at time_ms. Returns its sequence number, or 0
+// without a journal.
+static inline unsigned long long journal_append_at(Journal *j, char kind, const char *key, long long time_ms) {
+    if (!j->hdr)
+        return 0;
+    unsigned long long seq = __atomic_fetch_add(&j->hdr->next, 1, __ATOMIC_ACQ_REL);
+    JournalRecord *rec = &j->recs[seq % JOURNAL_SLOTS];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->time_ms = time_ms;
+    rec->kind = kind;
+    snprintf(rec->key, sizeof(rec->key), "%s", key);
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+    return seq;
+}
+
+// journal_append - Records a change of key made now.
+static inline unsigned long long journal_append(Journal *j, char kind, const char *key) {
+    return journal_append_at(j, kind, key, journal_now_ms());
+}
+
+// journal_read - Copies event seq to out. Returns 1, 0 when it is not published yet, or -1 when it
+// has been overwritten (the reader fell more than JOURNAL_SLOTS events behind).
+static inline int journal_read(const Journal *j, unsigned long long seq, JournalRecord *out) {
+    if (!j->hdr)
+        return 0;
+    const JournalRecord *rec = &j->recs[seq % JOURNAL_SLOTS];
+    unsigned long long found = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    if (found == seq) {
+        memcpy(out, rec, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq ? 1 : -1;  // Not overwritten meanwhile
+    }
+    if (found > seq || journal_head(j) >= seq + JOURNAL_SLOTS)
+        return -1;
+    return 0;
+}
+
+// journal_recent - Tells whether one of the last JOURNAL_DEDUP_SCAN events, made at since_ms or later,
+// is about key or removed a directory containing it.
+static inline int journal_recent(const Journal *j, const char *key, long long since_ms) {
+    unsigned long long head = journal_head(j);
+    JournalRecord rec;
+    for (unsigned long long seq = head; seq > 0 && head - seq < JOURNAL_DEDUP_SCAN; seq--) {
+        if (journal_read(j, seq, &rec) != 1 || rec.time_ms < since_ms)
+            continue;                            // Not in time order: changes are journaled late
+        size_t len = strlen(rec.key);
+        if (strcmp(rec.key, key) == 0 ||
+            (rec.kind == JOURNAL_RMDIR && strncmp(key, rec.key, len) == 0 && key[len] == '/'))
+            return 1;
+    }
+    return 0;
+}
+
+// journal_kind_name - Wire name of an event kind.
+static inline const char *journal_kind_name(char kind) {
+    switch (kind) {
+    case JOURNAL_ADD:   return "ADD";
+    case JOURNAL_MOD:   return "MOD";
+    case JOURNAL_DEL:   return "DEL";
+    case JOURNAL_RMDIR: return "RMDIR";
+    case JOURNAL_LOST:  return "LOST";
+    }
+    return "?";
+}
+
+#endif
@@ -0,0 +1,195 @@
+// s25parse.h - Command reader and dispatch shared by S1 and the backend servers.
+//
+// A request is one line of space-separated tokens ending in '\n', possibly followed by a body the
+// command reads itself (batch entry lists). A CmdReader keeps what arrived on one connection, so a
+// line split over several recv() calls is completed by the next one, and several lines (or a line and
+// the body behind it) arriving in one read are served one after the other. cmd_next() splits the line
+// in place: the tokens point into the reader's buffer and stay valid until the next call, so no
+// request is copied or allocated. Each reader also owns an Arena for the memory a handler needs while
+// serving the request; cmd_next() resets it, so nothing a handler takes from it has to be freed.
+// cmd_dispatch() finds the command in a table of CmdSpec entries, checks its argument count and calls
+// its handler.
+#ifndef S25PARSE_H
+#define S25PARSE_H
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "s25arena.h"
+
+#define CMD_BUF_SIZE 8192                        // Longest request line; the rest of the buffer holds what follows
+#define CMD_MAX_ARGS 8                           // Tokens after the command name kept per line
+
+// File types of stored names, told apart with one look at the extension
+#define FILE_OTHER 0                             // No extension or one no server stores
+#define FILE_C 1                                 // Kept by S1
+#define FILE_PDF 2                               // .pdf, .txt and .zip go to the backend nodes
+#define FILE_TXT 3
+#define FILE_ZIP 4
+
+// Bytes received on one connection and not consumed yet: buf[start, end)
+typedef struct {
+    int sock;
+    int passed_fd;                               // Descriptor that came with the buffered bytes (SCM_RIGHTS), or -1
+    size_t start, end;
+    Arena arena;                                 // Memory of the request being served
+    char buf[CMD_BUF_SIZE];
+} CmdReader;
+
+// One parsed request line
+typedef struct {
+    char *name;
+    char *args[CMD_MAX_ARGS];                    // NULL from args[argc] on
+    int argc;
+    int fd;                                      // Descriptor passed along with the line, or -1
+} Command;
+
+// Serves one command; returns 0 to read the next one, -1 to end the session
+typedef int (*CmdHandler)(CmdReader *r, Command *cmd);
+
+// Dispatch table entry. The table ends with an entry whose name is NULL and whose usage is the reply
+// to an unknown command.
+typedef struct {
+    const char *name;
+    int min_args;                                // Fewer arguments are answered with usage
+    CmdHandler handler;
+    const char *usage;
+} CmdSpec;
+
+// cmd_reader_init - Prepares a reader for the connection sock.
+static inline void cmd_reader_init(CmdReader *r, int sock) {
+    r->sock = sock;
+    r->passed_fd = -1;
+    r->start = r->end = 0;
+    arena_init(&r->arena);
+}
+
+// cmd_reader_close - Releases the reader's memory once the connection is done.
+static inline void cmd_reader_close(CmdReader *r) {
+    arena_free(&r->arena);
+}
+
+// cmd_fill - Receives more bytes behind the buffered ones, with a descriptor passed along, if any.
+// Returns the number of bytes received, 0 at end of stream or -1.
+static inline ssize_t cmd_fill(CmdReader *r) {
+    if (r->start > 0) {                          // Move the unconsumed bytes to the front first
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { r->buf + r->end, sizeof(r->buf) - r->end };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(r->sock, &msg, 0);
+    if (n <= 0)
+        return n;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&r->passed_fd, CMSG_DATA(cmsg), sizeof(int));
+    r->end += n;
+    return n;
+}
+
+// cmd_buffered - Bytes received behind the last line and not consumed yet.
+static inline size_t cmd_buffered(const CmdReader *r) {
+    return r->end - r->start;
+}
+
+// cmd_consume - Drops len buffered bytes that a command read from cmd_buffered's window itself.
+static inline void cmd_consume(CmdReader *r, size_t len) {
+    r->start += len < cmd_buffered(r) ? len : cmd_buffered(r);
+}
+
+// cmd_next - Reads the next request line and splits it into cmd. Blank lines are skipped; a line longer
+// than the buffer is dropped and comes back with an empty name. Everything allocated from the arena for
+// the previous request is released. Returns 1, or 0 when the connection closed (a line without its
+// '\n' is discarded).
+static inline int cmd_next(CmdReader *r, Command *cmd) {
+    arena_reset(&r->arena);
+    size_t scanned = 0;                          // Bytes already known to hold no '\n'
+    int overlong = 0;
+    while (1) {
+        char *line = r->buf + r->start;
+        char *nl = memchr(line + scanned, '\n', r->end - r->start - scanned);
+        if (!nl) {
+            scanned = r->end - r->start;
+            if (r->start == 0 && r->end == sizeof(r->buf)) {
+                overlong = 1;                    // No room to complete it: drop what we have
+                r->end = scanned = 0;
+            }
+            if (cmd_fill(r) <= 0)
+                return 0;
+            continue;
+        }
+        *nl = '\0';
+        r->start = nl + 1 - r->buf;
+        memset(cmd, 0, sizeof(*cmd));
+        cmd->fd = r->passed_fd;
+        r->passed_fd = -1;
+        if (overlong) {
+            cmd->name = nl;                      // Empty: answered as an unknown command
+            return 1;
+        }
+        char *p = line;
+        while (1) {                              // Tokens end at ' ', '\t' or '\r'
+            while (*p == ' ' || *p == '\t' || *p == '\r')
+                *p++ = '\0';
+            if (*p == '\0')
+                break;
+            if (!cmd->name)
+                cmd->name = p;
+            else if (cmd->argc < CMD_MAX_ARGS)
+                cmd->args[cmd->argc++] = p;
+            p += strcspn(p, " \t\r");
+        }
+        if (cmd->name)
+            return 1;
+        if (cmd->fd >= 0)
+            close(cmd->fd);                      // Nothing to pass it to
+        scanned = 0;
+    }
+}
+
+// cmd_file_type - Type of a stored name by its extension (FILE_OTHER when none matches).
+static inline int cmd_file_type(const char *name) {
+    const char *ext = name ? strrchr(name, '.') : NULL;
+    if (!ext)
+        return FILE_OTHER;
+    switch (ext[1]) {
+    case 'c': return ext[2] == '\0' ? FILE_C : FILE_OTHER;
+    case 'p': return strcmp(ext, ".pdf") == 0 ? FILE_PDF : FILE_OTHER;
+    case 't': return strcmp(ext, ".txt") == 0 ? FILE_TXT : FILE_OTHER;
+    case 'z': return strcmp(ext, ".zip") == 0 ? FILE_ZIP : FILE_OTHER;
+    }
+    return FILE_OTHER;
+}
+
+// cmd_lookup - Table entry for name; the terminating entry when the command is unknown.
+static inline const CmdSpec *cmd_lookup(const CmdSpec *table, const char *name) {
+    for (; table->name; table++)
+        if (table->name[0] == name[0] && strcmp(table->name, name) == 0)
+            return table;
+    return table;
+}
+
+// cmd_dispatch - Runs cmd through its table entry, answering unknown commands and missing arguments
+// with the entry's usage. Returns the handler's result (0 for answered errors).
+static inline int cmd_dispatch(const CmdSpec *table, CmdReader *r, Command *cmd) {
+    const CmdSpec *spec = cmd_lookup(table, cmd->name);
+    if (!spec->handler || cmd->argc < spec->min_args) {
+        if (cmd->fd >= 0)
+            close(cmd->fd);
+        send(r->sock, spec->usage, strlen(spec->usage), 0);
+        return 0;
+    }
+    return spec->handler(r, cmd);
+}
+
+#endif
@@ -0,0 +1,109 @@
+// s25prefetch.h - Read-ahead window for requests that send many files in a row.
+//
+// A tar archive or a downlm reply reads its files one after another, so without help every file
+// waits for the disk before it can be sent. A Prefetch walks the same list a few files ahead of the
+// sender and asks the kernel to start reading them (posix_fadvise(POSIX_FADV_WILLNEED)) while the
+// current one is copied, up to PREFETCH_BYTES of hinted data.
+//
+// How far ahead is enough depends on the disk. Each step times a small read at the start of the file
+// about to be sent: when it had to wait for the disk the window was too short and doubles, when it
+// came from the page cache the window shrinks by one, so a spinning or network disk settles on a deep
+// window and a fast one stays near PREFETCH_MIN.
+#ifndef S25PREFETCH_H
+#define S25PREFETCH_H
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define PREFETCH_MIN 2                           // Files hinted ahead of the one being sent, at least
+#define PREFETCH_MAX 64                          // and at most
+#define PREFETCH_BYTES (64LL * 1024 * 1024)      // Hinted data not yet sent, at most
+#define PREFETCH_FILE_BYTES (8LL * 1024 * 1024)  // Hinted per file; readahead covers the rest while it is sent
+#define PREFETCH_PROBE 4096                      // Bytes of the timed read
+#define PREFETCH_SLOW_US 1000                    // A probe slower than this waited for the disk
+#define PREFETCH_FAST_US 100                     // A probe faster than this was a page cache hit
+
+// Local file of entry i of the list, written to buf; NULL when it has none (kept in memory, remote)
+typedef const char *(*PrefetchPath)(void *ctx, int i, char *buf, size_t len);
+
+typedef struct {
+    PrefetchPath path_of;
+    void *ctx;
+    int count;                                   // Entries in the list
+    int depth;                                   // Current window, in files
+    int issued;                                  // Entries below this one have been hinted
+    long long hinted[PREFETCH_MAX + 1];          // Bytes hinted for entry i, at i % (PREFETCH_MAX + 1)
+} Prefetch;
+
+// prefetch_init - Prepares a window over the count entries that path_of resolves.
+static inline void prefetch_init(Prefetch *p, int count, PrefetchPath path_of, void *ctx) {
+    p->path_of = path_of;
+    p->ctx = ctx;
+    p->count = count;
+    p->depth = PREFETCH_MIN;
+    p->issued = 0;
+}
+
+// prefetch_hint - Starts reading the first bytes of path, at most budget. Returns the bytes hinted.
+static inline long long prefetch_hint(const char *path, long long budget) {
+    struct stat st;
+    long long len = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        len = st.st_size < PREFETCH_FILE_BYTES ? st.st_size : PREFETCH_FILE_BYTES;
+        if (len > budget)
+            len = budget;
+        if (len > 0 && posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED) != 0)
+            len = 0;
+    }
+    close(fd);
+    return len;
+}
+
+// prefetch_probe - Microseconds a read of the start of path took, or -1 when it could not be read.
+static inline long long prefetch_probe(const char *path) {
+    char buf[PREFETCH_PROBE];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = pread(fd, buf, sizeof(buf), 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    return (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+// prefetch_next - Called before entry i is sent: adapts the window to how long the start of entry i
+// took to read, then hints the entries after it that the window now covers.
+static inline void prefetch_next(Prefetch *p, int i) {
+    char path[1024];
+    const char *current = p->path_of(p->ctx, i, path, sizeof(path));
+    long long us = current ? prefetch_probe(current) : -1;
+    if (us > PREFETCH_SLOW_US)
+        p->depth = p->depth * 2 < PREFETCH_MAX ? p->depth * 2 : PREFETCH_MAX;
+    else if (us >= 0 && us < PREFETCH_FAST_US && p->depth > PREFETCH_MIN)
+        p->depth--;
+
+    long long ahead = 0;                         // Hinted bytes of the entries after i
+    if (p->issued <= i)
+        p->issued = i + 1;
+    for (int j = i + 1; j < p->issued; j++)
+        ahead += p->hinted[j % (PREFETCH_MAX + 1)];
+    while (p->issued < p->count && p->issued <= i + p->depth && ahead < PREFETCH_BYTES) {
+        const char *next = p->path_of(p->ctx, p->issued, path, sizeof(path));
+        long long len = next ? prefetch_hint(next, PREFETCH_BYTES - ahead) : 0;
+        p->hinted[p->issued % (PREFETCH_MAX + 1)] = len;
+        ahead += len;
+        p->issued++;
+    }
+}
+
+#endif
@@ -0,0 +1,133 @@
+// s25ring.h - Shared-memory ring used for bulk payload between S1 and backends on the same host.
+//
+// S1 creates a memfd holding RING_SLOTS buffers of RING_SLOT_SIZE bytes and passes it to the backend
+// over the Unix socket with SCM_RIGHTS ("shmring <slots> <slot_size>"). From then on file data on that
+// connection is written into the slots and only small RingMsg records travel over the socket:
+// the producer announces "slot, len", the consumer answers with the slot number once it is free again.
+// Included by S1.c and the backends; everything is static so each server still builds from one file.
+#ifndef S25RING_H
+#define S25RING_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define RING_SLOTS 8                             // Buffers in flight per connection
+#define RING_SLOT_SIZE (256 * 1024)              // Bytes per buffer
+
+// Shared-memory ring attached to one connection
+typedef struct {
+    int sock;                                    // Connection the ring belongs to, -1 when unused
+    int fd;                                      // memfd backing the ring
+    char *base;                                  // Mapping of slots * slot_size bytes
+    int slots;
+    int slot_size;
+} ShmRing;
+
+// Record sent over the socket for every filled slot; slot -1 opens a transfer of total bytes
+typedef struct {
+    int slot;
+    int len;
+    long long total;
+} RingMsg;
+
+// ring_reset - Marks the ring as unused.
+static inline void ring_reset(ShmRing *r) {
+    r->sock = -1;
+    r->fd = -1;
+    r->base = NULL;
+    r->slots = 0;
+    r->slot_size = 0;
+}
+
+// ring_close - Unmaps the ring and closes its memfd.
+static inline void ring_close(ShmRing *r) {
+    if (r->base)
+        munmap(r->base, (size_t)r->slots * r->slot_size);
+    if (r->fd >= 0)
+        close(r->fd);
+    ring_reset(r);
+}
+
+// ring_attach - Maps a ring whose memfd arrived over sock. Returns 0 or -1.
+static inline int ring_attach(ShmRing *r, int sock, int fd, int slots, int slot_size) {
+    ring_reset(r);
+    if (slots < 1 || slots > 64 || slot_size < 4096 || slot_size > 16 * 1024 * 1024)
+        return -1;
+    void *base = mmap(NULL, (size_t)slots * slot_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    r->sock = sock;
+    r->fd = fd;
+    r->base = base;
+    r->slots = slots;
+    r->slot_size = slot_size;
+    return 0;
+}
+
+// ring_create - Creates a memfd ring for sock, ready to be passed to the peer. Returns 0 or -1.
+static inline int ring_create(ShmRing *r, int sock) {
+    ring_reset(r);
+    int fd = syscall(SYS_memfd_create, "s25ring", 0);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, (off_t)RING_SLOTS * RING_SLOT_SIZE) != 0 ||
+        ring_attach(r, sock, fd, RING_SLOTS, RING_SLOT_SIZE) != 0) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+// ring_send_stream - Sends size bytes from fp through the ring. Returns 0 once the peer has
+// released every slot, -1 on failure.
+static inline int ring_send_stream(ShmRing *r, FILE *fp, long long size) {
+    RingMsg msg = { -1, 0, size };
+    int inflight = 0, ack;
+    long seq = 0;
+    if (send(r->sock, &msg, sizeof(msg), 0) != sizeof(msg))
+        return -1;
+    while (size > 0) {
+        if (inflight == r->slots) {              // Every slot is with the peer: wait for one back
+            if (recv(r->sock, &ack, sizeof(ack), MSG_WAITALL) != sizeof(ack))
+                return -1;
+            inflight--;
+        }
+        msg.slot = seq++ % r->slots;
+        msg.len = size < r->slot_size ? size : r->slot_size;
+        if (fread(r->base + (size_t)msg.slot * r->slot_size, 1, msg.len, fp) != (size_t)msg.len ||
+            send(r->sock, &msg, sizeof(msg), 0) != sizeof(msg))
+            return -1;
+        inflight++;
+        size -= msg.len;
+    }
+    while (inflight > 0) {                       // Leave no acks behind for the next command
+        if (recv(r->sock, &ack, sizeof(ack), MSG_WAITALL) != sizeof(ack))
+            return -1;
+        inflight--;
+    }
+    return 0;
+}
+
+// ring_recv_stream - Receives one transfer from the ring into fp. Returns 0 or -1.
+static inline int ring_recv_stream(ShmRing *r, FILE *fp) {
+    RingMsg msg;
+    if (recv(r->sock, &msg, sizeof(msg), MSG_WAITALL) != sizeof(msg) || msg.slot != -1 || msg.total <= 0)
+        return -1;
+    long long remaining = msg.total;
+    while (remaining > 0) {
+        if (recv(r->sock, &msg, sizeof(msg), MSG_WAITALL) != sizeof(msg) ||
+            msg.slot < 0 || msg.slot >= r->slots || msg.len <= 0 || msg.len > r->slot_size || msg.len > remaining)
+            return -1;
+        if (fwrite(r->base + (size_t)msg.slot * r->slot_size, 1, msg.len, fp) != (size_t)msg.len ||
+            send(r->sock, &msg.slot, sizeof(msg.slot), 0) != sizeof(msg.slot))
+            return -1;
+        remaining -= msg.len;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,499 @@
+// s25store.h - Log-structured segment store for small files.
+//
+// Small files are appended as records to large segment files (seg-NNNNNN.log) instead of each
+// getting a directory walk, an inode and a handful of sub-page writes. A record is a
+// StoreRecordHeader followed by the path and the file data; removals append a tombstone record.
+// Every process keeps an in-memory index (path -> segment, offset, length, checksum) that it
+// brings up to date by reading the records appended since its last look, so forked handlers
+// see each other's writes. Writers and the compactor serialize on an flock()ed LOCK file.
+// Compaction copies the live records of all sealed segments into the active one once at least
+// half of the sealed bytes are dead, then unlinks the sealed segments oldest first.
+// store_view serves reads straight out of mmap()ed segments, at most STORE_MAX_MAPS per process.
+#ifndef S25STORE_H
+#define S25STORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "s25arena.h"
+
+#define STORE_SMALL_MAX (64 * 1024)              // Files up to this size go into segments
+#ifndef STORE_SEGMENT_MAX
+#define STORE_SEGMENT_MAX (64L * 1024 * 1024)    // Segment size before a new one is started
+#endif
+#define STORE_MAX_SEGMENTS 1024
+#define STORE_MAX_MAPS 16                        // Segments kept mmap()ed per process for store_view
+#define STORE_MAGIC 0x53323553u                  // "S25S"
+#define STORE_DELETED 1u                         // Record flag: tombstone
+
+// On-disk record header, followed by path_len bytes of path and data_len bytes of data
+typedef struct {
+    unsigned int magic;
+    unsigned int flags;
+    unsigned int path_len;
+    unsigned int data_len;
+    unsigned int crc;                            // CRC-32 of the data
+    unsigned int mtime;                          // Seconds since the epoch; 0 in records from before it was kept
+} StoreRecordHeader;
+
+// Index entry for one path; seg is -1 once the path was removed
+typedef struct {
+    char *path;
+    int seg;                                     // Segment id
+    long offset;                                 // Offset of the data within the segment
+    unsigned int len;
+    unsigned int crc;
+    time_t mtime;                                // When this version was stored
+    int verified;                                // Checksum already checked by this process
+} StoreEntry;
+
+// Segment store rooted at dir, with this process's view of its index
+typedef struct {
+    char dir[512];
+    StoreEntry *table;                           // Open-addressed hash table of paths
+    size_t capacity;                             // Slots in table, a power of two
+    size_t used;                                 // Occupied slots, removed paths included
+    int seg_count;
+    int seg_ids[STORE_MAX_SEGMENTS];             // Known segments, ascending
+    int seg_fds[STORE_MAX_SEGMENTS];
+    long seg_scanned[STORE_MAX_SEGMENTS];        // Bytes of each segment already applied to the index
+    long seg_live[STORE_MAX_SEGMENTS];           // Bytes of records still referenced by the index
+    char *seg_maps[STORE_MAX_SEGMENTS];          // Read-only mapping of the segment, or NULL
+    long seg_map_len[STORE_MAX_SEGMENTS];
+    unsigned long seg_map_use[STORE_MAX_SEGMENTS];  // LRU clock of the mapping
+    unsigned long map_clock;
+} SegmentStore;
+
+// store_crc32 - CRC-32 (IEEE) of len bytes.
+static inline unsigned int store_crc32(const char *data, size_t len) {
+    unsigned int crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (unsigned char)data[i];
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+    }
+    return ~crc;
+}
+
+// store_hash - FNV-1a of a path, used to place it in the index.
+static inline size_t store_hash(const char *path) {
+    size_t h = 2166136261u;
+    for (; *path; path++)
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    return h;
+}
+
+// store_slot - Finds the slot of path, or the empty slot where it would go.
+static inline StoreEntry *store_slot(StoreEntry *table, size_t capacity, const char *path) {
+    size_t i = store_hash(path) & (capacity - 1);
+    while (table[i].path && strcmp(table[i].path, path) != 0)
+        i = (i + 1) & (capacity - 1);
+    return &table[i];
+}
+
+// store_seg_index - Position of segment id in seg_ids, or -1.
+static inline int store_seg_index(const SegmentStore *st, int seg) {
+    for (int i = 0; i < st->seg_count; i++)
+        if (st->seg_ids[i] == seg)
+            return i;
+    return -1;
+}
+
+// store_seg_path - Builds "<dir>/seg-NNNNNN.log".
+static inline void store_seg_path(const SegmentStore *st, int seg, char *path, size_t len) {
+    snprintf(path, len, "%s/seg-%06d.log", st->dir, seg);
+}
+
+// store_forget - Drops the in-memory index and closes the segment descriptors.
+static inline void store_forget(SegmentStore *st) {
+    for (size_t i = 0; i < st->capacity; i++)
+        free(st->table[i].path);
+    free(st->table);
+    for (int i = 0; i < st->seg_count; i++) {
+        close(st->seg_fds[i]);
+        if (st->seg_maps[i])
+            munmap(st->seg_maps[i], st->seg_map_len[i]);
+        st->seg_maps[i] = NULL;
+    }
+    st->table = NULL;
+    st->capacity = st->used = 0;
+    st->seg_count = 0;
+}
+
+// store_index - Applies one record to the index. record_len is the full on-disk size.
+static inline int store_index(SegmentStore *st, const char *path, int seg, long offset, unsigned int len,
+                              unsigned int crc, time_t mtime, long record_len, int deleted) {
+    if (st->used * 2 >= st->capacity) {          // Keep the table at most half full
+        size_t capacity = st->capacity ? st->capacity * 2 : 1024;
+        StoreEntry *table = calloc(capacity, sizeof(StoreEntry));
+        if (!table)
+            return -1;
+        for (size_t i = 0; i < st->capacity; i++)
+            if (st->table[i].path)
+                *store_slot(table, capacity, st->table[i].path) = st->table[i];
+        free(st->table);
+        st->table = table;
+        st->capacity = capacity;
+    }
+    StoreEntry *e = store_slot(st->table, st->capacity, path);
+    if (e->path && e->seg >= 0) {                // The previous version becomes dead space
+        int old = store_seg_index(st, e->seg);
+        if (old >= 0)
+            st->seg_live[old] -= (long)sizeof(StoreRecordHeader) + strlen(path) + e->len;
+    }
+    if (!e->path) {
+        e->path = strdup(path);
+        if (!e->path)
+            return -1;
+        st->used++;
+    }
+    e->seg = deleted ? -1 : seg;
+    e->offset = offset;
+    e->len = len;
+    e->crc = crc;
+    e->mtime = mtime;
+    e->verified = 0;
+    if (!deleted)
+        st->seg_live[store_seg_index(st, seg)] += record_len;
+    return 0;
+}
+
+// store_scan - Applies the records of segment slot i that this process has not seen yet.
+// A torn record at the tail (crash during an append) ends the scan.
+static inline void store_scan(SegmentStore *st, int i) {
+    struct stat sb;
+    if (fstat(st->seg_fds[i], &sb) != 0)
+        return;
+    while (st->seg_scanned[i] + (long)sizeof(StoreRecordHeader) <= sb.st_size) {
+        StoreRecordHeader h;
+        long pos = st->seg_scanned[i];
+        if (pread(st->seg_fds[i], &h, sizeof(h), pos) != sizeof(h) || h.magic != STORE_MAGIC ||
+            h.path_len == 0 || h.path_len >= 512 ||
+            pos + (long)sizeof(h) + h.path_len + h.data_len > sb.st_size)
+            break;
+        char path[512];
+        if (pread(st->seg_fds[i], path, h.path_len, pos + sizeof(h)) != (ssize_t)h.path_len)
+            break;
+        path[h.path_len] = '\0';
+        long record_len = sizeof(h) + h.path_len + h.data_len;
+        if (store_index(st, path, st->seg_ids[i], pos + sizeof(h) + h.path_len, h.data_len, h.crc,
+                        h.mtime ? (time_t)h.mtime : sb.st_mtime, record_len, (h.flags & STORE_DELETED) != 0) != 0)
+            break;
+        st->seg_scanned[i] = pos + record_len;
+    }
+}
+
+// store_compare_int - qsort comparator for segment ids.
+static inline int store_compare_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// store_refresh - Catches up with segments and records written by other processes. When a
+// segment this process knew about was compacted away, the index is rebuilt from scratch.
+static inline void store_refresh(SegmentStore *st) {
+    int ids[STORE_MAX_SEGMENTS], count = 0;
+    DIR *d = opendir(st->dir);
+    if (!d)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL && count < STORE_MAX_SEGMENTS) {
+        int seg;
+        if (sscanf(entry->d_name, "seg-%d.log", &seg) == 1)
+            ids[count++] = seg;
+    }
+    closedir(d);
+    qsort(ids, count, sizeof(int), store_compare_int);
+    for (int i = 0, j = 0; i < st->seg_count; i++) {
+        while (j < count && ids[j] < st->seg_ids[i])
+            j++;
+        if (j == count || ids[j] != st->seg_ids[i]) {
+            store_forget(st);                    // Compacted away under us: start over
+            break;
+        }
+    }
+    for (int j = 0; j < count; j++) {
+        if (store_seg_index(st, ids[j]) >= 0)
+            continue;
+        char path[600];
+        store_seg_path(st, ids[j], path, sizeof(path));
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            continue;                            // Unlinked between readdir and open
+        st->seg_ids[st->seg_count] = ids[j];
+        st->seg_fds[st->seg_count] = fd;
+        st->seg_scanned[st->seg_count] = 0;
+        st->seg_live[st->seg_count] = 0;
+        st->seg_maps[st->seg_count] = NULL;
+        st->seg_count++;
+    }
+    for (int i = 0; i < st->seg_count; i++)
+        store_scan(st, i);
+}
+
+// store_open - Opens (creating if needed) the store in dir and loads its index. Returns 0 or -1.
+static inline int store_open(SegmentStore *st, const char *dir) {
+    memset(st, 0, sizeof(*st));
+    snprintf(st->dir, sizeof(st->dir), "%s", dir);
+    if (mkdir(dir, 0755) != 0 && access(dir, F_OK) != 0)
+        return -1;
+    store_refresh(st);
+    return 0;
+}
+
+// store_lock - Takes the store's writer lock. Returns the lock descriptor or -1.
+static inline int store_lock(const SegmentStore *st) {
+    char path[600];
+    snprintf(path, sizeof(path), "%s/LOCK", st->dir);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd >= 0 && flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// store_write - Appends one record to the active segment, starting a new segment when it is full,
+// without bringing the index up to date. The caller holds the writer lock. Returns 0 or -1.
+static inline int store_write(SegmentStore *st, const char *path, const char *data, unsigned int len,
+                              unsigned int flags, time_t mtime) {
+    int seg = st->seg_count ? st->seg_ids[st->seg_count - 1] : 0;
+    char seg_path[600];
+    struct stat sb;
+    store_seg_path(st, seg, seg_path, sizeof(seg_path));
+    if (st->seg_count == 0 || (stat(seg_path, &sb) == 0 && sb.st_size >= STORE_SEGMENT_MAX))
+        store_seg_path(st, ++seg, seg_path, sizeof(seg_path));
+    StoreRecordHeader h = { STORE_MAGIC, flags, (unsigned int)strlen(path), len, store_crc32(data, len), (unsigned int)mtime };
+    size_t record_len = sizeof(h) + h.path_len + len;
+    char *record = malloc(record_len);
+    int fd = open(seg_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    int ok = record && fd >= 0;
+    if (ok) {                                    // One write per record: readers never see half a header
+        memcpy(record, &h, sizeof(h));
+        memcpy(record + sizeof(h), path, h.path_len);
+        memcpy(record + sizeof(h) + h.path_len, data, len);
+        ok = write(fd, record, record_len) == (ssize_t)record_len;
+    }
+    if (fd >= 0)
+        close(fd);
+    free(record);
+    return ok ? 0 : -1;
+}
+
+// store_append - store_write of a record stored now, followed by an index refresh. Returns 0 or -1.
+static inline int store_append(SegmentStore *st, const char *path, const char *data, unsigned int len, unsigned int flags) {
+    int ret = store_write(st, path, data, len, flags, time(NULL));
+    store_refresh(st);
+    return ret;
+}
+
+// store_read - Reads the data of entry e into a malloc()ed buffer the caller frees, verifying its
+// checksum. Returns 0, or -1 with *data NULL.
+static inline int store_read(SegmentStore *st, const StoreEntry *e, char **data) {
+    int i = store_seg_index(st, e->seg);
+    char *buf = malloc(e->len ? e->len : 1);
+    *data = NULL;
+    if (i < 0 || !buf || pread(st->seg_fds[i], buf, e->len, e->offset) != (ssize_t)e->len ||
+        store_crc32(buf, e->len) != e->crc) {
+        free(buf);
+        return -1;
+    }
+    *data = buf;
+    return 0;
+}
+
+// store_put - Stores len bytes of data under path, replacing any previous version. Returns 0 or -1.
+static inline int store_put(SegmentStore *st, const char *path, const char *data, unsigned int len) {
+    if (strlen(path) == 0 || strlen(path) >= 512)
+        return -1;
+    int lock_fd = store_lock(st);
+    if (lock_fd < 0)
+        return -1;
+    store_refresh(st);
+    int ret = store_append(st, path, data, len, 0);
+    close(lock_fd);
+    return ret;
+}
+
+// store_remove - Removes path from the store. Returns 0, or -1 when it was not stored.
+static inline int store_remove(SegmentStore *st, const char *path) {
+    int lock_fd = store_lock(st);
+    if (lock_fd < 0)
+        return -1;
+    store_refresh(st);
+    StoreEntry *e = st->capacity ? store_slot(st->table, st->capacity, path) : NULL;
+    int ret = (e && e->path && e->seg >= 0) ? store_append(st, path, "", 0, STORE_DELETED) : -1;
+    close(lock_fd);
+    return ret;
+}
+
+// store_get - Reads path into a malloc()ed buffer the caller frees, verifying its checksum, and
+// reports when it was stored unless mtime is NULL.
+// Returns 0, or -1 when the path is not stored (or its record is damaged).
+static inline int store_get(SegmentStore *st, const char *path, char **data, unsigned int *len, time_t *mtime) {
+    store_refresh(st);
+    StoreEntry *e = st->capacity ? store_slot(st->table, st->capacity, path) : NULL;
+    if (!e || !e->path || e->seg < 0 || store_read(st, e, data) != 0)
+        return -1;
+    *len = e->len;
+    if (mtime)
+        *mtime = e->mtime;
+    return 0;
+}
+
+// store_stat - Looks up the length, CRC and, unless mtime is NULL, the store time of path without
+// reading its data. Returns 0 or -1.
+static inline int store_stat(SegmentStore *st, const char *path, unsigned int *len, unsigned int *crc, time_t *mtime) {
+    store_refresh(st);
+    StoreEntry *e = st->capacity ? store_slot(st->table, st->capacity, path) : NULL;
+    if (!e || !e->path || e->seg < 0)
+        return -1;
+    *len = e->len;
+    *crc = e->crc;
+    if (mtime)
+        *mtime = e->mtime;
+    return 0;
+}
+
+// store_view - Like store_get, but points *data into a read-only mapping of the segment instead
+// of copying, with the record's CRC in *crc when crc is set. The pointer stays valid until the next
+// store call. Returns 0 or -1.
+static inline int store_view(SegmentStore *st, const char *path, const char **data, unsigned int *len, unsigned int *crc) {
+    store_refresh(st);
+    StoreEntry *e = st->capacity ? store_slot(st->table, st->capacity, path) : NULL;
+    int i = (e && e->path && e->seg >= 0) ? store_seg_index(st, e->seg) : -1;
+    if (i < 0)
+        return -1;
+    if (!st->seg_maps[i] || st->seg_map_len[i] < e->offset + (long)e->len) {
+        int mapped = 0, lru = -1;
+        for (int k = 0; k < st->seg_count; k++) {
+            if (st->seg_maps[k] && k != i) {
+                mapped++;
+                if (lru < 0 || st->seg_map_use[k] < st->seg_map_use[lru])
+                    lru = k;
+            }
+        }
+        if (mapped >= STORE_MAX_MAPS) {          // Bound the address space held by mappings
+            munmap(st->seg_maps[lru], st->seg_map_len[lru]);
+            st->seg_maps[lru] = NULL;
+        }
+        if (st->seg_maps[i])                     // Segment grew since it was mapped
+            munmap(st->seg_maps[i], st->seg_map_len[i]);
+        st->seg_maps[i] = mmap(NULL, st->seg_scanned[i], PROT_READ, MAP_SHARED, st->seg_fds[i], 0);
+        if (st->seg_maps[i] == MAP_FAILED) {
+            st->seg_maps[i] = NULL;
+            return -1;
+        }
+        st->seg_map_len[i] = st->seg_scanned[i];
+        madvise(st->seg_maps[i], st->seg_map_len[i], MADV_RANDOM);  // Records are read one at a time
+    }
+    st->seg_map_use[i] = ++st->map_clock;
+    if (!e->verified) {                          // Check each record once, not on every hot read
+        if (store_crc32(st->seg_maps[i] + e->offset, e->len) != e->crc)
+            return -1;
+        e->verified = 1;
+    }
+    *data = st->seg_maps[i] + e->offset;
+    *len = e->len;
+    if (crc)
+        *crc = e->crc;
+    return 0;
+}
+
+// store_collect - Appends the paths stored below prefix ("" for all) to out, only direct children
+// unless recursive is set, and only names ending in ext when ext is given. Returns 0, or -1 when the
+// arena ran out of memory.
+static inline int store_collect(SegmentStore *st, const char *prefix, int recursive, const char *ext, StrList *out) {
+    size_t prefix_len = strlen(prefix);
+    store_refresh(st);
+    for (size_t i = 0; i < st->capacity; i++) {
+        const char *path = st->table[i].path;
+        if (!path || st->table[i].seg < 0)
+            continue;
+        if (prefix_len && (strncmp(path, prefix, prefix_len) != 0 || path[prefix_len] != '/'))
+            continue;
+        const char *rest = path + prefix_len + (prefix_len ? 1 : 0);
+        const char *dot = strrchr(rest, '.');
+        if ((!recursive && strchr(rest, '/')) || (ext && (!dot || strcmp(dot, ext) != 0)))
+            continue;
+        if (strlist_add(out, path) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// store_remove_tree - Removes every path stored below prefix under one hold of the writer lock.
+// Returns the number of paths removed, or -1 when the lock could not be taken.
+static inline int store_remove_tree(SegmentStore *st, const char *prefix) {
+    int lock_fd = store_lock(st);
+    if (lock_fd < 0)
+        return -1;
+    Arena arena;
+    StrList paths;
+    int removed = 0;
+    arena_init(&arena);
+    strlist_init(&paths, &arena);
+    store_collect(st, prefix, 1, NULL, &paths);  // Copies: appending rehashes the index
+    for (int i = 0; i < paths.count; i++)
+        if (store_append(st, paths.items[i], "", 0, STORE_DELETED) == 0)
+            removed++;
+    arena_free(&arena);
+    close(lock_fd);
+    return removed;
+}
+
+// store_compact - Rewrites the live records of the sealed segments into the active segment when
+// at least half of the sealed bytes are dead, then unlinks those segments. Returns the number of
+// segments reclaimed.
+static inline int store_compact(SegmentStore *st) {
+    int lock_fd = store_lock(st);
+    if (lock_fd < 0)
+        return 0;
+    store_refresh(st);
+    int sealed = st->seg_count - 1;              // Everything but the active segment
+    long total = 0, live = 0;
+    for (int i = 0; i < sealed; i++) {
+        total += st->seg_scanned[i];
+        live += st->seg_live[i];
+    }
+    if (sealed <= 0 || total == 0 || live * 2 > total) {
+        close(lock_fd);
+        return 0;
+    }
+    int last_sealed = st->seg_ids[sealed - 1];
+    int ids[STORE_MAX_SEGMENTS];
+    memcpy(ids, st->seg_ids, sealed * sizeof(int));
+    int copied = 1;
+    // Copy the live records forward. The index is left alone until the refresh after the loop, so
+    // the table can be walked directly and the segments are rescanned once per pass, not per record.
+    for (size_t i = 0; copied && i < st->capacity; i++) {
+        StoreEntry *e = &st->table[i];
+        char *data;
+        if (!e->path || e->seg < 0 || e->seg > last_sealed)
+            continue;                            // Removed, or already in the active segment
+        if (store_read(st, e, &data) != 0 || store_write(st, e->path, data, e->len, 0, e->mtime) != 0)
+            copied = 0;
+        free(data);
+    }
+    store_refresh(st);
+    if (!copied) {                               // Keep the sealed segments; the copies are harmless duplicates
+        close(lock_fd);
+        return 0;
+    }
+    for (int s = 0; s < sealed; s++) {           // Oldest first: a crash never resurrects a removed file
+        char path[600];
+        store_seg_path(st, ids[s], path, sizeof(path));
+        unlink(path);
+    }
+    close(lock_fd);
+    store_refresh(st);
+    return sealed;
+}
+
+#endif